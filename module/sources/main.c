@@ -4,6 +4,8 @@
 
 #include "misc/procfs.h"
 #include "misc/sysfs.h"
+#include "trfs/extent.h"
+#include "trfs/inode.h"
 #include "trfs/printk.h"
 #include "trfs/register.h"
 
@@ -54,15 +56,21 @@ static int trfs_init(void) {
   TRFS_PRINT_INIT();
 
   int error;
-  if ((error = trfs_register())) goto trfs_cleanup;
+  // The inode cache must exist before the filesystem can be mounted.
+  if ((error = trfs_inode_cache_init())) goto inode_cache_cleanup;
+  if ((error = trfs_extent_cache_init())) goto extent_cache_cleanup;
+  // Mounts create their entries in /proc/fs/trfs and /sys/fs/trfs.
   if ((error = trfs_procfs_init())) goto procfs_cleanup;
   if ((error = trfs_sysfs_init())) goto sysfs_cleanup;
+  if ((error = trfs_register())) goto trfs_cleanup;
   return 0; // Success
 
   // Expect cleanup functions to be robust.
+  trfs_cleanup: trfs_unregister();
   sysfs_cleanup: trfs_sysfs_exit();
   procfs_cleanup: trfs_procfs_exit();
-  trfs_cleanup: trfs_unregister();
+  extent_cache_cleanup: trfs_extent_cache_exit();
+  inode_cache_cleanup: trfs_inode_cache_exit();
 
   TRFS_PRINT_EXIT();
   return error;
@@ -72,6 +80,8 @@ static void __exit trfs_exit(void) {
   trfs_unregister();
   trfs_procfs_exit();
   trfs_sysfs_exit();
+  trfs_extent_cache_exit();
+  trfs_inode_cache_exit();
 
   TRFS_PRINT_EXIT();
 }
@@ -1,156 +1,158 @@
-#include <linux/minmax.h>
+#include <linux/fs.h>
 #include <linux/proc_fs.h>
-#include <linux/version.h>
+#include <linux/seq_file.h>
 
 #include "misc/procfs.h"
 #include "trfs/printk.h"
+#include "trfs/stats.h"
+#include "trfs/super.h"
 
 // https://sysprog21.github.io/lkmpg/#the-proc-file-system
-// https://linux-kernel-labs.github.io/refs/heads/master/labs/device_drivers.html
 // https://www.kernel.org/doc/Documentation/filesystems/proc.txt
-
-#define TRFS_PROCFS_BUFFER_SIZE 128u
-#define TRFS_PROCFS_INITIAL "Hello from TRFS!"
-static char trfs_procfs_buffer[TRFS_PROCFS_BUFFER_SIZE] = TRFS_PROCFS_INITIAL;
-static size_t trfs_procfs_buffer_size = sizeof(TRFS_PROCFS_INITIAL) - 1;
-
-// TODO: Try seq_file
-static ssize_t trfs_procfs_read(
-  struct file* const file,
-  char __user* const user_buffer,
-  size_t const user_buffer_length,
-  loff_t* const file_offset
+// https://www.kernel.org/doc/html/latest/filesystems/seq_file.html
+
+// Each mount has a directory /proc/fs/trfs/<device> (e.g. /proc/fs/trfs/sda1)
+// with the statistics of trfs/stats.h:
+//   stats    one "<name> <count> <total nanoseconds>" line per operation, then
+//            one "<name> <value>" line per counter. negative_lookups counts
+//            the missing names looked up in a directory, the later lookups
+//            of them are answered by the dcache.
+//   latency  one "<name> <bucket 0> ... <bucket 31>" line per operation, bucket
+//            i counts the operations that took [2^i, 2^(i + 1)) nanoseconds.
+// Reads of folios, readahead and direct I/O are timed until their bios are
+// submitted (or completed, for synchronous direct I/O). The nanoseconds and
+// the latency are only accounted while /sys/fs/trfs/timing is 1.
+
+static char const* const TRFS_PROCFS_NAME = "fs/trfs";
+
+/// /proc/fs/trfs
+static struct proc_dir_entry* trfs_procfs_root = NULL;
+
+static char const* const trfs_operation_names[TRFS_OPERATIONS] = {
+  [TRFS_OPERATION_LOOKUP] = "lookup",
+  [TRFS_OPERATION_READDIR] = "readdir",
+  [TRFS_OPERATION_READ_FOLIO] = "read_folio",
+  [TRFS_OPERATION_READAHEAD] = "readahead",
+  [TRFS_OPERATION_WRITEPAGES] = "writepages",
+  [TRFS_OPERATION_DIRECT_READ] = "direct_read",
+  [TRFS_OPERATION_DIRECT_WRITE] = "direct_write",
+  [TRFS_OPERATION_ALLOCATE] = "allocate",
+  [TRFS_OPERATION_FSYNC] = "fsync",
+  [TRFS_OPERATION_SYNC_FS] = "sync_fs",
+};
+
+static char const* const trfs_counter_names[TRFS_COUNTERS] = {
+  [TRFS_COUNTER_PAGES_READ] = "pages_read",
+  [TRFS_COUNTER_PAGES_WRITTEN] = "pages_written",
+  [TRFS_COUNTER_BLOCKS_ALLOCATED] = "blocks_allocated",
+  [TRFS_COUNTER_BLOCKS_FREED] = "blocks_freed",
+  [TRFS_COUNTER_EXTENT_CACHE_HITS] = "extent_cache_hits",
+  [TRFS_COUNTER_EXTENT_CACHE_MISSES] = "extent_cache_misses",
+  [TRFS_COUNTER_NEGATIVE_LOOKUPS] = "negative_lookups",
+};
+
+static int trfs_procfs_show_stats(
+  struct seq_file* const file,
+  void* const data
 ) {
-  // loff_t is a signed integer (man loff_t).
-  if (*file_offset < 0) {
-    return -EINVAL;
+  struct trfs_mount_info const* const info = trfs_mount_info(file->private);
+
+  for (unsigned int operation = 0; operation < TRFS_OPERATIONS; ++operation) {
+    seq_printf(
+      file, "%s %llu %llu\n", trfs_operation_names[operation],
+      trfs_sum_operations(info, operation),
+      trfs_sum_nanoseconds(info, operation)
+    );
   }
 
-  // An unsigned subtraction is upcomming.
-  if (*file_offset >= trfs_procfs_buffer_size) {
-    return 0;
+  for (unsigned int counter = 0; counter < TRFS_COUNTERS; ++counter) {
+    seq_printf(file, "%s %llu\n", trfs_counter_names[counter], trfs_sum_counter(info, counter));
   }
 
-  size_t const actual_length = min(
-    // The (size_t*) cast should be safe here (isn't it?).
-    trfs_procfs_buffer_size - *(size_t*)file_offset,
-    user_buffer_length // Should not be zero?
-  );
+  return 0;
+}
 
-  if (actual_length <= 0) {
-    return -EINVAL; // Or 0 here?
-  }
+static int trfs_procfs_show_latency(
+  struct seq_file* const file,
+  void* const data
+) {
+  struct trfs_mount_info const* const info = trfs_mount_info(file->private);
+
+  for (unsigned int operation = 0; operation < TRFS_OPERATIONS; ++operation) {
+    seq_puts(file, trfs_operation_names[operation]);
 
-  if (copy_to_user(
-    user_buffer,
-    trfs_procfs_buffer + *file_offset,
-    actual_length
-  )) {
-    // copy_to_user() returns number of bytes that could not be copied.
-    // What happens when not returning an error? It is in a way a success.
-    return -EFAULT;
+    for (unsigned int bucket = 0; bucket < TRFS_LATENCY_BUCKETS; ++bucket) {
+      seq_printf(file, " %llu", trfs_sum_latency(info, operation, bucket));
+    }
+
+    seq_putc(file, '\n');
   }
 
-  *file_offset += actual_length;
-  return actual_length;
+  return 0;
 }
 
-// echo -n > /proc/trfs
-// echo -n dada > /proc/trfs
-// echo 00 | xxd -p -r > /proc/trfs
-// echo -ne '\x00' > /proc/trfs
-// printf '\x00' > /proc/trfs
-// echo -n dadafafa | dd of=/proc/trfs bs=1 seek=4
-// strace dd if=/proc/trfs bs=1 skip=11 count=4
-// cat /proc/trfs | hexdump -C
-static ssize_t trfs_procfs_write(
-  struct file* const file,
-  char __user const* const user_buffer,
-  size_t user_buffer_length,
-  loff_t* const file_offset
+///
+/// Creates /proc/fs/trfs/<device> for a new mount. Statistics are not worth
+/// failing a mount, errors are only reported.
+///
+void trfs_procfs_register(
+  struct super_block* const super_block
 ) {
-  // loff_t is a signed integer (man loff_t).
-  if (*file_offset < 0) {
-    return -EINVAL;
-  }
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
 
-  // Prevent buffer overflow and subtraction overflow.
-  if (*file_offset >= TRFS_PROCFS_BUFFER_SIZE) {
-    // There is an infinite loop when returning 0.
-    // I would like to RTFM but where to fint it?
-    return -EFBIG;
+  if (trfs_procfs_root == NULL) {
+    return;
   }
 
-  size_t const actual_length = min(
-    // The (size_t*) cast should be safe here (right?).
-    TRFS_PROCFS_BUFFER_SIZE - *(size_t*)file_offset,
-    user_buffer_length // Should be non-zero?
-  );
-
-  if (actual_length <= 0) {
-    return -EINVAL;
+  info->proc_entry = proc_mkdir(super_block->s_id, trfs_procfs_root);
+  if (info->proc_entry == NULL) {
+    TRFS_ERROR("Could not create /proc/%s/%s\n", TRFS_PROCFS_NAME, super_block->s_id);
+    return;
   }
 
-  // TODO: Locks?
-  if (copy_from_user(
-    trfs_procfs_buffer + *file_offset,
-    user_buffer,
-    actual_length
-  )) {
-    // We can technically not return an error if some bytes have actually
-    // been copied and adjust the file_offset consequently.
-    return -EFAULT;
+  // The files are given the superblock, which outlives them (see
+  // trfs_procfs_unregister()).
+  if (!proc_create_single_data("stats", 0444, info->proc_entry, trfs_procfs_show_stats, super_block)
+    || !proc_create_single_data("latency", 0444, info->proc_entry, trfs_procfs_show_latency, super_block)
+  ) {
+    TRFS_ERROR("Could not create the files of /proc/%s/%s\n", TRFS_PROCFS_NAME, super_block->s_id);
   }
-
-  *file_offset += actual_length;
-  trfs_procfs_buffer_size = *file_offset; // :thinking:
-  return actual_length;
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
-  // Prior to Linux 5.6 a file_operations is needed.
-  static struct proc_ops trfs_procfs_fops = {
-    .proc_read = trfs_procfs_read,
-    .proc_write = trfs_procfs_write,
-  };
-#else
-  static struct file_operations trfs_procfs_fops = {
-    .owner = THIS_MODULE,
-    .read = trfs_procfs_read,
-    .write = trfs_procfs_write,
-  }
-#endif
+///
+/// Removes /proc/fs/trfs/<device>, before the statistics are freed. Waits for
+/// the files being read.
+///
+void trfs_procfs_unregister(
+  struct super_block* const super_block
+) {
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
 
-static struct proc_dir_entry* trfs_procfs_entry = NULL;
-static char const* const TRFS_PROCFS_NAME = "trfs";
+  // Removes the whole subtree, does nothing for NULL.
+  proc_remove(info->proc_entry);
+  info->proc_entry = NULL;
+}
 
 int trfs_procfs_init(void) {
-  if (trfs_procfs_entry != NULL) {
+  if (trfs_procfs_root != NULL) {
     // Should not happen.
     return 0;
   }
 
-  trfs_procfs_entry = proc_create(
-    TRFS_PROCFS_NAME, 0666, NULL, // See proc_mkdir().
-    &trfs_procfs_fops
-  );
-
-  if (trfs_procfs_entry == NULL) {
+  trfs_procfs_root = proc_mkdir(TRFS_PROCFS_NAME, NULL);
+  if (trfs_procfs_root == NULL) {
     TRFS_ERROR("Could not initialize /proc/%s\n", TRFS_PROCFS_NAME);
     return -ENOMEM;
   }
 
-  // Only for test purposes.
-  proc_set_size(trfs_procfs_entry, TRFS_PROCFS_BUFFER_SIZE);
-  proc_set_user(trfs_procfs_entry, GLOBAL_ROOT_UID, GLOBAL_ROOT_GID);
-
   TRFS_INFO("/proc/%s created\n", TRFS_PROCFS_NAME);
   return 0;
 }
 
 void trfs_procfs_exit(void) {
-  if (trfs_procfs_entry != NULL) {
-    proc_remove(trfs_procfs_entry);
+  if (trfs_procfs_root != NULL) {
+    proc_remove(trfs_procfs_root);
+    trfs_procfs_root = NULL;
     TRFS_INFO("/proc/%s removed\n", TRFS_PROCFS_NAME);
   }
 }
@@ -1,7 +1,12 @@
 #ifndef TRFS_PROCSFS_H
 #define TRFS_PROCSFS_H
 
+struct super_block;
+
 int trfs_procfs_init(void);
 void trfs_procfs_exit(void);
 
+void trfs_procfs_register(struct super_block* const super_block);
+void trfs_procfs_unregister(struct super_block* const super_block);
+
 #endif // TRFS_PROCSFS_H
@@ -1,121 +1,344 @@
+#include <linux/backing-dev.h>
+#include <linux/fs.h>
+#include <linux/jump_label.h>
 #include <linux/kobject.h>
-#include <linux/minmax.h>
+#include <linux/percpu_counter.h>
 #include <linux/slab.h>
+#include <linux/string.h>
 #include <linux/sysfs.h>
 
 #include "misc/sysfs.h"
 #include "trfs/printk.h"
+#include "trfs/stats.h"
+#include "trfs/super.h"
 
 // https://docs.kernel.org/core-api/kobject.html
 // https://www.kernel.org/doc/Documentation/filesystems/sysfs.txt
 // https://sysprog21.github.io/lkmpg/#sysfs-interacting-with-your-module
-// https://medium.com/@emanuele.santini.88/sysfs-in-linux-kernel-a-complete-guide-part-1-c3629470fc84
-// https://medium.com/@emanuele.santini.88/a-complete-guide-to-sysfs-part-2-improving-the-attributes-1dbc1fca9b75
 
-struct trfs_sysfs_data {
- struct kobject trfs_kobject;
+// Each mount has a directory /sys/fs/trfs/<device> (e.g. /sys/fs/trfs/sda1),
+// in the kset /sys/fs/trfs. Its tunables take effect right away, without a
+// remount (a remount with the matching mount option overrides them):
+//   readahead_kb           readahead of the files (in KiB, readahead=),
+//                          inherited by the files when they are opened. It
+//                          is the one of the private BDI of the mount (also
+//                          /sys/class/bdi/trfs-*/read_ahead_kb), the disk
+//                          keeps its own.
+//   commit_interval        seconds between a superblock change and its write
+//                          back (commit=), 0 selects the default.
+//   alloc_policy           where new directories go, "spread" or "packed"
+//                          (alloc=).
+//   extent_cache_pressure  how readily the extents cached by the inodes are
+//                          reclaimed, in percent (as vfs_cache_pressure): 0
+//                          keeps them, above 100 reclaims them sooner.
+// The other files are read-only counters.
+//
+// /sys/fs/trfs/timing enables (1) or disables (0) the timing of the
+// operations of all the mounts (see trfs/stats.h), it is disabled at load.
 
-  #define TRFS_SYSFS_DADA_SIZE 256u
-  char dada[TRFS_SYSFS_DADA_SIZE];
-  int fafa;
+///
+/// The kobject of a mount. It is allocated separately from the mount info:
+/// a reference may outlive the mount, the attributes are gone by then (see
+/// trfs_sysfs_unregister()).
+///
+struct trfs_sysfs_mount {
+  struct kobject kobject;
+  struct super_block* super_block;
 };
 
-// ╔╦╗┌─┐┌┬┐┌─┐
-//  ║║├─┤ ││├─┤
-// ═╩╝┴ ┴╶┴┘┴ ┴
+/// /sys/fs/trfs
+static struct kset* trfs_sysfs_kset = NULL;
 
-static ssize_t trfs_sysfs_dada_show(
+static struct super_block* trfs_sysfs_super_block(
+  struct kobject* const kobject
+) {
+  return container_of(kobject, struct trfs_sysfs_mount, kobject)->super_block;
+}
+
+static struct trfs_mount_info* trfs_sysfs_mount_info(
+  struct kobject* const kobject
+) {
+  return trfs_mount_info(trfs_sysfs_super_block(kobject));
+}
+
+// ╔╦╗┬ ┬┌┐┌┌─┐┌┐ ┬  ┌─┐┌─┐
+//  ║ │ ││││├─┤├┴┐│  ├┤ └─┐
+//  ╩ └─┘┘└┘┴ ┴└─┘┴─┘└─┘└─┘
+
+static ssize_t trfs_sysfs_timing_show(
   struct kobject* const kobject,
   struct kobj_attribute* const attribute,
   char* const buffer
 ) {
-  // container_of(pointer, object type, member).
-  // Given the address of object.member (pointer), return the address of object.
-  struct trfs_sysfs_data* const data = container_of(
-    kobject, struct trfs_sysfs_data, trfs_kobject
-  );
+  return sysfs_emit(buffer, "%d\n", static_key_enabled(&trfs_timing));
+}
+
+static ssize_t trfs_sysfs_timing_store(
+  struct kobject* const kobject,
+  struct kobj_attribute* const attribute,
+  char const* const buffer,
+  size_t const count
+) {
+  bool enabled;
+
+  int const error = kstrtobool(buffer, &enabled);
+  if (error) {
+    return error;
+  }
+
+  // The operations in progress finish with the previous setting (see
+  // trfs_account()).
+  if (enabled) {
+    static_branch_enable(&trfs_timing);
+  }
+  else {
+    static_branch_disable(&trfs_timing);
+  }
 
-  // The buffer points to a temporary allocated kernel page.
-  // sysfs_emit() is equivalent to scnprintf(), but take care about the
-  // temporary buffer size (a page size).
-  return sysfs_emit(buffer, "%s\n", data->dada);
+  return (ssize_t) count;
 }
 
-static ssize_t trfs_sysfs_dada_store(
+static ssize_t trfs_sysfs_readahead_show(
+  struct kobject* const kobject,
+  struct kobj_attribute* const attribute,
+  char* const buffer
+) {
+  struct super_block const* const super_block = trfs_sysfs_super_block(kobject);
+
+  // The BDI of the mount, not of the disk (see trfs_set_readahead()).
+  return sysfs_emit(buffer, "%lu\n", READ_ONCE(super_block->s_bdi->ra_pages) << (PAGE_SHIFT - 10));
+}
+
+static ssize_t trfs_sysfs_readahead_store(
   struct kobject* const kobject,
   struct kobj_attribute* const attribute,
   char const* const buffer,
-  size_t count
+  size_t const count
 ) {
-  // Given the sample structure, the two below statements are equivalents:
-  // | struct sample { int mem1; char mem2; int mem3; }
-  // | 1. struct sample* pointer = &sample1;
-  // | 2. struct sample* pointer = container_of(&sample1.mem3, struct sample, mem3);
-  struct trfs_sysfs_data* const data = container_of(
-    kobject, struct trfs_sysfs_data, trfs_kobject
-  );
+  unsigned int readahead;
+
+  int const error = kstrtouint(buffer, 10, &readahead);
+  if (error) {
+    return error;
+  }
 
-  // The min() macro produces a warning even though the two values are of the same type...
-  size_t const length = min_t(size_t, count, TRFS_SYSFS_DADA_SIZE - 1u);
-  strncpy(data->dada, buffer, length);
-  data->dada[length] = 0x0; // :thinking:
+  if (readahead == TRFS_READAHEAD_DEVICE) {
+    return -EINVAL;
+  }
 
-  return length;
+  trfs_set_readahead(trfs_sysfs_super_block(kobject), readahead);
+  return (ssize_t) count;
 }
 
-// ╔═╗┌─┐┌─┐┌─┐
-// ╠╣ ├─┤├┤ ├─┤
-// ╚  ┴ ┴└  ┴ ┴
+static ssize_t trfs_sysfs_commit_interval_show(
+  struct kobject* const kobject,
+  struct kobj_attribute* const attribute,
+  char* const buffer
+) {
+  return sysfs_emit(buffer, "%u\n", READ_ONCE(trfs_sysfs_mount_info(kobject)->commit_interval));
+}
 
-static ssize_t trfs_sysfs_fafa_show(
+static ssize_t trfs_sysfs_commit_interval_store(
+  struct kobject* const kobject,
+  struct kobj_attribute* const attribute,
+  char const* const buffer,
+  size_t const count
+) {
+  unsigned int interval;
+
+  int const error = kstrtouint(buffer, 10, &interval);
+  if (error) {
+    return error;
+  }
+
+  if (interval > TRFS_MAX_COMMIT_INTERVAL) {
+    return -EINVAL;
+  }
+
+  // A pending commit keeps its delay.
+  WRITE_ONCE(trfs_sysfs_mount_info(kobject)->commit_interval, interval ?: TRFS_DEFAULT_COMMIT_INTERVAL);
+  return (ssize_t) count;
+}
+
+/// Indexed by TRFS_ALLOC_*.
+static char const* const trfs_sysfs_alloc_policies[] = {
+  [TRFS_ALLOC_SPREAD] = "spread",
+  [TRFS_ALLOC_PACKED] = "packed",
+};
+
+static ssize_t trfs_sysfs_alloc_policy_show(
   struct kobject* const kobject,
   struct kobj_attribute* const attribute,
   char* const buffer
 ) {
-  struct trfs_sysfs_data* const data = container_of(
-    kobject, struct trfs_sysfs_data, trfs_kobject
-  );
+  unsigned int const policy = READ_ONCE(trfs_sysfs_mount_info(kobject)->alloc_policy);
+
+  return sysfs_emit(buffer, "%s\n", trfs_sysfs_alloc_policies[policy]);
+}
+
+static ssize_t trfs_sysfs_alloc_policy_store(
+  struct kobject* const kobject,
+  struct kobj_attribute* const attribute,
+  char const* const buffer,
+  size_t const count
+) {
+  // Ignores a trailing newline.
+  int const policy = sysfs_match_string(trfs_sysfs_alloc_policies, buffer);
+  if (policy < 0) {
+    return policy;
+  }
 
-  return sysfs_emit(buffer, "%d\n", data->fafa);
+  WRITE_ONCE(trfs_sysfs_mount_info(kobject)->alloc_policy, (unsigned int) policy);
+  return (ssize_t) count;
 }
 
-static ssize_t trfs_sysfs_fafa_store(
+static ssize_t trfs_sysfs_extent_cache_pressure_show(
+  struct kobject* const kobject,
+  struct kobj_attribute* const attribute,
+  char* const buffer
+) {
+  return sysfs_emit(buffer, "%u\n", READ_ONCE(trfs_sysfs_mount_info(kobject)->extent_cache_pressure));
+}
+
+static ssize_t trfs_sysfs_extent_cache_pressure_store(
   struct kobject* const kobject,
   struct kobj_attribute* const attribute,
   char const* const buffer,
-  size_t count
+  size_t const count
+) {
+  unsigned int pressure;
+
+  int const error = kstrtouint(buffer, 10, &pressure);
+  if (error) {
+    return error;
+  }
+
+  WRITE_ONCE(trfs_sysfs_mount_info(kobject)->extent_cache_pressure, pressure);
+  return (ssize_t) count;
+}
+
+// ╔═╗┌─┐┬ ┬┌┐┌┌┬┐┌─┐┬─┐┌─┐
+// ║  │ ││ ││││ │ ├┤ ├┬┘└─┐
+// ╚═╝└─┘└─┘┘└┘ ┴ └─┘┴└─└─┘
+
+static ssize_t trfs_sysfs_free_blocks_show(
+  struct kobject* const kobject,
+  struct kobj_attribute* const attribute,
+  char* const buffer
 ) {
-  struct trfs_sysfs_data* const data = container_of(
-    kobject, struct trfs_sysfs_data, trfs_kobject
-  );
+  return sysfs_emit(buffer, "%lld\n", percpu_counter_sum_positive(&trfs_sysfs_mount_info(kobject)->free_blocks));
+}
 
-  // TODO: Ensure that the buffer is null-terminated (man kstrtoint).
-  int error = kstrtoint(buffer, 10, &data->fafa);
-  return error < 0 ? error : count;
+static ssize_t trfs_sysfs_reserved_blocks_show(
+  struct kobject* const kobject,
+  struct kobj_attribute* const attribute,
+  char* const buffer
+) {
+  return sysfs_emit(buffer, "%lld\n", percpu_counter_sum_positive(&trfs_sysfs_mount_info(kobject)->dirty_blocks));
+}
+
+static ssize_t trfs_sysfs_free_inodes_show(
+  struct kobject* const kobject,
+  struct kobj_attribute* const attribute,
+  char* const buffer
+) {
+  return sysfs_emit(buffer, "%lld\n", percpu_counter_sum_positive(&trfs_sysfs_mount_info(kobject)->free_inodes));
+}
+
+static ssize_t trfs_sysfs_extent_cache_size_show(
+  struct kobject* const kobject,
+  struct kobj_attribute* const attribute,
+  char* const buffer
+) {
+  return sysfs_emit(buffer, "%lu\n", READ_ONCE(trfs_sysfs_mount_info(kobject)->extent_cache_count));
+}
+
+static ssize_t trfs_sysfs_extent_cache_hits_show(
+  struct kobject* const kobject,
+  struct kobj_attribute* const attribute,
+  char* const buffer
+) {
+  u64 const hits = trfs_sum_counter(trfs_sysfs_mount_info(kobject), TRFS_COUNTER_EXTENT_CACHE_HITS);
+
+  return sysfs_emit(buffer, "%llu\n", hits);
+}
+
+static ssize_t trfs_sysfs_extent_cache_misses_show(
+  struct kobject* const kobject,
+  struct kobj_attribute* const attribute,
+  char* const buffer
+) {
+  u64 const misses = trfs_sum_counter(trfs_sysfs_mount_info(kobject), TRFS_COUNTER_EXTENT_CACHE_MISSES);
+
+  return sysfs_emit(buffer, "%llu\n", misses);
 }
 
 // ╔═╗┬ ┬┌─┐┌─┐┌─┐
 // ╚═╗└┬┘└─┐├┤ └─┐
 // ╚═╝ ┴ └─┘└  └─┘
 
-static struct kobj_attribute trfs_sysfs_dada_attribute = __ATTR(
-  dada, 0664, trfs_sysfs_dada_show, trfs_sysfs_dada_store
+static struct kobj_attribute trfs_sysfs_timing_attribute = __ATTR(
+  timing, 0644, trfs_sysfs_timing_show, trfs_sysfs_timing_store
 );
 
-static struct kobj_attribute trfs_sysfs_fafa_attribute = __ATTR(
-  fafa, 0664, trfs_sysfs_fafa_show, trfs_sysfs_fafa_store
+static struct kobj_attribute trfs_sysfs_readahead_attribute = __ATTR(
+  readahead_kb, 0644, trfs_sysfs_readahead_show, trfs_sysfs_readahead_store
+);
+
+static struct kobj_attribute trfs_sysfs_commit_interval_attribute = __ATTR(
+  commit_interval, 0644, trfs_sysfs_commit_interval_show, trfs_sysfs_commit_interval_store
+);
+
+static struct kobj_attribute trfs_sysfs_alloc_policy_attribute = __ATTR(
+  alloc_policy, 0644, trfs_sysfs_alloc_policy_show, trfs_sysfs_alloc_policy_store
+);
+
+static struct kobj_attribute trfs_sysfs_extent_cache_pressure_attribute = __ATTR(
+  extent_cache_pressure, 0644, trfs_sysfs_extent_cache_pressure_show, trfs_sysfs_extent_cache_pressure_store
+);
+
+static struct kobj_attribute trfs_sysfs_free_blocks_attribute = __ATTR(
+  free_blocks, 0444, trfs_sysfs_free_blocks_show, NULL
+);
+
+static struct kobj_attribute trfs_sysfs_reserved_blocks_attribute = __ATTR(
+  reserved_blocks, 0444, trfs_sysfs_reserved_blocks_show, NULL
+);
+
+static struct kobj_attribute trfs_sysfs_free_inodes_attribute = __ATTR(
+  free_inodes, 0444, trfs_sysfs_free_inodes_show, NULL
+);
+
+static struct kobj_attribute trfs_sysfs_extent_cache_size_attribute = __ATTR(
+  extent_cache_size, 0444, trfs_sysfs_extent_cache_size_show, NULL
+);
+
+static struct kobj_attribute trfs_sysfs_extent_cache_hits_attribute = __ATTR(
+  extent_cache_hits, 0444, trfs_sysfs_extent_cache_hits_show, NULL
+);
+
+static struct kobj_attribute trfs_sysfs_extent_cache_misses_attribute = __ATTR(
+  extent_cache_misses, 0444, trfs_sysfs_extent_cache_misses_show, NULL
 );
 
 static struct attribute* trfs_sysfs_attributes[] = {
-  &trfs_sysfs_dada_attribute.attr,
-  &trfs_sysfs_fafa_attribute.attr,
+  &trfs_sysfs_readahead_attribute.attr,
+  &trfs_sysfs_commit_interval_attribute.attr,
+  &trfs_sysfs_alloc_policy_attribute.attr,
+  &trfs_sysfs_extent_cache_pressure_attribute.attr,
+  &trfs_sysfs_free_blocks_attribute.attr,
+  &trfs_sysfs_reserved_blocks_attribute.attr,
+  &trfs_sysfs_free_inodes_attribute.attr,
+  &trfs_sysfs_extent_cache_size_attribute.attr,
+  &trfs_sysfs_extent_cache_hits_attribute.attr,
+  &trfs_sysfs_extent_cache_misses_attribute.attr,
   NULL,
 };
 
 // We could use ATTRIBUTE_GROUPS(trfs_sysfs_attrs) but it forces the
 // "attributes" to be named "attrs".
 static struct attribute_group const trfs_sysfs_group = {
- .attrs = trfs_sysfs_attributes,
+  .attrs = trfs_sysfs_attributes,
 };
 
 static struct attribute_group const* trfs_sysfs_groups[] = {
@@ -123,67 +346,103 @@ static struct attribute_group const* trfs_sysfs_groups[] = {
   NULL,
 };
 
-// See kset and how it is useful.
+static void trfs_sysfs_release(
+  struct kobject* const kobject
+) {
+  kfree(container_of(kobject, struct trfs_sysfs_mount, kobject));
+}
+
 static const struct kobj_type trfs_sysfs_ktype = {
- .default_groups = trfs_sysfs_groups,
- .sysfs_ops = &kobj_sysfs_ops,
-  // .release = trfs_sysfs_release,
+  .default_groups = trfs_sysfs_groups,
+  .sysfs_ops = &kobj_sysfs_ops,
+  .release = trfs_sysfs_release,
 };
 
-#define TRFS_SYSFS_NAME "trfs"
-static struct trfs_sysfs_data * trfs_sysfs_data = NULL;
+// ╔╦╗┌─┐┬ ┬┌┐┌┌┬┐┌─┐
+// ║║║│ ││ ││││ │ └─┐
+// ╩ ╩└─┘└─┘┘└┘ ┴ └─┘
+
+///
+/// Creates /sys/fs/trfs/<device> for a new mount. The tunables are not worth
+/// failing a mount (they keep the values of the mount options), errors are
+/// only reported.
+///
+void trfs_sysfs_register(
+  struct super_block* const super_block
+) {
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
+
+  if (trfs_sysfs_kset == NULL) {
+    return;
+  }
+
+  struct trfs_sysfs_mount* const mount = kzalloc(sizeof(struct trfs_sysfs_mount), GFP_KERNEL);
+  if (mount == NULL) {
+    TRFS_ERROR("Could not allocate the kobject of %s\n", super_block->s_id);
+    return;
+  }
+
+  mount->super_block = super_block;
+  mount->kobject.kset = trfs_sysfs_kset;
+
+  // The parent is the kset.
+  int const error = kobject_init_and_add(&mount->kobject, &trfs_sysfs_ktype, NULL, "%s", super_block->s_id);
+  if (error) {
+    TRFS_ERROR("Could not create /sys/fs/trfs/%s (error: [%d])\n", super_block->s_id, error);
+
+    // Frees the mount (see trfs_sysfs_release()).
+    kobject_put(&mount->kobject);
+    return;
+  }
+
+  info->kobject = &mount->kobject;
+}
+
+///
+/// Removes /sys/fs/trfs/<device>, before the mount info is freed. Once the
+/// attributes are removed, none is being read or written anymore.
+///
+void trfs_sysfs_unregister(
+  struct super_block* const super_block
+) {
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
+
+  if (info->kobject != NULL) {
+    kobject_del(info->kobject);
+    kobject_put(info->kobject);
+    info->kobject = NULL;
+  }
+}
 
 int trfs_sysfs_init(void) {
-  // kzalloc() allocates memory and set it with zeros.
-  // GFP stands for "Get Free Page", see documentation below.
-  // https://www.kernel.org/doc/html/next/core-api/memory-allocation.html
-  trfs_sysfs_data = kzalloc(sizeof(struct trfs_sysfs_data), GFP_KERNEL);
+  if (trfs_sysfs_kset != NULL) {
+    // Should not happen.
+    return 0;
+  }
 
-  if (trfs_sysfs_data == NULL) {
-    TRFS_ERROR("Could not allocate TRFS kobject\n");
+  trfs_sysfs_kset = kset_create_and_add("trfs", NULL, fs_kobj);
+  if (trfs_sysfs_kset == NULL) {
+    TRFS_ERROR("Could not initialize /sys/fs/trfs\n");
     return -ENOMEM;
   }
 
-  #define TRFS_SYSFS_DADA_INITIAL "Hello from TRFS!"
-  size_t const length = min_t(size_t, sizeof(TRFS_SYSFS_DADA_INITIAL), TRFS_SYSFS_DADA_SIZE) - 1u;
-  strncpy(trfs_sysfs_data->dada, TRFS_SYSFS_DADA_INITIAL, length);
-  trfs_sysfs_data->dada[length] = 0x0;
-  trfs_sysfs_data->fafa = 220; // Amicable number with 284.
-
-  // Create the kobject at /sys/kernel/trfs.
-  // https://docs.kernel.org/core-api/kobject.html#initialization-of-kobjects
-  int error = kobject_init_and_add(
-    &trfs_sysfs_data->trfs_kobject,
-    &trfs_sysfs_ktype,
-    kernel_kobj, // TODO: /sys/fs/
-    "%s", TRFS_SYSFS_NAME
-  );
-
-  // We could have used kobject_create_and_add() and sysfs_create_file(), but we
-  // are storing our variables ("dada" and "fafa") inside the same structure as
-  // the kobject. The longest way has been chosen for educational purposes.
-  // https://docs.kernel.org/core-api/kobject.html#creating-simple-kobjects
-  // https://github.com/torvalds/linux/blob/master/samples/kobject/kobject-example.c
+  // Removed with the kset.
+  int const error = sysfs_create_file(&trfs_sysfs_kset->kobj, &trfs_sysfs_timing_attribute.attr);
   if (error) {
-    TRFS_ERROR("Could not initialize /sys/kernel/%s\n", TRFS_SYSFS_NAME);
-
-    // https://www.kernel.org/doc/html/latest/driver-api/basics.html
-    // According to the documentation, kobject_put() MUST always be called
-    // whether an error occurs or not.
-    kobject_put(&trfs_sysfs_data->trfs_kobject);
-    kfree(trfs_sysfs_data);
-    trfs_sysfs_data = NULL;
-    return -ENOMEM;
+    TRFS_ERROR("Could not create /sys/fs/trfs/timing (error: [%d])\n", error);
+    kset_unregister(trfs_sysfs_kset);
+    trfs_sysfs_kset = NULL;
+    return error;
   }
 
-  TRFS_INFO("/sys/kernel/%s created\n", TRFS_SYSFS_NAME);
+  TRFS_INFO("/sys/fs/trfs created\n");
   return 0;
 }
 
 void trfs_sysfs_exit(void) {
-  if (trfs_sysfs_data != NULL) {
-    kobject_put(&trfs_sysfs_data->trfs_kobject);
-    kfree(trfs_sysfs_data);
-    TRFS_INFO("/sys/kernel/%s removed\n", TRFS_SYSFS_NAME);
+  if (trfs_sysfs_kset != NULL) {
+    kset_unregister(trfs_sysfs_kset);
+    trfs_sysfs_kset = NULL;
+    TRFS_INFO("/sys/fs/trfs removed\n");
   }
 }
@@ -1,7 +1,12 @@
 #ifndef TRFS_SYSFS_H
 #define TRFS_SYSFS_H
 
+struct super_block;
+
 int trfs_sysfs_init(void);
 void trfs_sysfs_exit(void);
 
+void trfs_sysfs_register(struct super_block* const super_block);
+void trfs_sysfs_unregister(struct super_block* const super_block);
+
 #endif // TRFS_SYSFS_H
@@ -8,7 +8,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
+#include <sys/random.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "trfs/super.h"
@@ -23,6 +25,19 @@
 #define MKFS_DEFAULT_BLOCK_SIZE_BITS 12u // 4096
 #define MKFS_DEFAULT_BLOCK_SIZE (1u << MKFS_DEFAULT_BLOCK_SIZE_BITS)
 
+/// The largest default allocation group (in blocks), volumes above it are split
+/// in several groups.
+#define MKFS_MAX_GROUP_BLOCKS (1u << 31)
+
+/// The value returned by getopt_long() for --64bit (long option only).
+#define MKFS_OPTION_64BIT 256
+
+/// The value returned by getopt_long() for --no-reflink (long option only).
+#define MKFS_OPTION_NO_REFLINK 257
+
+/// The number of zeroed blocks written at once (refcount tables).
+#define MKFS_ZERO_BLOCKS 256u
+
 #define eprintf(format, ...) fprintf(stderr, format, ##__VA_ARGS__)
 #define MKFS_INFO(format, ...) printf(format "\n", ##__VA_ARGS__)
 #define MKFS_ERROR(format, ...) eprintf("Error: " format "\n", ##__VA_ARGS__)
@@ -31,7 +46,12 @@
 struct mkfs_options {
   char const* device;
   uint32_t block_size;
-  uint32_t blocks;
+  uint32_t cluster_size;
+  uint64_t blocks;
+  uint32_t inodes;
+  uint32_t group_blocks;
+  bool is_64bit;
+  bool no_reflink;
   bool verbose;
 };
 
@@ -82,8 +102,22 @@ static void mkfs_usage(
     "Options:" LFLF
     "  -b, --block-size [BYTES]" LF
     "    File system's block size." LFLF
+    "  -c, --cluster-size [BYTES]" LF
+    "    Allocation unit, a power of 2 multiple of the block size (default: the" LF
+    "    block size)." LFLF
     "  -s, --blocks [N]" LF
     "    Number of blocks." LFLF
+    "  -i, --inodes [N]" LF
+    "    Number of inodes (default: one per 4 blocks)." LFLF
+    "  -g, --group-size [N]" LF
+    "    Number of blocks per allocation group (default: a single group of at" LF
+    "    most 2^31 blocks)." LFLF
+    "  --64bit" LF
+    "    Use 64-bit block numbers (implied beyond 2^32 - 1 blocks)." LFLF
+    "  --no-reflink" LF
+    "    Do not lay out the refcount tables that let files share blocks (cloned" LF
+    "    files are then copied). Implied when the cluster size is not the block" LF
+    "    size." LFLF
     "  -v, --verbose" LF
     "    Produce verbose ouput." LFLF
     "  -h, --help" LF
@@ -112,12 +146,12 @@ static void mkfs_usage(
 ///
 /// @pre string != NULL
 ///
-static uint32_t mkfs_parse_number(char const* const string) {
-  uint32_t number = 0u;
+static uint64_t mkfs_parse_number(char const* const string) {
+  uint64_t number = 0u;
 
   for (char const* character = string; *character != 0x0; ++character) {
     if (isdigit(*character)) {
-      number = (number * 10u) + (uint32_t) (*character - '0');
+      number = (number * 10u) + (uint64_t) (*character - '0');
       continue;
     }
 
@@ -139,6 +173,23 @@ static uint32_t mkfs_parse_number(char const* const string) {
   return number;
 }
 
+///
+/// Same as mkfs_parse_number() for 32-bit values, exits when the value does not
+/// fit.
+///
+/// @pre string != NULL
+///
+static uint32_t mkfs_parse_uint32(char const* const string) {
+  uint64_t const number = mkfs_parse_number(string);
+
+  if (number > UINT32_MAX) {
+    MKFS_ERROR("Value \"%s\" is too large (at most %u).", string, UINT32_MAX);
+    exit(EXIT_FAILURE);
+  }
+
+  return (uint32_t) number;
+}
+
 ///
 /// Parses command line arguments into the given `mkfs_options` structure.
 ///
@@ -156,12 +207,17 @@ static bool parse_mkfs_options(
     { "help", no_argument, NULL, 'h' },
     { "verbose", no_argument, NULL, 'v' },
     { "block-size", required_argument, NULL, 'b' },
+    { "cluster-size", required_argument, NULL, 'c' },
     { "blocks", required_argument, NULL, 's' },
+    { "inodes", required_argument, NULL, 'i' },
+    { "group-size", required_argument, NULL, 'g' },
+    { "64bit", no_argument, NULL, MKFS_OPTION_64BIT },
+    { "no-reflink", no_argument, NULL, MKFS_OPTION_NO_REFLINK },
     { NULL, 0, NULL, 0 },
   };
 
   while (option >= 0) {
-    option = getopt_long(argc, argv, "hvb:s:", options, NULL);
+    option = getopt_long(argc, argv, "hvb:c:s:i:g:", options, NULL);
 
     if (option <= -1) {
       break;
@@ -182,7 +238,13 @@ static bool parse_mkfs_options(
 
       // Block size.
       case 'b': {
-        mkfs_options->block_size = mkfs_parse_number(optarg);
+        mkfs_options->block_size = mkfs_parse_uint32(optarg);
+        break;
+      }
+
+      // Cluster size.
+      case 'c': {
+        mkfs_options->cluster_size = mkfs_parse_uint32(optarg);
         break;
       }
 
@@ -192,6 +254,30 @@ static bool parse_mkfs_options(
         break;
       }
 
+      // Inodes.
+      case 'i': {
+        mkfs_options->inodes = mkfs_parse_uint32(optarg);
+        break;
+      }
+
+      // Group size.
+      case 'g': {
+        mkfs_options->group_blocks = mkfs_parse_uint32(optarg);
+        break;
+      }
+
+      // 64-bit block numbers.
+      case MKFS_OPTION_64BIT: {
+        mkfs_options->is_64bit = true;
+        break;
+      }
+
+      // No refcount tables.
+      case MKFS_OPTION_NO_REFLINK: {
+        mkfs_options->no_reflink = true;
+        break;
+      }
+
       // Unrecognized option.
       case '?': {
         // opterr is by default non-zero.
@@ -239,13 +325,13 @@ static inline bool is_power_of_2(uint32_t n) {
 ///
 /// Exit if a multiplication overflow is detected.
 ///
-static inline uint32_t checked_multiplication(uint32_t a, uint32_t b) {
-  uint32_t n = a * b;
+static inline uint64_t checked_multiplication(uint64_t a, uint64_t b) {
+  uint64_t n = a * b;
 
   // Is -fwrapv set by default?
   // If the compiler going to optimize things?
   if (a != 0u && n / a != b) {
-    MKFS_ERROR("Multiplication overflow detected (%u x %u).", a, b);
+    MKFS_ERROR("Multiplication overflow detected (%lu x %lu).", a, b);
     exit(EXIT_FAILURE);
   }
 
@@ -370,12 +456,24 @@ static bool check_mkfs_options(
     goto close_fd;
   }
 
+  if (options->cluster_size != 0u && (
+    !is_power_of_2(options->cluster_size)
+    || options->cluster_size < options->block_size
+    || options->cluster_size / options->block_size > (1u << TRFS_MAX_CLUSTER_BITS)
+  )) {
+    MKFS_ERROR(
+      "Cluster size (%u) is not a power of 2 between the block size and %u blocks.",
+      options->cluster_size, 1u << TRFS_MAX_CLUSTER_BITS
+    );
+    goto close_fd;
+  }
+
   // 3. Check number of blocks.
   if (options->blocks < 2) {
     // Block 0: boot block.
     // Block 1: superblock.
     MKFS_ERROR(
-      "Number of blocks (%u) cannot be smaller than 2.",
+      "Number of blocks (%lu) cannot be smaller than 2.",
       options->blocks
     );
     goto close_fd;
@@ -383,7 +481,7 @@ static bool check_mkfs_options(
 
   if (checked_multiplication(options->blocks, options->block_size) >= device_size) {
     MKFS_ERROR(
-      "Total number of blocks (%u x %u) exceeds the device size (%lu).",
+      "Total number of blocks (%lu x %u) exceeds the device size (%lu).",
       options->blocks, options->block_size, device_size
     );
     goto close_fd;
@@ -468,9 +566,227 @@ bool seek_and_write(
 }
 
 ///
-/// Writes the superblock.
+/// Returns the number of blocks needed to hold `count` items of which
+/// `per_block` fit in a block.
+///
+static inline uint32_t blocks_for(uint64_t const count, uint32_t const per_block) {
+  return (uint32_t) ((count + per_block - 1u) / per_block);
+}
+
+///
+/// Writes a bitmap of `bits` bits starting at block `first_block`.
+///
+/// Bits [0, used) are set, as well as the trailing bits of the last bitmap
+/// block that do not map to anything.
+///
+/// @pre options != NULL
+/// @pre device != NULL
+///
+static bool write_bitmap(
+  struct mkfs_options const* const options,
+  struct device_stats const* const device,
+  uint64_t const first_block,
+  uint32_t const used,
+  uint32_t const bits
+) {
+  uint32_t const bits_per_block = options->block_size * 8u;
+  uint8_t* const buffer = malloc(options->block_size);
+
+  if (buffer == NULL) {
+    perror("Error malloc()");
+    return false;
+  }
+
+  bool success = true;
+  for (uint32_t index = 0; success && index < blocks_for(bits, bits_per_block); ++index) {
+    uint64_t const first = (uint64_t) index * bits_per_block;
+
+    for (uint32_t bit = 0; bit < bits_per_block; ++bit) {
+      uint64_t const position = first + bit;
+      bool const is_set = position < used || position >= bits;
+
+      // Least significant bit first (see the *_bit_le() kernel helpers).
+      if (bit % 8u == 0u) {
+        buffer[bit / 8u] = 0u;
+      }
+
+      if (is_set) {
+        buffer[bit / 8u] = (uint8_t) (buffer[bit / 8u] | (1u << (bit % 8u)));
+      }
+    }
+
+    success = seek_and_write(
+      options, device,
+      buffer, options->block_size,
+      (off_t) (first_block + index) * options->block_size
+    );
+  }
+
+  free(buffer);
+  return success;
+}
+
+///
+/// Writes `blocks` zeroed blocks starting at block `first_block` (a refcount
+/// table, nothing is shared).
+///
+/// @pre options != NULL
+/// @pre device != NULL
+///
+static bool write_zeroes(
+  struct mkfs_options const* const options,
+  struct device_stats const* const device,
+  uint64_t const first_block,
+  uint32_t const blocks
+) {
+  uint8_t* const buffer = calloc(MKFS_ZERO_BLOCKS, options->block_size);
+
+  if (buffer == NULL) {
+    perror("Error calloc()");
+    return false;
+  }
+
+  bool success = true;
+  for (uint32_t index = 0; success && index < blocks; index += MKFS_ZERO_BLOCKS) {
+    uint32_t const count = blocks - index < MKFS_ZERO_BLOCKS ? blocks - index : MKFS_ZERO_BLOCKS;
+
+    success = seek_and_write(
+      options, device,
+      buffer, (size_t) count * options->block_size,
+      (off_t) (first_block + index) * options->block_size
+    );
+  }
+
+  free(buffer);
+  return success;
+}
+
 ///
-/// TODO: inodes table, inode bitmap
+/// Writes the root directory inode (an empty directory has no block, its
+/// entries are stored in the inode until they outgrow it).
+///
+/// @pre options != NULL
+/// @pre device != NULL
+/// @pre layout != NULL (integers in CPU byte order)
+///
+static bool write_root_inode(
+  struct mkfs_options const* const options,
+  struct device_stats const* const device,
+  struct trfs_super_block_info const* const layout
+) {
+  int64_t const now = (int64_t) time(NULL);
+  struct trfs_inode const root = {
+    .mode = htobe16(S_IFDIR | 0755),
+    .links = htobe16(2), // "." and the parent's entry (itself).
+    .uid = htobe32(getuid()),
+    .gid = htobe32(getgid()),
+    .atime = (int64_t) htobe64((uint64_t) now),
+    .mtime = (int64_t) htobe64((uint64_t) now),
+    .ctime = (int64_t) htobe64((uint64_t) now),
+    .flags = htobe16(TRFS_INODE_INLINE),
+  };
+
+  return seek_and_write(
+    options, device,
+    &root, sizeof(root),
+    (off_t) trfs_group_inode_table_block(layout, 0) * options->block_size
+      + (off_t) TRFS_ROOT_INODE * TRFS_INODE_SIZE
+  );
+}
+
+///
+/// Computes the group geometry of the given layout (block_size, blocks,
+/// group_blocks, feature_incompat and the wanted number of inodes are set).
+///
+/// @pre layout != NULL
+///
+static bool compute_groups(
+  struct trfs_super_block_info* const layout,
+  uint32_t const inodes
+) {
+  uint32_t const bits_per_block = layout->block_size * 8u;
+  uint64_t const groups = (trfs_super_blocks(layout) + layout->group_blocks - 1u) / layout->group_blocks;
+
+  if (groups > UINT32_MAX) {
+    MKFS_ERROR("Too many allocation groups (%lu).", groups);
+    return false;
+  }
+
+  layout->groups = (uint32_t) groups;
+  layout->group_inodes = blocks_for(inodes, layout->groups);
+
+  uint64_t const total_inodes = (uint64_t) layout->groups * layout->group_inodes;
+  if (total_inodes > UINT32_MAX) {
+    MKFS_ERROR("Too many inodes (%lu).", total_inodes);
+    return false;
+  }
+
+  layout->bitmap_blocks = blocks_for(layout->group_blocks >> layout->cluster_bits, bits_per_block);
+  layout->refcount_blocks = layout->feature_incompat & TRFS_FEATURE_INCOMPAT_REFLINK
+    ? blocks_for(layout->group_blocks, layout->block_size / TRFS_REFCOUNT_SIZE)
+    : 0u;
+  layout->inode_bitmap_blocks = blocks_for(layout->group_inodes, bits_per_block);
+  layout->inode_table_blocks = blocks_for(layout->group_inodes, layout->block_size / TRFS_INODE_SIZE);
+  layout->inodes = (uint32_t) total_inodes;
+  return true;
+}
+
+///
+/// Sets the number of blocks of the given layout (in CPU byte order).
+///
+/// @pre layout != NULL
+///
+static inline void set_blocks(
+  struct trfs_super_block_info* const layout,
+  uint64_t const blocks
+) {
+  layout->blocks = (uint32_t) blocks;
+  layout->blocks_hi = (uint32_t) (blocks >> 32);
+}
+
+///
+/// Returns the number of metadata blocks of the given group (including the
+/// boot block and the superblock for the first group).
+///
+/// @pre layout != NULL
+///
+static inline uint64_t group_metadata(
+  struct trfs_super_block_info const* const layout,
+  uint32_t const group
+) {
+  return trfs_group_data_block(layout, group) - trfs_group_first_block(layout, group);
+}
+
+///
+/// Returns the number of clusters of the given group, a trailing partial
+/// cluster excepted (it is never allocated).
+///
+/// @pre layout != NULL
+///
+static inline uint32_t group_clusters(
+  struct trfs_super_block_info const* const layout,
+  uint32_t const group
+) {
+  return trfs_group_size(layout, group) >> layout->cluster_bits;
+}
+
+///
+/// Returns the number of clusters holding the metadata of the given group.
+///
+/// @pre layout != NULL
+///
+static inline uint32_t group_metadata_clusters(
+  struct trfs_super_block_info const* const layout,
+  uint32_t const group
+) {
+  return blocks_for(group_metadata(layout, group), trfs_super_cluster_blocks(layout));
+}
+
+///
+/// Writes the superblock, the bitmaps and the root directory.
+///
+/// The inode table is not cleared, the inode bitmap tells which inodes are in
+/// use and an inode is fully written when allocated.
 ///
 /// @pre options != NULL
 /// @pre device != NULL
@@ -481,12 +797,118 @@ static bool make_file_system(
   struct mkfs_options const* const options,
   struct device_stats const* const device
 ) {
+  // Layout (in blocks), see trfs_group_bitmap_block():
+  // | boot | superblock | free-block bitmap | refcounts | inode bitmap | inode table | data... (group 0)
+  // | free-block bitmap | refcounts | inode bitmap | inode table | data...                     (group n)
+  uint32_t const inodes = options->inodes != 0u
+    ? options->inodes
+    : (uint32_t) (options->blocks / 4u < UINT32_MAX ? options->blocks / 4u : UINT32_MAX);
+  uint32_t cluster_bits = 0u;
+  while (options->cluster_size >> cluster_bits > options->block_size) {
+    ++cluster_bits;
+  }
+
+  // Groups are made of whole clusters.
+  uint64_t const cluster_blocks = 1u << cluster_bits;
+  uint64_t const wanted_group_blocks = options->group_blocks != 0u
+    ? options->group_blocks
+    : MKFS_MAX_GROUP_BLOCKS;
+  uint64_t const group_blocks = (
+    (wanted_group_blocks < options->blocks ? wanted_group_blocks : options->blocks) + cluster_blocks - 1u
+  ) / cluster_blocks * cluster_blocks;
+
+  if (group_blocks > UINT32_MAX || (options->group_blocks != 0u && options->group_blocks % cluster_blocks != 0u)) {
+    MKFS_ERROR("Group size (%u blocks) is not a multiple of the cluster size.", options->group_blocks);
+    return false;
+  }
+
+  // Block numbers beyond 32 bits need the 64-bit inode and superblock format.
+  bool const is_64bit = options->is_64bit || options->blocks > UINT32_MAX;
+
+  // Shared blocks are counted one by one, the driver does not share clusters.
+  bool const is_reflink = !options->no_reflink && cluster_bits == 0u;
+
+  struct trfs_super_block_info layout = {
+    .block_size = options->block_size,
+    .group_blocks = (uint32_t) group_blocks,
+    .feature_incompat = (is_64bit ? TRFS_FEATURE_INCOMPAT_64BIT : 0u)
+      | (cluster_bits > 0u ? TRFS_FEATURE_INCOMPAT_BIGALLOC : 0u)
+      | (is_reflink ? TRFS_FEATURE_INCOMPAT_REFLINK : 0u),
+    .cluster_bits = cluster_bits,
+  };
+
+  set_blocks(&layout, options->blocks);
+  if (!compute_groups(&layout, inodes)) {
+    return false;
+  }
+
+  // A last group too small to hold its metadata (and one data block) is left
+  // out of the file system.
+  uint32_t const last = layout.groups - 1u;
+  if (last > 0 && group_metadata_clusters(&layout, last) >= group_clusters(&layout, last)) {
+    MKFS_WARNING(
+      "Last group (%u blocks) is too small, the file system is shrunk to %lu blocks.",
+      trfs_group_size(&layout, last), trfs_group_first_block(&layout, last)
+    );
+
+    set_blocks(&layout, trfs_group_first_block(&layout, last));
+    if (!compute_groups(&layout, inodes)) {
+      return false;
+    }
+  }
+
+  if (layout.group_inodes <= TRFS_ROOT_INODE) {
+    MKFS_ERROR("Number of inodes per group (%u) cannot be smaller than 2.", layout.group_inodes);
+    return false;
+  }
+
+  // Only the first group (boot block and superblock) and the last one (which
+  // may be smaller) can be too small.
+  uint32_t const checked_groups[] = { 0u, layout.groups - 1u };
+  for (size_t index = 0; index < sizeof(checked_groups) / sizeof(*checked_groups); ++index) {
+    uint32_t const group = checked_groups[index];
+
+    if (group_metadata_clusters(&layout, group) >= group_clusters(&layout, group)) {
+      MKFS_ERROR(
+        "Group %u (%u blocks) is too small to hold its metadata (%lu blocks).",
+        group, trfs_group_size(&layout, group), group_metadata(&layout, group)
+      );
+      return false;
+    }
+  }
+
+  uint64_t free_blocks = 0;
+  for (uint32_t group = 0; group < layout.groups; ++group) {
+    free_blocks += (uint64_t) (group_clusters(&layout, group) - group_metadata_clusters(&layout, group)) << cluster_bits;
+  }
+
+  // Directory name hash key.
+  if (getrandom(layout.hash_key, sizeof(layout.hash_key), 0) != sizeof(layout.hash_key)) {
+    perror("Error getrandom()");
+    return false;
+  }
+
   struct trfs_super_block_info super_block = {
     .magic_number = TRFS_MAGIC_NUMBER,
 
     // Convert to big-endian for readability.
-    .block_size = htobe32(options->block_size),
-    .blocks = htobe32(options->blocks),
+    .block_size = htobe32(layout.block_size),
+    .blocks = htobe32(layout.blocks),
+    .group_blocks = htobe32(layout.group_blocks),
+    .groups = htobe32(layout.groups),
+    .group_inodes = htobe32(layout.group_inodes),
+    .bitmap_blocks = htobe32(layout.bitmap_blocks),
+    .inode_bitmap_blocks = htobe32(layout.inode_bitmap_blocks),
+    .inode_table_blocks = htobe32(layout.inode_table_blocks),
+    .inodes = htobe32(layout.inodes),
+    .free_blocks = htobe32((uint32_t) free_blocks),
+    .free_inodes = htobe32(layout.inodes - (TRFS_ROOT_INODE + 1u)),
+    .feature_incompat = htobe32(layout.feature_incompat),
+    .hash_key = { htobe64(layout.hash_key[0]), htobe64(layout.hash_key[1]) },
+    .blocks_hi = htobe32(layout.blocks_hi),
+    .free_blocks_hi = htobe32((uint32_t) (free_blocks >> 32)),
+    .cluster_bits = htobe32(layout.cluster_bits),
+    .refcount_blocks = htobe32(layout.refcount_blocks),
   };
 
   if (options->verbose) {
@@ -494,11 +916,35 @@ static bool make_file_system(
       LF "Superblock:" LF
       "  Magic number: %.*s" LF
       "  Block size: %u" LF
-      "  Blocks: %u" LFLF
+      "  Blocks: %lu" LF
+      "  Cluster blocks: %u" LF
+      "  Group blocks: %u" LF
+      "  Groups: %u" LF
+      "  Group inodes: %u" LF
+      "  Bitmap blocks: %u" LF
+      "  Refcount blocks: %u" LF
+      "  Inode bitmap blocks: %u" LF
+      "  Inode table blocks: %u" LF
+      "  Inodes: %u" LF
+      "  Free blocks: %lu" LF
+      "  Free inodes: %u" LF
+      "  Incompatible features: %#x" LFLF
       , TRFS_MAGIC_NUMBER_LENGTH
       , super_block.magic_number
       , be32toh(super_block.block_size)
-      , be32toh(super_block.blocks)
+      , trfs_super_blocks(&layout)
+      , trfs_super_cluster_blocks(&layout)
+      , be32toh(super_block.group_blocks)
+      , be32toh(super_block.groups)
+      , be32toh(super_block.group_inodes)
+      , be32toh(super_block.bitmap_blocks)
+      , be32toh(super_block.refcount_blocks)
+      , be32toh(super_block.inode_bitmap_blocks)
+      , be32toh(super_block.inode_table_blocks)
+      , be32toh(super_block.inodes)
+      , free_blocks
+      , be32toh(super_block.free_inodes)
+      , layout.feature_incompat
     );
   }
 
@@ -530,6 +976,40 @@ static bool make_file_system(
     return false;
   }
 
+  for (uint32_t group = 0; group < layout.groups; ++group) {
+    // 3. Write free-block bitmaps (clusters holding metadata are in use).
+    success = write_bitmap(
+      options, device,
+      trfs_group_bitmap_block(&layout, group),
+      group_metadata_clusters(&layout, group),
+      group_clusters(&layout, group)
+    );
+
+    // 4. Write refcount tables (nothing is shared).
+    success = success && write_zeroes(
+      options, device,
+      trfs_group_refcount_block(&layout, group),
+      layout.refcount_blocks
+    );
+
+    // 5. Write inode bitmaps (inode 0 is never used, inode 1 is the root).
+    success = success && write_bitmap(
+      options, device,
+      trfs_group_inode_bitmap_block(&layout, group),
+      group == 0 ? TRFS_ROOT_INODE + 1u : 0u,
+      layout.group_inodes
+    );
+
+    if (!success) {
+      return false;
+    }
+  }
+
+  // 6. Write root directory.
+  if (!write_root_inode(options, device, &layout)) {
+    return false;
+  }
+
   MKFS_INFO("Done.");
 
   return true;
@@ -544,7 +1024,12 @@ int main(int const argc, char* const argv[]) {
   struct mkfs_options options = {
     .device = NULL,
     .block_size = MKFS_DEFAULT_BLOCK_SIZE,
+    .cluster_size = 0u,
     .blocks = 0u,
+    .inodes = 0u,
+    .group_blocks = 0u,
+    .is_64bit = false,
+    .no_reflink = false,
     .verbose = false,
   };
 
@@ -564,7 +1049,7 @@ int main(int const argc, char* const argv[]) {
   }
 
   MKFS_INFO("Filesystem block size: %u", options.block_size);
-  MKFS_INFO("Filesystem number of block: %u", options.blocks);
+  MKFS_INFO("Filesystem number of block: %lu", options.blocks);
 
   make_file_system(&options, &device);
 
@@ -0,0 +1,405 @@
+// Tracepoints (see Documentation/trace/tracepoints.rst), defined once by
+// trfs/trace.c. A disabled tracepoint costs a patched-out branch (static key),
+// enable them with perf(1) or bpftrace(8), or through tracefs:
+//   echo 1 > /sys/kernel/tracing/events/trfs/enable
+//   cat /sys/kernel/tracing/trace_pipe
+// Events of operations whose latency matters have a duration field (in
+// nanoseconds), from the start time given by the caller (also used for the
+// statistics of trfs/stats.h).
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM trfs
+
+#if !defined(TRFS_TRACE_EVENTS_H) || defined(TRACE_HEADER_MULTI_READ)
+#define TRFS_TRACE_EVENTS_H
+
+#include <linux/fs.h>
+#include <linux/iomap.h>
+#include <linux/ktime.h>
+#include <linux/tracepoint.h>
+#include <linux/writeback.h>
+
+#ifndef TRFS_TRACE_HELPERS
+#define TRFS_TRACE_HELPERS
+
+///
+/// Returns the nanoseconds elapsed since the given start time (see
+/// trfs_start_timing()), 0 when the operation was not timed.
+///
+static inline u64 trfs_trace_duration(u64 const started) {
+  return started ? ktime_get_ns() - started : 0;
+}
+
+#endif // TRFS_TRACE_HELPERS
+
+// ╔╗╔┌─┐┌┬┐┌─┐┌─┐
+// ║║║├─┤│││├┤ └─┐
+// ╝╚╝┴ ┴┴ ┴└─┘└─┘
+
+TRACE_EVENT(trfs_lookup,
+  TP_PROTO(struct inode* directory, struct dentry* dentry, u32 ino, int error, u64 started),
+  TP_ARGS(directory, dentry, ino, error, started),
+
+  TP_STRUCT__entry(
+    __field(dev_t, dev)
+    __field(unsigned long, directory)
+    __field(u32, ino)
+    __field(int, error)
+    __field(u64, duration)
+    __string(name, dentry->d_name.name)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = directory->i_sb->s_dev;
+    __entry->directory = directory->i_ino;
+    __entry->ino = ino;
+    __entry->error = error;
+    __entry->duration = trfs_trace_duration(started);
+    __assign_str(name, dentry->d_name.name);
+  ),
+
+  TP_printk("dev %d,%d directory %lu name %s ino %u error %d duration %llu",
+    MAJOR(__entry->dev), MINOR(__entry->dev), __entry->directory, __get_str(name),
+    __entry->ino, __entry->error, __entry->duration
+  )
+);
+
+TRACE_EVENT(trfs_iterate,
+  TP_PROTO(struct inode* directory, loff_t from, loff_t to, int error, u64 started),
+  TP_ARGS(directory, from, to, error, started),
+
+  TP_STRUCT__entry(
+    __field(dev_t, dev)
+    __field(unsigned long, directory)
+    __field(loff_t, from)
+    __field(loff_t, to)
+    __field(int, error)
+    __field(u64, duration)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = directory->i_sb->s_dev;
+    __entry->directory = directory->i_ino;
+    __entry->from = from;
+    __entry->to = to;
+    __entry->error = error;
+    __entry->duration = trfs_trace_duration(started);
+  ),
+
+  TP_printk("dev %d,%d directory %lu position %lld -> %lld error %d duration %llu",
+    MAJOR(__entry->dev), MINOR(__entry->dev), __entry->directory,
+    __entry->from, __entry->to, __entry->error, __entry->duration
+  )
+);
+
+// ╔═╗┬┬  ┌─┐┌─┐
+// ╠╣ ││  ├┤ └─┐
+// ╚  ┴┴─┘└─┘└─┘
+
+DECLARE_EVENT_CLASS(trfs_file_class,
+  TP_PROTO(struct inode* inode, struct file* file),
+  TP_ARGS(inode, file),
+
+  TP_STRUCT__entry(
+    __field(dev_t, dev)
+    __field(unsigned long, ino)
+    __field(loff_t, size)
+    __field(unsigned int, flags)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = inode->i_sb->s_dev;
+    __entry->ino = inode->i_ino;
+    __entry->size = i_size_read(inode);
+    __entry->flags = file->f_flags;
+  ),
+
+  TP_printk("dev %d,%d ino %lu size %lld flags %#o",
+    MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->size, __entry->flags
+  )
+);
+
+DEFINE_EVENT(trfs_file_class, trfs_file_open,
+  TP_PROTO(struct inode* inode, struct file* file),
+  TP_ARGS(inode, file)
+);
+
+DEFINE_EVENT(trfs_file_class, trfs_file_flush,
+  TP_PROTO(struct inode* inode, struct file* file),
+  TP_ARGS(inode, file)
+);
+
+DEFINE_EVENT(trfs_file_class, trfs_file_release,
+  TP_PROTO(struct inode* inode, struct file* file),
+  TP_ARGS(inode, file)
+);
+
+// ╔╦╗┌─┐┌┬┐┌─┐
+//  ║║├─┤ │ ├─┤
+// ═╩╝┴ ┴ ┴ ┴ ┴
+
+TRACE_EVENT(trfs_map_blocks,
+  TP_PROTO(struct inode* inode, loff_t offset, loff_t length, unsigned int flags, struct iomap const* iomap),
+  TP_ARGS(inode, offset, length, flags, iomap),
+
+  TP_STRUCT__entry(
+    __field(dev_t, dev)
+    __field(unsigned long, ino)
+    __field(loff_t, offset)
+    __field(loff_t, length)
+    __field(unsigned int, flags)
+    __field(u16, type)
+    __field(u64, addr)
+    __field(u64, mapped)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = inode->i_sb->s_dev;
+    __entry->ino = inode->i_ino;
+    __entry->offset = offset;
+    __entry->length = length;
+    __entry->flags = flags;
+    __entry->type = iomap->type;
+    __entry->addr = iomap->addr;
+    __entry->mapped = iomap->length;
+  ),
+
+  TP_printk("dev %d,%d ino %lu offset %lld length %lld flags %#x type %u addr %#llx mapped %llu",
+    MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->offset, __entry->length,
+    __entry->flags, __entry->type, __entry->addr, __entry->mapped
+  )
+);
+
+DECLARE_EVENT_CLASS(trfs_read_class,
+  TP_PROTO(struct inode* inode, loff_t position, size_t size),
+  TP_ARGS(inode, position, size),
+
+  TP_STRUCT__entry(
+    __field(dev_t, dev)
+    __field(unsigned long, ino)
+    __field(loff_t, position)
+    __field(size_t, size)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = inode->i_sb->s_dev;
+    __entry->ino = inode->i_ino;
+    __entry->position = position;
+    __entry->size = size;
+  ),
+
+  TP_printk("dev %d,%d ino %lu position %lld size %zu",
+    MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->position, __entry->size
+  )
+);
+
+DEFINE_EVENT(trfs_read_class, trfs_read_folio,
+  TP_PROTO(struct inode* inode, loff_t position, size_t size),
+  TP_ARGS(inode, position, size)
+);
+
+DEFINE_EVENT(trfs_read_class, trfs_readahead,
+  TP_PROTO(struct inode* inode, loff_t position, size_t size),
+  TP_ARGS(inode, position, size)
+);
+
+TRACE_EVENT(trfs_writepages,
+  TP_PROTO(struct inode* inode, struct writeback_control const* wbc, long wanted, int error, u64 started),
+  TP_ARGS(inode, wbc, wanted, error, started),
+
+  TP_STRUCT__entry(
+    __field(dev_t, dev)
+    __field(unsigned long, ino)
+    __field(loff_t, range_start)
+    __field(loff_t, range_end)
+    __field(long, wanted)
+    __field(long, written)
+    __field(int, sync_mode)
+    __field(int, error)
+    __field(u64, duration)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = inode->i_sb->s_dev;
+    __entry->ino = inode->i_ino;
+    __entry->range_start = wbc->range_start;
+    __entry->range_end = wbc->range_end;
+    __entry->wanted = wanted;
+    __entry->written = wanted - wbc->nr_to_write;
+    __entry->sync_mode = wbc->sync_mode;
+    __entry->error = error;
+    __entry->duration = trfs_trace_duration(started);
+  ),
+
+  TP_printk("dev %d,%d ino %lu range %lld-%lld pages %ld/%ld sync_mode %d error %d duration %llu",
+    MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->range_start, __entry->range_end,
+    __entry->written, __entry->wanted, __entry->sync_mode, __entry->error, __entry->duration
+  )
+);
+
+DECLARE_EVENT_CLASS(trfs_direct_io_class,
+  TP_PROTO(struct inode* inode, loff_t position, size_t count, ssize_t result, u64 started),
+  TP_ARGS(inode, position, count, result, started),
+
+  TP_STRUCT__entry(
+    __field(dev_t, dev)
+    __field(unsigned long, ino)
+    __field(loff_t, position)
+    __field(size_t, count)
+    __field(ssize_t, result)
+    __field(u64, duration)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = inode->i_sb->s_dev;
+    __entry->ino = inode->i_ino;
+    __entry->position = position;
+    __entry->count = count;
+    __entry->result = result;
+    __entry->duration = trfs_trace_duration(started);
+  ),
+
+  TP_printk("dev %d,%d ino %lu position %lld count %zu result %zd duration %llu",
+    MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->position,
+    __entry->count, __entry->result, __entry->duration
+  )
+);
+
+DEFINE_EVENT(trfs_direct_io_class, trfs_direct_read,
+  TP_PROTO(struct inode* inode, loff_t position, size_t count, ssize_t result, u64 started),
+  TP_ARGS(inode, position, count, result, started)
+);
+
+DEFINE_EVENT(trfs_direct_io_class, trfs_direct_write,
+  TP_PROTO(struct inode* inode, loff_t position, size_t count, ssize_t result, u64 started),
+  TP_ARGS(inode, position, count, result, started)
+);
+
+// ╔╗ ┬  ┌─┐┌─┐┬┌─┌─┐
+// ╠╩╗│  │ ││  ├┴┐└─┐
+// ╚═╝┴─┘└─┘└─┘┴ ┴└─┘
+
+TRACE_EVENT(trfs_allocate_blocks,
+  TP_PROTO(
+    struct super_block* super_block, u64 goal, u32 wanted, u64 start, u32 count, unsigned int flags,
+    int error, u64 started
+  ),
+  TP_ARGS(super_block, goal, wanted, start, count, flags, error, started),
+
+  TP_STRUCT__entry(
+    __field(dev_t, dev)
+    __field(u64, goal)
+    __field(u64, start)
+    __field(u32, wanted)
+    __field(u32, count)
+    __field(unsigned int, flags)
+    __field(int, error)
+    __field(u64, duration)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = super_block->s_dev;
+    __entry->goal = goal;
+    __entry->start = start;
+    __entry->wanted = wanted;
+    __entry->count = count;
+    __entry->flags = flags;
+    __entry->error = error;
+    __entry->duration = trfs_trace_duration(started);
+  ),
+
+  TP_printk("dev %d,%d goal %llu wanted %u start %llu count %u flags %#x error %d duration %llu",
+    MAJOR(__entry->dev), MINOR(__entry->dev), __entry->goal, __entry->wanted,
+    __entry->start, __entry->count, __entry->flags, __entry->error, __entry->duration
+  )
+);
+
+TRACE_EVENT(trfs_free_blocks,
+  TP_PROTO(struct super_block* super_block, u64 start, u32 count),
+  TP_ARGS(super_block, start, count),
+
+  TP_STRUCT__entry(
+    __field(dev_t, dev)
+    __field(u64, start)
+    __field(u32, count)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = super_block->s_dev;
+    __entry->start = start;
+    __entry->count = count;
+  ),
+
+  TP_printk("dev %d,%d start %llu count %u",
+    MAJOR(__entry->dev), MINOR(__entry->dev), __entry->start, __entry->count
+  )
+);
+
+// ╔═╗┬ ┬┌┐┌┌─┐
+// ╚═╗└┬┘││││
+// ╚═╝ ┴ ┘└┘└─┘
+
+TRACE_EVENT(trfs_fsync,
+  TP_PROTO(struct inode* inode, loff_t start, loff_t end, int datasync, int error, u64 started),
+  TP_ARGS(inode, start, end, datasync, error, started),
+
+  TP_STRUCT__entry(
+    __field(dev_t, dev)
+    __field(unsigned long, ino)
+    __field(loff_t, start)
+    __field(loff_t, end)
+    __field(int, datasync)
+    __field(int, error)
+    __field(u64, duration)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = inode->i_sb->s_dev;
+    __entry->ino = inode->i_ino;
+    __entry->start = start;
+    __entry->end = end;
+    __entry->datasync = datasync;
+    __entry->error = error;
+    __entry->duration = trfs_trace_duration(started);
+  ),
+
+  TP_printk("dev %d,%d ino %lu range %lld-%lld datasync %d error %d duration %llu",
+    MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->start, __entry->end,
+    __entry->datasync, __entry->error, __entry->duration
+  )
+);
+
+TRACE_EVENT(trfs_sync_fs,
+  TP_PROTO(struct super_block* super_block, int wait, int error, u64 started),
+  TP_ARGS(super_block, wait, error, started),
+
+  TP_STRUCT__entry(
+    __field(dev_t, dev)
+    __field(int, wait)
+    __field(int, error)
+    __field(u64, duration)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = super_block->s_dev;
+    __entry->wait = wait;
+    __entry->error = error;
+    __entry->duration = trfs_trace_duration(started);
+  ),
+
+  TP_printk("dev %d,%d wait %d error %d duration %llu",
+    MAJOR(__entry->dev), MINOR(__entry->dev), __entry->wait, __entry->error, __entry->duration
+  )
+);
+
+#endif // TRFS_TRACE_EVENTS_H
+
+// <trace/define_trace.h> includes this header again with angle brackets (see
+// ccflags-y in Kbuild).
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH trace/events
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trfs
+
+// Must stay outside of the include guard.
+#include <trace/define_trace.h>
@@ -0,0 +1,807 @@
+#include <linux/bitops.h>
+#include <linux/buffer_head.h>
+#include <linux/cpumask.h>
+#include <linux/fs.h>
+#include <linux/minmax.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+
+#include "trfs/alloc.h"
+#include "trfs/printk.h"
+#include "trfs/stats.h"
+#include "trfs/super.h"
+#include "trace/events/trfs.h"
+
+// The Block Allocator:
+// The on-disk free-block bitmap is loaded once at mount time into two red-black
+// trees of free extents. Finding room for N contiguous blocks is then a tree
+// descent (O(log n)) rather than a linear scan of the bitmap, which matters on
+// volumes where the bitmap spans thousands of blocks.
+//
+// Each allocation group has its own trees and lock (see struct trfs_group),
+// an allocation starts in the group of its goal and moves to the next groups
+// when it is full.
+//
+// With TRFS_FEATURE_INCOMPAT_BIGALLOC, space is handed out by whole clusters:
+// free extents start on a cluster boundary and hold whole clusters, requests
+// are rounded up. The caller only maps the blocks it asked for, the rest of
+// the last cluster stays with it (see trfs_allocate_run()).
+// https://www.kernel.org/doc/Documentation/core-api/rbtree.rst
+
+#define by_start_entry(node) rb_entry((node), struct trfs_free_extent, by_start)
+#define by_length_entry(node) rb_entry((node), struct trfs_free_extent, by_length)
+
+static bool trfs_free_extent_start_less(
+  struct rb_node* const a,
+  struct rb_node const* const b
+) {
+  return by_start_entry(a)->start < by_start_entry(b)->start;
+}
+
+static bool trfs_free_extent_length_less(
+  struct rb_node* const a,
+  struct rb_node const* const b
+) {
+  struct trfs_free_extent const* const left = by_length_entry(a);
+  struct trfs_free_extent const* const right = by_length_entry(b);
+
+  if (left->length != right->length) {
+    return left->length < right->length;
+  }
+
+  return left->start < right->start;
+}
+
+///
+/// Links the given extent in both trees.
+///
+/// @pre Lock is held.
+///
+static void trfs_link_free_extent(
+  struct trfs_free_space* const free_space,
+  struct trfs_free_extent* const extent
+) {
+  rb_add(&extent->by_start, &free_space->by_start, trfs_free_extent_start_less);
+  rb_add(&extent->by_length, &free_space->by_length, trfs_free_extent_length_less);
+}
+
+///
+/// Unlinks the given extent from both trees and releases it.
+///
+/// @pre Lock is held.
+///
+static void trfs_drop_free_extent(
+  struct trfs_free_space* const free_space,
+  struct trfs_free_extent* const extent
+) {
+  rb_erase(&extent->by_start, &free_space->by_start);
+  rb_erase(&extent->by_length, &free_space->by_length);
+  kfree(extent);
+}
+
+///
+/// Returns the free extent containing the given block, NULL if none.
+///
+/// @pre Lock is held.
+///
+static struct trfs_free_extent* trfs_find_free_extent(
+  struct trfs_free_space const* const free_space,
+  uint64_t const block
+) {
+  struct rb_node* node = free_space->by_start.rb_node;
+
+  while (node != NULL) {
+    struct trfs_free_extent* const extent = by_start_entry(node);
+
+    if (block < extent->start) {
+      node = node->rb_left;
+    }
+    else if (block - extent->start >= extent->length) {
+      node = node->rb_right;
+    }
+    else {
+      return extent;
+    }
+  }
+
+  return NULL;
+}
+
+///
+/// Returns the smallest free extent holding at least `count` blocks (the
+/// lowest one when several have the same length), NULL if none.
+///
+/// @pre Lock is held.
+///
+static struct trfs_free_extent* trfs_find_best_fit(
+  struct trfs_free_space const* const free_space,
+  uint32_t const count
+) {
+  struct trfs_free_extent* best = NULL;
+  struct rb_node* node = free_space->by_length.rb_node;
+
+  while (node != NULL) {
+    struct trfs_free_extent* const extent = by_length_entry(node);
+
+    if (extent->length >= count) {
+      best = extent;
+      node = node->rb_left;
+    }
+    else {
+      node = node->rb_right;
+    }
+  }
+
+  return best;
+}
+
+///
+/// Removes [start, start + count) from the given free extent.
+///
+/// Carving the middle of an extent splits it in two, in which case `*spare`
+/// is consumed for the right part and reset to NULL.
+///
+/// @pre Lock is held.
+/// @pre [start, start + count) lies within the extent.
+///
+static void trfs_carve_free_extent(
+  struct trfs_free_space* const free_space,
+  struct trfs_free_extent* const extent,
+  uint64_t const start,
+  uint32_t const count,
+  struct trfs_free_extent** const spare
+) {
+  uint64_t const end = start + count;
+  uint64_t const extent_end = extent->start + extent->length;
+
+  free_space->free_blocks -= count;
+
+  if (start == extent->start && end == extent_end) {
+    trfs_drop_free_extent(free_space, extent);
+    return;
+  }
+
+  // Carving never moves an extent past one of its neighbours, so only its
+  // position in the length tree has to be updated.
+  rb_erase(&extent->by_length, &free_space->by_length);
+
+  if (start == extent->start) {
+    extent->start = end;
+    extent->length = (uint32_t) (extent_end - end);
+  }
+  else if (end == extent_end) {
+    extent->length = (uint32_t) (start - extent->start);
+  }
+  else {
+    extent->length = (uint32_t) (start - extent->start);
+    (*spare)->start = end;
+    (*spare)->length = (uint32_t) (extent_end - end);
+    trfs_link_free_extent(free_space, *spare);
+    *spare = NULL;
+  }
+
+  rb_add(&extent->by_length, &free_space->by_length, trfs_free_extent_length_less);
+}
+
+///
+/// Gives [start, start + count) back to the index, merging it with its
+/// neighbours when they are adjacent. `*spare` is consumed (and reset to NULL)
+/// when no merge is possible.
+///
+/// @return -EINVAL if the range is (partially) free already.
+///
+/// @pre Lock is held.
+///
+static int trfs_insert_free_range(
+  struct trfs_free_space* const free_space,
+  uint64_t const start,
+  uint32_t const count,
+  struct trfs_free_extent** const spare
+) {
+  struct trfs_free_extent* previous = NULL;
+  struct trfs_free_extent* next = NULL;
+  struct rb_node* node = free_space->by_start.rb_node;
+
+  while (node != NULL) {
+    struct trfs_free_extent* const extent = by_start_entry(node);
+
+    if (start < extent->start) {
+      next = extent;
+      node = node->rb_left;
+    }
+    else {
+      previous = extent;
+      node = node->rb_right;
+    }
+  }
+
+  if (previous != NULL && previous->start + previous->length > start) {
+    return -EINVAL;
+  }
+
+  if (next != NULL && start + count > next->start) {
+    return -EINVAL;
+  }
+
+  bool const merge_previous = previous != NULL && previous->start + previous->length == start;
+  bool const merge_next = next != NULL && start + count == next->start;
+
+  if (merge_previous && merge_next) {
+    rb_erase(&previous->by_length, &free_space->by_length);
+    previous->length += count + next->length;
+    trfs_drop_free_extent(free_space, next);
+    rb_add(&previous->by_length, &free_space->by_length, trfs_free_extent_length_less);
+  }
+  else if (merge_previous) {
+    rb_erase(&previous->by_length, &free_space->by_length);
+    previous->length += count;
+    rb_add(&previous->by_length, &free_space->by_length, trfs_free_extent_length_less);
+  }
+  else if (merge_next) {
+    rb_erase(&next->by_length, &free_space->by_length);
+    next->start = start;
+    next->length += count;
+    rb_add(&next->by_length, &free_space->by_length, trfs_free_extent_length_less);
+  }
+  else {
+    (*spare)->start = start;
+    (*spare)->length = count;
+    trfs_link_free_extent(free_space, *spare);
+    *spare = NULL;
+  }
+
+  free_space->free_blocks += count;
+  return 0;
+}
+
+///
+/// Sets (used = true) or clears the bits of [start, start + count) in the
+/// on-disk bitmap of its group. Buffers are only marked dirty, the regular
+/// buffer writeback takes care of flushing them.
+///
+/// @return -EIO when a bitmap block cannot be read, the bits already changed
+///   are changed back (their blocks were just read, they are cached).
+///
+/// @pre The range is made of whole clusters of one group.
+///
+static int trfs_update_bitmap(
+  struct super_block* const super_block,
+  uint64_t const start,
+  uint32_t const count,
+  bool const used
+) {
+  struct trfs_mount_info const* const info = trfs_mount_info(super_block);
+  uint32_t const bits_per_block = 8u * super_block->s_blocksize;
+  uint32_t const cluster_bits = info->super.cluster_bits;
+  uint32_t const group = trfs_block_group(info, start);
+  uint64_t const bitmap_block = trfs_group_bitmap_block(&info->super, group);
+
+  // Bits are relative to the group, one per cluster.
+  uint32_t const first_bit = (uint32_t) ((start - trfs_group_first_block(&info->super, group)) >> cluster_bits);
+  uint32_t const end_bit = first_bit + (count >> cluster_bits);
+  uint32_t bit_start = first_bit;
+
+  while (bit_start < end_bit) {
+    uint64_t const block = bitmap_block + bit_start / bits_per_block;
+    uint32_t const offset = bit_start % bits_per_block;
+    uint32_t const length = min(end_bit - bit_start, bits_per_block - offset);
+
+    struct buffer_head* const buffer_head = sb_bread(super_block, block);
+    if (!buffer_head) {
+      TRFS_ERROR("Could not read bitmap block [%llu].\n", block);
+
+      if (bit_start > first_bit) {
+        trfs_update_bitmap(super_block, start, (bit_start - first_bit) << cluster_bits, !used);
+      }
+
+      return -EIO;
+    }
+
+    // Allocators working on the same bitmap block are serialized here.
+    lock_buffer(buffer_head);
+    for (uint32_t bit = offset; bit < offset + length; ++bit) {
+      if (used) {
+        __set_bit_le(bit, buffer_head->b_data);
+      }
+      else {
+        __clear_bit_le(bit, buffer_head->b_data);
+      }
+    }
+    unlock_buffer(buffer_head);
+
+    mark_buffer_dirty(buffer_head);
+    brelse(buffer_head);
+
+    bit_start += length;
+  }
+
+  return 0;
+}
+
+///
+/// Beyond this distance to the limit, the approximate per-CPU counters are
+/// precise enough (each CPU may hold up to percpu_counter_batch blocks).
+///
+#define TRFS_COUNTER_SLACK (4 * percpu_counter_batch * num_online_cpus())
+
+///
+/// Returns how many of the `wanted` blocks can be allocated, the blocks
+/// reserved by delayed allocations excepted (unless `reserved` is set).
+///
+static uint32_t trfs_available_blocks(
+  struct trfs_mount_info* const info,
+  uint32_t const wanted,
+  bool const reserved
+) {
+  s64 free = percpu_counter_read_positive(&info->free_blocks);
+  s64 dirty = reserved ? 0 : percpu_counter_read_positive(&info->dirty_blocks);
+
+  // Close to the limit, fold the per-CPU deltas (slower, exact).
+  if (free - dirty < (s64) wanted + TRFS_COUNTER_SLACK) {
+    free = percpu_counter_sum_positive(&info->free_blocks);
+    dirty = reserved ? 0 : percpu_counter_sum_positive(&info->dirty_blocks);
+  }
+
+  return free <= dirty ? 0 : (uint32_t) min_t(s64, free - dirty, wanted);
+}
+
+///
+/// Allocates up to `*count` contiguous blocks from one group: at `goal` when
+/// the free extent containing it is large enough, otherwise from the smallest
+/// free extent that fits. When `partial` is set and no free extent is large
+/// enough, the largest one is used and `*count` is lowered.
+///
+/// @return False when the group has no suitable free extent.
+///
+static bool trfs_allocate_from_group(
+  struct trfs_free_space* const free_space,
+  uint64_t const goal,
+  uint32_t* const count,
+  bool const partial,
+  uint64_t* const start,
+  struct trfs_free_extent** const spare
+) {
+  // Unlocked hint, checked again under the lock.
+  if (!partial && READ_ONCE(free_space->free_blocks) < *count) {
+    return false;
+  }
+
+  spin_lock(&free_space->lock);
+
+  uint64_t first = goal;
+  struct trfs_free_extent* extent = trfs_find_free_extent(free_space, goal);
+
+  if (extent == NULL || extent->start + extent->length - goal < *count) {
+    extent = trfs_find_best_fit(free_space, *count);
+
+    if (extent == NULL && partial) {
+      struct rb_node* const largest = rb_last(&free_space->by_length);
+
+      if (largest != NULL) {
+        extent = by_length_entry(largest);
+        *count = extent->length;
+      }
+    }
+
+    if (extent == NULL) {
+      spin_unlock(&free_space->lock);
+      return false;
+    }
+
+    first = extent->start;
+  }
+
+  trfs_carve_free_extent(free_space, extent, first, *count, spare);
+  spin_unlock(&free_space->lock);
+
+  *start = first;
+  return true;
+}
+
+///
+/// Allocates up to `*count` contiguous blocks (see trfs_allocate_blocks()).
+///
+static int trfs_allocate_free_blocks(
+  struct super_block* const super_block,
+  uint64_t const goal,
+  uint32_t* const count,
+  uint64_t* const start,
+  unsigned int const flags
+) {
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
+  uint32_t const groups = info->super.groups;
+  uint32_t const cluster_blocks = trfs_super_cluster_blocks(&info->super);
+  uint64_t const cluster_goal = round_up(goal, cluster_blocks);
+  uint32_t const goal_group = cluster_goal < trfs_super_blocks(&info->super)
+    ? trfs_block_group(info, cluster_goal)
+    : 0;
+  bool const reserved = flags & TRFS_ALLOCATE_RESERVED;
+  uint64_t first = 0;
+  bool found = false;
+
+  if (unlikely(*count == 0)) {
+    return -EINVAL;
+  }
+
+  // The blocks taken from the free space (whole clusters).
+  uint32_t length = round_down(
+    trfs_available_blocks(info, round_up(*count, cluster_blocks), reserved), cluster_blocks
+  );
+
+  if (length == 0) {
+    return -ENOSPC;
+  }
+
+  // Allocating under the spinlock is not allowed, hence the spare extent.
+  struct trfs_free_extent* spare = kmalloc(sizeof(struct trfs_free_extent), GFP_NOFS);
+  if (spare == NULL) {
+    return -ENOMEM;
+  }
+
+  // First pass: a run of *count blocks, second pass: the largest one.
+  for (uint32_t pass = 0; !found && pass < 2; ++pass) {
+    for (uint32_t index = 0; !found && index < groups; ++index) {
+      uint32_t const group = (goal_group + index) % groups;
+      uint64_t const group_goal = index == 0
+        ? cluster_goal
+        : round_up(trfs_group_data_block(&info->super, group), cluster_blocks);
+
+      found = trfs_allocate_from_group(
+        &info->groups[group].free_space, group_goal, &length, pass > 0, &first, &spare
+      );
+    }
+  }
+
+  kfree(spare);
+
+  if (!found) {
+    return -ENOSPC;
+  }
+
+  // The end of the last cluster is not part of the reservation.
+  uint32_t const used = min(*count, length);
+
+  percpu_counter_sub(&info->free_blocks, length);
+  if (reserved) {
+    percpu_counter_sub(&info->dirty_blocks, used);
+  }
+
+  int const error = trfs_update_bitmap(super_block, first, length, true);
+  if (error) {
+    // Blocks have not been handed out yet and their bits are clear again,
+    // give them back to the index.
+    struct trfs_free_space* const free_space = &info->groups[trfs_block_group(info, first)].free_space;
+
+    spare = kmalloc(sizeof(struct trfs_free_extent), GFP_NOFS | __GFP_NOFAIL);
+    spin_lock(&free_space->lock);
+    trfs_insert_free_range(free_space, first, length, &spare);
+    spin_unlock(&free_space->lock);
+    kfree(spare);
+
+    percpu_counter_add(&info->free_blocks, length);
+    if (reserved) {
+      percpu_counter_add(&info->dirty_blocks, used);
+    }
+
+    return error;
+  }
+
+  *start = first;
+  *count = used;
+  trfs_dirty_super_block(super_block);
+  return 0;
+}
+
+///
+/// Allocates up to `*count` contiguous blocks.
+///
+/// The allocation starts at `goal` when the free extent containing it is large
+/// enough, otherwise the smallest free extent that fits is used, in the group
+/// of the goal first and then in the next groups. When no free extent is large
+/// enough, the largest one of the first group having free blocks is used and
+/// `*count` is lowered.
+///
+/// With clusters, the goal and the allocation are rounded up to whole
+/// clusters, `*start` is the start of a cluster.
+///
+/// Reserved blocks (see trfs_reserve_blocks()) are only handed out with
+/// TRFS_ALLOCATE_RESERVED, the allocation then consumes the reservation.
+///
+/// @return 0 on success with `*start` and `*count` set, -ENOSPC when the
+///   device is full.
+///
+/// @pre *count > 0
+///
+int trfs_allocate_blocks(
+  struct super_block* const super_block,
+  uint64_t const goal,
+  uint32_t* const count,
+  uint64_t* const start,
+  unsigned int const flags
+) {
+  u64 const started = trfs_start_timing();
+  uint32_t const wanted = *count;
+
+  int const error = trfs_allocate_free_blocks(super_block, goal, count, start, flags);
+
+  trace_trfs_allocate_blocks(
+    super_block, goal, wanted, error ? 0 : *start, error ? 0 : *count, flags, error, started
+  );
+
+  trfs_account(super_block, TRFS_OPERATION_ALLOCATE, started);
+  if (!error) {
+    trfs_count(super_block, TRFS_COUNTER_BLOCKS_ALLOCATED, *count);
+  }
+
+  return error;
+}
+
+///
+/// Reserves blocks for a later allocation (delayed allocation), so that the
+/// allocation cannot fail with -ENOSPC at writeback.
+///
+/// No lock is taken: concurrent reservations may overcommit by a few blocks
+/// when the device is almost full, as with ext4.
+///
+/// @return -ENOSPC when there are not enough unreserved free blocks.
+///
+int trfs_reserve_blocks(
+  struct super_block* const super_block,
+  uint32_t const count
+) {
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
+
+  if (trfs_available_blocks(info, count, false) < count) {
+    return -ENOSPC;
+  }
+
+  percpu_counter_add(&info->dirty_blocks, count);
+  return 0;
+}
+
+///
+/// Gives back reserved blocks that will not be allocated.
+///
+void trfs_unreserve_blocks(
+  struct super_block* const super_block,
+  uint32_t const count
+) {
+  percpu_counter_sub(&trfs_mount_info(super_block)->dirty_blocks, count);
+}
+
+///
+/// Releases [start, start + count).
+///
+/// With clusters, the cluster holding `start` is kept when the range does not
+/// begin it (its first blocks are still in use, the caller rounds `start` down
+/// otherwise), and the last cluster is released whole.
+///
+void trfs_free_blocks(
+  struct super_block* const super_block,
+  uint64_t const start,
+  uint32_t const count
+) {
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
+  uint32_t const cluster_blocks = trfs_super_cluster_blocks(&info->super);
+
+  if (count == 0 || start + count < start || start + count > trfs_super_blocks(&info->super)) {
+    TRFS_ERROR("Invalid block range [%llu, +%u) released.\n", start, count);
+    return;
+  }
+
+  uint64_t const first = round_up(start, cluster_blocks);
+  uint64_t const end = round_up(start + count, cluster_blocks);
+  if (first >= end) {
+    return;
+  }
+
+  uint32_t const length = (uint32_t) (end - first);
+  uint32_t const group = trfs_block_group(info, first);
+  if (trfs_block_group(info, end - 1) != group) {
+    TRFS_ERROR("Block range [%llu, +%u) crosses a group boundary.\n", start, count);
+    return;
+  }
+
+  struct trfs_free_space* const free_space = &info->groups[group].free_space;
+
+  // The bits are cleared before the range is back in the index: once there,
+  // an allocation may take it and set them again.
+  if (trfs_update_bitmap(super_block, first, length, false)) {
+    TRFS_ERROR("Block range [%llu, +%u) is leaked.\n", start, count);
+    return;
+  }
+
+  // Releasing blocks must not fail.
+  struct trfs_free_extent* spare = kmalloc(
+    sizeof(struct trfs_free_extent), GFP_NOFS | __GFP_NOFAIL
+  );
+
+  spin_lock(&free_space->lock);
+  int const error = trfs_insert_free_range(free_space, first, length, &spare);
+  spin_unlock(&free_space->lock);
+  kfree(spare);
+
+  if (error) {
+    TRFS_ERROR("Block range [%llu, +%u) is already free.\n", start, count);
+    return;
+  }
+
+  percpu_counter_add(&info->free_blocks, length);
+  trfs_dirty_super_block(super_block);
+
+  trace_trfs_free_blocks(super_block, first, length);
+  trfs_count(super_block, TRFS_COUNTER_BLOCKS_FREED, length);
+}
+
+///
+/// Appends an extent read from the bitmap to the index.
+///
+static int trfs_add_loaded_extent(
+  struct trfs_free_space* const free_space,
+  uint64_t const start,
+  uint32_t const length
+) {
+  struct trfs_free_extent* const extent = kmalloc(sizeof(struct trfs_free_extent), GFP_KERNEL);
+  if (extent == NULL) {
+    return -ENOMEM;
+  }
+
+  extent->start = start;
+  extent->length = length;
+  trfs_link_free_extent(free_space, extent);
+  free_space->free_blocks += length;
+  return 0;
+}
+
+///
+/// Builds the free-extent index of a group from its on-disk bitmap.
+///
+static int trfs_load_group_free_space(
+  struct super_block* const super_block,
+  uint32_t const group
+) {
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
+  struct trfs_free_space* const free_space = &info->groups[group].free_space;
+  uint32_t const bits_per_block = 8u * super_block->s_blocksize;
+  uint32_t const cluster_bits = info->super.cluster_bits;
+  uint64_t const group_first = trfs_group_first_block(&info->super, group);
+  uint64_t const bitmap_block = trfs_group_bitmap_block(&info->super, group);
+  int error = 0;
+
+  // A trailing partial cluster is never allocated (mkfs marks it in use).
+  uint32_t const group_size = trfs_group_size(&info->super, group) >> cluster_bits;
+
+  // Free runs may cross bitmap blocks, the current one is kept aside until its
+  // end is known. Runs are group relative, in clusters.
+  uint32_t run_start = 0;
+  uint32_t run_length = 0;
+
+  for (uint32_t index = 0; index < info->super.bitmap_blocks; ++index) {
+    uint32_t const first = index * bits_per_block;
+    if (first >= group_size) {
+      break;
+    }
+
+    struct buffer_head* const buffer_head = sb_bread(super_block, bitmap_block + index);
+    if (!buffer_head) {
+      TRFS_ERROR("Could not read bitmap block [%llu].\n", bitmap_block + index);
+      return -EIO;
+    }
+
+    uint32_t const bits = min(bits_per_block, group_size - first);
+    unsigned long bit = find_next_zero_bit_le(buffer_head->b_data, bits, 0);
+
+    while (bit < bits) {
+      unsigned long const end = find_next_bit_le(buffer_head->b_data, bits, bit);
+
+      if (run_length > 0 && run_start + run_length == first + bit) {
+        run_length += end - bit;
+      }
+      else {
+        if (run_length > 0) {
+          error = trfs_add_loaded_extent(
+            free_space, group_first + ((uint64_t) run_start << cluster_bits), run_length << cluster_bits
+          );
+          if (error) {
+            brelse(buffer_head);
+            return error;
+          }
+        }
+
+        run_start = first + bit;
+        run_length = end - bit;
+      }
+
+      bit = find_next_zero_bit_le(buffer_head->b_data, bits, end);
+    }
+
+    brelse(buffer_head);
+  }
+
+  if (run_length > 0) {
+    error = trfs_add_loaded_extent(
+      free_space, group_first + ((uint64_t) run_start << cluster_bits), run_length << cluster_bits
+    );
+  }
+
+  return error;
+}
+
+///
+/// Builds the free-extent indexes from the on-disk bitmaps, and initializes
+/// the block counters.
+///
+/// @pre trfs_mount_info(super_block)->super has been read.
+/// @pre trfs_mount_info(super_block)->groups has been allocated.
+///
+int trfs_load_free_space(
+  struct super_block* const super_block
+) {
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
+  uint32_t const bits_per_block = 8u * super_block->s_blocksize;
+  s64 free_blocks = 0;
+  int error = 0;
+
+  for (uint32_t group = 0; group < info->super.groups; ++group) {
+    struct trfs_free_space* const free_space = &info->groups[group].free_space;
+
+    spin_lock_init(&free_space->lock);
+    free_space->by_start = RB_ROOT;
+    free_space->by_length = RB_ROOT;
+    free_space->free_blocks = 0;
+  }
+
+  if ((uint64_t) info->super.bitmap_blocks * bits_per_block < info->super.group_blocks >> info->super.cluster_bits) {
+    TRFS_ERROR("Bitmap is too small (%u blocks).\n", info->super.bitmap_blocks);
+    return -EINVAL;
+  }
+
+  for (uint32_t group = 0; group < info->super.groups; ++group) {
+    if ((error = trfs_load_group_free_space(super_block, group))) {
+      goto cleanup;
+    }
+
+    free_blocks += info->groups[group].free_space.free_blocks;
+  }
+
+  if ((error = percpu_counter_init(&info->free_blocks, free_blocks, GFP_KERNEL))
+    || (error = percpu_counter_init(&info->dirty_blocks, 0, GFP_KERNEL))
+  ) {
+    goto cleanup;
+  }
+
+  TRFS_INFO("Free blocks: %lld\n", free_blocks);
+  return 0;
+
+cleanup:
+  trfs_release_free_space(super_block);
+  return error;
+}
+
+///
+/// Releases the in-memory indexes (the on-disk bitmaps are left untouched) and
+/// the counters.
+///
+void trfs_release_free_space(
+  struct super_block* const super_block
+) {
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
+
+  for (uint32_t group = 0; info->groups != NULL && group < info->super.groups; ++group) {
+    struct trfs_free_space* const free_space = &info->groups[group].free_space;
+    struct trfs_free_extent* extent;
+    struct trfs_free_extent* next;
+
+    rbtree_postorder_for_each_entry_safe(extent, next, &free_space->by_start, by_start) {
+      kfree(extent);
+    }
+
+    free_space->by_start = RB_ROOT;
+    free_space->by_length = RB_ROOT;
+    free_space->free_blocks = 0;
+  }
+
+  // No-op when not initialized (the mount info is zeroed).
+  percpu_counter_destroy(&info->free_blocks);
+  percpu_counter_destroy(&info->dirty_blocks);
+}
@@ -0,0 +1,76 @@
+#ifndef TRFS_ALLOC_H
+#define TRFS_ALLOC_H
+
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+struct super_block;
+
+///
+/// A run of contiguous free blocks.
+///
+/// Each extent is linked in two trees at once: one sorted by start block (to
+/// honour allocation goals and to merge neighbours on release) and one sorted
+/// by length (to find the best fit in O(log n)).
+///
+struct trfs_free_extent {
+  struct rb_node by_start;
+  struct rb_node by_length;
+  uint64_t start;
+  uint32_t length;
+};
+
+///
+/// In-memory free-space index of an allocation group, built from the on-disk
+/// free-block bitmap of the group at mount time. The bitmap stays the
+/// persistent copy and is updated lazily (buffers are only marked dirty).
+///
+/// The totals of the file system are per-CPU counters of the mount info, so
+/// that reservations from concurrent writers and statfs() do not share a cache
+/// line (nor a lock).
+///
+struct trfs_free_space {
+  spinlock_t lock;
+
+  /// Free extents sorted by start block.
+  struct rb_root by_start;
+
+  /// Free extents sorted by (length, start block).
+  struct rb_root by_length;
+
+  /// The number of free blocks of the group.
+  uint32_t free_blocks;
+};
+
+/// Allocate from the blocks reserved by the caller.
+#define TRFS_ALLOCATE_RESERVED 0x1u
+
+int trfs_load_free_space(struct super_block* const super_block);
+void trfs_release_free_space(struct super_block* const super_block);
+
+int trfs_allocate_blocks(
+  struct super_block* const super_block,
+  uint64_t const goal,
+  uint32_t* const count,
+  uint64_t* const start,
+  unsigned int const flags
+);
+
+int trfs_reserve_blocks(
+  struct super_block* const super_block,
+  uint32_t const count
+);
+
+void trfs_unreserve_blocks(
+  struct super_block* const super_block,
+  uint32_t const count
+);
+
+void trfs_free_blocks(
+  struct super_block* const super_block,
+  uint64_t const start,
+  uint32_t const count
+);
+
+#endif // TRFS_ALLOC_H
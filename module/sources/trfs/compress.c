@@ -0,0 +1,719 @@
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/lz4.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/sched/mm.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/writeback.h>
+#include <linux/zstd.h>
+
+#include "trfs/compress.h"
+#include "trfs/data.h"
+#include "trfs/inode.h"
+#include "trfs/printk.h"
+#include "trfs/super.h"
+
+// Compression:
+// With the compress= mount option, writeback compresses file data by clusters
+// of TRFS_COMPRESS_CLUSTER_SIZE bytes. A cluster whose compressed form saves at
+// least one block is written to just enough blocks and mapped by a single
+// compressed extent (see trfs/super.h), the other clusters are written as is by
+// iomap. Reading any page of a compressed cluster decompresses the whole
+// cluster, readahead fills all the pages of a cluster from one decompression.
+// Only clusters written from scratch are compressed (all their blocks are
+// delayed, see trfs_delay_blocks()). Writing to a compressed cluster first
+// expands it back to delayed blocks (see trfs_expand_compressed_clusters()),
+// it is compressed again at writeback.
+// Folios are single pages (large folios are not enabled on the mapping).
+
+/// The zstd level, the default of the zstd tool.
+#define TRFS_ZSTD_LEVEL 3
+
+/// The number of pages of a cluster, the mount fails when a page is larger than
+/// a cluster (see trfs_parse_parameter()).
+#define TRFS_CLUSTER_PAGES (TRFS_COMPRESS_CLUSTER_SIZE >> PAGE_SHIFT)
+
+static char const* const trfs_compression_names[] = {
+  [TRFS_COMPRESS_NONE] = "none",
+  [TRFS_COMPRESS_LZ4] = "lz4",
+  [TRFS_COMPRESS_ZSTD] = "zstd",
+};
+
+///
+/// Returns the name of a TRFS_COMPRESS_* algorithm (compress= mount option).
+///
+char const* trfs_compression_name(
+  unsigned int const compression
+) {
+  return compression < ARRAY_SIZE(trfs_compression_names)
+    ? trfs_compression_names[compression]
+    : "unknown";
+}
+
+// ╔═╗┌─┐┌┬┐┌─┐┌─┐┌─┐
+// ║  │ │ ││├┤ │  └─┐
+// ╚═╝└─┘─┴┘└─┘└─┘└─┘
+
+///
+/// Compression state of a writeback pass, shared by all its clusters.
+///
+struct trfs_compressor {
+  /// TRFS_COMPRESS_LZ4 or TRFS_COMPRESS_ZSTD.
+  unsigned int compression;
+
+  /// LZ4 working memory, or the zstd context.
+  void* workspace;
+  zstd_cctx* zstd;
+  zstd_parameters zstd_parameters;
+
+  /// The cluster being compressed, and its compressed form (header first).
+  void* input;
+  void* output;
+};
+
+static void trfs_compressor_release(
+  struct trfs_compressor* const compressor
+) {
+  kvfree(compressor->workspace);
+  kvfree(compressor->input);
+  kvfree(compressor->output);
+}
+
+static int trfs_compressor_init(
+  struct trfs_compressor* const compressor,
+  unsigned int const compression
+) {
+  size_t workspace_size = LZ4_MEM_COMPRESS;
+
+  *compressor = (struct trfs_compressor) { .compression = compression };
+
+  if (compression == TRFS_COMPRESS_ZSTD) {
+    compressor->zstd_parameters = zstd_get_params(TRFS_ZSTD_LEVEL, TRFS_COMPRESS_CLUSTER_SIZE);
+    workspace_size = zstd_cctx_workspace_bound(&compressor->zstd_parameters.cParams);
+  }
+
+  // Called from writeback, reclaim must not recurse into the file system
+  // (kvmalloc() only falls back to vmalloc() with GFP_KERNEL).
+  unsigned int const flags = memalloc_nofs_save();
+  compressor->workspace = kvmalloc(workspace_size, GFP_KERNEL);
+  compressor->input = kvmalloc(TRFS_COMPRESS_CLUSTER_SIZE, GFP_KERNEL);
+  compressor->output = kvmalloc(TRFS_COMPRESS_CLUSTER_SIZE, GFP_KERNEL);
+  memalloc_nofs_restore(flags);
+
+  if (!compressor->workspace || !compressor->input || !compressor->output) {
+    trfs_compressor_release(compressor);
+    return -ENOMEM;
+  }
+
+  if (compression == TRFS_COMPRESS_ZSTD) {
+    compressor->zstd = zstd_init_cctx(compressor->workspace, workspace_size);
+    if (compressor->zstd == NULL) {
+      trfs_compressor_release(compressor);
+      return -EINVAL;
+    }
+  }
+
+  return 0;
+}
+
+///
+/// Compresses the cluster in compressor->input to compressor->output, after
+/// the header.
+///
+/// @return The size of the compressed data, 0 when it does not fit in the given
+///   capacity.
+///
+static size_t trfs_compress(
+  struct trfs_compressor* const compressor,
+  size_t const capacity
+) {
+  char* const output = (char*) compressor->output + sizeof(struct trfs_compressed_header);
+
+  switch (compressor->compression) {
+    case TRFS_COMPRESS_LZ4: {
+      int const size = LZ4_compress_default(
+        compressor->input, output,
+        TRFS_COMPRESS_CLUSTER_SIZE, (int) capacity, compressor->workspace
+      );
+
+      return size > 0 ? (size_t) size : 0;
+    }
+
+    case TRFS_COMPRESS_ZSTD: {
+      size_t const size = zstd_compress_cctx(
+        compressor->zstd, output, capacity,
+        compressor->input, TRFS_COMPRESS_CLUSTER_SIZE, &compressor->zstd_parameters
+      );
+
+      return zstd_is_error(size) ? 0 : size;
+    }
+
+    default:
+      return 0;
+  }
+}
+
+///
+/// Decompresses a whole cluster from the given compressed data.
+///
+/// @return -EIO when the data is corrupted.
+///
+static int trfs_decompress(
+  unsigned int const compression,
+  void const* const input,
+  size_t const size,
+  void* const cluster
+) {
+  switch (compression) {
+    case TRFS_COMPRESS_LZ4: {
+      int const result = LZ4_decompress_safe(input, cluster, (int) size, TRFS_COMPRESS_CLUSTER_SIZE);
+      return result == TRFS_COMPRESS_CLUSTER_SIZE ? 0 : -EIO;
+    }
+
+    case TRFS_COMPRESS_ZSTD: {
+      size_t const workspace_size = zstd_dctx_workspace_bound();
+
+      unsigned int const flags = memalloc_nofs_save();
+      void* const workspace = kvmalloc(workspace_size, GFP_KERNEL);
+      memalloc_nofs_restore(flags);
+
+      if (workspace == NULL) {
+        return -ENOMEM;
+      }
+
+      zstd_dctx* const context = zstd_init_dctx(workspace, workspace_size);
+      size_t const result = context != NULL
+        ? zstd_decompress_dctx(context, cluster, TRFS_COMPRESS_CLUSTER_SIZE, input, size)
+        : 0;
+
+      kvfree(workspace);
+      return !zstd_is_error(result) && result == TRFS_COMPRESS_CLUSTER_SIZE ? 0 : -EIO;
+    }
+
+    default:
+      return -EIO;
+  }
+}
+
+// ╔╗ ┬  ┌─┐┌─┐┬┌─┌─┐
+// ╠╩╗│  │ ││  ├┴┐└─┐
+// ╚═╝┴─┘└─┘└─┘┴ ┴└─┘
+
+// The compressed blocks go through the buffer cache of the device, as the
+// directory blocks do. They are always written whole (and synchronously), so
+// that a block reused from a freed cluster never reads stale data.
+
+///
+/// Reads the compressed blocks of an extent to the given buffer.
+///
+static int trfs_read_compressed_blocks(
+  struct super_block* const super_block,
+  struct trfs_extent const* const extent,
+  void* const buffer
+) {
+  uint32_t const blocks = trfs_extent_blocks(extent);
+
+  // Submitted together, then waited for one by one.
+  for (uint32_t index = 0; index < blocks; ++index) {
+    sb_breadahead(super_block, extent->start + index);
+  }
+
+  for (uint32_t index = 0; index < blocks; ++index) {
+    struct buffer_head* const buffer_head = sb_bread(super_block, extent->start + index);
+    if (!buffer_head) {
+      return -EIO;
+    }
+
+    memcpy(
+      (char*) buffer + ((size_t) index << super_block->s_blocksize_bits),
+      buffer_head->b_data, super_block->s_blocksize
+    );
+
+    brelse(buffer_head);
+  }
+
+  return 0;
+}
+
+///
+/// Writes the given buffer to the blocks [start, start + blocks), and waits for
+/// the writes to complete.
+///
+static int trfs_write_compressed_blocks(
+  struct super_block* const super_block,
+  uint64_t const start,
+  uint32_t const blocks,
+  void const* const buffer
+) {
+  int error = 0;
+
+  for (uint32_t index = 0; index < blocks; ++index) {
+    struct buffer_head* const buffer_head = sb_getblk(super_block, start + index);
+    if (!buffer_head) {
+      return -ENOMEM;
+    }
+
+    lock_buffer(buffer_head);
+    memcpy(
+      buffer_head->b_data,
+      (char const*) buffer + ((size_t) index << super_block->s_blocksize_bits),
+      super_block->s_blocksize
+    );
+    set_buffer_uptodate(buffer_head);
+    mark_buffer_dirty(buffer_head);
+    unlock_buffer(buffer_head);
+
+    write_dirty_buffer(buffer_head, 0);
+    brelse(buffer_head);
+  }
+
+  for (uint32_t index = 0; index < blocks; ++index) {
+    struct buffer_head* const buffer_head = sb_getblk(super_block, start + index);
+    if (!buffer_head) {
+      return -ENOMEM;
+    }
+
+    wait_on_buffer(buffer_head);
+    if (!buffer_uptodate(buffer_head)) {
+      error = -EIO;
+    }
+
+    brelse(buffer_head);
+  }
+
+  return error;
+}
+
+// ╦═╗┌─┐┌─┐┌┬┐
+// ╠╦╝├┤ ├─┤ ││
+// ╩╚═└─┘┴ ┴─┴┘
+
+///
+/// Reads and decompresses the cluster of the given compressed extent.
+///
+/// @return -EIO when the cluster is corrupted.
+///
+static int trfs_read_cluster(
+  struct inode* const inode,
+  struct trfs_extent const* const extent,
+  void* const cluster
+) {
+  struct super_block* const super_block = inode->i_sb;
+  uint32_t const blocks = trfs_extent_blocks(extent);
+  size_t const size = (size_t) blocks << super_block->s_blocksize_bits;
+  int error;
+
+  if (blocks == 0 || blocks >= trfs_cluster_blocks(inode)) {
+    TRFS_ERROR("Corrupted compressed extent at block [%llu].\n", extent->start);
+    return -EIO;
+  }
+
+  unsigned int const flags = memalloc_nofs_save();
+  void* const buffer = kvmalloc(size, GFP_KERNEL);
+  memalloc_nofs_restore(flags);
+
+  if (buffer == NULL) {
+    return -ENOMEM;
+  }
+
+  if ((error = trfs_read_compressed_blocks(super_block, extent, buffer))) {
+    goto cleanup;
+  }
+
+  struct trfs_compressed_header const* const header = buffer;
+  size_t const compressed = be32_to_cpu(header->size);
+
+  if (compressed > size - sizeof(struct trfs_compressed_header)
+    || (error = trfs_decompress(
+      trfs_extent_compression(extent),
+      header + 1, compressed, cluster
+    ))
+  ) {
+    TRFS_ERROR("Corrupted compressed cluster at block [%llu].\n", extent->start);
+    error = -EIO;
+  }
+
+cleanup:
+  kvfree(buffer);
+  return error;
+}
+
+///
+/// Copies the part of a decompressed cluster backing the given folio, and marks
+/// the folio uptodate.
+///
+static void trfs_fill_folio(
+  struct folio* const folio,
+  void const* const cluster
+) {
+  size_t const offset = (size_t) (folio_pos(folio) & (TRFS_COMPRESS_CLUSTER_SIZE - 1));
+  void* const address = kmap_local_folio(folio, 0);
+
+  memcpy(address, (char const*) cluster + offset, folio_size(folio));
+  kunmap_local(address);
+
+  flush_dcache_folio(folio);
+  folio_mark_uptodate(folio);
+}
+
+///
+/// Reads a locked folio of the compressed cluster of the given extent, and
+/// unlocks it.
+///
+int trfs_read_compressed_folio(
+  struct folio* const folio,
+  struct trfs_extent const* const extent
+) {
+  unsigned int const flags = memalloc_nofs_save();
+  void* const cluster = kvmalloc(TRFS_COMPRESS_CLUSTER_SIZE, GFP_KERNEL);
+  memalloc_nofs_restore(flags);
+
+  int const error = cluster != NULL
+    ? trfs_read_cluster(folio->mapping->host, extent, cluster)
+    : -ENOMEM;
+
+  if (!error) {
+    trfs_fill_folio(folio, cluster);
+  }
+
+  folio_unlock(folio);
+  kvfree(cluster);
+  return error;
+}
+
+///
+/// Readahead of a file with compressed clusters: each cluster is decompressed
+/// once for all its folios, the other folios are read by iomap (one at a time,
+/// the readahead window is not submitted as a whole).
+///
+void trfs_readahead_compressed(
+  struct readahead_control* const control
+) {
+  struct inode* const inode = control->mapping->host;
+  struct folio* folio;
+
+  // The last decompressed cluster (its first logical block).
+  void* cluster = NULL;
+  bool cached = false;
+  uint32_t cached_logical = 0;
+
+  while ((folio = readahead_folio(control)) != NULL) {
+    uint32_t const logical = (uint32_t) (folio_pos(folio) >> inode->i_blkbits);
+    struct trfs_extent extent;
+
+    if (!trfs_lookup_compressed(inode, logical, &extent)) {
+      iomap_read_folio(folio, &trfs_iomap_ops);
+      continue;
+    }
+
+    if (cluster == NULL) {
+      unsigned int const flags = memalloc_nofs_save();
+      cluster = kvmalloc(TRFS_COMPRESS_CLUSTER_SIZE, GFP_KERNEL);
+      memalloc_nofs_restore(flags);
+    }
+
+    if (cluster != NULL && (!cached || cached_logical != extent.logical)) {
+      cached = trfs_read_cluster(inode, &extent, cluster) == 0;
+      cached_logical = extent.logical;
+    }
+
+    // Left not uptodate on error, read_folio() reports it.
+    if (cluster != NULL && cached) {
+      trfs_fill_folio(folio, cluster);
+    }
+
+    folio_unlock(folio);
+  }
+
+  kvfree(cluster);
+}
+
+// ╦ ╦┬─┐┬┌┬┐┌─┐
+// ║║║├┬┘│ │ ├┤
+// ╚╩╝┴└─┴ ┴ └─┘
+
+///
+/// Locks the folios of the cluster starting at the given page index, when they
+/// are all cached, uptodate, dirty, and not under writeback.
+///
+/// @return false when the cluster cannot be compressed now, nothing is locked.
+///
+static bool trfs_lock_cluster(
+  struct address_space* const mapping,
+  pgoff_t const index,
+  struct folio** const folios,
+  struct writeback_control const* const wbc
+) {
+  // Background writeback does not wait for busy folios.
+  int const flags = FGP_LOCK | (wbc->sync_mode == WB_SYNC_NONE ? FGP_NOWAIT : 0);
+  unsigned int locked = 0;
+  bool usable = true;
+
+  while (usable && locked < TRFS_CLUSTER_PAGES) {
+    struct folio* const folio = __filemap_get_folio(mapping, index + locked, flags, 0);
+    if (folio == NULL) {
+      break;
+    }
+
+    folios[locked++] = folio;
+    usable = folio_test_uptodate(folio)
+      && folio_test_dirty(folio)
+      && !folio_test_writeback(folio)
+      && folio_nr_pages(folio) == 1;
+  }
+
+  if (usable && locked == TRFS_CLUSTER_PAGES) {
+    return true;
+  }
+
+  while (locked > 0) {
+    --locked;
+    folio_unlock(folios[locked]);
+    folio_put(folios[locked]);
+  }
+
+  return false;
+}
+
+///
+/// Compresses and writes the delayed cluster starting at the given logical
+/// block. The cluster is left to iomap when it does not compress well, or on
+/// any error.
+///
+static void trfs_compress_cluster(
+  struct trfs_compressor* const compressor,
+  struct inode* const inode,
+  uint32_t const logical,
+  struct folio** const folios,
+  struct writeback_control* const wbc
+) {
+  struct super_block* const super_block = inode->i_sb;
+  uint32_t const cluster_blocks = trfs_cluster_blocks(inode);
+  loff_t const position = (loff_t) logical << inode->i_blkbits;
+
+  if (!trfs_lock_cluster(inode->i_mapping, (pgoff_t) (position >> PAGE_SHIFT), folios, wbc)) {
+    return;
+  }
+
+  for (unsigned int index = 0; index < TRFS_CLUSTER_PAGES; ++index) {
+    void const* const address = kmap_local_folio(folios[index], 0);
+    memcpy((char*) compressor->input + index * PAGE_SIZE, address, PAGE_SIZE);
+    kunmap_local(address);
+  }
+
+  // The end of the last page may hold garbage past the end of file.
+  loff_t const valid = clamp_t(loff_t, i_size_read(inode) - position, 0, TRFS_COMPRESS_CLUSTER_SIZE);
+  memset((char*) compressor->input + valid, 0, TRFS_COMPRESS_CLUSTER_SIZE - (size_t) valid);
+
+  // Only worth it when at least one block is saved.
+  size_t const capacity = ((size_t) (cluster_blocks - 1) << inode->i_blkbits)
+    - sizeof(struct trfs_compressed_header);
+
+  size_t const size = cluster_blocks > 1 ? trfs_compress(compressor, capacity) : 0;
+  if (size == 0) {
+    goto unlock;
+  }
+
+  size_t const used = sizeof(struct trfs_compressed_header) + size;
+  uint32_t const blocks = (uint32_t) DIV_ROUND_UP(used, super_block->s_blocksize);
+
+  struct trfs_compressed_header* const header = compressor->output;
+  header->size = cpu_to_be32((uint32_t) size);
+  header->reserved = 0;
+  memset((char*) compressor->output + used, 0, ((size_t) blocks << inode->i_blkbits) - used);
+
+  // From the reservation of the cluster, as a single run.
+  uint64_t start;
+  uint32_t count = blocks;
+
+  if (trfs_allocate_blocks(
+    super_block, trfs_allocation_goal(inode, logical),
+    &count, &start, TRFS_ALLOCATE_RESERVED
+  )) {
+    goto unlock;
+  }
+
+  if (count < blocks) {
+    goto release;
+  }
+
+  int const error = trfs_write_compressed_blocks(super_block, start, blocks, compressor->output);
+  if (error) {
+    TRFS_WARN("Could not write the compressed cluster at block [%llu] (%d).\n", start, error);
+    goto release;
+  }
+
+  if (trfs_map_compressed_cluster(inode, logical, start, blocks, compressor->compression)) {
+    goto release;
+  }
+
+  // The data is on disk, the folios go through an (empty) writeback so that
+  // the dirty and writeback tags stay consistent.
+  for (unsigned int index = 0; index < TRFS_CLUSTER_PAGES; ++index) {
+    folio_clear_dirty_for_io(folios[index]);
+    folio_start_writeback(folios[index]);
+    folio_unlock(folios[index]);
+    folio_end_writeback(folios[index]);
+    folio_put(folios[index]);
+  }
+
+  wbc->nr_to_write -= TRFS_CLUSTER_PAGES;
+  return;
+
+release:
+  // The blocks are free again, so the reservation is not expected to fail.
+  trfs_free_blocks(super_block, start, count);
+  trfs_reserve_blocks(super_block, count);
+
+unlock:
+  for (unsigned int index = 0; index < TRFS_CLUSTER_PAGES; ++index) {
+    folio_unlock(folios[index]);
+    folio_put(folios[index]);
+  }
+}
+
+///
+/// Writeback pass run before iomap: compresses the dirty clusters of the file
+/// that are entirely delayed, iomap writes the rest.
+///
+/// Skipped while the file is written or truncated (i_rwsem is held), those
+/// change the delayed blocks and the page cache: the data is then written as
+/// is. Also skipped while the file is mapped writable, its pages would be
+/// dirtied again right away (and the cluster expanded, see
+/// trfs_page_mkwrite()).
+///
+void trfs_compress_clusters(
+  struct address_space* const mapping,
+  struct writeback_control* const wbc
+) {
+  struct inode* const inode = mapping->host;
+  unsigned int const compression = READ_ONCE(trfs_mount_info(inode->i_sb)->compression);
+  uint32_t const cluster_blocks = trfs_cluster_blocks(inode);
+  struct trfs_compressor compressor;
+
+  if (compression == TRFS_COMPRESS_NONE || trfs_inode_is_inline(inode) || mapping_writably_mapped(mapping)) {
+    return;
+  }
+
+  if (!inode_trylock(inode)) {
+    return;
+  }
+
+  struct folio** const folios = kmalloc_array(TRFS_CLUSTER_PAGES, sizeof(struct folio*), GFP_NOFS);
+  if (folios == NULL) {
+    goto unlock;
+  }
+
+  if (trfs_compressor_init(&compressor, compression)) {
+    goto cleanup;
+  }
+
+  uint32_t logical = 0;
+  while (wbc->nr_to_write > 0 && trfs_next_delayed_cluster(inode, &logical)) {
+    trfs_compress_cluster(&compressor, inode, logical, folios, wbc);
+
+    if (logical > U32_MAX - cluster_blocks) {
+      break;
+    }
+
+    logical += cluster_blocks;
+  }
+
+  trfs_compressor_release(&compressor);
+
+cleanup:
+  kfree(folios);
+
+unlock:
+  inode_unlock(inode);
+}
+
+// ╔═╗─┐ ┬┌─┐┌─┐┌┐┌┌┬┐
+// ║╣ ┌┴┬┘├─┘├─┤│││ ││
+// ╚═╝┴ └─┴  ┴ ┴┘└┘─┴┘
+
+///
+/// Expands a compressed cluster: its pages are read (decompressed) and
+/// dirtied, and its blocks go back to delayed blocks.
+///
+static int trfs_expand_cluster(
+  struct inode* const inode,
+  struct trfs_extent const* const extent
+) {
+  struct address_space* const mapping = inode->i_mapping;
+  pgoff_t const index = (pgoff_t) (((loff_t) extent->logical << inode->i_blkbits) >> PAGE_SHIFT);
+  pgoff_t const end = (pgoff_t) DIV_ROUND_UP(i_size_read(inode), PAGE_SIZE);
+  unsigned int const count = end > index ? (unsigned int) min_t(pgoff_t, end - index, TRFS_CLUSTER_PAGES) : 0;
+  struct folio* folios[TRFS_CLUSTER_PAGES];
+  unsigned int read = 0;
+  int error = 0;
+
+  for (; read < count; ++read) {
+    folios[read] = read_mapping_folio(mapping, index + read, NULL);
+
+    if (IS_ERR(folios[read])) {
+      error = PTR_ERR(folios[read]);
+      goto cleanup;
+    }
+  }
+
+  // Locked so that they are not read again while the cluster is unmapped.
+  for (unsigned int page = 0; page < count; ++page) {
+    folio_lock(folios[page]);
+  }
+
+  error = trfs_unmap_compressed_cluster(inode, extent->logical);
+
+  for (unsigned int page = 0; page < count; ++page) {
+    if (!error) {
+      folio_mark_dirty(folios[page]);
+    }
+
+    folio_unlock(folios[page]);
+  }
+
+cleanup:
+  while (read > 0) {
+    folio_put(folios[--read]);
+  }
+
+  return error;
+}
+
+///
+/// Expands the compressed clusters overlapping the byte range [start, end),
+/// before it is written or truncated.
+///
+/// @pre The inode i_rwsem is held exclusively, or the invalidate lock of its
+///   mapping for a page fault (see trfs_page_mkwrite()).
+///
+int trfs_expand_compressed_clusters(
+  struct inode* const inode,
+  loff_t const start,
+  loff_t const end
+) {
+  uint32_t const cluster_blocks = trfs_cluster_blocks(inode);
+
+  if (end <= start || !trfs_has_compressed_extents(inode)) {
+    return 0;
+  }
+
+  uint64_t const first = round_down((uint64_t) start >> inode->i_blkbits, cluster_blocks);
+  uint64_t const last = min((uint64_t) (end - 1) >> inode->i_blkbits, (uint64_t) U32_MAX);
+
+  for (uint64_t logical = first; logical <= last; logical += cluster_blocks) {
+    struct trfs_extent extent;
+
+    if (trfs_lookup_compressed(inode, (uint32_t) logical, &extent)) {
+      int const error = trfs_expand_cluster(inode, &extent);
+      if (error) {
+        return error;
+      }
+    }
+  }
+
+  return 0;
+}
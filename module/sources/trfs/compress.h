@@ -0,0 +1,30 @@
+#ifndef TRFS_COMPRESS_H
+#define TRFS_COMPRESS_H
+
+#include <linux/fs.h>
+#include <linux/pagemap.h>
+#include <linux/writeback.h>
+
+#include "trfs/super.h"
+
+char const* trfs_compression_name(unsigned int const compression);
+
+void trfs_compress_clusters(
+  struct address_space* const mapping,
+  struct writeback_control* const wbc
+);
+
+int trfs_read_compressed_folio(
+  struct folio* const folio,
+  struct trfs_extent const* const extent
+);
+
+void trfs_readahead_compressed(struct readahead_control* const control);
+
+int trfs_expand_compressed_clusters(
+  struct inode* const inode,
+  loff_t const start,
+  loff_t const end
+);
+
+#endif // TRFS_COMPRESS_H
@@ -0,0 +1,802 @@
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/iomap.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/writeback.h>
+
+#include "trfs/compress.h"
+#include "trfs/data.h"
+#include "trfs/inode.h"
+#include "trfs/printk.h"
+#include "trfs/stats.h"
+#include "trfs/super.h"
+#include "trace/events/trfs.h"
+
+// File Data:
+// Regular files go through the page cache and the iomap library: iomap asks
+// trfs_iomap_begin() for the mapping of a file range and gets the longest run
+// of blocks that are contiguous on disk (or a hole), then builds one bio per
+// run instead of one buffer_head per block.
+// Writeback goes the other way: dirty folios are gathered into bios covering
+// the same runs (see trfs_writepages()).
+// Small files are inline: their content is stored in the inode record and
+// copied by iomap between the page cache and the record (IOMAP_INLINE), no
+// data block is read, allocated or written back.
+// Compressed clusters are read and written around iomap (see trfs/compress.c).
+// Preallocated blocks are unwritten (IOMAP_UNWRITTEN): iomap reads them as
+// zeroes without any I/O, and they are marked written once data written to
+// them is on disk (see trfs_complete_ioends()).
+// Blocks shared with other files (see TRFS_INODE_SHARED) are copied on write:
+// direct writes and writeback map new unwritten blocks in their place before
+// writing, converted like preallocated ones (see trfs_unshare_blocks()).
+// https://docs.kernel.org/filesystems/iomap/index.html
+
+///
+/// Maps the inline data of the inode: the record is read (from the buffer
+/// cache, trfs_iget() read it) and kept until trfs_iomap_end().
+///
+static int trfs_iomap_begin_inline(
+  struct inode* const inode,
+  loff_t const offset,
+  loff_t const length,
+  struct iomap* const iomap
+) {
+  struct buffer_head* buffer_head;
+
+  iomap->flags = 0;
+  iomap->bdev = inode->i_sb->s_bdev;
+
+  // Zeroing up to the end of the block goes past the inline area.
+  if (offset >= TRFS_INODE_INLINE_SIZE) {
+    iomap->type = IOMAP_HOLE;
+    iomap->addr = IOMAP_NULL_ADDR;
+    iomap->offset = offset;
+    iomap->length = (u64) length;
+    return 0;
+  }
+
+  struct trfs_inode* const record = trfs_get_inode_record(inode->i_sb, inode->i_ino, &buffer_head);
+  if (IS_ERR(record)) {
+    return PTR_ERR(record);
+  }
+
+  iomap->type = IOMAP_INLINE;
+  iomap->addr = IOMAP_NULL_ADDR;
+  iomap->offset = 0;
+  iomap->length = TRFS_INODE_INLINE_SIZE;
+  iomap->inline_data = record->inline_data;
+  iomap->private = buffer_head;
+  return 0;
+}
+
+///
+/// Maps the file range [offset, offset + length) (or its beginning) to disk.
+///
+/// The returned mapping stops at the end of the extent holding the first
+/// block, or at the next extent for a hole (filled with zeroes by iomap on
+/// reads).
+///
+/// Buffered writes to a hole only reserve blocks (IOMAP_DELALLOC), they are
+/// allocated at writeback (see trfs_map_writeback_blocks()). Direct writes
+/// allocate the hole right away as unwritten blocks, as one run when possible,
+/// converted once the data is on disk (see trfs_direct_write_end_io()), and
+/// copy shared blocks on write to unwritten blocks the same way. Writes to
+/// unwritten blocks (IOMAP_UNWRITTEN) go to the preallocated blocks.
+///
+/// Buffered writes and write faults (see trfs_page_mkwrite()) to shared blocks
+/// reserve their copies, made at writeback.
+///
+static int trfs_iomap_begin(
+  struct inode* const inode,
+  loff_t const offset,
+  loff_t const length,
+  unsigned int const flags,
+  struct iomap* const iomap,
+  struct iomap* const srcmap
+) {
+  unsigned int const block_bits = inode->i_blkbits;
+  loff_t const first = offset >> block_bits;
+
+  // Writers converting the inode hold i_rwsem, readers the folio lock (see
+  // trfs_uninline_data()).
+  if (trfs_inode_is_inline(inode)) {
+    return trfs_iomap_begin_inline(inode, offset, length, iomap);
+  }
+
+  loff_t const last = min_t(loff_t, (offset + length - 1) >> block_bits, U32_MAX);
+
+  // Logical block numbers are 32-bit.
+  if (first > U32_MAX) {
+    return -EFBIG;
+  }
+
+  uint64_t physical;
+  uint32_t count = (uint32_t) min_t(loff_t, last - first + 1, U32_MAX);
+  enum trfs_run_type type;
+
+  int error = trfs_map_blocks(inode, (uint32_t) first, &physical, &count, &type);
+  if (error) {
+    return error;
+  }
+
+  iomap->flags = 0;
+
+  // Writers hold i_rwsem, the hole cannot be filled concurrently. The new
+  // blocks are flagged so that iomap zeroes the parts of them that are not
+  // written instead of reading stale data from disk. Zeroing a hole is a
+  // no-op, it does not need blocks.
+  if (type == TRFS_RUN_HOLE && (flags & IOMAP_WRITE) && !(flags & IOMAP_ZERO)) {
+    if (flags & IOMAP_DIRECT) {
+      error = trfs_map_new_blocks(inode, (uint32_t) first, &physical, &count, true);
+      type = TRFS_RUN_UNWRITTEN;
+    }
+    else {
+      error = trfs_delay_blocks(inode, (uint32_t) first, count);
+      type = TRFS_RUN_DELAYED;
+    }
+
+    if (error) {
+      return error;
+    }
+
+    iomap->flags |= IOMAP_F_NEW;
+  }
+
+  if (type == TRFS_RUN_MAPPED && (flags & IOMAP_WRITE) && !(flags & IOMAP_DIRECT)
+    && trfs_inode_is_shared(inode)
+    && (error = trfs_reserve_cow_blocks(inode, (uint32_t) first, count))
+  ) {
+    return error;
+  }
+
+  // Direct writes are aligned, the new blocks are written whole and converted
+  // by trfs_direct_write_end_io().
+  if (type == TRFS_RUN_MAPPED && (flags & IOMAP_DIRECT) && (flags & IOMAP_WRITE)
+    && trfs_inode_is_shared(inode)
+    && (error = trfs_unshare_blocks(inode, (uint32_t) first, count, &physical, &count, &type))
+  ) {
+    return error;
+  }
+
+  iomap->bdev = inode->i_sb->s_bdev;
+  iomap->offset = first << block_bits;
+  iomap->length = (u64) count << block_bits;
+
+  if (type == TRFS_RUN_MAPPED || type == TRFS_RUN_UNWRITTEN) {
+    iomap->type = type == TRFS_RUN_UNWRITTEN ? IOMAP_UNWRITTEN : IOMAP_MAPPED;
+    iomap->addr = (u64) physical << block_bits;
+  }
+  else {
+    iomap->type = type == TRFS_RUN_DELAYED ? IOMAP_DELALLOC : IOMAP_HOLE;
+    iomap->addr = IOMAP_NULL_ADDR;
+  }
+
+  trace_trfs_map_blocks(inode, offset, length, flags, iomap);
+  return 0;
+}
+
+static int trfs_iomap_end(
+  struct inode* const inode,
+  loff_t const offset,
+  loff_t const length,
+  ssize_t const written,
+  unsigned int const flags,
+  struct iomap* const iomap
+) {
+  // i_size was updated by iomap_write_end().
+  if (iomap->flags & IOMAP_F_SIZE_CHANGED) {
+    mark_inode_dirty(inode);
+  }
+
+  // The data has been copied to the record, which is written back with the
+  // buffer cache.
+  if (iomap->type == IOMAP_INLINE) {
+    struct buffer_head* const buffer_head = iomap->private;
+
+    if ((flags & IOMAP_WRITE) && written > 0) {
+      mark_buffer_dirty(buffer_head);
+    }
+
+    brelse(buffer_head);
+    return 0;
+  }
+
+  // A short write leaves blocks reserved by trfs_iomap_begin() without data,
+  // their reservation is given back (blocks partially written are kept).
+  if (iomap->type == IOMAP_DELALLOC && (iomap->flags & IOMAP_F_NEW)) {
+    loff_t const start = written > 0
+      ? round_up(offset + written, i_blocksize(inode))
+      : iomap->offset;
+
+    loff_t const end = iomap->offset + (loff_t) iomap->length;
+
+    if (start < end) {
+      trfs_undelay_blocks(
+        inode, (uint32_t) (start >> inode->i_blkbits), (uint64_t) end >> inode->i_blkbits
+      );
+    }
+  }
+
+  return 0;
+}
+
+const struct iomap_ops trfs_iomap_ops = {
+  .iomap_begin = trfs_iomap_begin,
+  .iomap_end = trfs_iomap_end,
+};
+
+static int trfs_read_folio(
+  struct file* const file,
+  struct folio* const folio
+) {
+  struct inode* const inode = folio->mapping->host;
+  u64 const started = trfs_start_timing();
+  struct trfs_extent extent;
+
+  trace_trfs_read_folio(inode, folio_pos(folio), folio_size(folio));
+  trfs_count(inode->i_sb, TRFS_COUNTER_PAGES_READ, folio_nr_pages(folio));
+
+  int const error = trfs_lookup_compressed(inode, (uint32_t) (folio_pos(folio) >> inode->i_blkbits), &extent)
+    ? trfs_read_compressed_folio(folio, &extent)
+    : iomap_read_folio(folio, &trfs_iomap_ops);
+
+  trfs_account(inode->i_sb, TRFS_OPERATION_READ_FOLIO, started);
+  return error;
+}
+
+///
+/// Called by the page cache for sequential reads, the readahead window is
+/// submitted as one bio per contiguous run.
+///
+static void trfs_readahead(
+  struct readahead_control* const control
+) {
+  struct inode* const inode = control->mapping->host;
+  u64 const started = trfs_start_timing();
+
+  trace_trfs_readahead(inode, readahead_pos(control), readahead_length(control));
+  trfs_count(inode->i_sb, TRFS_COUNTER_PAGES_READ, readahead_count(control));
+
+  if (trfs_has_compressed_extents(inode)) {
+    trfs_readahead_compressed(control);
+  }
+  else {
+    iomap_readahead(control, &trfs_iomap_ops);
+  }
+
+  trfs_account(inode->i_sb, TRFS_OPERATION_READAHEAD, started);
+}
+
+///
+/// Returns the number of blocks (at most count) from the given offset that
+/// writeback writes whole: the end of the folio holding it and the dirty
+/// folios following it, as long as they are uptodate. When the folio holding
+/// the offset is not, only its block is: iomap skips the blocks of a folio
+/// that are not uptodate.
+///
+static uint32_t trfs_writeback_blocks(
+  struct inode* const inode,
+  loff_t const offset,
+  uint32_t const count
+) {
+  loff_t const limit = offset + ((loff_t) count << inode->i_blkbits);
+  pgoff_t index = (pgoff_t) (offset >> PAGE_SHIFT);
+  loff_t end = offset + i_blocksize(inode);
+
+  while (end < limit) {
+    struct folio* const folio = filemap_get_folio(inode->i_mapping, index);
+    if (folio == NULL) {
+      break;
+    }
+
+    // The folio holding the offset is under writeback, it is not dirty anymore.
+    bool const whole = folio_test_uptodate(folio)
+      && (folio_pos(folio) <= offset || folio_test_dirty(folio));
+
+    if (whole) {
+      end = folio_pos(folio) + (loff_t) folio_size(folio);
+      index = folio->index + folio_nr_pages(folio);
+    }
+
+    folio_put(folio);
+
+    if (!whole) {
+      break;
+    }
+  }
+
+  return (uint32_t) ((min(end, limit) - offset) >> inode->i_blkbits);
+}
+
+///
+/// Maps the block at the given offset for writeback.
+///
+/// Dirty folios are visited in index order and consecutive ones usually fall
+/// in the same extent: the mapping of the previous call is reused as long as
+/// it covers the offset, iomap then appends the blocks to the current bio
+/// (ioend) since they are contiguous on disk.
+///
+/// A delayed block is allocated along with the whole delayed extent holding
+/// it, that is every block written since the last writeback, as one extent
+/// when the free space allows it.
+///
+/// Shared blocks are copied on write, to new blocks mapped in their place, as
+/// one run up to the end of the folios written whole (see
+/// trfs_writeback_blocks()). Blocks of a shared inode that are not shared are
+/// mapped as one run, like those of any other inode.
+///
+static int trfs_map_writeback_blocks(
+  struct iomap_writepage_ctx* const context,
+  struct inode* const inode,
+  loff_t const offset
+) {
+  // Holes are not reused: a write may have delayed them since. Unwritten
+  // blocks are only marked written once their bios complete.
+  if ((context->iomap.type == IOMAP_MAPPED || context->iomap.type == IOMAP_UNWRITTEN)
+    && offset >= context->iomap.offset
+    && offset < context->iomap.offset + (loff_t) context->iomap.length
+  ) {
+    return 0;
+  }
+
+  // Inline data never dirties the page cache.
+  if (WARN_ON_ONCE(trfs_inode_is_inline(inode))) {
+    return -EIO;
+  }
+
+  int error = trfs_allocate_delayed_blocks(inode, (uint32_t) (offset >> inode->i_blkbits));
+  if (error) {
+    return error;
+  }
+
+  // Map up to the end of file, the run stops at the end of the extent.
+  loff_t const length = max_t(loff_t, i_size_read(inode) - offset, i_blocksize(inode));
+  if ((error = trfs_iomap_begin(inode, offset, length, 0, &context->iomap, NULL))
+    || context->iomap.type != IOMAP_MAPPED
+    || !trfs_inode_is_shared(inode)
+  ) {
+    return error;
+  }
+
+  uint32_t const logical = (uint32_t) (offset >> inode->i_blkbits);
+  uint32_t count = (uint32_t) (context->iomap.length >> inode->i_blkbits);
+  uint32_t const written = trfs_writeback_blocks(inode, offset, count);
+  uint64_t physical;
+  enum trfs_run_type type;
+
+  // Also lowers count to the run that is shared or not.
+  if ((error = trfs_unshare_blocks(inode, logical, written, &physical, &count, &type))) {
+    return error;
+  }
+
+  context->iomap.type = type == TRFS_RUN_UNWRITTEN ? IOMAP_UNWRITTEN : IOMAP_MAPPED;
+  context->iomap.addr = (u64) physical << inode->i_blkbits;
+  context->iomap.length = (u64) count << inode->i_blkbits;
+  return 0;
+}
+
+///
+/// Completes the bio of an ioend of unwritten blocks: the ioend is queued on
+/// its inode, the blocks are marked written by trfs_complete_ioends(), which
+/// may sleep.
+///
+static void trfs_end_unwritten_bio(
+  struct bio* const bio
+) {
+  struct iomap_ioend* const ioend = bio->bi_private;
+  struct inode* const inode = ioend->io_inode;
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+  unsigned long flags;
+
+  spin_lock_irqsave(&info->ioend_lock, flags);
+
+  // Otherwise the work is already queued.
+  if (list_empty(&info->ioend_list)) {
+    queue_work(trfs_mount_info(inode->i_sb)->unwritten_workqueue, &info->ioend_work);
+  }
+
+  list_add_tail(&ioend->io_list, &info->ioend_list);
+  spin_unlock_irqrestore(&info->ioend_lock, flags);
+}
+
+///
+/// Marks the unwritten blocks of the completed ioends of an inode written,
+/// then ends the writeback of their folios. Until then, the blocks still read
+/// as zeroes (their folios are under writeback, fsync(2) waits for them).
+///
+void trfs_complete_ioends(
+  struct work_struct* const work
+) {
+  struct trfs_inode_info* const info = container_of(work, struct trfs_inode_info, ioend_work);
+  struct inode* const inode = &info->vfs_inode;
+  struct iomap_ioend* ioend;
+  unsigned long flags;
+  LIST_HEAD(ioends);
+
+  spin_lock_irqsave(&info->ioend_lock, flags);
+  list_splice_init(&info->ioend_list, &ioends);
+  spin_unlock_irqrestore(&info->ioend_lock, flags);
+
+  while ((ioend = list_first_entry_or_null(&ioends, struct iomap_ioend, io_list)) != NULL) {
+    list_del_init(&ioend->io_list);
+
+    int error = blk_status_to_errno(ioend->io_bio->bi_status);
+    if (!error) {
+      error = trfs_convert_unwritten_blocks(
+        inode,
+        (uint32_t) (ioend->io_offset >> inode->i_blkbits),
+        ((uint64_t) (ioend->io_offset + (loff_t) ioend->io_size) + i_blocksize(inode) - 1) >> inode->i_blkbits
+      );
+
+      if (error) {
+        TRFS_ERROR("Could not mark the written blocks of inode [%lu].\n", inode->i_ino);
+      }
+    }
+
+    // Errors are reported on the mapping (see mapping_set_error()).
+    iomap_finish_ioends(ioend, error);
+  }
+}
+
+///
+/// Called before an ioend is submitted, ioends of unwritten blocks complete
+/// in trfs_end_unwritten_bio().
+///
+static int trfs_prepare_ioend(
+  struct iomap_ioend* const ioend,
+  int const status
+) {
+  if (!status && ioend->io_type == IOMAP_UNWRITTEN) {
+    ioend->io_bio->bi_end_io = trfs_end_unwritten_bio;
+  }
+
+  return status;
+}
+
+static const struct iomap_writeback_ops trfs_writeback_ops = {
+  .map_blocks = trfs_map_writeback_blocks,
+  .prepare_ioend = trfs_prepare_ioend,
+};
+
+///
+/// Copies the inline data of a file, dirtied through a shared mapping (see
+/// trfs_page_mkwrite()), back to its record.
+///
+/// @return -EAGAIN when the file is not inline anymore.
+///
+static int trfs_write_inline_folio(
+  struct address_space* const mapping,
+  struct writeback_control* const wbc
+) {
+  struct inode* const inode = mapping->host;
+  struct buffer_head* buffer_head;
+  int error = 0;
+
+  struct folio* const folio = __filemap_get_folio(mapping, 0, FGP_LOCK, 0);
+  if (folio == NULL) {
+    return 0;
+  }
+
+  // The flag only changes under the folio lock (see trfs_uninline_data()).
+  if (!trfs_inode_is_inline(inode)) {
+    error = -EAGAIN;
+    goto unlock;
+  }
+
+  if (!folio_clear_dirty_for_io(folio)) {
+    goto unlock;
+  }
+
+  struct trfs_inode* const record = trfs_get_inode_record(inode->i_sb, inode->i_ino, &buffer_head);
+  if (IS_ERR(record)) {
+    folio_redirty_for_writepage(wbc, folio);
+    error = PTR_ERR(record);
+    goto unlock;
+  }
+
+  // The file is not larger than the inline area.
+  void const* const address = kmap_local_folio(folio, 0);
+  memcpy(record->inline_data, address, min_t(size_t, i_size_read(inode), TRFS_INODE_INLINE_SIZE));
+  kunmap_local(address);
+
+  mark_buffer_dirty(buffer_head);
+  brelse(buffer_head);
+
+  // There is no I/O, writeback only clears the dirty tag of the folio.
+  folio_start_writeback(folio);
+  folio_unlock(folio);
+  folio_end_writeback(folio);
+  folio_put(folio);
+  return 0;
+
+unlock:
+  folio_unlock(folio);
+  folio_put(folio);
+  return error;
+}
+
+///
+/// Writes the dirty folios of a file back, in index order, as large bios made
+/// of the runs of folios that are contiguous on disk. The bios are submitted
+/// under a plug so that the block layer can merge them further.
+///
+/// Clusters that compress well are written first (see trfs_compress_clusters()).
+///
+static int trfs_writepages(
+  struct address_space* const mapping,
+  struct writeback_control* const wbc
+) {
+  u64 const started = trfs_start_timing();
+  long const wanted = wbc->nr_to_write;
+  struct iomap_writepage_ctx context = {};
+  struct blk_plug plug;
+  int error;
+
+  if (trfs_inode_is_inline(mapping->host)
+    && (error = trfs_write_inline_folio(mapping, wbc)) != -EAGAIN
+  ) {
+    goto trace;
+  }
+
+  trfs_compress_clusters(mapping, wbc);
+
+  blk_start_plug(&plug);
+  error = iomap_writepages(mapping, wbc, &context, &trfs_writeback_ops);
+  blk_finish_plug(&plug);
+
+trace:
+  trace_trfs_writepages(mapping->host, wbc, wanted, error, started);
+  trfs_account(mapping->host->i_sb, TRFS_OPERATION_WRITEPAGES, started);
+  trfs_count(mapping->host->i_sb, TRFS_COUNTER_PAGES_WRITTEN, (u64) max(wanted - wbc->nr_to_write, 0L));
+  return error;
+}
+
+///
+/// Moves the inline data of a file to the page cache, from which it is
+/// written back to a (delayed) data block, and switches the file to extents.
+/// Called before the file outgrows the inline area.
+///
+/// @pre The inode i_rwsem is held exclusively.
+///
+int trfs_uninline_data(
+  struct inode* const inode
+) {
+  struct folio* folio = NULL;
+  int error = 0;
+
+  if (!trfs_inode_is_inline(inode)) {
+    return 0;
+  }
+
+  if (i_size_read(inode) > 0) {
+    // Read through the inline mapping, then locked so that it cannot be read
+    // again (nor evicted) while the flag changes.
+    folio = read_mapping_folio(inode->i_mapping, 0, NULL);
+    if (IS_ERR(folio)) {
+      return PTR_ERR(folio);
+    }
+
+    folio_lock(folio);
+
+    if ((error = trfs_delay_blocks(inode, 0, 1))) {
+      goto unlock;
+    }
+  }
+
+  trfs_clear_inline_flag(inode);
+
+  if (folio != NULL) {
+    folio_mark_dirty(folio);
+  }
+
+unlock:
+  if (folio != NULL) {
+    folio_unlock(folio);
+    folio_put(folio);
+  }
+
+  return error;
+}
+
+///
+/// Checks that a direct I/O is aligned on the file system block size (set by
+/// trfs_set_block_size()), both in the file and in memory. Unaligned direct
+/// I/O would need sub-block zeroing and read-modify-write cycles.
+///
+static bool trfs_direct_io_aligned(
+  struct kiocb const* const iocb,
+  struct iov_iter const* const iter
+) {
+  unsigned long const mask = i_blocksize(file_inode(iocb->ki_filp)) - 1;
+
+  return ((unsigned long) iocb->ki_pos & mask) == 0
+    && (iov_iter_alignment(iter) & mask) == 0;
+}
+
+///
+/// Direct read: bios are built straight from the user pages, one per extent
+/// (holes read as zeroes).
+///
+/// @return -ENOTBLK when the file has compressed clusters, the caller falls
+///   back to a buffered read.
+///
+ssize_t trfs_direct_read(
+  struct kiocb* const iocb,
+  struct iov_iter* const to
+) {
+  struct inode* const inode = file_inode(iocb->ki_filp);
+
+  if (!trfs_direct_io_aligned(iocb, to)) {
+    return -EINVAL;
+  }
+
+  if (iov_iter_count(to) == 0) {
+    return 0;
+  }
+
+  u64 const started = trfs_start_timing();
+  loff_t const position = iocb->ki_pos;
+  size_t const count = iov_iter_count(to);
+
+  inode_lock_shared(inode);
+
+  ssize_t const result = trfs_has_compressed_extents(inode)
+    ? -ENOTBLK
+    : iomap_dio_rw(iocb, to, &trfs_iomap_ops, NULL, 0, NULL, 0);
+
+  inode_unlock_shared(inode);
+
+  // An asynchronous read returns -EIOCBQUEUED, the duration is the submission.
+  trace_trfs_direct_read(inode, position, count, result, started);
+  trfs_account(inode->i_sb, TRFS_OPERATION_DIRECT_READ, started);
+  return result;
+}
+
+///
+/// Completes a direct write: the file size is updated once the data is on
+/// disk, so that a concurrent reader never sees blocks that are not written
+/// yet. Unwritten blocks written to are marked written first.
+///
+static int trfs_direct_write_end_io(
+  struct kiocb* const iocb,
+  ssize_t const size,
+  int const error,
+  unsigned int const flags
+) {
+  struct inode* const inode = file_inode(iocb->ki_filp);
+
+  if (error || size <= 0) {
+    return error;
+  }
+
+  if (flags & IOMAP_DIO_UNWRITTEN) {
+    int const convert_error = trfs_convert_unwritten_blocks(
+      inode,
+      (uint32_t) (iocb->ki_pos >> inode->i_blkbits),
+      (uint64_t) (iocb->ki_pos + size + (loff_t) i_blocksize(inode) - 1) >> inode->i_blkbits
+    );
+
+    if (convert_error) {
+      return convert_error;
+    }
+  }
+
+  if (iocb->ki_pos + size > i_size_read(inode)) {
+    i_size_write(inode, iocb->ki_pos + size);
+    mark_inode_dirty(inode);
+  }
+
+  return 0;
+}
+
+static const struct iomap_dio_ops trfs_direct_write_ops = {
+  .end_io = trfs_direct_write_end_io,
+};
+
+///
+/// Direct write, holes are allocated by trfs_iomap_begin().
+///
+/// @return -ENOTBLK when the page cache could not be invalidated, the caller
+///   falls back to a buffered write.
+///
+/// @pre The inode is locked and generic_write_checks() passed.
+///
+ssize_t trfs_direct_write(
+  struct kiocb* const iocb,
+  struct iov_iter* const from
+) {
+  struct inode* const inode = file_inode(iocb->ki_filp);
+  unsigned int flags = 0;
+
+  if (!trfs_direct_io_aligned(iocb, from)) {
+    return -EINVAL;
+  }
+
+  // Extending writes complete synchronously: the size is updated by the end_io
+  // handler, which must run before the lock is released.
+  if (iocb->ki_pos + (loff_t) iov_iter_count(from) > i_size_read(inode)) {
+    flags |= IOMAP_DIO_FORCE_WAIT;
+  }
+
+  u64 const started = trfs_start_timing();
+  loff_t const position = iocb->ki_pos;
+  size_t const count = iov_iter_count(from);
+
+  ssize_t const result = iomap_dio_rw(iocb, from, &trfs_iomap_ops, &trfs_direct_write_ops, flags, NULL, 0);
+
+  trace_trfs_direct_write(inode, position, count, result, started);
+  trfs_account(inode->i_sb, TRFS_OPERATION_DIRECT_WRITE, started);
+  return result;
+}
+
+///
+/// Called before a page of a shared mapping is first written to: blocks are
+/// reserved for it, for a hole or for the copy of shared blocks (see
+/// trfs_iomap_begin()), and the compressed cluster holding it is expanded.
+///
+/// The invalidate lock keeps truncation and hole punching away, i_rwsem cannot
+/// be taken under the mmap lock.
+///
+static vm_fault_t trfs_page_mkwrite(
+  struct vm_fault* const vmf
+) {
+  struct inode* const inode = file_inode(vmf->vma->vm_file);
+  loff_t const position = folio_pos(page_folio(vmf->page));
+  vm_fault_t result;
+
+  sb_start_pagefault(inode->i_sb);
+  file_update_time(vmf->vma->vm_file);
+  filemap_invalidate_lock_shared(inode->i_mapping);
+
+  int const error = trfs_expand_compressed_clusters(inode, position, position + 1);
+  result = error ? vmf_error(error) : iomap_page_mkwrite(vmf, &trfs_iomap_ops);
+
+  filemap_invalidate_unlock_shared(inode->i_mapping);
+  sb_end_pagefault(inode->i_sb);
+  return result;
+}
+
+static const struct vm_operations_struct trfs_file_vm_operations = {
+  .fault = filemap_fault,
+  .map_pages = filemap_map_pages,
+  .page_mkwrite = trfs_page_mkwrite,
+};
+
+///
+/// Maps a regular file, its pages are the ones of the page cache, shared with
+/// read(2) and write(2).
+///
+int trfs_file_mmap(
+  struct file* const file,
+  struct vm_area_struct* const vma
+) {
+  file_accessed(file);
+  vma->vm_ops = &trfs_file_vm_operations;
+  return 0;
+}
+
+static sector_t trfs_bmap(
+  struct address_space* const mapping,
+  sector_t const block
+) {
+  return iomap_bmap(mapping, block, &trfs_iomap_ops);
+}
+
+const struct address_space_operations trfs_address_space_operations = {
+  .read_folio = trfs_read_folio,
+  .readahead = trfs_readahead,
+  .writepages = trfs_writepages,
+  .bmap = trfs_bmap,
+  // Direct I/O goes through trfs_direct_read/write(), the VFS only checks that
+  // the method is set to allow O_DIRECT (FMODE_CAN_ODIRECT).
+  .direct_IO = noop_direct_IO,
+  .dirty_folio = filemap_dirty_folio,
+  .release_folio = iomap_release_folio,
+  .invalidate_folio = iomap_invalidate_folio,
+  .migrate_folio = filemap_migrate_folio,
+  .is_partially_uptodate = iomap_is_partially_uptodate,
+  .error_remove_page = generic_error_remove_page,
+};
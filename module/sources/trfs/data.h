@@ -0,0 +1,31 @@
+#ifndef TRFS_DATA_H
+#define TRFS_DATA_H
+
+#include <linux/fs.h>
+#include <linux/iomap.h>
+#include <linux/mm_types.h>
+#include <linux/workqueue.h>
+
+extern const struct iomap_ops trfs_iomap_ops;
+extern const struct address_space_operations trfs_address_space_operations;
+
+int trfs_uninline_data(struct inode* const inode);
+
+void trfs_complete_ioends(struct work_struct* const work);
+
+int trfs_file_mmap(
+  struct file* const file,
+  struct vm_area_struct* const vma
+);
+
+ssize_t trfs_direct_read(
+  struct kiocb* const iocb,
+  struct iov_iter* const to
+);
+
+ssize_t trfs_direct_write(
+  struct kiocb* const iocb,
+  struct iov_iter* const from
+);
+
+#endif // TRFS_DATA_H
@@ -1,4 +1,3 @@
-
 // The Directory Entry Object (dentry):
 // A dentry represents a directory entry in the filesystem, associating a
 // filename with its corresponding inode.
@@ -9,3 +8,10 @@
 // by keeping frequently accessed directory data in memory,
 //
 // https://www.kernel.org/doc/Documentation/filesystems/vfs.txt
+//
+// Lookups of missing names leave negative dentries (no inode) in the dcache,
+// so that repeated misses (build systems, $PATH searches) are answered without
+// reading the directory again (see trfs_inode_lookup()). The VFS turns them
+// positive when the name is created, and a removed name negative. No dentry
+// operations are needed: names too long are rejected by trfs_inode_lookup(),
+// and unused negative dentries are kept until the dcache is shrunk.
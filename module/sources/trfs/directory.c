@@ -0,0 +1,1084 @@
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/siphash.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+
+#include "trfs/directory.h"
+#include "trfs/inode.h"
+#include "trfs/printk.h"
+#include "trfs/super.h"
+
+// The Directory Index:
+// Entries are spread over leaf blocks according to the hash of their name, the
+// root index (logical block 0) and, for large directories, one level of index
+// nodes tell which leaf covers which hash range (see trfs/super.h). This is
+// close to the ext3/ext4 "htree" but without the linear fallback: a lookup
+// never scans more than one leaf.
+// Small directories are inline: their entries are stored in the inode record
+// as a single leaf, until they outgrow it.
+// https://docs.kernel.org/filesystems/ext4/directory.html#hash-tree-directories
+
+/// readdir(3) cookies: (hash << 16 | rank) + 2, the rank being the one of the
+/// entry among the entries with the same hash, in name order ("." and ".." use
+/// 0 and 1). They do not depend on where the entry is stored, splitting a leaf
+/// or moving the inline leaf to a block leaves them as they are.
+#define TRFS_DIRECTORY_POSITION(hash, rank) \
+  (2 + (((loff_t) (hash) << 16) | (loff_t) (rank)))
+
+/// The readdir(3) cookie past the last entry.
+#define TRFS_DIRECTORY_POSITION_END TRFS_DIRECTORY_POSITION((loff_t) U32_MAX + 1, 0)
+
+///
+/// Blocks read while walking down the index towards a leaf.
+///
+struct trfs_directory_path {
+  /// Root index, then index node (when the root depth is 1).
+  struct buffer_head* index[TRFS_DIRECTORY_MAX_DEPTH + 1];
+
+  /// Position of the followed entry in each index block.
+  uint32_t position[TRFS_DIRECTORY_MAX_DEPTH + 1];
+
+  /// Number of index blocks in use.
+  uint32_t levels;
+
+  struct buffer_head* leaf;
+  uint32_t leaf_block;
+};
+
+uint32_t trfs_directory_hash(
+  struct super_block const* const super_block,
+  char const* const name,
+  unsigned int const length
+) {
+  return (uint32_t) siphash(name, length, &trfs_mount_info(super_block)->hash_key);
+}
+
+///
+/// Reads the given logical block of a directory.
+///
+/// @return A buffer_head (release with brelse()) or an ERR_PTR().
+///
+static struct buffer_head* trfs_directory_read_block(
+  struct inode* const directory,
+  uint32_t const logical
+) {
+  uint64_t physical;
+  int const error = trfs_map_block(directory, logical, &physical);
+
+  if (error) {
+    return ERR_PTR(error);
+  }
+
+  if (physical == 0) {
+    TRFS_ERROR("Directory [%lu] has a hole at block [%u].\n", directory->i_ino, logical);
+    return ERR_PTR(-EIO);
+  }
+
+  struct buffer_head* const buffer_head = sb_bread(directory->i_sb, physical);
+  if (!buffer_head) {
+    TRFS_ERROR("Could not read directory block [%llu].\n", physical);
+    return ERR_PTR(-EIO);
+  }
+
+  return buffer_head;
+}
+
+///
+/// Returns the maximum number of entries of an index block.
+///
+static inline uint32_t trfs_directory_index_limit(
+  struct super_block const* const super_block
+) {
+  return (super_block->s_blocksize - sizeof(struct trfs_directory_index))
+    / sizeof(struct trfs_directory_index_entry);
+}
+
+static bool trfs_directory_check_index(
+  struct super_block const* const super_block,
+  struct trfs_directory_index const* const index
+) {
+  uint32_t const count = be32_to_cpu(index->count);
+
+  return be32_to_cpu(index->magic) == TRFS_DIRECTORY_INDEX_MAGIC
+    && be32_to_cpu(index->depth) <= TRFS_DIRECTORY_MAX_DEPTH
+    && count > 0 && count <= trfs_directory_index_limit(super_block);
+}
+
+///
+/// Checks a leaf of `size` bytes (a block, or the inline area of the inode).
+///
+static bool trfs_directory_check_leaf(
+  struct trfs_directory_leaf const* const leaf,
+  uint32_t const size
+) {
+  uint32_t const used = be32_to_cpu(leaf->used);
+
+  return be32_to_cpu(leaf->magic) == TRFS_DIRECTORY_LEAF_MAGIC
+    && used >= sizeof(struct trfs_directory_leaf)
+    && used <= size;
+}
+
+///
+/// Returns the entry at the given offset of a leaf, NULL when the offset is
+/// past the used area or when the entry overflows it.
+///
+static struct trfs_directory_entry* trfs_directory_entry_at(
+  struct trfs_directory_leaf* const leaf,
+  uint32_t const offset
+) {
+  uint32_t const used = be32_to_cpu(leaf->used);
+
+  if (offset + sizeof(struct trfs_directory_entry) > used) {
+    return NULL;
+  }
+
+  struct trfs_directory_entry* const entry = (void*) leaf + offset;
+  if (offset + TRFS_DIRECTORY_ENTRY_SIZE(entry->name_length) > used) {
+    return NULL;
+  }
+
+  return entry;
+}
+
+///
+/// Returns the position of the last index entry whose hash is lower than or
+/// equal to the given hash.
+///
+/// @pre The index has been checked.
+///
+static uint32_t trfs_directory_search_index(
+  struct trfs_directory_index const* const index,
+  uint32_t const hash
+) {
+  uint32_t low = 0;
+  uint32_t high = be32_to_cpu(index->count);
+
+  // First entry whose hash is greater than the given hash.
+  while (low < high) {
+    uint32_t const middle = low + (high - low) / 2;
+
+    if (be32_to_cpu(index->entries[middle].hash) <= hash) {
+      low = middle + 1;
+    }
+    else {
+      high = middle;
+    }
+  }
+
+  return low == 0 ? 0 : low - 1;
+}
+
+static void trfs_directory_release_path(
+  struct trfs_directory_path* const path
+) {
+  for (uint32_t level = 0; level < path->levels; ++level) {
+    brelse(path->index[level]);
+    path->index[level] = NULL;
+  }
+
+  brelse(path->leaf);
+  path->leaf = NULL;
+  path->levels = 0;
+}
+
+///
+/// Reads the index blocks and the leaf covering the given hash.
+///
+/// @pre The directory is not empty.
+///
+static int trfs_directory_walk(
+  struct inode* const directory,
+  uint32_t const hash,
+  struct trfs_directory_path* const path
+) {
+  struct super_block* const super_block = directory->i_sb;
+  uint32_t block = 0;
+  uint32_t depth = 0;
+  int error = 0;
+
+  memset(path, 0, sizeof(struct trfs_directory_path));
+
+  for (uint32_t level = 0; level <= depth; ++level) {
+    struct buffer_head* const buffer_head = trfs_directory_read_block(directory, block);
+    if (IS_ERR(buffer_head)) {
+      error = PTR_ERR(buffer_head);
+      goto cleanup;
+    }
+
+    path->index[level] = buffer_head;
+    path->levels = level + 1;
+
+    struct trfs_directory_index const* const index = (void*) buffer_head->b_data;
+    if (!trfs_directory_check_index(super_block, index)) {
+      goto corrupted;
+    }
+
+    if (level == 0) {
+      depth = be32_to_cpu(index->depth);
+    }
+    else if (be32_to_cpu(index->depth) != 0) {
+      goto corrupted;
+    }
+
+    path->position[level] = trfs_directory_search_index(index, hash);
+    block = be32_to_cpu(index->entries[path->position[level]].block);
+  }
+
+  path->leaf = trfs_directory_read_block(directory, block);
+  if (IS_ERR(path->leaf)) {
+    error = PTR_ERR(path->leaf);
+    path->leaf = NULL;
+    goto cleanup;
+  }
+
+  if (!trfs_directory_check_leaf((void*) path->leaf->b_data, super_block->s_blocksize)) {
+    goto corrupted;
+  }
+
+  path->leaf_block = block;
+  return 0;
+
+corrupted:
+  TRFS_ERROR("Directory [%lu] has a corrupted index.\n", directory->i_ino);
+  error = -EIO;
+
+cleanup:
+  trfs_directory_release_path(path);
+  return error;
+}
+
+///
+/// Reads the leaf stored in the record of an inline directory.
+///
+/// @return The leaf within the record, the caller has to release the buffer
+///   with brelse(). An ERR_PTR() on error.
+///
+/// @pre The directory is inline and not empty.
+///
+static struct trfs_directory_leaf* trfs_directory_read_inline(
+  struct inode* const directory,
+  struct buffer_head** const buffer_head
+) {
+  struct trfs_inode* const record = trfs_get_inode_record(
+    directory->i_sb, directory->i_ino, buffer_head
+  );
+
+  if (IS_ERR(record)) {
+    return ERR_CAST(record);
+  }
+
+  struct trfs_directory_leaf* const leaf = (void*) record->inline_data;
+  if (!trfs_directory_check_leaf(leaf, TRFS_INODE_INLINE_SIZE)) {
+    TRFS_ERROR("Directory [%lu] has a corrupted inline leaf.\n", directory->i_ino);
+    brelse(*buffer_head);
+    return ERR_PTR(-EIO);
+  }
+
+  return leaf;
+}
+
+///
+/// Returns the inode number of the given name in a leaf, 0 if not found.
+///
+static uint32_t trfs_directory_find(
+  struct trfs_directory_leaf* const leaf,
+  uint32_t const hash,
+  struct qstr const* const name
+) {
+  struct trfs_directory_entry const* entry;
+  uint32_t offset = sizeof(struct trfs_directory_leaf);
+
+  while ((entry = trfs_directory_entry_at(leaf, offset)) != NULL) {
+    if (be32_to_cpu(entry->hash) == hash
+      && entry->name_length == name->len
+      && memcmp(entry->name, name->name, name->len) == 0
+    ) {
+      return be32_to_cpu(entry->inode);
+    }
+
+    offset += TRFS_DIRECTORY_ENTRY_SIZE(entry->name_length);
+  }
+
+  return 0;
+}
+
+///
+/// Looks for the given name in a directory.
+///
+/// @return 0 on success, *ino being 0 when there is no such entry.
+///
+int trfs_directory_lookup(
+  struct inode* const directory,
+  struct qstr const* const name,
+  uint32_t* const ino
+) {
+  struct trfs_directory_path path;
+  *ino = 0;
+
+  if (directory->i_size == 0) {
+    return 0;
+  }
+
+  uint32_t const hash = trfs_directory_hash(directory->i_sb, name->name, name->len);
+
+  if (trfs_inode_is_inline(directory)) {
+    struct buffer_head* buffer_head;
+    struct trfs_directory_leaf* const leaf = trfs_directory_read_inline(directory, &buffer_head);
+    if (IS_ERR(leaf)) {
+      return PTR_ERR(leaf);
+    }
+
+    *ino = trfs_directory_find(leaf, hash, name);
+    brelse(buffer_head);
+    return 0;
+  }
+
+  int const error = trfs_directory_walk(directory, hash, &path);
+  if (error) {
+    return error;
+  }
+
+  *ino = trfs_directory_find((void*) path.leaf->b_data, hash, name);
+  trfs_directory_release_path(&path);
+  return 0;
+}
+
+struct trfs_directory_slot {
+  uint32_t hash;
+  uint32_t offset;
+};
+
+static int trfs_directory_slot_compare(
+  void const* const a,
+  void const* const b
+) {
+  uint32_t const left = ((struct trfs_directory_slot const*) a)->hash;
+  uint32_t const right = ((struct trfs_directory_slot const*) b)->hash;
+
+  return left < right ? -1 : left > right;
+}
+
+///
+/// Orders the entries of a leaf by hash, then by name (see
+/// TRFS_DIRECTORY_POSITION()).
+///
+static int trfs_directory_slot_compare_names(
+  void const* const a,
+  void const* const b,
+  void const* const leaf
+) {
+  struct trfs_directory_slot const* const left = a;
+  struct trfs_directory_slot const* const right = b;
+
+  if (left->hash != right->hash) {
+    return left->hash < right->hash ? -1 : 1;
+  }
+
+  struct trfs_directory_entry const* const left_entry = leaf + left->offset;
+  struct trfs_directory_entry const* const right_entry = leaf + right->offset;
+  int const order = memcmp(
+    left_entry->name, right_entry->name, min(left_entry->name_length, right_entry->name_length)
+  );
+
+  return order ? order : (int) left_entry->name_length - (int) right_entry->name_length;
+}
+
+///
+/// Lists the entries of a leaf, *count is set to their number.
+///
+/// @return The slots of the entries (free with kfree()) or an ERR_PTR().
+///
+static struct trfs_directory_slot* trfs_directory_leaf_slots(
+  struct trfs_directory_leaf* const leaf,
+  uint32_t* const count
+) {
+  uint32_t const entries = be32_to_cpu(leaf->count);
+  struct trfs_directory_entry const* entry;
+
+  struct trfs_directory_slot* const slots = kmalloc_array(
+    max(entries, 1u), sizeof(struct trfs_directory_slot), GFP_NOFS
+  );
+
+  if (slots == NULL) {
+    return ERR_PTR(-ENOMEM);
+  }
+
+  uint32_t offset = sizeof(struct trfs_directory_leaf);
+  *count = 0;
+
+  while (*count < entries && (entry = trfs_directory_entry_at(leaf, offset)) != NULL) {
+    slots[*count].hash = be32_to_cpu(entry->hash);
+    slots[*count].offset = offset;
+    offset += TRFS_DIRECTORY_ENTRY_SIZE(entry->name_length);
+    ++*count;
+  }
+
+  return slots;
+}
+
+///
+/// Emits the entries of a leaf from context->pos onwards, in hash order.
+/// *full is set when the user buffer is full.
+///
+static int trfs_directory_emit_leaf(
+  struct dir_context* const context,
+  struct trfs_directory_leaf* const leaf,
+  bool* const full
+) {
+  uint32_t count;
+  uint32_t rank = 0;
+
+  struct trfs_directory_slot* const slots = trfs_directory_leaf_slots(leaf, &count);
+  if (IS_ERR(slots)) {
+    return PTR_ERR(slots);
+  }
+
+  sort_r(slots, count, sizeof(struct trfs_directory_slot), trfs_directory_slot_compare_names, NULL, leaf);
+  *full = false;
+
+  for (uint32_t index = 0; index < count; ++index) {
+    struct trfs_directory_entry const* const entry = (void*) leaf + slots[index].offset;
+
+    rank = index > 0 && slots[index].hash == slots[index - 1].hash ? rank + 1 : 0;
+    loff_t const position = TRFS_DIRECTORY_POSITION(slots[index].hash, rank);
+
+    if (position < context->pos) {
+      continue;
+    }
+
+    if (!dir_emit(
+      context, entry->name, entry->name_length,
+      be32_to_cpu(entry->inode), entry->type
+    )) {
+      *full = true;
+      break;
+    }
+
+    context->pos = position + 1;
+  }
+
+  kfree(slots);
+  return 0;
+}
+
+///
+/// Returns the first hash covered by the leaf following the one of the path
+/// in hash order, false when it is the last one.
+///
+static bool trfs_directory_next_hash(
+  struct trfs_directory_path const* const path,
+  uint32_t* const hash
+) {
+  for (uint32_t level = path->levels; level-- > 0;) {
+    struct trfs_directory_index const* const index = (void*) path->index[level]->b_data;
+    uint32_t const next = path->position[level] + 1;
+
+    if (next < be32_to_cpu(index->count)) {
+      *hash = be32_to_cpu(index->entries[next].hash);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+///
+/// Emits the directory entries (but "." and "..") from context->pos onwards.
+///
+/// Entries are emitted in hash order, leaf after leaf following the index:
+/// their position is their hash (see TRFS_DIRECTORY_POSITION()), so that an
+/// entry moved by a leaf split is neither skipped nor emitted twice.
+///
+int trfs_directory_emit(
+  struct file* const file,
+  struct dir_context* const context
+) {
+  struct inode* const directory = file_inode(file);
+  bool full = false;
+  int error;
+
+  if (context->pos < 2 || context->pos >= TRFS_DIRECTORY_POSITION_END) {
+    return 0;
+  }
+
+  if (directory->i_size == 0) {
+    context->pos = TRFS_DIRECTORY_POSITION_END;
+    return 0;
+  }
+
+  if (trfs_inode_is_inline(directory)) {
+    struct buffer_head* buffer_head;
+
+    struct trfs_directory_leaf* const leaf = trfs_directory_read_inline(directory, &buffer_head);
+    if (IS_ERR(leaf)) {
+      return PTR_ERR(leaf);
+    }
+
+    error = trfs_directory_emit_leaf(context, leaf, &full);
+    brelse(buffer_head);
+
+    if (!error && !full) {
+      context->pos = TRFS_DIRECTORY_POSITION_END;
+    }
+
+    return error;
+  }
+
+  for (;;) {
+    struct trfs_directory_path path;
+    uint32_t next;
+
+    // The leaf covering the hash of the position.
+    if ((error = trfs_directory_walk(directory, (uint32_t) ((context->pos - 2) >> 16), &path))) {
+      return error;
+    }
+
+    error = trfs_directory_emit_leaf(context, (void*) path.leaf->b_data, &full);
+    bool const last = !trfs_directory_next_hash(&path, &next);
+    trfs_directory_release_path(&path);
+
+    if (error || full) {
+      return error;
+    }
+
+    if (last) {
+      context->pos = TRFS_DIRECTORY_POSITION_END;
+      return 0;
+    }
+
+    context->pos = TRFS_DIRECTORY_POSITION(next, 0);
+  }
+}
+
+// ╦┌┐┌┌─┐┌─┐┬─┐┌┬┐┬┌─┐┌┐┌
+// ║│││└─┐├┤ ├┬┘ │ ││ ││││
+// ╩┘└┘└─┘└─┘┴└─ ┴ ┴└─┘┘└┘
+
+///
+/// Appends a zeroed block to the directory.
+///
+/// @return An up-to-date buffer_head (release with brelse()) or an ERR_PTR().
+///
+/// @pre The directory i_rwsem is held exclusively.
+///
+static struct buffer_head* trfs_directory_new_block(
+  struct inode* const directory,
+  uint32_t* const logical
+) {
+  struct super_block* const super_block = directory->i_sb;
+  uint64_t physical;
+
+  *logical = directory->i_size >> super_block->s_blocksize_bits;
+
+  int const error = trfs_map_new_block(directory, *logical, &physical);
+  if (error) {
+    return ERR_PTR(error);
+  }
+
+  // The block is new, there is no need to read it.
+  struct buffer_head* const buffer_head = sb_getblk(super_block, physical);
+  if (!buffer_head) {
+    return ERR_PTR(-ENOMEM);
+  }
+
+  lock_buffer(buffer_head);
+  memset(buffer_head->b_data, 0, super_block->s_blocksize);
+  set_buffer_uptodate(buffer_head);
+  unlock_buffer(buffer_head);
+
+  i_size_write(directory, (loff_t) (*logical + 1) << super_block->s_blocksize_bits);
+  mark_inode_dirty(directory);
+  return buffer_head;
+}
+
+static void trfs_directory_init_leaf(
+  struct trfs_directory_leaf* const leaf
+) {
+  leaf->magic = cpu_to_be32(TRFS_DIRECTORY_LEAF_MAGIC);
+  leaf->count = 0;
+  leaf->used = cpu_to_be32(sizeof(struct trfs_directory_leaf));
+}
+
+///
+/// Creates the root index and its single leaf, empty or holding a copy of the
+/// given leaf (the inline one).
+///
+static int trfs_directory_init(
+  struct inode* const directory,
+  struct trfs_directory_leaf const* const entries
+) {
+  uint32_t root_block;
+  uint32_t leaf_block;
+
+  struct buffer_head* const root_head = trfs_directory_new_block(directory, &root_block);
+  if (IS_ERR(root_head)) {
+    return PTR_ERR(root_head);
+  }
+
+  struct buffer_head* const leaf_head = trfs_directory_new_block(directory, &leaf_block);
+  if (IS_ERR(leaf_head)) {
+    brelse(root_head);
+    return PTR_ERR(leaf_head);
+  }
+
+  struct trfs_directory_index* const root = (void*) root_head->b_data;
+  root->magic = cpu_to_be32(TRFS_DIRECTORY_INDEX_MAGIC);
+  root->depth = 0;
+  root->count = cpu_to_be32(1);
+  root->entries[0].hash = 0;
+  root->entries[0].block = cpu_to_be32(leaf_block);
+
+  if (entries != NULL) {
+    memcpy(leaf_head->b_data, entries, be32_to_cpu(entries->used));
+  }
+  else {
+    trfs_directory_init_leaf((void*) leaf_head->b_data);
+  }
+
+  mark_buffer_dirty(root_head);
+  mark_buffer_dirty(leaf_head);
+  brelse(root_head);
+  brelse(leaf_head);
+  return 0;
+}
+
+///
+/// Inserts (hash, block) at the given position of an index block.
+///
+/// @pre The index is not full.
+///
+static void trfs_directory_index_insert(
+  struct trfs_directory_index* const index,
+  uint32_t const position,
+  uint32_t const hash,
+  uint32_t const block
+) {
+  uint32_t const count = be32_to_cpu(index->count);
+
+  memmove(
+    &index->entries[position + 1], &index->entries[position],
+    (count - position) * sizeof(struct trfs_directory_index_entry)
+  );
+
+  index->entries[position].hash = cpu_to_be32(hash);
+  index->entries[position].block = cpu_to_be32(block);
+  index->count = cpu_to_be32(count + 1);
+}
+
+///
+/// Moves the entries [from, count) of an index block to another (empty) one.
+///
+static void trfs_directory_index_move(
+  struct trfs_directory_index* const source,
+  struct trfs_directory_index* const destination,
+  uint32_t const from
+) {
+  uint32_t const count = be32_to_cpu(source->count);
+
+  destination->magic = cpu_to_be32(TRFS_DIRECTORY_INDEX_MAGIC);
+  destination->depth = 0;
+  destination->count = cpu_to_be32(count - from);
+  memcpy(
+    destination->entries, &source->entries[from],
+    (count - from) * sizeof(struct trfs_directory_index_entry)
+  );
+
+  source->count = cpu_to_be32(from);
+}
+
+///
+/// Adds (hash, block) to the index, right after the entry followed by the
+/// path. Full index blocks are split: the root index first becomes a parent
+/// of two index nodes, then index nodes are split in two.
+///
+/// @return -ENOSPC when the index cannot grow anymore.
+///
+static int trfs_directory_index_add(
+  struct inode* const directory,
+  struct trfs_directory_path* const path,
+  uint32_t const hash,
+  uint32_t const block
+) {
+  uint32_t const limit = trfs_directory_index_limit(directory->i_sb);
+  uint32_t const level = path->levels - 1;
+  uint32_t const position = path->position[level] + 1;
+
+  struct buffer_head* const index_head = path->index[level];
+  struct trfs_directory_index* const index = (void*) index_head->b_data;
+  uint32_t const count = be32_to_cpu(index->count);
+
+  if (count < limit) {
+    trfs_directory_index_insert(index, position, hash, block);
+    mark_buffer_dirty(index_head);
+    return 0;
+  }
+
+  if (level == 0) {
+    // The root is full and points to leaves: its entries are moved to two
+    // new index nodes and it becomes their parent.
+    uint32_t lower_block;
+    uint32_t upper_block;
+
+    struct buffer_head* const lower_head = trfs_directory_new_block(directory, &lower_block);
+    if (IS_ERR(lower_head)) {
+      return PTR_ERR(lower_head);
+    }
+
+    struct buffer_head* const upper_head = trfs_directory_new_block(directory, &upper_block);
+    if (IS_ERR(upper_head)) {
+      brelse(lower_head);
+      return PTR_ERR(upper_head);
+    }
+
+    struct trfs_directory_index* const lower = (void*) lower_head->b_data;
+    struct trfs_directory_index* const upper = (void*) upper_head->b_data;
+    uint32_t const half = count / 2;
+
+    trfs_directory_index_move(index, upper, half);
+    trfs_directory_index_move(index, lower, 0);
+
+    if (position <= half) {
+      trfs_directory_index_insert(lower, position, hash, block);
+    }
+    else {
+      trfs_directory_index_insert(upper, position - half, hash, block);
+    }
+
+    index->depth = cpu_to_be32(1);
+    index->count = 0;
+    trfs_directory_index_insert(index, 0, 0, lower_block);
+    trfs_directory_index_insert(index, 1, be32_to_cpu(upper->entries[0].hash), upper_block);
+
+    mark_buffer_dirty(lower_head);
+    mark_buffer_dirty(upper_head);
+    mark_buffer_dirty(index_head);
+    brelse(lower_head);
+    brelse(upper_head);
+    return 0;
+  }
+
+  // An index node is full: its upper half is moved to a new node.
+  struct buffer_head* const root_head = path->index[0];
+  struct trfs_directory_index* const root = (void*) root_head->b_data;
+  uint32_t upper_block;
+
+  if (be32_to_cpu(root->count) >= limit) {
+    TRFS_WARN("Directory [%lu] index is full.\n", directory->i_ino);
+    return -ENOSPC;
+  }
+
+  struct buffer_head* const upper_head = trfs_directory_new_block(directory, &upper_block);
+  if (IS_ERR(upper_head)) {
+    return PTR_ERR(upper_head);
+  }
+
+  struct trfs_directory_index* const upper = (void*) upper_head->b_data;
+  uint32_t const half = count / 2;
+
+  trfs_directory_index_move(index, upper, half);
+
+  if (position <= half) {
+    trfs_directory_index_insert(index, position, hash, block);
+  }
+  else {
+    trfs_directory_index_insert(upper, position - half, hash, block);
+  }
+
+  trfs_directory_index_insert(
+    root, path->position[0] + 1,
+    be32_to_cpu(upper->entries[0].hash), upper_block
+  );
+
+  mark_buffer_dirty(upper_head);
+  mark_buffer_dirty(index_head);
+  mark_buffer_dirty(root_head);
+  brelse(upper_head);
+  return 0;
+}
+
+///
+/// Splits the leaf of the given path in two by hash: the upper half of its
+/// entries moves to a new leaf which is then added to the index. Entries with
+/// the same hash always stay in the same leaf.
+///
+/// @return -ENOSPC when all entries share the same hash.
+///
+static int trfs_directory_split_leaf(
+  struct inode* const directory,
+  struct trfs_directory_path* const path
+) {
+  struct super_block* const super_block = directory->i_sb;
+  struct trfs_directory_leaf* const leaf = (void*) path->leaf->b_data;
+  uint32_t slot_count;
+  int error = 0;
+
+  struct trfs_directory_slot* const slots = trfs_directory_leaf_slots(leaf, &slot_count);
+  if (IS_ERR(slots)) {
+    return PTR_ERR(slots);
+  }
+
+  void* const copy = kmalloc(super_block->s_blocksize, GFP_NOFS);
+  if (copy == NULL) {
+    error = -ENOMEM;
+    goto cleanup;
+  }
+
+  sort(slots, slot_count, sizeof(struct trfs_directory_slot), trfs_directory_slot_compare, NULL);
+
+  // Find a split point between two different hashes, closest to the middle.
+  uint32_t split = slot_count / 2;
+  while (split < slot_count && split > 0 && slots[split].hash == slots[split - 1].hash) {
+    ++split;
+  }
+
+  if (split == slot_count) {
+    split = slot_count / 2;
+    while (split > 0 && slots[split].hash == slots[split - 1].hash) {
+      --split;
+    }
+  }
+
+  if (split == 0) {
+    TRFS_WARN("Directory [%lu] leaf [%u] cannot be split.\n", directory->i_ino, path->leaf_block);
+    error = -ENOSPC;
+    goto cleanup;
+  }
+
+  uint32_t upper_block;
+  struct buffer_head* const upper_head = trfs_directory_new_block(directory, &upper_block);
+  if (IS_ERR(upper_head)) {
+    error = PTR_ERR(upper_head);
+    goto cleanup;
+  }
+
+  error = trfs_directory_index_add(directory, path, slots[split].hash, upper_block);
+  if (error) {
+    // The new block stays in the directory as an empty leaf.
+    trfs_directory_init_leaf((void*) upper_head->b_data);
+    mark_buffer_dirty(upper_head);
+    brelse(upper_head);
+    goto cleanup;
+  }
+
+  // Rebuild both leaves (sorted by hash) from a copy of the full one.
+  struct trfs_directory_leaf* const upper = (void*) upper_head->b_data;
+  memcpy(copy, leaf, be32_to_cpu(leaf->used));
+  trfs_directory_init_leaf(leaf);
+  trfs_directory_init_leaf(upper);
+
+  for (uint32_t index = 0; index < slot_count; ++index) {
+    struct trfs_directory_leaf* const target = index < split ? leaf : upper;
+    struct trfs_directory_entry const* const source = copy + slots[index].offset;
+    uint32_t const size = TRFS_DIRECTORY_ENTRY_SIZE(source->name_length);
+    uint32_t const used = be32_to_cpu(target->used);
+
+    memcpy((void*) target + used, source, size);
+    target->used = cpu_to_be32(used + size);
+    be32_add_cpu(&target->count, 1);
+  }
+
+  mark_buffer_dirty(path->leaf);
+  mark_buffer_dirty(upper_head);
+  brelse(upper_head);
+
+cleanup:
+  kfree(copy);
+  kfree(slots);
+  return error;
+}
+
+///
+/// Appends an entry to a leaf.
+///
+/// @pre The leaf has room for the entry.
+///
+static void trfs_directory_append(
+  struct trfs_directory_leaf* const leaf,
+  struct qstr const* const name,
+  uint32_t const hash,
+  uint32_t const ino,
+  uint8_t const type
+) {
+  uint32_t const size = TRFS_DIRECTORY_ENTRY_SIZE(name->len);
+  uint32_t const used = be32_to_cpu(leaf->used);
+  struct trfs_directory_entry* const entry = (void*) leaf + used;
+
+  memset(entry, 0, size);
+  entry->inode = cpu_to_be32(ino);
+  entry->hash = cpu_to_be32(hash);
+  entry->name_length = name->len;
+  entry->type = type;
+  memcpy(entry->name, name->name, name->len);
+
+  leaf->used = cpu_to_be32(used + size);
+  be32_add_cpu(&leaf->count, 1);
+}
+
+///
+/// Adds an entry to the leaf of an inline directory.
+///
+/// @return -ENOSPC when the entry does not fit in the inode.
+///
+static int trfs_directory_add_inline(
+  struct inode* const directory,
+  struct qstr const* const name,
+  uint32_t const hash,
+  uint32_t const ino,
+  uint8_t const type
+) {
+  uint32_t const size = TRFS_DIRECTORY_ENTRY_SIZE(name->len);
+  struct buffer_head* buffer_head;
+  struct trfs_directory_leaf* leaf;
+  bool const empty = directory->i_size == 0;
+
+  if (empty) {
+    if (sizeof(struct trfs_directory_leaf) + size > TRFS_INODE_INLINE_SIZE) {
+      return -ENOSPC;
+    }
+
+    struct trfs_inode* const record = trfs_get_inode_record(
+      directory->i_sb, directory->i_ino, &buffer_head
+    );
+
+    if (IS_ERR(record)) {
+      return PTR_ERR(record);
+    }
+
+    leaf = (void*) record->inline_data;
+  }
+  else {
+    leaf = trfs_directory_read_inline(directory, &buffer_head);
+    if (IS_ERR(leaf)) {
+      return PTR_ERR(leaf);
+    }
+
+    if (be32_to_cpu(leaf->used) + size > TRFS_INODE_INLINE_SIZE) {
+      brelse(buffer_head);
+      return -ENOSPC;
+    }
+  }
+
+  // The block holds the records of other inodes, written back concurrently
+  // (see trfs_write_inode()): the leaf is only written to disk whole.
+  lock_buffer(buffer_head);
+  if (empty) {
+    trfs_directory_init_leaf(leaf);
+  }
+
+  trfs_directory_append(leaf, name, hash, ino, type);
+  unlock_buffer(buffer_head);
+
+  mark_buffer_dirty(buffer_head);
+  brelse(buffer_head);
+
+  if (empty) {
+    i_size_write(directory, TRFS_INODE_INLINE_SIZE);
+    mark_inode_dirty(directory);
+  }
+
+  return 0;
+}
+
+///
+/// Moves the entries of an inline directory to a (block) leaf.
+///
+static int trfs_directory_uninline(
+  struct inode* const directory
+) {
+  struct buffer_head* buffer_head;
+  int error = 0;
+
+  if (directory->i_size > 0) {
+    struct trfs_directory_leaf* const leaf = trfs_directory_read_inline(directory, &buffer_head);
+    if (IS_ERR(leaf)) {
+      return PTR_ERR(leaf);
+    }
+
+    struct trfs_directory_leaf* const copy = kmemdup(leaf, TRFS_INODE_INLINE_SIZE, GFP_NOFS);
+    brelse(buffer_head);
+
+    if (copy == NULL) {
+      return -ENOMEM;
+    }
+
+    // Blocks are appended from logical block 0.
+    i_size_write(directory, 0);
+    if ((error = trfs_directory_init(directory, copy))) {
+      // The blocks mapped so far are freed, the entries are still inline.
+      i_size_write(directory, 0);
+      trfs_truncate_blocks(directory);
+      i_size_write(directory, TRFS_INODE_INLINE_SIZE);
+      mark_inode_dirty(directory);
+    }
+
+    kfree(copy);
+  }
+
+  if (!error) {
+    trfs_clear_inline_flag(directory);
+  }
+
+  return error;
+}
+
+///
+/// Adds an entry to a directory.
+///
+/// @pre The name is not in the directory yet.
+/// @pre The directory i_rwsem is held exclusively.
+///
+int trfs_directory_add(
+  struct inode* const directory,
+  struct qstr const* const name,
+  uint32_t const ino,
+  uint8_t const type
+) {
+  struct super_block* const super_block = directory->i_sb;
+  uint32_t const hash = trfs_directory_hash(super_block, name->name, name->len);
+  uint32_t const size = TRFS_DIRECTORY_ENTRY_SIZE(name->len);
+  struct trfs_directory_path path;
+  int error;
+
+  if (trfs_inode_is_inline(directory)) {
+    error = trfs_directory_add_inline(directory, name, hash, ino, type);
+    if (error != -ENOSPC) {
+      return error;
+    }
+
+    if ((error = trfs_directory_uninline(directory))) {
+      return error;
+    }
+  }
+
+  if (directory->i_size == 0 && (error = trfs_directory_init(directory, NULL))) {
+    return error;
+  }
+
+  // A split makes room in one of the two halves, but the new entry may belong
+  // to the full one when the split point is not in the middle.
+  for (;;) {
+    if ((error = trfs_directory_walk(directory, hash, &path))) {
+      return error;
+    }
+
+    struct trfs_directory_leaf* const leaf = (void*) path.leaf->b_data;
+    uint32_t const used = be32_to_cpu(leaf->used);
+
+    if (used + size <= super_block->s_blocksize) {
+      trfs_directory_append(leaf, name, hash, ino, type);
+      mark_buffer_dirty(path.leaf);
+      break;
+    }
+
+    error = trfs_directory_split_leaf(directory, &path);
+    trfs_directory_release_path(&path);
+
+    if (error) {
+      return error;
+    }
+  }
+
+  trfs_directory_release_path(&path);
+  return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef TRFS_DIRECTORY_H
+#define TRFS_DIRECTORY_H
+
+#include <linux/types.h>
+
+struct dir_context;
+struct file;
+struct inode;
+struct qstr;
+struct super_block;
+
+uint32_t trfs_directory_hash(
+  struct super_block const* const super_block,
+  char const* const name,
+  unsigned int const length
+);
+
+int trfs_directory_lookup(
+  struct inode* const directory,
+  struct qstr const* const name,
+  uint32_t* const ino
+);
+
+int trfs_directory_add(
+  struct inode* const directory,
+  struct qstr const* const name,
+  uint32_t const ino,
+  uint8_t const type
+);
+
+int trfs_directory_emit(
+  struct file* const file,
+  struct dir_context* const context
+);
+
+#endif // TRFS_DIRECTORY_H
@@ -0,0 +1,1796 @@
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/list.h>
+#include <linux/minmax.h>
+#include <linux/rbtree.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+
+#include "trfs/alloc.h"
+#include "trfs/extent.h"
+#include "trfs/inode.h"
+#include "trfs/printk.h"
+#include "trfs/refcount.h"
+#include "trfs/stats.h"
+#include "trfs/super.h"
+
+// Extent Trees:
+// The extents of a file are the leaves of a B+tree rooted in its inode (see
+// trfs/super.h). Mapping a block reads one node per level, so that a random
+// access to a heavily fragmented file costs at most TRFS_EXTENT_MAX_DEPTH
+// block reads (nodes stay in the buffer cache). Small files keep their extents
+// in the root and never read a node.
+//
+// Index keys are never updated: the key of a node only bounds it from below,
+// and a hole returned by trfs_lookup_extent() never crosses the key of the
+// next node, so that an extent inserted in a hole never crosses one either.
+// https://docs.kernel.org/filesystems/ext4/dynamic.html#extent-tree
+
+// ╔═╗┌─┐┌┬┐┬ ┬┌─┐
+// ╠═╝├─┤ │ ├─┤└─┐
+// ╩  ┴ ┴ ┴ ┴ ┴└─┘
+
+/// Extents and index entries have the same size (and start with their key).
+#define TRFS_EXTENT_ENTRY_SIZE sizeof(struct trfs_extent)
+
+///
+/// The nodes from the root of an extent tree down to the leaf holding a
+/// logical block.
+///
+struct trfs_extent_path {
+  /// The depth of the tree, levels[depth] is the leaf.
+  uint32_t depth;
+
+  /// The key of the node following the leaf (past the last logical block when
+  /// there is none), the leaf does not map blocks from there.
+  uint64_t end;
+
+  struct {
+    /// The node (NULL for the root, which is in the inode info).
+    struct buffer_head* buffer_head;
+
+    /// For an index, the entry leading to the next level. For the leaf, the
+    /// number of extents starting at or before the logical block.
+    uint32_t position;
+  } levels[TRFS_EXTENT_MAX_DEPTH + 1];
+};
+
+///
+/// Returns the number of entries a node of the given level can hold.
+///
+static uint32_t trfs_extent_capacity(
+  struct inode const* const inode,
+  struct trfs_extent_path const* const path,
+  uint32_t const level
+) {
+  if (level > 0) {
+    return (uint32_t) (
+      (inode->i_sb->s_blocksize - sizeof(struct trfs_extent_node)) / TRFS_EXTENT_ENTRY_SIZE
+    );
+  }
+
+  return path->depth > 0
+    ? TRFS_INODE_INDEX_ENTRIES
+    : trfs_mount_info(inode->i_sb)->inode_extents;
+}
+
+static void* trfs_path_entries(
+  struct inode* const inode,
+  struct trfs_extent_path const* const path,
+  uint32_t const level
+) {
+  return level == 0
+    ? (void*) &trfs_inode_info(inode)->extent_root
+    : path->levels[level].buffer_head->b_data + sizeof(struct trfs_extent_node);
+}
+
+static uint32_t trfs_path_count(
+  struct inode* const inode,
+  struct trfs_extent_path const* const path,
+  uint32_t const level
+) {
+  if (level == 0) {
+    return trfs_inode_info(inode)->extent_count;
+  }
+
+  struct trfs_extent_node const* const node = (void*) path->levels[level].buffer_head->b_data;
+  return be16_to_cpu(node->count);
+}
+
+///
+/// Marks the node of the given level dirty (the root is written with the
+/// inode, which the callers mark dirty).
+///
+static void trfs_dirty_path_node(
+  struct inode* const inode,
+  struct trfs_extent_path const* const path,
+  uint32_t const level
+) {
+  if (level > 0) {
+    // Written by fsync(2) along with the data (see generic_file_fsync()).
+    mark_buffer_dirty_inode(path->levels[level].buffer_head, inode);
+  }
+}
+
+static void trfs_set_path_count(
+  struct inode* const inode,
+  struct trfs_extent_path const* const path,
+  uint32_t const level,
+  uint32_t const count
+) {
+  if (level == 0) {
+    trfs_inode_info(inode)->extent_count = count;
+    return;
+  }
+
+  struct trfs_extent_node* const node = (void*) path->levels[level].buffer_head->b_data;
+  node->count = cpu_to_be16((uint16_t) count);
+  trfs_dirty_path_node(inode, path, level);
+}
+
+static uint32_t trfs_entry_logical(
+  void const* const entries,
+  uint32_t const index
+) {
+  return be32_to_cpu(((struct trfs_extent const*) entries)[index].logical);
+}
+
+static void trfs_get_extent(
+  void const* const entries,
+  uint32_t const index,
+  struct trfs_extent* const extent
+) {
+  struct trfs_extent const* const entry = (struct trfs_extent const*) entries + index;
+
+  extent->logical = be32_to_cpu(entry->logical);
+  extent->length = be32_to_cpu(entry->length);
+  extent->start = be64_to_cpu(entry->start);
+}
+
+static void trfs_set_extent(
+  void* const entries,
+  uint32_t const index,
+  struct trfs_extent const* const extent
+) {
+  struct trfs_extent* const entry = (struct trfs_extent*) entries + index;
+
+  entry->logical = cpu_to_be32(extent->logical);
+  entry->length = cpu_to_be32(extent->length);
+  entry->start = cpu_to_be64(extent->start);
+}
+
+static void trfs_set_index(
+  void* const entries,
+  uint32_t const index,
+  uint32_t const logical,
+  uint64_t const block
+) {
+  struct trfs_extent_index* const entry = (struct trfs_extent_index*) entries + index;
+
+  entry->logical = cpu_to_be32(logical);
+  entry->reserved = 0;
+  entry->block = cpu_to_be64(block);
+}
+
+///
+/// Returns the number of entries whose key is lower than or equal to the given
+/// logical block.
+///
+static uint32_t trfs_upper_bound(
+  void const* const entries,
+  uint32_t const count,
+  uint32_t const logical
+) {
+  uint32_t low = 0;
+  uint32_t high = count;
+
+  while (low < high) {
+    uint32_t const middle = low + (high - low) / 2;
+
+    if (trfs_entry_logical(entries, middle) <= logical) {
+      low = middle + 1;
+    }
+    else {
+      high = middle;
+    }
+  }
+
+  return low;
+}
+
+///
+/// Reads a node of the extent tree of the given inode and checks its header.
+///
+/// @return A buffer (release with brelse()) or an ERR_PTR().
+///
+static struct buffer_head* trfs_read_extent_node(
+  struct inode* const inode,
+  uint64_t const block,
+  uint32_t const depth
+) {
+  struct super_block* const super_block = inode->i_sb;
+
+  struct buffer_head* const buffer_head = sb_bread(super_block, block);
+  if (!buffer_head) {
+    TRFS_ERROR("Could not read extent node [%llu] of inode [%lu].\n", block, inode->i_ino);
+    return ERR_PTR(-EIO);
+  }
+
+  struct trfs_extent_node const* const node = (void*) buffer_head->b_data;
+  uint32_t const capacity = (uint32_t) (
+    (super_block->s_blocksize - sizeof(struct trfs_extent_node)) / TRFS_EXTENT_ENTRY_SIZE
+  );
+
+  if (
+    be32_to_cpu(node->magic) != TRFS_EXTENT_NODE_MAGIC
+    || be16_to_cpu(node->depth) != depth
+    || be16_to_cpu(node->count) > capacity
+    || be32_to_cpu(node->inode) != inode->i_ino
+  ) {
+    TRFS_ERROR("Extent node [%llu] of inode [%lu] is corrupted.\n", block, inode->i_ino);
+    brelse(buffer_head);
+    return ERR_PTR(-EIO);
+  }
+
+  return buffer_head;
+}
+
+static void trfs_release_extent_path(
+  struct trfs_extent_path* const path
+) {
+  for (uint32_t level = 1; level <= path->depth; ++level) {
+    brelse(path->levels[level].buffer_head);
+    path->levels[level].buffer_head = NULL;
+  }
+}
+
+///
+/// Reads the nodes from the root down to the leaf holding the given logical
+/// block (or the hole it is in).
+///
+/// @pre Mapping lock is held.
+///
+static int trfs_find_extent_path(
+  struct inode* const inode,
+  uint32_t const logical,
+  struct trfs_extent_path* const path
+) {
+  path->depth = trfs_inode_info(inode)->extent_depth;
+  path->end = (uint64_t) U32_MAX + 1;
+
+  for (uint32_t level = 0; level <= path->depth; ++level) {
+    path->levels[level].buffer_head = NULL;
+  }
+
+  for (uint32_t level = 0; level < path->depth; ++level) {
+    void const* const entries = trfs_path_entries(inode, path, level);
+    uint32_t const count = trfs_path_count(inode, path, level);
+
+    if (count == 0) {
+      TRFS_ERROR("Inode [%lu] has an empty extent index.\n", inode->i_ino);
+      trfs_release_extent_path(path);
+      return -EIO;
+    }
+
+    // The first child also covers the blocks before its key.
+    uint32_t const bound = trfs_upper_bound(entries, count, logical);
+    uint32_t const child = bound > 0 ? bound - 1 : 0;
+
+    if (child + 1 < count) {
+      path->end = min_t(uint64_t, path->end, trfs_entry_logical(entries, child + 1));
+    }
+
+    struct buffer_head* const buffer_head = trfs_read_extent_node(
+      inode,
+      be64_to_cpu(((struct trfs_extent_index const*) entries)[child].block),
+      path->depth - level - 1
+    );
+
+    if (IS_ERR(buffer_head)) {
+      trfs_release_extent_path(path);
+      return PTR_ERR(buffer_head);
+    }
+
+    path->levels[level].position = child;
+    path->levels[level + 1].buffer_head = buffer_head;
+  }
+
+  path->levels[path->depth].position = trfs_upper_bound(
+    trfs_path_entries(inode, path, path->depth),
+    trfs_path_count(inode, path, path->depth),
+    logical
+  );
+
+  return 0;
+}
+
+// ╔═╗┌─┐┌─┐┬ ┬┌─┐
+// ║  ├─┤│  ├─┤├┤
+// ╚═╝┴ ┴└─┘┴ ┴└─┘
+
+// Extent Cache:
+// Extents found in the nodes of a tree are remembered by the inode, so that
+// mapping the same blocks again does not go through the buffer cache. Cached
+// extents may be shorter than the extents of the tree (the tree merges new
+// extents with their neighbours) but never map a block differently: they are
+// forgotten when their extent is removed or truncated.
+//
+// The cached extents of a mount are kept on an LRU list, trimmed by a
+// shrinker under memory pressure. Lookups only flag the extents they hit, so
+// that they do not take the lock of the list: the shrinker gives flagged
+// extents a second chance.
+
+struct trfs_cached_extent {
+  /// In trfs_inode_info::cached_extents.
+  struct rb_node node;
+
+  /// In trfs_mount_info::extent_cache_lru.
+  struct list_head lru;
+
+  struct trfs_inode_info* owner;
+
+  /// The extent, in CPU byte order.
+  struct trfs_extent extent;
+
+  /// The number of logical blocks mapped by the extent.
+  uint32_t span;
+
+  /// Hit since the shrinker last saw it.
+  bool referenced;
+};
+
+static struct kmem_cache* trfs_cached_extent_cache = NULL;
+
+int trfs_extent_cache_init(void) {
+  trfs_cached_extent_cache = KMEM_CACHE(trfs_cached_extent, SLAB_RECLAIM_ACCOUNT);
+
+  if (trfs_cached_extent_cache == NULL) {
+    TRFS_ERROR("Could not create the extent cache.\n");
+    return -ENOMEM;
+  }
+
+  return 0;
+}
+
+void trfs_extent_cache_exit(void) {
+  kmem_cache_destroy(trfs_cached_extent_cache);
+  trfs_cached_extent_cache = NULL;
+}
+
+static bool trfs_cached_extent_less(
+  struct rb_node* const node,
+  struct rb_node const* const other
+) {
+  return rb_entry(node, struct trfs_cached_extent, node)->extent.logical
+    < rb_entry(other, struct trfs_cached_extent, node)->extent.logical;
+}
+
+///
+/// Returns the first cached extent overlapping [logical, end), NULL when
+/// there is none.
+///
+/// @pre The cache lock of the inode is held.
+///
+static struct trfs_cached_extent* trfs_find_cached_extent(
+  struct trfs_inode_info const* const info,
+  uint32_t const logical,
+  uint64_t const end
+) {
+  struct rb_node* node = info->cached_extents.rb_node;
+  struct trfs_cached_extent* found = NULL;
+
+  // The first extent ending after logical (cached extents never overlap).
+  while (node != NULL) {
+    struct trfs_cached_extent* const cached = rb_entry(node, struct trfs_cached_extent, node);
+
+    if ((uint64_t) cached->extent.logical + cached->span <= logical) {
+      node = node->rb_right;
+    }
+    else {
+      found = cached;
+      node = node->rb_left;
+    }
+  }
+
+  return found != NULL && found->extent.logical < end ? found : NULL;
+}
+
+///
+/// Removes a cached extent from its inode and from the LRU list, and frees it.
+///
+/// @pre The cache lock of the inode is held for writing.
+///
+static void trfs_forget_cached_extent(
+  struct trfs_mount_info* const mount_info,
+  struct trfs_cached_extent* const cached
+) {
+  rb_erase(&cached->node, &cached->owner->cached_extents);
+
+  spin_lock(&mount_info->extent_cache_lock);
+  list_del(&cached->lru);
+  --mount_info->extent_cache_count;
+  spin_unlock(&mount_info->extent_cache_lock);
+
+  kmem_cache_free(trfs_cached_extent_cache, cached);
+}
+
+///
+/// Forgets the cached extents overlapping [logical, end).
+///
+/// @pre Mapping lock is held for writing, or the inode is being evicted.
+///
+static void trfs_forget_cached_extents(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint64_t const end
+) {
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+  struct trfs_mount_info* const mount_info = trfs_mount_info(inode->i_sb);
+  struct trfs_cached_extent* cached;
+
+  // Extents are only added under the mapping lock, the shrinker only removes.
+  if (RB_EMPTY_ROOT(&info->cached_extents)) {
+    return;
+  }
+
+  write_lock(&info->cache_lock);
+
+  while ((cached = trfs_find_cached_extent(info, logical, end)) != NULL) {
+    trfs_forget_cached_extent(mount_info, cached);
+  }
+
+  write_unlock(&info->cache_lock);
+}
+
+///
+/// Remembers an extent found in the tree, replacing the shorter versions of it
+/// that may be cached. Nothing is cached when memory is short.
+///
+/// @pre Mapping lock is held.
+///
+static void trfs_cache_extent(
+  struct inode* const inode,
+  struct trfs_extent const* const extent,
+  uint32_t const span
+) {
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+  struct trfs_mount_info* const mount_info = trfs_mount_info(inode->i_sb);
+  struct trfs_cached_extent* overlap;
+
+  struct trfs_cached_extent* const cached = kmem_cache_alloc(trfs_cached_extent_cache, GFP_NOFS);
+  if (cached == NULL) {
+    return;
+  }
+
+  cached->owner = info;
+  cached->extent = *extent;
+  cached->span = span;
+  cached->referenced = false;
+
+  write_lock(&info->cache_lock);
+
+  while ((overlap = trfs_find_cached_extent(info, extent->logical, (uint64_t) extent->logical + span))) {
+    trfs_forget_cached_extent(mount_info, overlap);
+  }
+
+  rb_add(&cached->node, &info->cached_extents, trfs_cached_extent_less);
+
+  spin_lock(&mount_info->extent_cache_lock);
+  list_add_tail(&cached->lru, &mount_info->extent_cache_lru);
+  ++mount_info->extent_cache_count;
+  spin_unlock(&mount_info->extent_cache_lock);
+
+  write_unlock(&info->cache_lock);
+}
+
+///
+/// Copies the cached extent mapping the given logical block to *extent (see
+/// trfs_lookup_extent()).
+///
+/// @return false when the block is not cached.
+///
+static bool trfs_lookup_cached_extent(
+  struct inode* const inode,
+  uint32_t const logical,
+  struct trfs_extent* const extent,
+  uint32_t* const count
+) {
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+
+  read_lock(&info->cache_lock);
+
+  struct trfs_cached_extent* const cached = trfs_find_cached_extent(info, logical, (uint64_t) logical + 1);
+  if (cached != NULL) {
+    *extent = cached->extent;
+
+    if (count != NULL) {
+      *count = min(*count, cached->span - (logical - extent->logical));
+    }
+
+    if (!READ_ONCE(cached->referenced)) {
+      WRITE_ONCE(cached->referenced, true);
+    }
+  }
+
+  read_unlock(&info->cache_lock);
+
+  trfs_count(
+    inode->i_sb, cached != NULL ? TRFS_COUNTER_EXTENT_CACHE_HITS : TRFS_COUNTER_EXTENT_CACHE_MISSES, 1
+  );
+  return cached != NULL;
+}
+
+///
+/// Forgets all the cached extents of an inode, before it is freed.
+///
+void trfs_drop_extent_cache(
+  struct inode* const inode
+) {
+  trfs_forget_cached_extents(inode, 0, (uint64_t) U32_MAX + 1);
+}
+
+static unsigned long trfs_count_extent_cache(
+  struct shrinker* const shrinker,
+  struct shrink_control* const control
+) {
+  struct trfs_mount_info const* const mount_info = container_of(
+    shrinker, struct trfs_mount_info, extent_cache_shrinker
+  );
+
+  unsigned long const count = READ_ONCE(mount_info->extent_cache_count);
+  if (count == 0) {
+    return SHRINK_EMPTY;
+  }
+
+  // As vfs_cache_pressure: 0 keeps the extents, above 100 reclaims them sooner.
+  return mult_frac(count, READ_ONCE(mount_info->extent_cache_pressure), 100);
+}
+
+///
+/// Frees up to nr_to_scan cached extents, oldest first. The cache lock of an
+/// inode is taken after the lock of the list (the other way around
+/// elsewhere), extents whose inode is busy are skipped.
+///
+static unsigned long trfs_scan_extent_cache(
+  struct shrinker* const shrinker,
+  struct shrink_control* const control
+) {
+  struct trfs_mount_info* const mount_info = container_of(
+    shrinker, struct trfs_mount_info, extent_cache_shrinker
+  );
+
+  unsigned long freed = 0;
+  LIST_HEAD(dispose);
+
+  spin_lock(&mount_info->extent_cache_lock);
+
+  for (unsigned long scanned = 0; scanned < control->nr_to_scan; ++scanned) {
+    if (list_empty(&mount_info->extent_cache_lru)) {
+      break;
+    }
+
+    struct trfs_cached_extent* const cached = list_first_entry(
+      &mount_info->extent_cache_lru, struct trfs_cached_extent, lru
+    );
+
+    if (READ_ONCE(cached->referenced) || !write_trylock(&cached->owner->cache_lock)) {
+      WRITE_ONCE(cached->referenced, false);
+      list_move_tail(&cached->lru, &mount_info->extent_cache_lru);
+      continue;
+    }
+
+    rb_erase(&cached->node, &cached->owner->cached_extents);
+    write_unlock(&cached->owner->cache_lock);
+
+    list_move(&cached->lru, &dispose);
+    --mount_info->extent_cache_count;
+    ++freed;
+  }
+
+  spin_unlock(&mount_info->extent_cache_lock);
+
+  struct trfs_cached_extent* cached;
+  struct trfs_cached_extent* next;
+
+  list_for_each_entry_safe(cached, next, &dispose, lru) {
+    kmem_cache_free(trfs_cached_extent_cache, cached);
+  }
+
+  return freed;
+}
+
+///
+/// Sets up the extent cache of a mount.
+///
+int trfs_register_extent_cache(
+  struct super_block* const super_block
+) {
+  struct trfs_mount_info* const mount_info = trfs_mount_info(super_block);
+
+  INIT_LIST_HEAD(&mount_info->extent_cache_lru);
+  spin_lock_init(&mount_info->extent_cache_lock);
+  mount_info->extent_cache_count = 0;
+  mount_info->extent_cache_pressure = TRFS_DEFAULT_EXTENT_CACHE_PRESSURE;
+
+  mount_info->extent_cache_shrinker.count_objects = trfs_count_extent_cache;
+  mount_info->extent_cache_shrinker.scan_objects = trfs_scan_extent_cache;
+  mount_info->extent_cache_shrinker.seeks = DEFAULT_SEEKS;
+
+  return register_shrinker(&mount_info->extent_cache_shrinker, "trfs-extents:%s", super_block->s_id);
+}
+
+///
+/// Tears down the extent cache of a mount, once all its inodes are evicted.
+/// Also called when trfs_register_extent_cache() failed or was not called.
+///
+void trfs_unregister_extent_cache(
+  struct super_block* const super_block
+) {
+  struct trfs_mount_info* const mount_info = trfs_mount_info(super_block);
+
+  // Does nothing for a shrinker that has not been registered.
+  unregister_shrinker(&mount_info->extent_cache_shrinker);
+}
+
+// ╦  ┌─┐┌─┐┬┌─┬ ┬┌─┐
+// ║  │ ││ │├┴┐│ │├─┘
+// ╩═╝└─┘└─┘┴ ┴└─┘┴
+
+///
+/// Returns the number of logical blocks mapped by an extent, a compressed
+/// extent maps a whole cluster whatever its number of physical blocks.
+///
+uint32_t trfs_extent_span(
+  struct inode const* const inode,
+  struct trfs_extent const* const extent
+) {
+  return trfs_extent_compression(extent) != TRFS_COMPRESS_NONE
+    ? trfs_cluster_blocks(inode)
+    : trfs_extent_blocks(extent);
+}
+
+///
+/// Copies the extent mapping the given logical block to *extent (in CPU byte
+/// order), its length is 0 for a hole.
+///
+/// When count is not NULL, it is lowered to the number of blocks from logical
+/// onwards that are in the extent (or that are a hole).
+///
+/// @pre Mapping lock is held.
+///
+int trfs_lookup_extent(
+  struct inode* const inode,
+  uint32_t const logical,
+  struct trfs_extent* const extent,
+  uint32_t* const count
+) {
+  struct trfs_extent_path path;
+
+  // A root holding the extents is already in memory.
+  bool const cached = trfs_inode_info(inode)->extent_depth > 0;
+  if (cached && trfs_lookup_cached_extent(inode, logical, extent, count)) {
+    return 0;
+  }
+
+  int const error = trfs_find_extent_path(inode, logical, &path);
+  if (error) {
+    return error;
+  }
+
+  void const* const entries = trfs_path_entries(inode, &path, path.depth);
+  uint32_t const position = path.levels[path.depth].position;
+
+  if (position > 0) {
+    trfs_get_extent(entries, position - 1, extent);
+    uint32_t const span = trfs_extent_span(inode, extent);
+
+    if (logical - extent->logical < span) {
+      if (count != NULL) {
+        *count = min(*count, span - (logical - extent->logical));
+      }
+
+      if (cached) {
+        trfs_cache_extent(inode, extent, span);
+      }
+
+      goto release;
+    }
+  }
+
+  // A hole, up to the next extent or the next leaf.
+  uint64_t const next = position < trfs_path_count(inode, &path, path.depth)
+    ? trfs_entry_logical(entries, position)
+    : path.end;
+
+  if (count != NULL) {
+    *count = (uint32_t) min_t(uint64_t, *count, next - logical);
+  }
+
+  *extent = (struct trfs_extent) { .logical = logical };
+
+release:
+  trfs_release_extent_path(&path);
+  return 0;
+}
+
+///
+/// Copies the last extent starting before the given logical block to *extent,
+/// its length is 0 when there is none in the leaf holding the block.
+///
+/// @pre Mapping lock is held.
+///
+int trfs_lookup_previous_extent(
+  struct inode* const inode,
+  uint32_t const logical,
+  struct trfs_extent* const extent
+) {
+  struct trfs_extent_path path;
+  *extent = (struct trfs_extent) { 0 };
+
+  if (logical == 0) {
+    return 0;
+  }
+
+  int const error = trfs_find_extent_path(inode, logical - 1, &path);
+  if (error) {
+    return error;
+  }
+
+  uint32_t const position = path.levels[path.depth].position;
+  if (position > 0) {
+    trfs_get_extent(trfs_path_entries(inode, &path, path.depth), position - 1, extent);
+  }
+
+  trfs_release_extent_path(&path);
+  return 0;
+}
+
+// ╦┌┐┌┌─┐┌─┐┬─┐┌┬┐
+// ║│││└─┐├┤ ├┬┘ │
+// ╩┘└┘└─┘└─┘┴└─ ┴
+
+///
+/// Allocates an empty node of the given depth, near the inode table of the
+/// inode. The node is counted in the blocks of the inode.
+///
+/// @return A dirty buffer (release with brelse()) or an ERR_PTR().
+///
+static struct buffer_head* trfs_new_extent_node(
+  struct inode* const inode,
+  uint32_t const depth
+) {
+  struct super_block* const super_block = inode->i_sb;
+  struct trfs_mount_info const* const mount_info = trfs_mount_info(super_block);
+  uint64_t const goal = trfs_group_data_block(
+    &mount_info->super, trfs_inode_group(mount_info, inode->i_ino)
+  );
+  uint64_t block;
+  uint32_t count = 1;
+
+  int const error = trfs_allocate_blocks(super_block, goal, &count, &block, 0);
+  if (error) {
+    return ERR_PTR(error);
+  }
+
+  struct buffer_head* const buffer_head = sb_getblk(super_block, block);
+  if (!buffer_head) {
+    trfs_free_blocks(super_block, block, 1);
+    return ERR_PTR(-ENOMEM);
+  }
+
+  lock_buffer(buffer_head);
+  memset(buffer_head->b_data, 0, super_block->s_blocksize);
+
+  struct trfs_extent_node* const node = (void*) buffer_head->b_data;
+  node->magic = cpu_to_be32(TRFS_EXTENT_NODE_MAGIC);
+  node->depth = cpu_to_be16((uint16_t) depth);
+  node->inode = cpu_to_be32((uint32_t) inode->i_ino);
+
+  set_buffer_uptodate(buffer_head);
+  unlock_buffer(buffer_head);
+  mark_buffer_dirty_inode(buffer_head, inode);
+
+  inode->i_blocks += 1 << (super_block->s_blocksize_bits - 9);
+  return buffer_head;
+}
+
+///
+/// Frees a node left empty, the buffer is released.
+///
+static void trfs_free_extent_node(
+  struct inode* const inode,
+  struct buffer_head* const buffer_head
+) {
+  struct super_block* const super_block = inode->i_sb;
+  uint64_t const block = buffer_head->b_blocknr;
+
+  // The block may be reused for data, the buffer must not be written anymore.
+  bforget(buffer_head);
+
+  trfs_free_blocks(super_block, block, 1);
+  inode->i_blocks -= 1 << (super_block->s_blocksize_bits - 9);
+}
+
+///
+/// Moves the entries of the root to a new node, the root becomes an index
+/// with that single node: the tree is one level deeper.
+///
+/// @return -EFBIG when the tree is already TRFS_EXTENT_MAX_DEPTH deep.
+///
+static int trfs_grow_extent_tree(
+  struct inode* const inode
+) {
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+
+  if (info->extent_depth >= TRFS_EXTENT_MAX_DEPTH) {
+    return -EFBIG;
+  }
+
+  struct buffer_head* const buffer_head = trfs_new_extent_node(inode, info->extent_depth);
+  if (IS_ERR(buffer_head)) {
+    return PTR_ERR(buffer_head);
+  }
+
+  struct trfs_extent_node* const node = (void*) buffer_head->b_data;
+  memcpy(node + 1, &info->extent_root, info->extent_count * TRFS_EXTENT_ENTRY_SIZE);
+  node->count = cpu_to_be16((uint16_t) info->extent_count);
+
+  trfs_set_index(&info->extent_root, 0, 0, buffer_head->b_blocknr);
+  info->extent_count = 1;
+  info->extent_depth += 1;
+  WRITE_ONCE(info->flags, info->flags | TRFS_INODE_EXTENT_TREE);
+
+  brelse(buffer_head);
+
+  // Older drivers would read the root as extents.
+  trfs_set_feature_incompat(inode->i_sb, TRFS_FEATURE_INCOMPAT_EXTENT_TREE);
+  return 0;
+}
+
+///
+/// Moves the upper half of a full node (below the root) to a new node, added
+/// to its parent. A leaf being appended to (append is set and the logical
+/// block is past its last extent) is not split: a new empty leaf is added,
+/// keyed by the logical block being inserted, so that a file written
+/// sequentially ends up with full leaves.
+///
+/// @pre The parent has room for another entry.
+///
+static int trfs_split_extent_node(
+  struct inode* const inode,
+  struct trfs_extent_path const* const path,
+  uint32_t const level,
+  uint32_t const logical,
+  bool const append
+) {
+  void* const entries = trfs_path_entries(inode, path, level);
+  uint32_t const count = trfs_path_count(inode, path, level);
+  bool const appending = append && level == path->depth && path->levels[level].position == count;
+  uint32_t const split = appending ? count : count / 2;
+
+  struct buffer_head* const buffer_head = trfs_new_extent_node(inode, path->depth - level);
+  if (IS_ERR(buffer_head)) {
+    return PTR_ERR(buffer_head);
+  }
+
+  struct trfs_extent_node* const node = (void*) buffer_head->b_data;
+  uint32_t const key = appending ? logical : trfs_entry_logical(entries, split);
+
+  memcpy(node + 1, entries + split * TRFS_EXTENT_ENTRY_SIZE, (count - split) * TRFS_EXTENT_ENTRY_SIZE);
+  node->count = cpu_to_be16((uint16_t) (count - split));
+  trfs_set_path_count(inode, path, level, split);
+
+  // The new node goes right after the split one.
+  void* const parent_entries = trfs_path_entries(inode, path, level - 1);
+  uint32_t const parent_count = trfs_path_count(inode, path, level - 1);
+  uint32_t const position = path->levels[level - 1].position + 1;
+
+  memmove(
+    parent_entries + (position + 1) * TRFS_EXTENT_ENTRY_SIZE,
+    parent_entries + position * TRFS_EXTENT_ENTRY_SIZE,
+    (parent_count - position) * TRFS_EXTENT_ENTRY_SIZE
+  );
+
+  trfs_set_index(parent_entries, position, key, buffer_head->b_blocknr);
+  trfs_set_path_count(inode, path, level - 1, parent_count + 1);
+
+  brelse(buffer_head);
+  return 0;
+}
+
+///
+/// Makes room for another entry in the node of the given level, splitting it
+/// (and its full parents first) or growing the tree when it is the root.
+///
+/// The path is stale afterwards, the insertion has to look it up again. An
+/// extent being split in place (append is not set) stays whole in one node.
+///
+static int trfs_make_extent_room(
+  struct inode* const inode,
+  struct trfs_extent_path const* const path,
+  uint32_t const level,
+  uint32_t const logical,
+  bool const append
+) {
+  if (level == 0) {
+    return trfs_grow_extent_tree(inode);
+  }
+
+  if (trfs_path_count(inode, path, level - 1) >= trfs_extent_capacity(inode, path, level - 1)) {
+    return trfs_make_extent_room(inode, path, level - 1, logical, append);
+  }
+
+  return trfs_split_extent_node(inode, path, level, logical, append);
+}
+
+///
+/// Returns true when the second extent (in CPU byte order) follows the first
+/// one both in the file and on disk, and both can be merged into one extent.
+/// Compressed extents are never merged, unwritten extents only with
+/// unwritten ones.
+///
+static bool trfs_extents_mergeable(
+  struct trfs_extent const* const first,
+  struct trfs_extent const* const second
+) {
+  uint32_t const first_blocks = trfs_extent_blocks(first);
+
+  // Merged lengths have to stay clear of the flag bits.
+  return trfs_extent_compression(first) == TRFS_COMPRESS_NONE
+    && trfs_extent_compression(second) == TRFS_COMPRESS_NONE
+    && trfs_extent_unwritten(first) == trfs_extent_unwritten(second)
+    && first->logical + first_blocks == second->logical
+    && first->start + first_blocks == second->start
+    && first_blocks + trfs_extent_blocks(second) <= TRFS_EXTENT_LENGTH_MASK;
+}
+
+///
+/// Inserts the extent [logical, logical + count) -> physical, merging it with
+/// its neighbours (in the same leaf) when they are contiguous both in the file
+/// and on disk (see trfs_extents_mergeable()).
+///
+/// flags are the high bits of the length of the extent: a compressed extent
+/// (TRFS_COMPRESS_* << TRFS_EXTENT_COMPRESSION_SHIFT) maps a whole cluster to
+/// count physical blocks, the blocks of an unwritten one
+/// (TRFS_EXTENT_UNWRITTEN) read as zeroes.
+///
+/// @return -EFBIG when the tree cannot grow anymore.
+///
+/// @pre Mapping lock is held for writing.
+/// @pre The range is a hole, within the hole returned by trfs_lookup_extent().
+/// @pre count <= TRFS_EXTENT_LENGTH_MASK
+///
+int trfs_insert_extent(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint64_t const physical,
+  uint32_t const count,
+  uint32_t const flags
+) {
+  struct super_block* const super_block = inode->i_sb;
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+  struct trfs_extent const extent = {
+    .logical = logical,
+    .length = count | flags,
+    .start = physical,
+  };
+  struct trfs_extent_path path;
+  int error = 0;
+
+  for (;;) {
+    if ((error = trfs_find_extent_path(inode, logical, &path))) {
+      return error;
+    }
+
+    uint32_t const leaf = path.depth;
+    void* const entries = trfs_path_entries(inode, &path, leaf);
+    uint32_t const leaf_count = trfs_path_count(inode, &path, leaf);
+    uint32_t const position = path.levels[leaf].position;
+    struct trfs_extent previous = { 0 };
+    struct trfs_extent next = { 0 };
+
+    if (position > 0) {
+      trfs_get_extent(entries, position - 1, &previous);
+    }
+
+    if (position < leaf_count) {
+      trfs_get_extent(entries, position, &next);
+    }
+
+    bool const after_previous = position > 0 && trfs_extents_mergeable(&previous, &extent);
+    bool const before_next = position < leaf_count && trfs_extents_mergeable(&extent, &next);
+
+    if (after_previous && before_next
+      && trfs_extent_blocks(&previous) + count + trfs_extent_blocks(&next) <= TRFS_EXTENT_LENGTH_MASK
+    ) {
+      previous.length += count + trfs_extent_blocks(&next);
+      trfs_set_extent(entries, position - 1, &previous);
+
+      memmove(
+        entries + position * TRFS_EXTENT_ENTRY_SIZE,
+        entries + (position + 1) * TRFS_EXTENT_ENTRY_SIZE,
+        (leaf_count - position - 1) * TRFS_EXTENT_ENTRY_SIZE
+      );
+
+      trfs_set_path_count(inode, &path, leaf, leaf_count - 1);
+    }
+    else if (after_previous) {
+      previous.length += count;
+      trfs_set_extent(entries, position - 1, &previous);
+      trfs_dirty_path_node(inode, &path, leaf);
+    }
+    else if (before_next) {
+      next.logical = logical;
+      next.start = physical;
+      next.length += count;
+      trfs_set_extent(entries, position, &next);
+      trfs_dirty_path_node(inode, &path, leaf);
+    }
+    else if (leaf_count < trfs_extent_capacity(inode, &path, leaf)) {
+      memmove(
+        entries + (position + 1) * TRFS_EXTENT_ENTRY_SIZE,
+        entries + position * TRFS_EXTENT_ENTRY_SIZE,
+        (leaf_count - position) * TRFS_EXTENT_ENTRY_SIZE
+      );
+
+      trfs_set_extent(entries, position, &extent);
+      trfs_set_path_count(inode, &path, leaf, leaf_count + 1);
+    }
+    else {
+      error = trfs_make_extent_room(inode, &path, leaf, logical, true);
+      trfs_release_extent_path(&path);
+
+      if (error) {
+        // The tree may have been split or grown already.
+        mark_inode_dirty(inode);
+        return error;
+      }
+
+      continue;
+    }
+
+    trfs_release_extent_path(&path);
+    break;
+  }
+
+  if (trfs_extent_compression(&extent) != TRFS_COMPRESS_NONE) {
+    WRITE_ONCE(info->flags, info->flags | TRFS_INODE_COMPRESSED);
+  }
+
+  // Older drivers would read unwritten blocks as data.
+  if (trfs_extent_unwritten(&extent)) {
+    trfs_set_feature_incompat(super_block, TRFS_FEATURE_INCOMPAT_UNWRITTEN);
+  }
+
+  inode->i_blocks += (blkcnt_t) count << (super_block->s_blocksize_bits - 9);
+  mark_inode_dirty(inode);
+  return 0;
+}
+
+// ╦═╗┌─┐┌┬┐┌─┐┬  ┬┌─┐
+// ╠╦╝├┤ ││││ │└┐┌┘├┤
+// ╩╚═└─┘┴ ┴└─┘ └┘ └─┘
+
+///
+/// Frees the blocks of [start, start + count) unmapped from the inode, the
+/// ones still mapped by other extents are only released (see
+/// trfs/refcount.c).
+///
+static void trfs_free_extent_blocks(
+  struct inode* const inode,
+  uint64_t const start,
+  uint32_t const count
+) {
+  if (READ_ONCE(trfs_inode_info(inode)->flags) & TRFS_INODE_SHARED) {
+    trfs_release_shared_blocks(inode->i_sb, start, count);
+  }
+  else {
+    trfs_free_blocks(inode->i_sb, start, count);
+  }
+}
+
+///
+/// Removes the entry at the given position of the node of the given level. A
+/// node left empty is freed and removed from its parent, an empty root is an
+/// empty leaf again.
+///
+static void trfs_remove_extent_entry(
+  struct inode* const inode,
+  struct trfs_extent_path* const path,
+  uint32_t const level,
+  uint32_t const position
+) {
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+  void* const entries = trfs_path_entries(inode, path, level);
+  uint32_t const count = trfs_path_count(inode, path, level);
+
+  memmove(
+    entries + position * TRFS_EXTENT_ENTRY_SIZE,
+    entries + (position + 1) * TRFS_EXTENT_ENTRY_SIZE,
+    (count - position - 1) * TRFS_EXTENT_ENTRY_SIZE
+  );
+
+  trfs_set_path_count(inode, path, level, count - 1);
+
+  if (count > 1) {
+    return;
+  }
+
+  if (level == 0) {
+    info->extent_depth = 0;
+    WRITE_ONCE(info->flags, info->flags & ~(TRFS_INODE_EXTENT_TREE | TRFS_INODE_COMPRESSED));
+    return;
+  }
+
+  trfs_free_extent_node(inode, path->levels[level].buffer_head);
+  path->levels[level].buffer_head = NULL;
+
+  trfs_remove_extent_entry(inode, path, level - 1, path->levels[level - 1].position);
+}
+
+///
+/// Removes the extent starting at the given logical block and frees its
+/// blocks.
+///
+/// @return -ENOENT when no extent starts there.
+///
+/// @pre Mapping lock is held for writing.
+///
+int trfs_remove_extent(
+  struct inode* const inode,
+  uint32_t const logical
+) {
+  struct super_block* const super_block = inode->i_sb;
+  struct trfs_extent_path path;
+  struct trfs_extent extent;
+
+  int error = trfs_find_extent_path(inode, logical, &path);
+  if (error) {
+    return error;
+  }
+
+  uint32_t const position = path.levels[path.depth].position;
+
+  if (position > 0) {
+    trfs_get_extent(trfs_path_entries(inode, &path, path.depth), position - 1, &extent);
+  }
+
+  if (position == 0 || extent.logical != logical) {
+    error = -ENOENT;
+    goto release;
+  }
+
+  trfs_remove_extent_entry(inode, &path, path.depth, position - 1);
+  trfs_forget_cached_extents(inode, logical, (uint64_t) logical + trfs_extent_span(inode, &extent));
+
+  trfs_free_extent_blocks(inode, extent.start, trfs_extent_blocks(&extent));
+  inode->i_blocks -= (blkcnt_t) trfs_extent_blocks(&extent) << (super_block->s_blocksize_bits - 9);
+  mark_inode_dirty(inode);
+
+release:
+  trfs_release_extent_path(&path);
+  return error;
+}
+
+///
+/// Returns true when one of the logical blocks of [logical, logical + count)
+/// is mapped to the physical block at the same offset from `physical`.
+///
+/// The blocks of a cluster are mapped at a constant distance from their
+/// logical blocks: a cluster is allocated for a run of logical blocks, its
+/// tail only ever extends the run (see trfs_lookup_cluster_tail() in
+/// trfs/inode.c) and splitting an extent keeps the distance. The other users
+/// of a cluster are found that way.
+///
+/// @pre Mapping lock is held.
+///
+static bool trfs_blocks_mapped(
+  struct inode* const inode,
+  uint64_t logical,
+  uint64_t physical,
+  uint64_t count
+) {
+  while (count > 0 && logical <= U32_MAX) {
+    uint32_t run = (uint32_t) min_t(uint64_t, count, U32_MAX);
+    struct trfs_extent extent;
+
+    // An unreadable tree keeps the cluster, leaking it is harmless.
+    if (trfs_lookup_extent(inode, (uint32_t) logical, &extent, &run)) {
+      return true;
+    }
+
+    if (extent.length > 0
+      && trfs_extent_compression(&extent) == TRFS_COMPRESS_NONE
+      && extent.start + (logical - extent.logical) == physical
+    ) {
+      return true;
+    }
+
+    logical += run;
+    physical += run;
+    count -= run;
+  }
+
+  return false;
+}
+
+///
+/// Returns true when other blocks of the cluster holding the given physical
+/// block, before it, are still mapped (the given physical block maps the given
+/// logical block): that cluster must not be freed with the blocks from there.
+///
+/// @pre Mapping lock is held.
+///
+static bool trfs_cluster_precedes(
+  struct inode* const inode,
+  uint64_t const logical,
+  uint64_t const physical
+) {
+  uint32_t const cluster_blocks = trfs_super_cluster_blocks(&trfs_mount_info(inode->i_sb)->super);
+  uint64_t const count = min(physical - round_down(physical, cluster_blocks), logical);
+
+  return trfs_blocks_mapped(inode, logical - count, physical - count, count);
+}
+
+///
+/// Returns true when other blocks of the cluster holding the block before the
+/// given physical block, from it onwards, are still mapped (the given physical
+/// block maps the given logical block): that cluster must not be freed with
+/// the blocks up to there.
+///
+/// @pre Mapping lock is held.
+///
+static bool trfs_cluster_continues(
+  struct inode* const inode,
+  uint64_t const logical,
+  uint64_t const physical
+) {
+  uint32_t const cluster_blocks = trfs_super_cluster_blocks(&trfs_mount_info(inode->i_sb)->super);
+
+  return trfs_blocks_mapped(inode, logical, physical, round_up(physical, cluster_blocks) - physical);
+}
+
+///
+/// Frees the given entries of a node and, for an index, the nodes below.
+/// `previous` is the last extent freed (its length is 0 before the first one),
+/// the extents are freed in logical order.
+///
+/// With clusters, the first cluster of an extent is freed with it unless the
+/// previous extent uses it (see trfs_blocks_mapped()), the last one always is.
+///
+static void trfs_free_extent_entries(
+  struct inode* const inode,
+  void const* const entries,
+  uint32_t const count,
+  uint32_t const depth,
+  struct trfs_extent* const previous
+) {
+  uint32_t const cluster_blocks = trfs_super_cluster_blocks(&trfs_mount_info(inode->i_sb)->super);
+
+  for (uint32_t index = 0; index < count; ++index) {
+    if (depth == 0) {
+      struct trfs_extent extent;
+
+      trfs_get_extent(entries, index, &extent);
+      uint64_t const end = extent.start + trfs_extent_blocks(&extent);
+      uint64_t start = extent.start;
+
+      if (trfs_extent_compression(&extent) == TRFS_COMPRESS_NONE
+        && !(previous->length > 0
+          && trfs_extent_compression(previous) == TRFS_COMPRESS_NONE
+          && previous->start < start
+          && previous->start + trfs_extent_blocks(previous) > round_down(start, cluster_blocks))
+      ) {
+        start = round_down(start, cluster_blocks);
+      }
+
+      trfs_free_extent_blocks(inode, start, (uint32_t) (end - start));
+      *previous = extent;
+      continue;
+    }
+
+    // An unreadable node and the blocks it maps are leaked (and reported).
+    struct buffer_head* const buffer_head = trfs_read_extent_node(
+      inode, be64_to_cpu(((struct trfs_extent_index const*) entries)[index].block), depth - 1
+    );
+
+    if (IS_ERR(buffer_head)) {
+      continue;
+    }
+
+    struct trfs_extent_node const* const node = (void*) buffer_head->b_data;
+    trfs_free_extent_entries(inode, node + 1, be16_to_cpu(node->count), depth - 1, previous);
+    trfs_free_extent_node(inode, buffer_head);
+  }
+}
+
+///
+/// Frees all the blocks of the inode, extents and nodes.
+///
+/// @pre Mapping lock is held for writing, or the inode is being evicted.
+///
+void trfs_free_extents(
+  struct inode* const inode
+) {
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+  struct trfs_extent previous = { 0 };
+
+  trfs_drop_extent_cache(inode);
+  trfs_free_extent_entries(inode, &info->extent_root, info->extent_count, info->extent_depth, &previous);
+
+  info->extent_depth = 0;
+  info->extent_count = 0;
+  WRITE_ONCE(info->flags, info->flags & ~(TRFS_INODE_EXTENT_TREE | TRFS_INODE_COMPRESSED | TRFS_INODE_SHARED));
+  inode->i_blocks = 0;
+}
+
+///
+/// Frees the blocks mapped from the given logical block onwards, the extent
+/// holding it is shortened. A compressed cluster holding it is kept whole.
+///
+/// @pre Mapping lock is held for writing.
+///
+int trfs_truncate_extents(
+  struct inode* const inode,
+  uint64_t const first
+) {
+  struct super_block* const super_block = inode->i_sb;
+  uint32_t const cluster_blocks = trfs_super_cluster_blocks(&trfs_mount_info(super_block)->super);
+  struct trfs_extent_path path;
+  int error = 0;
+
+  if (first == 0) {
+    trfs_free_extents(inode);
+    return 0;
+  }
+
+  if (first <= U32_MAX) {
+    trfs_forget_cached_extents(inode, (uint32_t) first, (uint64_t) U32_MAX + 1);
+  }
+
+  // Extents are sorted, only the last ones can be (partially) past the end.
+  for (;;) {
+    if ((error = trfs_find_extent_path(inode, U32_MAX, &path))) {
+      break;
+    }
+
+    void* const entries = trfs_path_entries(inode, &path, path.depth);
+    uint32_t const count = trfs_path_count(inode, &path, path.depth);
+    struct trfs_extent extent;
+
+    if (count == 0) {
+      trfs_release_extent_path(&path);
+      break;
+    }
+
+    trfs_get_extent(entries, count - 1, &extent);
+
+    if ((uint64_t) extent.logical + trfs_extent_span(inode, &extent) <= first) {
+      trfs_release_extent_path(&path);
+      break;
+    }
+
+    if (extent.logical >= first) {
+      uint64_t start = extent.start;
+
+      // The first cluster goes with the extent unless a previous extent uses
+      // it (it is freed along with that one).
+      if (trfs_extent_compression(&extent) == TRFS_COMPRESS_NONE
+        && !trfs_cluster_precedes(inode, extent.logical, extent.start)
+      ) {
+        start = round_down(start, cluster_blocks);
+      }
+
+      trfs_remove_extent_entry(inode, &path, path.depth, count - 1);
+      trfs_release_extent_path(&path);
+
+      trfs_free_extent_blocks(inode, start, (uint32_t) (extent.start + trfs_extent_blocks(&extent) - start));
+      inode->i_blocks -= (blkcnt_t) trfs_extent_blocks(&extent) << (super_block->s_blocksize_bits - 9);
+      continue;
+    }
+
+    if (trfs_extent_compression(&extent) == TRFS_COMPRESS_NONE) {
+      uint32_t const kept = (uint32_t) (first - extent.logical);
+      uint32_t const freed = trfs_extent_blocks(&extent) - kept;
+
+      trfs_free_extent_blocks(inode, extent.start + kept, freed);
+      inode->i_blocks -= (blkcnt_t) freed << (super_block->s_blocksize_bits - 9);
+
+      extent.length -= freed;
+      trfs_set_extent(entries, count - 1, &extent);
+      trfs_dirty_path_node(inode, &path, path.depth);
+    }
+
+    trfs_release_extent_path(&path);
+    break;
+  }
+
+  mark_inode_dirty(inode);
+  return error;
+}
+
+// ╔═╗┌─┐┬  ┬┌┬┐
+// ╚═╗├─┘│  │ │
+// ╚═╝┴  ┴─┘┴ ┴
+
+// Unwritten Extents:
+// Preallocated blocks (fallocate(2)) are mapped by extents flagged
+// TRFS_EXTENT_UNWRITTEN, which read as zeroes: preallocating only writes the
+// extent tree, never the blocks. Once data has been written to some of them,
+// the extent is split in place (unwritten head and tail, written middle), the
+// same way a hole punched in an extent keeps its head and its tail.
+// Shared blocks copied on write are split the same way, the middle is mapped
+// to the new blocks, unwritten until the copy is on disk (see
+// trfs_remap_extents()).
+
+/// What trfs_split_extents() does to the range.
+enum trfs_split_mode {
+  /// Marks the unwritten blocks written.
+  TRFS_SPLIT_CONVERT,
+
+  /// Frees the blocks.
+  TRFS_SPLIT_PUNCH,
+
+  /// Maps the range to other (unwritten) blocks, the blocks are released.
+  TRFS_SPLIT_REMAP,
+};
+
+///
+/// Replaces the extent at the given position of the leaf by the given pieces
+/// of it (sorted, there may be none), merging the first and the last piece
+/// with the neighbours of the extent when possible (see
+/// trfs_extents_mergeable()).
+///
+/// @pre The leaf has room for the pieces.
+///
+static void trfs_replace_extent(
+  struct inode* const inode,
+  struct trfs_extent_path* const path,
+  uint32_t const position,
+  struct trfs_extent const* pieces,
+  uint32_t count
+) {
+  uint32_t const leaf = path->depth;
+  void* const entries = trfs_path_entries(inode, path, leaf);
+  uint32_t const leaf_count = trfs_path_count(inode, path, leaf);
+  struct trfs_extent neighbour;
+
+  if (count > 0 && position > 0) {
+    trfs_get_extent(entries, position - 1, &neighbour);
+
+    if (trfs_extents_mergeable(&neighbour, &pieces[0])) {
+      neighbour.length += trfs_extent_blocks(&pieces[0]);
+      trfs_set_extent(entries, position - 1, &neighbour);
+      ++pieces;
+      --count;
+    }
+  }
+
+  if (count > 0 && position + 1 < leaf_count) {
+    trfs_get_extent(entries, position + 1, &neighbour);
+
+    if (trfs_extents_mergeable(&pieces[count - 1], &neighbour)) {
+      neighbour.logical = pieces[count - 1].logical;
+      neighbour.start = pieces[count - 1].start;
+      neighbour.length += trfs_extent_blocks(&pieces[count - 1]);
+      trfs_set_extent(entries, position + 1, &neighbour);
+      --count;
+    }
+  }
+
+  if (count == 0) {
+    trfs_remove_extent_entry(inode, path, leaf, position);
+    return;
+  }
+
+  memmove(
+    entries + (position + count) * TRFS_EXTENT_ENTRY_SIZE,
+    entries + (position + 1) * TRFS_EXTENT_ENTRY_SIZE,
+    (leaf_count - position - 1) * TRFS_EXTENT_ENTRY_SIZE
+  );
+
+  for (uint32_t index = 0; index < count; ++index) {
+    trfs_set_extent(entries, position + index, &pieces[index]);
+  }
+
+  trfs_set_path_count(inode, path, leaf, leaf_count + count - 1);
+}
+
+///
+/// Splits the extents overlapping [first, end) at the ends of the range, and
+/// either marks the unwritten blocks in the range written, frees the blocks in
+/// the range (punch) or maps the range to the blocks starting at `physical`
+/// (remap). A compressed extent is only freed when it is wholly in the range,
+/// and never remapped.
+///
+/// @pre Mapping lock is held for writing.
+///
+static int trfs_split_extents(
+  struct inode* const inode,
+  uint32_t const first,
+  uint64_t const end,
+  enum trfs_split_mode const mode,
+  uint64_t const physical
+) {
+  struct super_block* const super_block = inode->i_sb;
+  uint32_t const cluster_blocks = trfs_super_cluster_blocks(&trfs_mount_info(super_block)->super);
+  uint64_t logical = first;
+  int error = 0;
+
+  while (logical < end) {
+    struct trfs_extent_path path;
+    struct trfs_extent extent = { 0 };
+
+    if ((error = trfs_find_extent_path(inode, (uint32_t) logical, &path))) {
+      break;
+    }
+
+    uint32_t const leaf = path.depth;
+    void* const entries = trfs_path_entries(inode, &path, leaf);
+    uint32_t const leaf_count = trfs_path_count(inode, &path, leaf);
+    uint32_t const position = path.levels[leaf].position;
+
+    if (position > 0) {
+      trfs_get_extent(entries, position - 1, &extent);
+    }
+
+    // A hole, up to the next extent or the next leaf.
+    if (position == 0 || logical - extent.logical >= trfs_extent_span(inode, &extent)) {
+      logical = position < leaf_count ? trfs_entry_logical(entries, position) : path.end;
+      trfs_release_extent_path(&path);
+      continue;
+    }
+
+    uint64_t const extent_end = (uint64_t) extent.logical + trfs_extent_span(inode, &extent);
+    uint64_t const to = min(extent_end, end);
+    uint32_t const from = (uint32_t) logical;
+    uint32_t const flags = extent.length & ~TRFS_EXTENT_LENGTH_MASK;
+    bool const compressed = trfs_extent_compression(&extent) != TRFS_COMPRESS_NONE;
+
+    bool const punch = mode == TRFS_SPLIT_PUNCH;
+    bool const skipped = punch
+      ? compressed && (extent.logical < from || extent_end > end)
+      : mode == TRFS_SPLIT_CONVERT ? !trfs_extent_unwritten(&extent) : compressed;
+
+    if (skipped) {
+      logical = extent_end;
+      trfs_release_extent_path(&path);
+      continue;
+    }
+
+    struct trfs_extent pieces[3];
+    uint32_t count = 0;
+
+    if (from > extent.logical) {
+      pieces[count++] = (struct trfs_extent) {
+        .logical = extent.logical,
+        .length = (from - extent.logical) | flags,
+        .start = extent.start,
+      };
+    }
+
+    if (!punch) {
+      pieces[count++] = (struct trfs_extent) {
+        .logical = from,
+        .length = (uint32_t) (to - from) | (mode == TRFS_SPLIT_REMAP ? TRFS_EXTENT_UNWRITTEN : 0),
+        .start = mode == TRFS_SPLIT_REMAP
+          ? physical + (from - first)
+          : extent.start + (from - extent.logical),
+      };
+    }
+
+    if (to < extent_end) {
+      pieces[count++] = (struct trfs_extent) {
+        .logical = (uint32_t) to,
+        .length = (uint32_t) (extent_end - to) | flags,
+        .start = extent.start + (to - extent.logical),
+      };
+    }
+
+    if (count > 1 && leaf_count + count - 1 > trfs_extent_capacity(inode, &path, leaf)) {
+      error = trfs_make_extent_room(inode, &path, leaf, from, false);
+      trfs_release_extent_path(&path);
+
+      if (error) {
+        break;
+      }
+
+      continue;
+    }
+
+    if (punch && compressed) {
+      trfs_free_extent_blocks(inode, extent.start, trfs_extent_blocks(&extent));
+      inode->i_blocks -= (blkcnt_t) trfs_extent_blocks(&extent) << (super_block->s_blocksize_bits - 9);
+    }
+    else if (punch) {
+      uint64_t start = extent.start + (from - extent.logical);
+      uint64_t physical_end = start + (to - from);
+
+      // The first cluster is freed too when nothing else (the head, another
+      // extent) uses it, and the last one is kept when something does.
+      if (cluster_blocks > 1 && !trfs_cluster_precedes(inode, from, start)) {
+        start = round_down(start, cluster_blocks);
+      }
+
+      if (cluster_blocks > 1 && trfs_cluster_continues(inode, to, physical_end)) {
+        physical_end = round_down(physical_end, cluster_blocks);
+      }
+
+      if (physical_end > start) {
+        trfs_free_extent_blocks(inode, start, (uint32_t) (physical_end - start));
+      }
+
+      inode->i_blocks -= (blkcnt_t) (to - from) << (super_block->s_blocksize_bits - 9);
+    }
+    else if (mode == TRFS_SPLIT_REMAP) {
+      trfs_free_extent_blocks(inode, extent.start + (from - extent.logical), (uint32_t) (to - from));
+    }
+
+    trfs_replace_extent(inode, &path, position - 1, pieces, count);
+    trfs_release_extent_path(&path);
+    logical = to;
+  }
+
+  mark_inode_dirty(inode);
+  return error;
+}
+
+///
+/// Marks the blocks of [first, end) written, once their data is on disk. The
+/// written blocks and the holes in the range are left untouched.
+///
+/// @return -EFBIG when the tree cannot grow anymore, the range may then be
+///   partially converted.
+///
+/// @pre Mapping lock is held for writing.
+///
+int trfs_convert_unwritten_extents(
+  struct inode* const inode,
+  uint32_t const first,
+  uint64_t const end
+) {
+  int const error = trfs_split_extents(inode, first, end, TRFS_SPLIT_CONVERT, 0);
+
+  // Also drops the extents cached by the lookups made while splitting.
+  trfs_forget_cached_extents(inode, first, end);
+  return error;
+}
+
+///
+/// Frees the blocks mapped in [first, end), the extents straddling its ends are
+/// shortened. A compressed cluster straddling them is kept whole.
+///
+/// @return -EFBIG when the tree cannot grow anymore, the range may then be
+///   partially freed.
+///
+/// @pre Mapping lock is held for writing.
+///
+int trfs_punch_extents(
+  struct inode* const inode,
+  uint32_t const first,
+  uint64_t const end
+) {
+  int const error = trfs_split_extents(inode, first, end, TRFS_SPLIT_PUNCH, 0);
+
+  // Also drops the extents cached by the lookups made while splitting.
+  trfs_forget_cached_extents(inode, first, end);
+  return error;
+}
+
+///
+/// Maps [first, end) to the blocks starting at the given physical block, the
+/// blocks mapped so far are released (see trfs_unshare_blocks() in
+/// trfs/inode.c). The new blocks are unwritten: they read as zeroes until the
+/// data written to them is on disk (see trfs_convert_unwritten_extents()).
+///
+/// @return -EFBIG when the tree cannot grow anymore, nothing is remapped then.
+///
+/// @pre Mapping lock is held for writing.
+/// @pre [first, end) is mapped by a single extent of written blocks, that is
+///   not compressed.
+///
+int trfs_remap_extents(
+  struct inode* const inode,
+  uint32_t const first,
+  uint64_t const end,
+  uint64_t const physical
+) {
+  int const error = trfs_split_extents(inode, first, end, TRFS_SPLIT_REMAP, physical);
+
+  // Also drops the extents cached by the lookups made while splitting.
+  trfs_forget_cached_extents(inode, first, end);
+  return error;
+}
+
+// ╦═╗┌─┐┌─┐┌┬┐
+// ╠╦╝│ ││ │ │
+// ╩╚═└─┘└─┘ ┴
+
+///
+/// Reads the root of the extent tree of a record. Extents of the root are
+/// kept in the format of the nodes (see TRFS_FEATURE_INCOMPAT_64BIT).
+///
+/// @return -EIO when the root is corrupted.
+///
+int trfs_decode_extent_root(
+  struct super_block* const super_block,
+  struct trfs_inode const* const record,
+  struct trfs_inode_info* const info
+) {
+  struct trfs_mount_info const* const mount_info = trfs_mount_info(super_block);
+  uint32_t const count = be16_to_cpu(record->extent_count);
+
+  info->extent_depth = 0;
+  info->extent_count = 0;
+
+  if (info->flags & TRFS_INODE_INLINE) {
+    return 0;
+  }
+
+  if (info->flags & TRFS_INODE_EXTENT_TREE) {
+    uint32_t const depth = be32_to_cpu(record->extent_root.depth);
+
+    if (depth == 0 || depth > TRFS_EXTENT_MAX_DEPTH || count == 0 || count > TRFS_INODE_INDEX_ENTRIES) {
+      return -EIO;
+    }
+
+    info->extent_depth = depth;
+    info->extent_count = count;
+    memcpy(info->extent_root.index, record->extent_root.entries, count * TRFS_EXTENT_ENTRY_SIZE);
+    return 0;
+  }
+
+  info->extent_count = min(count, mount_info->inode_extents);
+
+  if (mount_info->super.feature_incompat & TRFS_FEATURE_INCOMPAT_64BIT) {
+    memcpy(info->extent_root.extents, record->extents, info->extent_count * TRFS_EXTENT_ENTRY_SIZE);
+  }
+  else {
+    for (uint32_t index = 0; index < info->extent_count; ++index) {
+      info->extent_root.extents[index].logical = record->extents32[index].logical;
+      info->extent_root.extents[index].length = record->extents32[index].length;
+      info->extent_root.extents[index].start = cpu_to_be64(be32_to_cpu(record->extents32[index].start));
+    }
+  }
+
+  // TRFS_INODE_COMPRESSED is only tracked since extent trees.
+  for (uint32_t index = 0; index < info->extent_count; ++index) {
+    if (be32_to_cpu(info->extent_root.extents[index].length) >> TRFS_EXTENT_COMPRESSION_SHIFT) {
+      info->flags |= TRFS_INODE_COMPRESSED;
+    }
+  }
+
+  return 0;
+}
+
+///
+/// Writes the root of the extent tree to a record, the counterpart of
+/// trfs_decode_extent_root().
+///
+/// @pre Mapping lock is held.
+///
+void trfs_encode_extent_root(
+  struct super_block* const super_block,
+  struct trfs_inode* const record,
+  struct trfs_inode_info const* const info
+) {
+  record->extent_count = cpu_to_be16((uint16_t) info->extent_count);
+
+  if (info->extent_depth > 0) {
+    record->extent_root.depth = cpu_to_be32(info->extent_depth);
+    record->extent_root.reserved = 0;
+    memcpy(record->extent_root.entries, info->extent_root.index, info->extent_count * TRFS_EXTENT_ENTRY_SIZE);
+  }
+  else if (trfs_mount_info(super_block)->super.feature_incompat & TRFS_FEATURE_INCOMPAT_64BIT) {
+    memcpy(record->extents, info->extent_root.extents, info->extent_count * TRFS_EXTENT_ENTRY_SIZE);
+  }
+  else {
+    for (uint32_t index = 0; index < info->extent_count; ++index) {
+      record->extents32[index].logical = info->extent_root.extents[index].logical;
+      record->extents32[index].length = info->extent_root.extents[index].length;
+      record->extents32[index].start = cpu_to_be32((uint32_t) be64_to_cpu(info->extent_root.extents[index].start));
+    }
+  }
+}
@@ -0,0 +1,87 @@
+#ifndef TRFS_EXTENT_H
+#define TRFS_EXTENT_H
+
+#include <linux/fs.h>
+#include <linux/types.h>
+
+#include "trfs/super.h"
+
+struct trfs_inode_info;
+
+int trfs_extent_cache_init(void);
+void trfs_extent_cache_exit(void);
+
+int trfs_register_extent_cache(struct super_block* const super_block);
+void trfs_unregister_extent_cache(struct super_block* const super_block);
+void trfs_drop_extent_cache(struct inode* const inode);
+
+int trfs_decode_extent_root(
+  struct super_block* const super_block,
+  struct trfs_inode const* const record,
+  struct trfs_inode_info* const info
+);
+
+void trfs_encode_extent_root(
+  struct super_block* const super_block,
+  struct trfs_inode* const record,
+  struct trfs_inode_info const* const info
+);
+
+uint32_t trfs_extent_span(
+  struct inode const* const inode,
+  struct trfs_extent const* const extent
+);
+
+int trfs_lookup_extent(
+  struct inode* const inode,
+  uint32_t const logical,
+  struct trfs_extent* const extent,
+  uint32_t* const count
+);
+
+int trfs_lookup_previous_extent(
+  struct inode* const inode,
+  uint32_t const logical,
+  struct trfs_extent* const extent
+);
+
+int trfs_insert_extent(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint64_t const physical,
+  uint32_t const count,
+  uint32_t const flags
+);
+
+int trfs_remove_extent(
+  struct inode* const inode,
+  uint32_t const logical
+);
+
+int trfs_truncate_extents(
+  struct inode* const inode,
+  uint64_t const first
+);
+
+void trfs_free_extents(struct inode* const inode);
+
+int trfs_convert_unwritten_extents(
+  struct inode* const inode,
+  uint32_t const first,
+  uint64_t const end
+);
+
+int trfs_punch_extents(
+  struct inode* const inode,
+  uint32_t const first,
+  uint64_t const end
+);
+
+int trfs_remap_extents(
+  struct inode* const inode,
+  uint32_t const first,
+  uint64_t const end,
+  uint64_t const physical
+);
+
+#endif // TRFS_EXTENT_H
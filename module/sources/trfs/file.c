@@ -1,7 +1,17 @@
+#include <linux/falloc.h>
 #include <linux/fs.h>
+#include <linux/iomap.h>
+#include <linux/pagemap.h>
 
+#include "trfs/compress.h"
+#include "trfs/data.h"
+#include "trfs/directory.h"
 #include "trfs/file.h"
+#include "trfs/inode.h"
 #include "trfs/printk.h"
+#include "trfs/stats.h"
+#include "trfs/super.h"
+#include "trace/events/trfs.h"
 
 // The File Object:
 // A file object represents a file opened by a process. This is also known as an
@@ -16,12 +26,112 @@ trfs_inode_lookup(
 ) {
   // inode->i_op
   // https://www.kernel.org/doc/Documentation/filesystems/vfs.txt
-  TRFS_INFO("Inode lookup\n");
-  return NULL;
+  if (child_dentry->d_name.len > TRFS_NAME_LENGTH) {
+    return ERR_PTR(-ENAMETOOLONG);
+  }
+
+  u64 const started = trfs_start_timing();
+  uint32_t ino;
+
+  int const error = trfs_directory_lookup(parent_inode, &child_dentry->d_name, &ino);
+  trace_trfs_lookup(parent_inode, child_dentry, error ? 0 : ino, error, started);
+  trfs_account(parent_inode->i_sb, TRFS_OPERATION_LOOKUP, started);
+
+  if (error) {
+    return ERR_PTR(error);
+  }
+
+  // A missing name is cached as a negative dentry, the next lookups of it are
+  // answered by the dcache (see trfs/dentry.c).
+  if (ino == 0) {
+    trfs_count(parent_inode->i_sb, TRFS_COUNTER_NEGATIVE_LOOKUPS, 1);
+    d_add(child_dentry, NULL);
+    return NULL;
+  }
+
+  // d_splice_alias() hashes the dentry, errors from trfs_iget() are passed
+  // through.
+  return d_splice_alias(trfs_iget(parent_inode->i_sb, ino), child_dentry);
+}
+
+///
+/// Allocates an inode and links it into the parent directory.
+///
+static int trfs_inode_make(
+  struct inode* const parent_inode,
+  struct dentry* const child_dentry,
+  umode_t const mode
+) {
+  if (child_dentry->d_name.len > TRFS_NAME_LENGTH) {
+    return -ENAMETOOLONG;
+  }
+
+  struct inode* const inode = trfs_new_inode(parent_inode, mode);
+  if (IS_ERR(inode)) {
+    return PTR_ERR(inode);
+  }
+
+  // A directory is linked from its parent and from its own "." entry, its
+  // ".." entry links the parent.
+  if (S_ISDIR(mode)) {
+    set_nlink(inode, 2);
+    inc_nlink(parent_inode);
+  }
+
+  int const error = trfs_directory_add(
+    parent_inode, &child_dentry->d_name,
+    (uint32_t) inode->i_ino, fs_umode_to_dtype(mode)
+  );
+
+  if (error) {
+    if (S_ISDIR(mode)) {
+      drop_nlink(parent_inode);
+    }
+
+    // The inode is freed on eviction.
+    clear_nlink(inode);
+    discard_new_inode(inode);
+    return error;
+  }
+
+  // Only the times of the parent change (they may wait with lazytime), unless
+  // it gained a subdirectory (and a link).
+  struct timespec64 now = current_time(parent_inode);
+  generic_update_time(parent_inode, &now, S_MTIME | S_CTIME);
+
+  if (S_ISDIR(mode)) {
+    mark_inode_dirty(parent_inode);
+  }
+
+  d_instantiate_new(child_dentry, inode);
+  return 0;
+}
+
+static int
+trfs_inode_create(
+  struct user_namespace* const user_namespace,
+  struct inode* const parent_inode,
+  struct dentry* const child_dentry,
+  umode_t const mode,
+  bool const exclusive
+) {
+  return trfs_inode_make(parent_inode, child_dentry, mode);
+}
+
+static int
+trfs_inode_mkdir(
+  struct user_namespace* const user_namespace,
+  struct inode* const parent_inode,
+  struct dentry* const child_dentry,
+  umode_t const mode
+) {
+  return trfs_inode_make(parent_inode, child_dentry, S_IFDIR | mode);
 }
 
 struct inode_operations const trfs_inode_operations = {
   .lookup = trfs_inode_lookup,
+  .create = trfs_inode_create,
+  .mkdir = trfs_inode_mkdir,
 };
 
 /**
@@ -41,8 +151,7 @@ trfs_file_open(
   struct inode* const inode,
   struct file* const file
 ) {
-  // Log only for test purposes.
-  TRFS_INFO("File open");
+  trace_trfs_file_open(inode, file);
   return 0;
 }
 
@@ -58,8 +167,7 @@ trfs_file_flush(
   struct file* const file,
   fl_owner_t const id
 ) {
-  // Log only for test purposes.
-  TRFS_INFO("File flush");
+  trace_trfs_file_flush(file_inode(file), file);
   return 0;
 }
 
@@ -75,8 +183,7 @@ trfs_file_release(
   struct inode* const inode,
   struct file* const file
 ) {
-  // Log only for test purposes.
-  TRFS_INFO("File release");
+  trace_trfs_file_release(inode, file);
   return 0;
 }
 
@@ -88,14 +195,456 @@ trfs_directory_iterate(
   struct file* const file,
   struct dir_context* const context
 ) {
-  TRFS_INFO("Directory iterate\n");
+  u64 const started = trfs_start_timing();
+  loff_t const position = context->pos;
+  int error = 0;
+
   // Emit the standard entries "." and "..".
-  dir_emit_dots(file, context);
+  if (dir_emit_dots(file, context)) {
+    error = trfs_directory_emit(file, context);
+  }
+
+  trace_trfs_iterate(file_inode(file), position, context->pos, error, started);
+  trfs_account(file_inode(file)->i_sb, TRFS_OPERATION_READDIR, started);
+  return error;
+}
+
+///
+/// Changes the attributes of a regular file, truncating it (and freeing its
+/// blocks past the new end) when its size changes.
+///
+static int
+trfs_file_setattr(
+  struct user_namespace* const user_namespace,
+  struct dentry* const dentry,
+  struct iattr* const attributes
+) {
+  struct inode* const inode = d_inode(dentry);
+
+  int error = setattr_prepare(user_namespace, dentry, attributes);
+  if (error) {
+    return error;
+  }
+
+  if ((attributes->ia_valid & ATTR_SIZE) && attributes->ia_size != inode->i_size) {
+    // The caller holds i_rwsem, no new direct I/O can start. The ones in
+    // flight must not write to blocks about to be freed.
+    inode_dio_wait(inode);
+
+    if (attributes->ia_size > TRFS_INODE_INLINE_SIZE && (error = trfs_uninline_data(inode))) {
+      return error;
+    }
+
+    // Zero the end of the new last block, it would be read back if the file
+    // grows again (writeback zeroes past the end of file when it grows). A
+    // compressed cluster holding the new end is expanded first.
+    if (attributes->ia_size < inode->i_size
+      && ((error = trfs_expand_compressed_clusters(inode, attributes->ia_size, attributes->ia_size + 1))
+        || (error = iomap_truncate_page(inode, attributes->ia_size, NULL, &trfs_iomap_ops)))
+    ) {
+      return error;
+    }
+
+    // Page faults must not dirty the pages (nor expand clusters) past the new
+    // end while its blocks are freed.
+    filemap_invalidate_lock(inode->i_mapping);
+    truncate_setsize(inode, attributes->ia_size);
+    trfs_truncate_blocks(inode);
+    filemap_invalidate_unlock(inode->i_mapping);
+    inode->i_mtime = inode->i_ctime = current_time(inode);
+  }
+
+  setattr_copy(user_namespace, inode, attributes);
+
+  // Only a new size matters to fdatasync(2) (I_DIRTY_DATASYNC).
+  if (attributes->ia_valid & ATTR_SIZE) {
+    mark_inode_dirty(inode);
+  }
+  else {
+    mark_inode_dirty_sync(inode);
+  }
+
   return 0;
 }
 
+struct inode_operations const trfs_file_inode_operations = {
+  .setattr = trfs_file_setattr,
+  .getattr = simple_getattr,
+};
+
+static ssize_t
+trfs_file_read_iter(
+  struct kiocb* const iocb,
+  struct iov_iter* const to
+) {
+  if (iocb->ki_flags & IOCB_DIRECT) {
+    ssize_t const result = trfs_direct_read(iocb, to);
+
+    // Compressed clusters are only read through the page cache.
+    if (result != -ENOTBLK) {
+      return result;
+    }
+
+    return filemap_read(iocb, to, 0);
+  }
+
+  return generic_file_read_iter(iocb, to);
+}
+
+///
+/// Buffered write: copies into the page cache, blocks are allocated by
+/// trfs_iomap_begin() and written back by trfs_writepages().
+///
+/// O_DIRECT writes bypass the page cache (see trfs_direct_write()).
+///
+static ssize_t
+trfs_file_write_iter(
+  struct kiocb* const iocb,
+  struct iov_iter* const from
+) {
+  struct file* const file = iocb->ki_filp;
+  struct inode* const inode = file_inode(file);
+  ssize_t result;
+
+  inode_lock(inode);
+
+  if ((result = generic_write_checks(iocb, from)) <= 0) {
+    goto unlock;
+  }
+
+  if ((result = file_remove_privs(file)) || (result = file_update_time(file))) {
+    goto unlock;
+  }
+
+  // Direct I/O needs blocks, as does a file outgrowing its inode.
+  if (trfs_inode_is_inline(inode)
+    && ((iocb->ki_flags & IOCB_DIRECT)
+      || iocb->ki_pos + (loff_t) iov_iter_count(from) > TRFS_INODE_INLINE_SIZE)
+    && (result = trfs_uninline_data(inode))
+  ) {
+    goto unlock;
+  }
+
+  // Compressed clusters are rewritten as plain blocks, and compressed again at
+  // writeback.
+  if ((result = trfs_expand_compressed_clusters(
+    inode, iocb->ki_pos, iocb->ki_pos + (loff_t) iov_iter_count(from)
+  ))) {
+    goto unlock;
+  }
+
+  if (iocb->ki_flags & IOCB_DIRECT) {
+    result = trfs_direct_write(iocb, from);
+
+    // Cached pages could not be invalidated, the write goes through the page
+    // cache which is then written back and dropped, as O_DIRECT expects.
+    if (result == -ENOTBLK) {
+      loff_t const position = iocb->ki_pos;
+
+      result = iomap_file_buffered_write(iocb, from, &trfs_iomap_ops);
+      if (result > 0) {
+        int const error = filemap_write_and_wait_range(
+          file->f_mapping, position, position + result - 1
+        );
+
+        if (error) {
+          result = error;
+        }
+        else {
+          invalidate_mapping_pages(
+            file->f_mapping, position >> PAGE_SHIFT, (position + result - 1) >> PAGE_SHIFT
+          );
+        }
+      }
+    }
+
+    goto unlock;
+  }
+
+  result = iomap_file_buffered_write(iocb, from, &trfs_iomap_ops);
+
+unlock:
+  inode_unlock(inode);
+
+  // Flushes the written range for O_SYNC/O_DSYNC files.
+  if (result > 0) {
+    result = generic_write_sync(iocb, result);
+  }
+
+  return result;
+}
+
+///
+/// Zeroes [from, to) in the page cache, up to the end of the file (pages past
+/// the end are zeroed when read).
+///
+static int trfs_zero_range(
+  struct inode* const inode,
+  loff_t const from,
+  loff_t const to
+) {
+  loff_t const end = min(to, i_size_read(inode));
+
+  return from < end
+    ? iomap_zero_range(inode, from, end - from, NULL, &trfs_iomap_ops)
+    : 0;
+}
+
+///
+/// Preallocates blocks (mode 0 or FALLOC_FL_KEEP_SIZE), punches a hole
+/// (FALLOC_FL_PUNCH_HOLE) or zeroes a range (FALLOC_FL_ZERO_RANGE) of a
+/// regular file, see fallocate(2).
+///
+/// Preallocated blocks are unwritten extents: only the extent tree is written,
+/// and the blocks read as zeroes until data is written to them. Zeroing a
+/// range punches its whole blocks and preallocates them again.
+///
+static long
+trfs_file_fallocate(
+  struct file* const file,
+  int const mode,
+  loff_t const offset,
+  loff_t const length
+) {
+  struct inode* const inode = file_inode(file);
+  unsigned int const block_bits = inode->i_blkbits;
+  loff_t const end = offset + length;
+  long error;
+
+  if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+    return -EOPNOTSUPP;
+  }
+
+  // Logical block numbers are 32-bit.
+  if ((uint64_t) (end - 1) >> block_bits > U32_MAX) {
+    return -EFBIG;
+  }
+
+  inode_lock(inode);
+
+  // Direct I/O in flight must not write to blocks about to be punched.
+  inode_dio_wait(inode);
+
+  if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)
+    && (error = inode_newsize_ok(inode, end))
+  ) {
+    goto unlock;
+  }
+
+  if ((error = file_remove_privs(file)) || (error = file_update_time(file))) {
+    goto unlock;
+  }
+
+  // Only blocks can be unwritten, compressed clusters are rewritten as plain
+  // blocks.
+  if ((error = trfs_uninline_data(inode))
+    || (error = trfs_expand_compressed_clusters(inode, offset, end))
+  ) {
+    goto unlock;
+  }
+
+  if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+    loff_t const first = round_up(offset, i_blocksize(inode));
+    loff_t const last = round_down(end, i_blocksize(inode));
+
+    // The parts of the blocks at the ends of the range are zeroed in place.
+    if (first >= last) {
+      error = trfs_zero_range(inode, offset, end);
+    }
+    else if (!(error = trfs_zero_range(inode, offset, first))) {
+      error = trfs_zero_range(inode, last, end);
+    }
+
+    // Reads must not bring the blocks back in the page cache before they are
+    // freed.
+    if (!error && first < last) {
+      filemap_invalidate_lock(inode->i_mapping);
+      truncate_pagecache_range(inode, first, last - 1);
+      error = trfs_punch_blocks(inode, (uint32_t) (first >> block_bits), (uint64_t) last >> block_bits);
+      filemap_invalidate_unlock(inode->i_mapping);
+    }
+
+    if (error) {
+      goto unlock;
+    }
+  }
+
+  if (!(mode & FALLOC_FL_PUNCH_HOLE)) {
+    error = trfs_preallocate_blocks(
+      inode,
+      (uint32_t) (offset >> block_bits),
+      ((uint64_t) end + i_blocksize(inode) - 1) >> block_bits
+    );
+
+    if (error) {
+      goto unlock;
+    }
+
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+      truncate_setsize(inode, end);
+    }
+  }
+
+  // The times were updated by file_update_time().
+  mark_inode_dirty(inode);
+
+unlock:
+  inode_unlock(inode);
+  return error;
+}
+
+///
+/// Clones a range of a file to another (or to another range of the same file,
+/// see ioctl_ficlone(2) and copy_file_range(2)): the target range maps the
+/// blocks of the source range, which become shared, instead of a copy of them.
+/// With REMAP_FILE_DEDUP, the ranges are only shared when their content is
+/// the same.
+///
+/// @return -EOPNOTSUPP when the file system has no refcount tables (see
+///   TRFS_FEATURE_INCOMPAT_REFLINK), or when the source is inline or has
+///   compressed clusters (copy_file_range(2) then falls back to a copy).
+///
+static loff_t
+trfs_file_remap_range(
+  struct file* const file_in,
+  loff_t const position_in,
+  struct file* const file_out,
+  loff_t const position_out,
+  loff_t length,
+  unsigned int const remap_flags
+) {
+  struct inode* const source = file_inode(file_in);
+  struct inode* const target = file_inode(file_out);
+  unsigned int const block_bits = target->i_blkbits;
+  loff_t error = 0;
+
+  if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_ADVISORY)) {
+    return -EINVAL;
+  }
+
+  if (!(trfs_mount_info(target->i_sb)->super.feature_incompat & TRFS_FEATURE_INCOMPAT_REFLINK)) {
+    return -EOPNOTSUPP;
+  }
+
+  lock_two_nondirectories(source, target);
+
+  // Inline data and compressed clusters have no blocks of their own to share.
+  if (trfs_inode_is_inline(source) || trfs_has_compressed_extents(source)) {
+    error = -EOPNOTSUPP;
+    goto unlock_inodes;
+  }
+
+  // The target needs blocks, and its compressed clusters straddling the range
+  // are rewritten as plain blocks (written back with the range below). This
+  // reads the page cache, before the invalidate locks are taken. A clone up to
+  // the end of the source has no length yet.
+  loff_t const wanted = length > 0 ? length : i_size_read(source) - position_in;
+  if (wanted > 0
+    && ((error = trfs_uninline_data(target))
+      || (error = trfs_expand_compressed_clusters(target, position_out, position_out + wanted)))
+  ) {
+    goto unlock_inodes;
+  }
+
+  filemap_invalidate_lock_two(source->i_mapping, target->i_mapping);
+
+  // Checks the ranges and writes them back (and compares them for a dedup).
+  error = generic_remap_file_range_prep(file_in, position_in, file_out, position_out, &length, remap_flags);
+  if (error < 0 || length == 0) {
+    goto unlock;
+  }
+
+  loff_t const end = round_up(position_out + length, i_blocksize(target));
+  uint32_t const first = (uint32_t) (position_out >> block_bits);
+
+  // Logical block numbers are 32-bit.
+  if ((uint64_t) (end - 1) >> block_bits > U32_MAX) {
+    error = -EFBIG;
+    goto unlock;
+  }
+
+  // The partial last block of the source is only shared past the end of the
+  // target, it would bring the zeroes following the end of the source.
+  if (end != position_out + length && position_out + length < i_size_read(target)) {
+    error = -EINVAL;
+    goto unlock;
+  }
+
+  // The pages of the target range are clean, the blocks that the pages
+  // straddling the range keep are read again.
+  error = invalidate_inode_pages2_range(
+    target->i_mapping, position_out >> PAGE_SHIFT, (end - 1) >> PAGE_SHIFT
+  );
+
+  if (error) {
+    goto unlock;
+  }
+
+  // The blocks of the target are replaced as the range is cloned, a failure
+  // midway leaves the rest of the target untouched.
+  error = trfs_clone_blocks(
+    source, (uint32_t) (position_in >> block_bits), target, first, (uint32_t) ((uint64_t) end >> block_bits) - first
+  );
+
+  if (error) {
+    goto unlock;
+  }
+
+  if (position_out + length > i_size_read(target)) {
+    i_size_write(target, position_out + length);
+  }
+
+  // The times were updated by generic_remap_file_range_prep().
+  mark_inode_dirty(target);
+  error = length;
+
+unlock:
+  filemap_invalidate_unlock_two(source->i_mapping, target->i_mapping);
+
+unlock_inodes:
+  unlock_two_nondirectories(source, target);
+  return error;
+}
+
+///
+/// Writes the dirty pages of a file and its inode back (see
+/// generic_file_fsync()).
+///
+static int
+trfs_file_fsync(
+  struct file* const file,
+  loff_t const start,
+  loff_t const end,
+  int const datasync
+) {
+  u64 const started = trfs_start_timing();
+  int const error = generic_file_fsync(file, start, end, datasync);
+
+  trace_trfs_fsync(file_inode(file), start, end, datasync, error, started);
+  trfs_account(file_inode(file)->i_sb, TRFS_OPERATION_FSYNC, started);
+  return error;
+}
+
+// Reads, writes, splice(2) and mmap(2) go through the page cache (see
+// trfs/data.c), copy_file_range(2) clones the blocks when it can (see
+// trfs_file_remap_range()).
+struct file_operations const trfs_file_operations = {
+  .owner = THIS_MODULE,
+  .llseek = generic_file_llseek,
+  .read_iter = trfs_file_read_iter,
+  .write_iter = trfs_file_write_iter,
+  .mmap = trfs_file_mmap,
+  .fsync = trfs_file_fsync,
+  .splice_read = generic_file_splice_read,
+  .splice_write = iter_file_splice_write,
+  .fallocate = trfs_file_fallocate,
+  .remap_file_range = trfs_file_remap_range,
+};
+
 struct file_operations const trfs_directory_operations = {
   .owner = THIS_MODULE,
+  .llseek = generic_file_llseek,
+  .read = generic_read_dir,
   .iterate = trfs_directory_iterate,
 
   .open = trfs_file_open,
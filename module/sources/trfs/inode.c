@@ -1,4 +1,1865 @@
+#include <linux/bitops.h>
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/rbtree.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/smp.h>
+#include <linux/writeback.h>
+
+#include "trfs/data.h"
+#include "trfs/extent.h"
+#include "trfs/file.h"
+#include "trfs/inode.h"
+#include "trfs/printk.h"
+#include "trfs/refcount.h"
+#include "trfs/super.h"
 
 // The Inode Object:
 // An inode object represents an object within the filesystem.
-// https://www.kernel.org/doc/Documentation/filesystems/vfs.txt
\ No newline at end of file
+// https://www.kernel.org/doc/Documentation/filesystems/vfs.txt
+
+// ╔═╗┌─┐┌─┐┬ ┬┌─┐
+// ║  ├─┤│  ├─┤├┤
+// ╚═╝┴ ┴└─┘┴ ┴└─┘
+
+static struct kmem_cache* trfs_inode_cache = NULL;
+
+///
+/// Slab constructor, called once when the slab allocates the object, not on
+/// every allocation (objects are returned to the cache in that state).
+///
+static void trfs_inode_init_once(void* const object) {
+  struct trfs_inode_info* const info = object;
+
+  init_rwsem(&info->mapping_lock);
+  rwlock_init(&info->cache_lock);
+  spin_lock_init(&info->ioend_lock);
+  INIT_LIST_HEAD(&info->ioend_list);
+  INIT_WORK(&info->ioend_work, trfs_complete_ioends);
+  inode_init_once(&info->vfs_inode);
+}
+
+int trfs_inode_cache_init(void) {
+  // SLAB_RECLAIM_ACCOUNT: objects are reclaimable (inode shrinker).
+  // SLAB_ACCOUNT: objects are charged to the memory cgroup of the caller.
+  trfs_inode_cache = kmem_cache_create(
+    "trfs_inode_cache", sizeof(struct trfs_inode_info), 0,
+    SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD | SLAB_ACCOUNT,
+    trfs_inode_init_once
+  );
+
+  if (trfs_inode_cache == NULL) {
+    TRFS_ERROR("Could not create the inode cache.\n");
+    return -ENOMEM;
+  }
+
+  return 0;
+}
+
+void trfs_inode_cache_exit(void) {
+  // Inodes are freed after an RCU grace period (see free_inode()), wait for
+  // them before destroying the cache.
+  rcu_barrier();
+  kmem_cache_destroy(trfs_inode_cache);
+  trfs_inode_cache = NULL;
+}
+
+struct inode* trfs_alloc_inode(
+  struct super_block* const super_block
+) {
+  struct trfs_inode_info* const info = alloc_inode_sb(super_block, trfs_inode_cache, GFP_KERNEL);
+  if (info == NULL) {
+    return NULL;
+  }
+
+  info->flags = 0;
+  info->extent_depth = 0;
+  info->extent_count = 0;
+  info->cached_extents = RB_ROOT;
+  info->delayed_extents = RB_ROOT;
+  info->cow_extents = RB_ROOT;
+  return &info->vfs_inode;
+}
+
+void trfs_free_inode(
+  struct inode* const inode
+) {
+  kmem_cache_free(trfs_inode_cache, trfs_inode_info(inode));
+}
+
+// ╔╗ ┬┌┬┐┌┬┐┌─┐┌─┐
+// ╠╩╗│ │ │││├─┤├─┘
+// ╚═╝┴ ┴ ┴ ┴┴ ┴┴
+
+///
+/// Allocates an inode number from the inode bitmap of the given group,
+/// starting the search after the last allocated one.
+///
+/// @return -ENOSPC when the group has no free inode.
+///
+static int trfs_allocate_group_inode_number(
+  struct super_block* const super_block,
+  uint32_t const group,
+  unsigned long* const ino
+) {
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
+  struct trfs_group* const trfs_group = &info->groups[group];
+  uint32_t const bits_per_block = 8u * super_block->s_blocksize;
+  uint32_t const inodes = info->super.group_inodes;
+  uint32_t const blocks = DIV_ROUND_UP(inodes, bits_per_block);
+  uint64_t const bitmap_block = trfs_group_inode_bitmap_block(&info->super, group);
+  int error = -ENOSPC;
+
+  // Unlocked hint, checked again under the lock.
+  if (READ_ONCE(trfs_group->free_inodes) == 0) {
+    return -ENOSPC;
+  }
+
+  mutex_lock(&trfs_group->inode_lock);
+
+  uint32_t const hint = trfs_group->inode_hint < inodes ? trfs_group->inode_hint : 0;
+
+  // The hint block is visited twice: from the hint, then (after wrapping
+  // around) from its beginning.
+  for (uint32_t visited = 0; trfs_group->free_inodes > 0 && visited <= blocks; ++visited) {
+    uint32_t const index = (hint / bits_per_block + visited) % blocks;
+    uint32_t const first = index * bits_per_block;
+    uint32_t const bits = min(bits_per_block, inodes - first);
+
+    struct buffer_head* const buffer_head = sb_bread(super_block, bitmap_block + index);
+    if (!buffer_head) {
+      TRFS_ERROR("Could not read inode bitmap block [%llu].\n", bitmap_block + index);
+      error = -EIO;
+      break;
+    }
+
+    unsigned long const bit = find_next_zero_bit_le(
+      buffer_head->b_data, bits, visited == 0 ? hint % bits_per_block : 0
+    );
+
+    if (bit < bits) {
+      __set_bit_le(bit, buffer_head->b_data);
+      mark_buffer_dirty(buffer_head);
+      brelse(buffer_head);
+
+      *ino = (unsigned long) group * inodes + first + bit;
+      trfs_group->inode_hint = first + (uint32_t) bit + 1;
+      trfs_group->free_inodes -= 1;
+      error = 0;
+      break;
+    }
+
+    brelse(buffer_head);
+  }
+
+  mutex_unlock(&trfs_group->inode_lock);
+  return error;
+}
+
+///
+/// Allocates an inode number, in the given group when it has free inodes,
+/// otherwise in the next groups.
+///
+static int trfs_allocate_inode_number(
+  struct super_block* const super_block,
+  uint32_t const group,
+  unsigned long* const ino
+) {
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
+  int error = -ENOSPC;
+
+  for (uint32_t index = 0; error == -ENOSPC && index < info->super.groups; ++index) {
+    error = trfs_allocate_group_inode_number(
+      super_block, (group + index) % info->super.groups, ino
+    );
+  }
+
+  if (!error) {
+    percpu_counter_dec(&info->free_inodes);
+    trfs_dirty_super_block(super_block);
+  }
+
+  return error;
+}
+
+static void trfs_free_inode_number(
+  struct super_block* const super_block,
+  unsigned long const ino
+) {
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
+  uint32_t const group = trfs_inode_group(info, ino);
+  struct trfs_group* const trfs_group = &info->groups[group];
+  uint32_t const bits_per_block = 8u * super_block->s_blocksize;
+  uint32_t const bit = (uint32_t) (ino % info->super.group_inodes);
+  uint64_t const block = trfs_group_inode_bitmap_block(&info->super, group) + bit / bits_per_block;
+
+  mutex_lock(&trfs_group->inode_lock);
+
+  struct buffer_head* const buffer_head = sb_bread(super_block, block);
+  if (!buffer_head) {
+    TRFS_ERROR("Could not read inode bitmap block [%llu].\n", block);
+  }
+  else {
+    if (!__test_and_clear_bit_le(bit % bits_per_block, buffer_head->b_data)) {
+      TRFS_ERROR("Inode [%lu] is already free.\n", ino);
+    }
+    else {
+      trfs_group->free_inodes += 1;
+      percpu_counter_inc(&info->free_inodes);
+    }
+
+    mark_buffer_dirty(buffer_head);
+    brelse(buffer_head);
+  }
+
+  mutex_unlock(&trfs_group->inode_lock);
+  trfs_dirty_super_block(super_block);
+}
+
+///
+/// Counts the free inodes of the inode bitmaps, at mount time (the counter of
+/// the superblock may be stale after a crash), and initializes the counters.
+///
+/// @pre trfs_mount_info(super_block)->groups has been allocated.
+///
+int trfs_count_free_inodes(
+  struct super_block* const super_block
+) {
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
+  uint32_t const bits_per_block = 8u * super_block->s_blocksize;
+  uint32_t const inodes = info->super.group_inodes;
+  s64 free_inodes = 0;
+
+  for (uint32_t group = 0; group < info->super.groups; ++group) {
+    uint64_t const bitmap_block = trfs_group_inode_bitmap_block(&info->super, group);
+    uint32_t used = 0;
+
+    for (uint32_t first = 0; first < inodes; first += bits_per_block) {
+      uint32_t const bits = min(bits_per_block, inodes - first);
+      uint64_t const block = bitmap_block + first / bits_per_block;
+
+      struct buffer_head* const buffer_head = sb_bread(super_block, block);
+      if (!buffer_head) {
+        TRFS_ERROR("Could not read inode bitmap block [%llu].\n", block);
+        return -EIO;
+      }
+
+      // Bits are counted per byte, which does not depend on the bit order. In
+      // the last byte, the first bits are the least significant ones.
+      uint8_t const* const bytes = (void*) buffer_head->b_data;
+      used += (uint32_t) memweight(bytes, bits / 8u);
+      if (bits % 8u) {
+        used += hweight8(bytes[bits / 8u] & ((1u << (bits % 8u)) - 1u));
+      }
+
+      brelse(buffer_head);
+    }
+
+    // Inode 0 (group 0) is marked in use by mkfs.
+    info->groups[group].free_inodes = inodes - min(used, inodes);
+    info->groups[group].inode_hint = 0;
+    free_inodes += info->groups[group].free_inodes;
+  }
+
+  return percpu_counter_init(&info->free_inodes, free_inodes, GFP_KERNEL);
+}
+
+///
+/// Returns the group of a new inode: directories are spread over the groups
+/// (by CPU, so that concurrent mkdir do not contend), other files go to the
+/// group of their directory so that they stay close to it. With alloc=packed
+/// directories also stay in the group of their parent.
+///
+static uint32_t trfs_new_inode_group(
+  struct inode* const directory,
+  umode_t const mode
+) {
+  struct trfs_mount_info const* const info = trfs_mount_info(directory->i_sb);
+
+  if (S_ISDIR(mode) && READ_ONCE(info->alloc_policy) == TRFS_ALLOC_SPREAD) {
+    return raw_smp_processor_id() % info->super.groups;
+  }
+
+  return trfs_inode_group(info, directory->i_ino);
+}
+
+// ╦┌┐┌┌─┐┌┬┐┌─┐
+// ║││││ │ ││├┤
+// ╩┘└┘└─┘╶┴┘└─┘
+
+///
+/// Reads the inode table block holding the given inode.
+///
+/// @return The inode within the block, the caller has to release the buffer
+///   with brelse(). An ERR_PTR() on error.
+///
+/// @pre super_block != NULL
+/// @pre buffer_head != NULL
+///
+struct trfs_inode* trfs_get_inode_record(
+  struct super_block* const super_block,
+  unsigned long const ino,
+  struct buffer_head** const buffer_head
+) {
+  struct trfs_mount_info const* const info = trfs_mount_info(super_block);
+
+  if (ino == 0 || ino >= info->super.inodes) {
+    TRFS_ERROR("Invalid inode number [%lu].\n", ino);
+    return ERR_PTR(-EINVAL);
+  }
+
+  unsigned long const inodes_per_block = super_block->s_blocksize / TRFS_INODE_SIZE;
+  uint32_t const group = trfs_inode_group(info, ino);
+  uint32_t const index = (uint32_t) (ino % info->super.group_inodes);
+  uint64_t const block = trfs_group_inode_table_block(&info->super, group) + index / inodes_per_block;
+
+  *buffer_head = sb_bread(super_block, block);
+  if (!*buffer_head) {
+    TRFS_ERROR("Could not read inode table block [%llu].\n", block);
+    return ERR_PTR(-EIO);
+  }
+
+  return (struct trfs_inode*) (
+    (*buffer_head)->b_data + (index % inodes_per_block) * TRFS_INODE_SIZE
+  );
+}
+
+///
+/// Sets the inode and file operations according to the file type.
+///
+/// @return False when the file type is not supported.
+///
+static bool trfs_set_inode_operations(
+  struct inode* const inode
+) {
+  if (S_ISDIR(inode->i_mode)) {
+    inode->i_op = &trfs_inode_operations;
+    inode->i_fop = &trfs_directory_operations;
+    return true;
+  }
+
+  if (S_ISREG(inode->i_mode)) {
+    inode->i_op = &trfs_file_inode_operations;
+    inode->i_fop = &trfs_file_operations;
+    inode->i_mapping->a_ops = &trfs_address_space_operations;
+    return true;
+  }
+
+  return false;
+}
+
+///
+/// Returns the in-memory inode of the given inode number, reading it from the
+/// inode table when it is not cached yet.
+///
+/// @return A referenced inode (release with iput()) or an ERR_PTR().
+///
+struct inode* trfs_iget(
+  struct super_block* const super_block,
+  unsigned long const ino
+) {
+  struct buffer_head* buffer_head;
+  struct inode* const inode = iget_locked(super_block, ino);
+
+  if (!inode) {
+    return ERR_PTR(-ENOMEM);
+  }
+
+  // Already cached.
+  if (!(inode->i_state & I_NEW)) {
+    return inode;
+  }
+
+  struct trfs_inode const* const record = trfs_get_inode_record(super_block, ino, &buffer_head);
+  if (IS_ERR(record)) {
+    iget_failed(inode);
+    return ERR_CAST(record);
+  }
+
+  inode->i_mode = be16_to_cpu(record->mode);
+
+  // From "struct super_block::s_user_ns": [source/include/linux/fs.h]
+  // Owning user namespace and default context in which to interpret filesystem
+  // uids, gids, quotas, device nodes, xattrs and security labels.
+  // i_uid_write() and i_gid_write() map on-disk ids through it.
+  i_uid_write(inode, be32_to_cpu(record->uid));
+  i_gid_write(inode, be32_to_cpu(record->gid));
+  set_nlink(inode, be16_to_cpu(record->links));
+
+  inode->i_size = be64_to_cpu(record->size);
+  inode->i_blocks = (blkcnt_t) be32_to_cpu(record->blocks) << (super_block->s_blocksize_bits - 9);
+
+  inode->i_atime.tv_sec = (int64_t) be64_to_cpu(record->atime);
+  inode->i_mtime.tv_sec = (int64_t) be64_to_cpu(record->mtime);
+  inode->i_ctime.tv_sec = (int64_t) be64_to_cpu(record->ctime);
+  inode->i_atime.tv_nsec = be32_to_cpu(record->atime_nsec);
+  inode->i_mtime.tv_nsec = be32_to_cpu(record->mtime_nsec);
+  inode->i_ctime.tv_nsec = be32_to_cpu(record->ctime_nsec);
+
+  // The mapping is kept in memory for the lifetime of the inode, so that
+  // mapping a block does not read the inode table again. Inline data stays in
+  // the record (in the buffer cache), see trfs_iomap_begin_inline().
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+  info->flags = be16_to_cpu(record->flags);
+
+  int const error = trfs_decode_extent_root(super_block, record, info);
+  brelse(buffer_head);
+
+  if (error) {
+    TRFS_ERROR("Inode [%lu] has a corrupted extent tree root.\n", ino);
+    iget_failed(inode);
+    return ERR_PTR(error);
+  }
+
+  if ((info->flags & TRFS_INODE_INLINE) && inode->i_size > TRFS_INODE_INLINE_SIZE) {
+    TRFS_ERROR("Inline inode [%lu] is too large (%lld bytes).\n", ino, inode->i_size);
+    iget_failed(inode);
+    return ERR_PTR(-EIO);
+  }
+
+  if (!trfs_set_inode_operations(inode)) {
+    // Also catches free inodes (mode is zero).
+    TRFS_ERROR("Inode [%lu] has an unsupported mode (%o).\n", ino, inode->i_mode);
+    iget_failed(inode);
+    return ERR_PTR(-EIO);
+  }
+
+  unlock_new_inode(inode);
+  return inode;
+}
+
+///
+/// Allocates a new inode in the given directory.
+///
+/// @return A locked (I_NEW) inode, to be released with d_instantiate_new() or
+///   discard_new_inode(). An ERR_PTR() on error.
+///
+struct inode* trfs_new_inode(
+  struct inode* const directory,
+  umode_t const mode
+) {
+  struct super_block* const super_block = directory->i_sb;
+  unsigned long ino;
+
+  struct inode* const inode = new_inode(super_block);
+  if (!inode) {
+    return ERR_PTR(-ENOMEM);
+  }
+
+  int error = trfs_allocate_inode_number(
+    super_block, trfs_new_inode_group(directory, mode), &ino
+  );
+  if (error) {
+    iput(inode);
+    return ERR_PTR(error);
+  }
+
+  // https://www.kernel.org/doc/Documentation/filesystems/idmappings.rst
+
+  // From inode_init_owner(): [source/fs/inode.c]
+  // Init uid,gid,mode for new inode according to posix standards.
+  // If the inode has been created through an idmapped mount the idmap of
+  // the vfsmount must be passed through @idmap. This function will then take
+  // care to map the inode according to @idmap before checking permissions
+  // and initializing i_uid and i_gid. On non-idmapped mounts or if permission
+  // checking is to be performed on the raw inode simply pass @nop_mnt_idmap.
+
+  // From [source/include/linux/mnt_idmapping.h]:
+  // struct mnt_idmap nop_mnt_idmap; // Identity mapping.
+  // struct user_namespace init_user_ns; // ??
+  inode_init_owner(super_block->s_user_ns, inode, directory, mode);
+
+  // Files and directories start inline, the record is cleared for that
+  // (it may hold the data of a previous inode).
+  struct buffer_head* buffer_head;
+  struct trfs_inode* const record = trfs_get_inode_record(super_block, ino, &buffer_head);
+  if (IS_ERR(record)) {
+    trfs_free_inode_number(super_block, ino);
+    iput(inode);
+    return ERR_CAST(record);
+  }
+
+  lock_buffer(buffer_head);
+  memset(record, 0, TRFS_INODE_SIZE);
+  unlock_buffer(buffer_head);
+  mark_buffer_dirty(buffer_head);
+  brelse(buffer_head);
+
+  if (S_ISREG(mode) || S_ISDIR(mode)) {
+    trfs_inode_info(inode)->flags = TRFS_INODE_INLINE;
+  }
+
+  inode->i_ino = ino;
+  inode->i_blocks = 0;
+  inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
+  trfs_set_inode_operations(inode);
+
+  // Fails when a stale inode with the same number is still cached.
+  if (insert_inode_locked(inode) < 0) {
+    TRFS_ERROR("Inode [%lu] is already in use.\n", ino);
+    make_bad_inode(inode);
+    iput(inode);
+    return ERR_PTR(-EIO);
+  }
+
+  mark_inode_dirty(inode);
+  return inode;
+}
+
+///
+/// Copies the timestamps of an inode to its record.
+///
+static void trfs_encode_inode_times(
+  struct trfs_inode* const record,
+  struct inode const* const inode
+) {
+  record->atime = cpu_to_be64(inode->i_atime.tv_sec);
+  record->mtime = cpu_to_be64(inode->i_mtime.tv_sec);
+  record->ctime = cpu_to_be64(inode->i_ctime.tv_sec);
+  record->atime_nsec = cpu_to_be32(inode->i_atime.tv_nsec);
+  record->mtime_nsec = cpu_to_be32(inode->i_mtime.tv_nsec);
+  record->ctime_nsec = cpu_to_be32(inode->i_ctime.tv_nsec);
+}
+
+///
+/// With lazytime, timestamp updates only flag the inode I_DIRTY_TIME and are
+/// written back with the next real change of the inode, on sync, or once they
+/// are old enough (vm.dirtytime_expire_seconds).
+///
+/// The inode table block holding the given inode is about to be written: the
+/// timestamps of the other cached inodes of the block that are only dirty
+/// because of their timestamps are copied along, sparing them a write of their
+/// own. From ext4_update_other_inodes_time().
+///
+static void trfs_update_other_inode_times(
+  struct super_block* const super_block,
+  unsigned long const ino,
+  struct buffer_head* const buffer_head
+) {
+  struct trfs_mount_info const* const info = trfs_mount_info(super_block);
+  unsigned long const inodes_per_block = super_block->s_blocksize / TRFS_INODE_SIZE;
+  unsigned long const group_inodes = info->super.group_inodes;
+
+  // The inodes of the block (the last block of a group may be partial).
+  unsigned long const first = ino - ino % group_inodes % inodes_per_block;
+  unsigned long const end = min3(
+    first + inodes_per_block,
+    (ino / group_inodes + 1) * group_inodes,
+    (unsigned long) info->super.inodes
+  );
+
+  rcu_read_lock();
+
+  for (unsigned long other = max(first, 1ul); other < end; ++other) {
+    if (other == ino) {
+      continue;
+    }
+
+    struct inode* const inode = find_inode_by_ino_rcu(super_block, other);
+    if (inode == NULL) {
+      continue;
+    }
+
+    spin_lock(&inode->i_lock);
+
+    if ((inode->i_state & (I_FREEING | I_WILL_FREE | I_NEW | I_DIRTY_INODE)) == 0
+      && (inode->i_state & I_DIRTY_TIME)
+    ) {
+      inode->i_state &= ~I_DIRTY_TIME;
+      spin_unlock(&inode->i_lock);
+
+      trfs_encode_inode_times(
+        (struct trfs_inode*) (buffer_head->b_data + (other - first) * TRFS_INODE_SIZE),
+        inode
+      );
+    }
+    else {
+      spin_unlock(&inode->i_lock);
+    }
+  }
+
+  rcu_read_unlock();
+}
+
+///
+/// Copies the in-memory inode to its record in the inode table.
+///
+int trfs_write_inode(
+  struct inode* const inode,
+  struct writeback_control* const wbc
+) {
+  struct super_block* const super_block = inode->i_sb;
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+  struct buffer_head* buffer_head;
+  int error = 0;
+
+  struct trfs_inode* const record = trfs_get_inode_record(super_block, inode->i_ino, &buffer_head);
+  if (IS_ERR(record)) {
+    return PTR_ERR(record);
+  }
+
+  down_read(&info->mapping_lock);
+  bool const is_inline = info->flags & TRFS_INODE_INLINE;
+
+  // The block holds other records, written back concurrently (see
+  // trfs_new_inode()): the record is only written to disk whole.
+  lock_buffer(buffer_head);
+
+  // The inode table is not cleared by mkfs. Inline data is written in place
+  // (see trfs_iomap_end()), it is left untouched.
+  memset(record, 0, is_inline ? offsetof(struct trfs_inode, inline_data) : TRFS_INODE_SIZE);
+
+  record->mode = cpu_to_be16(inode->i_mode);
+  record->links = cpu_to_be16(inode->i_nlink);
+  record->uid = cpu_to_be32(i_uid_read(inode));
+  record->gid = cpu_to_be32(i_gid_read(inode));
+  record->blocks = cpu_to_be32(inode->i_blocks >> (super_block->s_blocksize_bits - 9));
+  record->size = cpu_to_be64(inode->i_size);
+
+  trfs_encode_inode_times(record, inode);
+
+  record->flags = cpu_to_be16((uint16_t) info->flags);
+  if (!is_inline) {
+    trfs_encode_extent_root(super_block, record, info);
+  }
+  up_read(&info->mapping_lock);
+
+  if (super_block->s_flags & SB_LAZYTIME) {
+    trfs_update_other_inode_times(super_block, inode->i_ino, buffer_head);
+  }
+
+  unlock_buffer(buffer_head);
+  mark_buffer_dirty(buffer_head);
+
+  if (wbc->sync_mode == WB_SYNC_ALL) {
+    sync_dirty_buffer(buffer_head);
+
+    if (buffer_req(buffer_head) && !buffer_uptodate(buffer_head)) {
+      TRFS_ERROR("Could not write inode [%lu].\n", inode->i_ino);
+      error = -EIO;
+    }
+  }
+
+  brelse(buffer_head);
+  return error;
+}
+
+///
+/// Switches an inline inode to extents, once its content has been moved out
+/// of the record by the caller. The record is rewritten as a whole by
+/// trfs_write_inode() (the inline area is cleared).
+///
+/// @pre The inode i_rwsem is held exclusively.
+///
+void trfs_clear_inline_flag(
+  struct inode* const inode
+) {
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+
+  down_write(&info->mapping_lock);
+  WRITE_ONCE(info->flags, info->flags & ~TRFS_INODE_INLINE);
+  up_write(&info->mapping_lock);
+
+  mark_inode_dirty(inode);
+}
+
+///
+/// Called when the last reference to an inode is dropped and the inode is not
+/// kept in the inode cache. Unlinked inodes give their blocks and their number
+/// back.
+///
+void trfs_evict_inode(
+  struct inode* const inode
+) {
+  struct super_block* const super_block = inode->i_sb;
+
+  truncate_inode_pages_final(&inode->i_data);
+
+  // Writeback has completed, the conversion of its last unwritten blocks may
+  // still be running (see trfs_complete_ioends()).
+  flush_work(&trfs_inode_info(inode)->ioend_work);
+
+  // Dirty pages of a linked inode have been written back, delayed blocks are
+  // left only when the pages were dropped (unlinked inode, I/O error).
+  trfs_undelay_blocks(inode, 0, (uint64_t) U32_MAX + 1);
+
+  if (!inode->i_nlink && !is_bad_inode(inode)) {
+    trfs_free_extents(inode);
+
+    // Clear the record, so that a stale directory entry cannot resurrect it.
+    struct buffer_head* buffer_head;
+    struct trfs_inode* const record = trfs_get_inode_record(super_block, inode->i_ino, &buffer_head);
+    if (!IS_ERR(record)) {
+      record->mode = 0;
+      mark_buffer_dirty(buffer_head);
+      brelse(buffer_head);
+    }
+
+    trfs_free_inode_number(super_block, inode->i_ino);
+  }
+
+  trfs_drop_extent_cache(inode);
+
+  // Extent nodes dirtied by mark_buffer_dirty_inode() are written back with
+  // the block device, they are only detached from the inode.
+  invalidate_inode_buffers(inode);
+  clear_inode(inode);
+}
+
+// ╔═╗─┐ ┬┌┬┐┌─┐┌┐┌┌┬┐┌─┐
+// ║╣ ┌┴┬┘ │ ├┤ │││ │ └─┐
+// ╚═╝┴ └─ ┴ └─┘┘└┘ ┴ └─┘
+
+///
+/// Returns the physical block of the given logical block of an extent
+/// returned by trfs_lookup_extent(), 0 for a hole.
+///
+/// @return -EOPNOTSUPP for a compressed extent, its blocks are not blocks of
+/// the file (see trfs/compress.c).
+///
+static int trfs_extent_physical(
+  struct trfs_extent const* const extent,
+  uint32_t const logical,
+  uint64_t* const physical
+) {
+  if (extent->length == 0) {
+    *physical = 0;
+    return 0;
+  }
+
+  if (trfs_extent_compression(extent) != TRFS_COMPRESS_NONE) {
+    *physical = 0;
+    return -EOPNOTSUPP;
+  }
+
+  *physical = extent->start + (logical - extent->logical);
+  return 0;
+}
+
+///
+/// Returns the physical block where the blocks of the given logical block
+/// would best be allocated: right after the previous extent so that the file
+/// stays contiguous, in the group of the inode without a previous extent.
+///
+/// @pre Mapping lock is held.
+///
+static uint64_t trfs_lookup_goal(
+  struct inode* const inode,
+  uint32_t const logical
+) {
+  struct trfs_mount_info const* const mount_info = trfs_mount_info(inode->i_sb);
+  struct trfs_extent extent;
+
+  // Only a hint, an unreadable tree falls back to the group of the inode.
+  if (!trfs_lookup_previous_extent(inode, logical, &extent) && extent.length > 0) {
+    return extent.start + trfs_extent_blocks(&extent);
+  }
+
+  return trfs_group_data_block(
+    &mount_info->super, trfs_inode_group(mount_info, inode->i_ino)
+  );
+}
+
+///
+/// Returns the number of blocks left in the last cluster of the extent ending
+/// right before the given logical block, 0 when there is no such extent (see
+/// TRFS_FEATURE_INCOMPAT_BIGALLOC). These blocks belong to the inode, *physical
+/// is set to the first one.
+///
+/// @pre Mapping lock is held.
+///
+static uint32_t trfs_lookup_cluster_tail(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint64_t* const physical
+) {
+  uint32_t const cluster_blocks = trfs_super_cluster_blocks(&trfs_mount_info(inode->i_sb)->super);
+  struct trfs_extent extent;
+
+  if (cluster_blocks == 1 || trfs_lookup_previous_extent(inode, logical, &extent)) {
+    return 0;
+  }
+
+  if (extent.length > 0
+    && trfs_extent_compression(&extent) == TRFS_COMPRESS_NONE
+    && extent.logical + trfs_extent_blocks(&extent) == logical
+  ) {
+    uint64_t const end = extent.start + trfs_extent_blocks(&extent);
+
+    *physical = end;
+    return (uint32_t) (round_up(end, cluster_blocks) - end);
+  }
+
+  return 0;
+}
+
+///
+/// Allocates one run of up to *count blocks for the hole starting at the given
+/// logical block, near the previous extent (see trfs_lookup_goal()). *count is
+/// lowered to the length of the run.
+///
+/// With clusters, the end of the last cluster of the previous extent is used
+/// first when the hole follows it.
+///
+/// Preallocated runs are unwritten (see TRFS_EXTENT_UNWRITTEN).
+///
+/// @pre Mapping lock is held for writing.
+/// @pre [logical, logical + *count) is a hole.
+///
+static int trfs_allocate_run(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint64_t* const physical,
+  uint32_t* const count,
+  unsigned int const flags,
+  bool const unwritten
+) {
+  struct super_block* const super_block = inode->i_sb;
+  uint32_t const extent_flags = unwritten ? TRFS_EXTENT_UNWRITTEN : 0;
+  struct trfs_extent hole;
+
+  *count = min(*count, TRFS_EXTENT_LENGTH_MASK);
+
+  // The run must not cross the key of the next node of the extent tree (see
+  // trfs/extent.c), delayed extents may.
+  int error = trfs_lookup_extent(inode, logical, &hole, count);
+  if (error) {
+    *physical = 0;
+    return error;
+  }
+
+  uint32_t const tail = trfs_lookup_cluster_tail(inode, logical, physical);
+  if (tail > 0) {
+    *count = min(*count, tail);
+
+    error = trfs_insert_extent(inode, logical, *physical, *count, extent_flags);
+    if (error) {
+      *physical = 0;
+      return error;
+    }
+
+    // Already allocated with the cluster.
+    if (flags & TRFS_ALLOCATE_RESERVED) {
+      trfs_unreserve_blocks(super_block, *count);
+    }
+
+    return 0;
+  }
+
+  error = trfs_allocate_blocks(super_block, trfs_lookup_goal(inode, logical), count, physical, flags);
+  if (error) {
+    return error;
+  }
+
+  if ((error = trfs_insert_extent(inode, logical, *physical, *count, extent_flags))) {
+    trfs_free_blocks(super_block, *physical, *count);
+
+    // The blocks are free again, so the reservation is not expected to fail.
+    if (flags & TRFS_ALLOCATE_RESERVED) {
+      trfs_reserve_blocks(super_block, *count);
+    }
+
+    *physical = 0;
+  }
+
+  return error;
+}
+
+// ╔╦╗┌─┐┬  ┌─┐┬ ┬┌─┐┌┬┐
+//  ║║├┤ │  ├─┤└┬┘├┤  ││
+// ═╩╝└─┘┴─┘┴ ┴ ┴ └─┘─┴┘
+
+// Delayed Allocation:
+// Buffered writes to holes only reserve blocks (trfs_delay_blocks()), physical
+// blocks are allocated when the pages are written back: the allocator then
+// sees the whole dirty range of the inode at once and places it in as few
+// extents as possible, instead of one small extent per write(2).
+// https://docs.kernel.org/filesystems/ext4/allocators.html
+
+#define delayed_entry(node) rb_entry((node), struct trfs_delayed_extent, node)
+
+static bool trfs_delayed_extent_less(
+  struct rb_node* const a,
+  struct rb_node const* const b
+) {
+  return delayed_entry(a)->logical < delayed_entry(b)->logical;
+}
+
+///
+/// Returns the extent of the tree (delayed_extents or cow_extents) holding the
+/// given logical block, or the first one after it, NULL if none.
+///
+/// @pre Mapping lock is held.
+///
+static struct trfs_delayed_extent* trfs_find_delayed_extent(
+  struct rb_root const* const root,
+  uint32_t const logical
+) {
+  struct rb_node* node = root->rb_node;
+  struct trfs_delayed_extent* next = NULL;
+
+  while (node != NULL) {
+    struct trfs_delayed_extent* const extent = delayed_entry(node);
+
+    if (logical < extent->logical) {
+      next = extent;
+      node = node->rb_left;
+    }
+    else if (logical - extent->logical >= extent->length) {
+      node = node->rb_right;
+    }
+    else {
+      return extent;
+    }
+  }
+
+  return next;
+}
+
+///
+/// Adds [logical, logical + count) to the extents of the tree, merging it with
+/// adjacent ones.
+///
+/// @pre Mapping lock is held for writing.
+/// @pre The range is not in the tree.
+///
+static int trfs_insert_delayed_extent(
+  struct rb_root* const root,
+  uint32_t const logical,
+  uint32_t const count
+) {
+  struct trfs_delayed_extent* const next = trfs_find_delayed_extent(root, logical);
+  struct rb_node* const previous_node = next
+    ? rb_prev(&next->node)
+    : rb_last(root);
+
+  struct trfs_delayed_extent* const previous = previous_node
+    ? delayed_entry(previous_node)
+    : NULL;
+
+  bool const after_previous = previous && previous->logical + previous->length == logical;
+  bool const before_next = next && logical + count == next->logical;
+
+  if (after_previous && before_next) {
+    previous->length += count + next->length;
+    rb_erase(&next->node, root);
+    kfree(next);
+  }
+  else if (after_previous) {
+    previous->length += count;
+  }
+  else if (before_next) {
+    // The order does not change.
+    next->logical = logical;
+    next->length += count;
+  }
+  else {
+    struct trfs_delayed_extent* const extent = kmalloc(sizeof(struct trfs_delayed_extent), GFP_NOFS);
+    if (extent == NULL) {
+      return -ENOMEM;
+    }
+
+    extent->logical = logical;
+    extent->length = count;
+    rb_add(&extent->node, root, trfs_delayed_extent_less);
+  }
+
+  return 0;
+}
+
+///
+/// Removes [logical, end) from the extents of the tree.
+///
+/// @return The number of removed blocks.
+///
+/// @pre Mapping lock is held for writing.
+///
+static uint32_t trfs_remove_delayed_extents(
+  struct rb_root* const root,
+  uint32_t const logical,
+  uint64_t const end
+) {
+  struct trfs_delayed_extent* extent = trfs_find_delayed_extent(root, logical);
+  uint32_t removed = 0;
+
+  while (extent != NULL && extent->logical < end) {
+    struct rb_node* const next = rb_next(&extent->node);
+    uint64_t const extent_end = (uint64_t) extent->logical + extent->length;
+    uint32_t const from = max(extent->logical, logical);
+    uint32_t const to = (uint32_t) min(extent_end, end);
+
+    removed += to - from;
+
+    if (from == extent->logical && to == extent_end) {
+      rb_erase(&extent->node, root);
+      kfree(extent);
+    }
+    else if (from == extent->logical) {
+      extent->logical = to;
+      extent->length = (uint32_t) (extent_end - to);
+    }
+    else if (to == extent_end) {
+      extent->length = from - extent->logical;
+    }
+    else {
+      // Punching the middle of an extent must not fail.
+      struct trfs_delayed_extent* const tail = kmalloc(
+        sizeof(struct trfs_delayed_extent), GFP_NOFS | __GFP_NOFAIL
+      );
+
+      tail->logical = to;
+      tail->length = (uint32_t) (extent_end - to);
+      extent->length = from - extent->logical;
+      rb_add(&tail->node, root, trfs_delayed_extent_less);
+      break;
+    }
+
+    extent = next ? delayed_entry(next) : NULL;
+  }
+
+  return removed;
+}
+
+///
+/// Reserves blocks for the hole [logical, logical + count), they are allocated
+/// by trfs_allocate_delayed_blocks() at writeback.
+///
+/// @return -ENOSPC when the blocks cannot be reserved.
+///
+/// @pre The range is a hole and is not delayed yet.
+///
+int trfs_delay_blocks(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint32_t const count
+) {
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+
+  int error = trfs_reserve_blocks(inode->i_sb, count);
+  if (error) {
+    return error;
+  }
+
+  down_write(&info->mapping_lock);
+  error = trfs_insert_delayed_extent(&info->delayed_extents, logical, count);
+  up_write(&info->mapping_lock);
+
+  if (error) {
+    trfs_unreserve_blocks(inode->i_sb, count);
+  }
+
+  return error;
+}
+
+///
+/// Gives back the reservation of the delayed blocks in [logical, end), and the
+/// one of the copies of shared blocks (see trfs_reserve_cow_blocks()), when
+/// their pages are dropped before being written back.
+///
+void trfs_undelay_blocks(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint64_t const end
+) {
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+
+  down_write(&info->mapping_lock);
+  uint32_t const removed = trfs_remove_delayed_extents(&info->delayed_extents, logical, end)
+    + trfs_remove_delayed_extents(&info->cow_extents, logical, end);
+  up_write(&info->mapping_lock);
+
+  if (removed > 0) {
+    trfs_unreserve_blocks(inode->i_sb, removed);
+  }
+}
+
+///
+/// Allocates the whole delayed extent holding the given logical block (if
+/// any), from its reservation.
+///
+int trfs_allocate_delayed_blocks(
+  struct inode* const inode,
+  uint32_t const logical
+) {
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+  int error = 0;
+
+  down_write(&info->mapping_lock);
+
+  struct trfs_delayed_extent* const extent = trfs_find_delayed_extent(&info->delayed_extents, logical);
+
+  if (extent != NULL && extent->logical <= logical) {
+    // Several runs are needed when free space is fragmented.
+    while (extent->length > 0) {
+      uint64_t physical;
+      uint32_t count = extent->length;
+
+      error = trfs_allocate_run(inode, extent->logical, &physical, &count, TRFS_ALLOCATE_RESERVED, false);
+      if (error) {
+        break;
+      }
+
+      extent->logical += count;
+      extent->length -= count;
+    }
+
+    if (extent->length == 0) {
+      rb_erase(&extent->node, &info->delayed_extents);
+      kfree(extent);
+    }
+  }
+
+  up_write(&info->mapping_lock);
+  return error;
+}
+
+// ╔╦╗┌─┐┌─┐┌─┐┬┌┐┌┌─┐
+// ║║║├─┤├─┘├─┘│││││ ┬
+// ╩ ╩┴ ┴┴  ┴  ┴┘└┘└─┘
+
+///
+/// Translates a logical block of the given inode to a physical block.
+///
+/// *physical is set to 0 when the block is not mapped (a hole), block 0 (the
+/// boot block) is never a data block.
+///
+int trfs_map_block(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint64_t* const physical
+) {
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+  struct trfs_extent extent;
+
+  down_read(&info->mapping_lock);
+
+  int error = trfs_lookup_extent(inode, logical, &extent, NULL);
+  if (!error) {
+    error = trfs_extent_physical(&extent, logical, physical);
+  }
+
+  up_read(&info->mapping_lock);
+  return error;
+}
+
+///
+/// Same as trfs_map_block() for a run of blocks: *count (at most the number of
+/// wanted blocks on input) is lowered to the number of blocks contiguous on
+/// disk, or to the length of the hole when *physical is 0. *type tells what
+/// the run is.
+///
+/// @return -EOPNOTSUPP when the block is in a compressed cluster.
+///
+/// @pre *count > 0
+///
+int trfs_map_blocks(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint64_t* const physical,
+  uint32_t* const count,
+  enum trfs_run_type* const type
+) {
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+  struct trfs_extent mapped;
+
+  down_read(&info->mapping_lock);
+  *type = TRFS_RUN_HOLE;
+
+  int error = trfs_lookup_extent(inode, logical, &mapped, count);
+  if (error) {
+    goto unlock;
+  }
+
+  error = trfs_extent_physical(&mapped, logical, physical);
+
+  if (mapped.length > 0) {
+    *type = trfs_extent_unwritten(&mapped) ? TRFS_RUN_UNWRITTEN : TRFS_RUN_MAPPED;
+  }
+  else {
+    struct trfs_delayed_extent const* const extent = trfs_find_delayed_extent(&info->delayed_extents, logical);
+
+    if (extent != NULL && extent->logical <= logical) {
+      *type = TRFS_RUN_DELAYED;
+      *count = min(*count, extent->logical + extent->length - logical);
+    }
+    else if (extent != NULL) {
+      *count = min(*count, extent->logical - logical);
+    }
+  }
+
+unlock:
+  up_read(&info->mapping_lock);
+  return error;
+}
+
+///
+/// Maps a run of blocks starting at the given logical block, allocating
+/// physical blocks when it is a hole (delayed blocks are allocated from their
+/// reservation).
+///
+/// On input *count is the number of wanted blocks, it is lowered to the length
+/// of the mapped (or newly allocated) run.
+///
+/// New blocks are unwritten when asked to (TRFS_EXTENT_UNWRITTEN), so that
+/// they read as zeroes until their data is on disk.
+///
+/// @return -EFBIG when the inode has no room for another extent, -EOPNOTSUPP
+/// when the block is in a compressed cluster.
+///
+/// @pre *count > 0
+///
+int trfs_map_new_blocks(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint64_t* const physical,
+  uint32_t* const count,
+  bool const unwritten
+) {
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+  struct trfs_extent mapped;
+
+  down_write(&info->mapping_lock);
+
+  // Also lowers *count to the length of the hole.
+  int error = trfs_lookup_extent(inode, logical, &mapped, count);
+  if (error || mapped.length > 0) {
+    error = error ? error : trfs_extent_physical(&mapped, logical, physical);
+    goto unlock;
+  }
+
+  struct trfs_delayed_extent const* const extent = trfs_find_delayed_extent(&info->delayed_extents, logical);
+
+  if (extent != NULL && extent->logical <= logical) {
+    *count = min(*count, extent->logical + extent->length - logical);
+
+    error = trfs_allocate_run(inode, logical, physical, count, TRFS_ALLOCATE_RESERVED, unwritten);
+    if (!error) {
+      trfs_remove_delayed_extents(&info->delayed_extents, logical, (uint64_t) logical + *count);
+    }
+  }
+  else {
+    if (extent != NULL) {
+      *count = min(*count, extent->logical - logical);
+    }
+
+    error = trfs_allocate_run(inode, logical, physical, count, 0, unwritten);
+  }
+
+unlock:
+  up_write(&info->mapping_lock);
+  return error;
+}
+
+///
+/// Maps the given logical block, allocating a physical block when it is a
+/// hole (see trfs_map_new_blocks()).
+///
+int trfs_map_new_block(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint64_t* const physical
+) {
+  uint32_t count = 1;
+  return trfs_map_new_blocks(inode, logical, physical, &count, false);
+}
+
+///
+/// Frees the blocks past the end of the file (i_size) and gives back the
+/// reservation of its delayed blocks, the page cache has to be truncated first.
+///
+/// A compressed cluster holding the end of the file is kept whole, it has to be
+/// expanded first (see trfs_expand_compressed_clusters()).
+///
+void trfs_truncate_blocks(
+  struct inode* const inode
+) {
+  struct super_block* const super_block = inode->i_sb;
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+  uint64_t const size = (uint64_t) i_size_read(inode);
+  uint64_t const first = (size + super_block->s_blocksize - 1) >> super_block->s_blocksize_bits;
+
+  if (first <= U32_MAX) {
+    trfs_undelay_blocks(inode, (uint32_t) first, (uint64_t) U32_MAX + 1);
+  }
+
+  down_write(&info->mapping_lock);
+  int const error = trfs_truncate_extents(inode, first);
+  up_write(&info->mapping_lock);
+
+  // The blocks that could not be freed stay allocated to the inode.
+  if (error) {
+    TRFS_ERROR("Could not truncate the blocks of inode [%lu].\n", inode->i_ino);
+  }
+}
+
+///
+/// Allocates unwritten blocks for the holes of [logical, end) (see
+/// fallocate(2)), the blocks already mapped and the delayed ones are left
+/// untouched. Only the extent tree is written, the blocks read as zeroes until
+/// data is written to them.
+///
+/// @return -ENOSPC when the disk is full, the blocks allocated so far are kept.
+///
+int trfs_preallocate_blocks(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint64_t const end
+) {
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+  uint64_t next = logical;
+  int error = 0;
+
+  down_write(&info->mapping_lock);
+
+  while (next < end) {
+    uint32_t count = (uint32_t) min_t(uint64_t, end - next, U32_MAX);
+    struct trfs_extent mapped;
+    uint64_t physical;
+
+    // Also lowers count to the length of the hole.
+    if ((error = trfs_lookup_extent(inode, (uint32_t) next, &mapped, &count))) {
+      break;
+    }
+
+    if (mapped.length == 0) {
+      struct trfs_delayed_extent const* const extent = trfs_find_delayed_extent(&info->delayed_extents, (uint32_t) next);
+
+      if (extent != NULL && extent->logical <= next) {
+        count = min(count, (uint32_t) ((uint64_t) extent->logical + extent->length - next));
+      }
+      else {
+        if (extent != NULL) {
+          count = min(count, (uint32_t) (extent->logical - next));
+        }
+
+        if ((error = trfs_allocate_run(inode, (uint32_t) next, &physical, &count, 0, true))) {
+          break;
+        }
+      }
+    }
+
+    next += count;
+  }
+
+  up_write(&info->mapping_lock);
+  return error;
+}
+
+///
+/// Marks the blocks of [logical, end) written, once their data is on disk (see
+/// trfs_convert_unwritten_extents()).
+///
+int trfs_convert_unwritten_blocks(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint64_t const end
+) {
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+
+  down_write(&info->mapping_lock);
+  int const error = trfs_convert_unwritten_extents(inode, logical, end);
+  up_write(&info->mapping_lock);
+
+  return error;
+}
+
+///
+/// Frees the blocks of [logical, end) and gives back the reservation of its
+/// delayed blocks (see fallocate(2)), the page cache has to be truncated
+/// first.
+///
+/// A compressed cluster straddling the ends of the range is kept whole, it has
+/// to be expanded first (see trfs_expand_compressed_clusters()).
+///
+int trfs_punch_blocks(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint64_t const end
+) {
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+
+  trfs_undelay_blocks(inode, logical, end);
+
+  down_write(&info->mapping_lock);
+  int const error = trfs_punch_extents(inode, logical, end);
+  up_write(&info->mapping_lock);
+
+  return error;
+}
+
+// ╔═╗┬ ┬┌─┐┬─┐┬┌┐┌┌─┐
+// ╚═╗├─┤├─┤├┬┘│││││ ┬
+// ╚═╝┴ ┴┴ ┴┴└─┴┘└┘└─┘
+
+// Shared Blocks:
+// Cloning a range of a file (FICLONE, copy_file_range(2)) maps the blocks of
+// the source in the target too, no data is copied: both files are flagged
+// TRFS_INODE_SHARED and the blocks get one more reference (see
+// trfs/refcount.c). A shared block is never written in place, the first write
+// maps new blocks in place of the shared ones (copy on write, see
+// trfs_unshare_blocks()).
+
+///
+/// Maps the blocks of the source range [logical, logical + count) in the target
+/// from the given logical block onwards, sharing them in place of the blocks
+/// of the target. Holes and unwritten blocks of the source are punched in the
+/// target.
+///
+/// The target is replaced one run at a time, its blocks are only punched once
+/// the blocks replacing them have their reference: a failure leaves the rest
+/// of the target range as it was.
+///
+/// @return -EMLINK when a block is shared too many times, -EFBIG when the
+///   target has no room for another extent. The blocks cloned so far are kept.
+///
+/// @pre Both inodes are locked, the source range has been written back and the
+///   page cache of the target range truncated.
+///
+int trfs_clone_blocks(
+  struct inode* const source,
+  uint32_t const logical,
+  struct inode* const target,
+  uint32_t const target_logical,
+  uint32_t const count
+) {
+  struct super_block* const super_block = target->i_sb;
+  struct trfs_inode_info* const source_info = trfs_inode_info(source);
+  struct trfs_inode_info* const target_info = trfs_inode_info(target);
+  uint32_t offset = 0;
+  int error = 0;
+
+  // Flagged before any block is shared (the source may be the target).
+  down_write(&source_info->mapping_lock);
+  WRITE_ONCE(source_info->flags, source_info->flags | TRFS_INODE_SHARED);
+  up_write(&source_info->mapping_lock);
+  mark_inode_dirty(source);
+
+  down_write(&target_info->mapping_lock);
+  WRITE_ONCE(target_info->flags, target_info->flags | TRFS_INODE_SHARED);
+  up_write(&target_info->mapping_lock);
+  mark_inode_dirty(target);
+
+  while (offset < count) {
+    uint32_t run = count - offset;
+    uint32_t const at = target_logical + offset;
+    struct trfs_extent hole;
+    enum trfs_run_type type;
+    uint64_t physical;
+
+    if ((error = trfs_map_blocks(source, logical + offset, &physical, &run, &type))) {
+      break;
+    }
+
+    if (type == TRFS_RUN_MAPPED && (error = trfs_share_blocks(super_block, physical, run))) {
+      break;
+    }
+
+    if ((error = trfs_punch_blocks(target, at, (uint64_t) at + run))) {
+      if (type == TRFS_RUN_MAPPED) {
+        trfs_release_shared_blocks(super_block, physical, run);
+      }
+
+      break;
+    }
+
+    if (type == TRFS_RUN_MAPPED) {
+      uint32_t mapped = run;
+
+      down_write(&target_info->mapping_lock);
+
+      // The run must not cross the key of the next node of the extent tree
+      // (see trfs_allocate_run()), the rest of it is cloned next.
+      error = trfs_lookup_extent(target, at, &hole, &mapped);
+      if (!error && WARN_ON_ONCE(hole.length > 0)) {
+        error = -EIO;
+      }
+
+      if (!error) {
+        error = trfs_insert_extent(target, at, physical, mapped, 0);
+      }
+
+      up_write(&target_info->mapping_lock);
+
+      // The blocks not mapped by the target are still mapped by the source,
+      // nothing is freed.
+      if (error) {
+        mapped = 0;
+      }
+
+      if (mapped < run) {
+        trfs_release_shared_blocks(super_block, physical + mapped, run - mapped);
+      }
+
+      if (error) {
+        break;
+      }
+
+      run = mapped;
+    }
+
+    offset += run;
+  }
+
+  return error;
+}
+
+///
+/// Reserves a block for each shared block of [logical, logical + count) that
+/// is not reserved yet: buffered writes only dirty the page cache, the copy of
+/// the shared blocks is allocated at writeback from this reservation (see
+/// trfs_unshare_blocks()), so that it cannot fail on a full disk.
+///
+/// @return -ENOSPC when the blocks cannot be reserved.
+///
+int trfs_reserve_cow_blocks(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint32_t const count
+) {
+  struct super_block* const super_block = inode->i_sb;
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+  uint64_t const end = (uint64_t) logical + count;
+  uint64_t next = logical;
+  int error = 0;
+
+  down_write(&info->mapping_lock);
+
+  while (next < end) {
+    struct trfs_extent mapped;
+    uint64_t physical;
+    uint32_t run = (uint32_t) (end - next);
+    bool shared = false;
+
+    // Also lowers run to the end of the extent (or of the hole).
+    if ((error = trfs_lookup_extent(inode, (uint32_t) next, &mapped, &run))) {
+      break;
+    }
+
+    if (mapped.length > 0 && !trfs_extent_unwritten(&mapped)) {
+      if ((error = trfs_extent_physical(&mapped, (uint32_t) next, &physical))
+        || (error = trfs_lookup_shared_blocks(super_block, physical, &run, &shared))
+      ) {
+        break;
+      }
+    }
+
+    if (shared) {
+      struct trfs_delayed_extent const* const extent = trfs_find_delayed_extent(&info->cow_extents, (uint32_t) next);
+
+      if (extent != NULL && extent->logical <= next) {
+        run = (uint32_t) min_t(uint64_t, run, (uint64_t) extent->logical + extent->length - next);
+      }
+      else {
+        if (extent != NULL) {
+          run = min(run, (uint32_t) (extent->logical - next));
+        }
+
+        if ((error = trfs_reserve_blocks(super_block, run))) {
+          break;
+        }
+
+        if ((error = trfs_insert_delayed_extent(&info->cow_extents, (uint32_t) next, run))) {
+          trfs_unreserve_blocks(super_block, run);
+          break;
+        }
+      }
+    }
+
+    next += run;
+  }
+
+  up_write(&info->mapping_lock);
+  return error;
+}
+
+///
+/// Gives the blocks mapped from the given logical block onwards blocks of
+/// their own when they are shared with other files: new blocks are allocated
+/// and mapped in place of the shared ones, unwritten until the caller has
+/// written them whole (see trfs_convert_unwritten_blocks()). Only the first
+/// `written` blocks, the ones the caller writes whole, are copied.
+/// *count (at most the number of wanted blocks on input) is lowered to the
+/// length of the run, *physical is set to its first block (0 for a hole) and
+/// *type to what the run is (TRFS_RUN_UNWRITTEN for new blocks).
+///
+/// Blocks that are not shared, unwritten blocks and holes are left untouched.
+/// The copies reserved by trfs_reserve_cow_blocks() are allocated from their
+/// reservation, it is given back for the blocks that are not shared anymore.
+///
+/// @return -ENOSPC when the disk is full.
+///
+/// @pre *count > 0
+/// @pre written > 0
+///
+int trfs_unshare_blocks(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint32_t const written,
+  uint64_t* const physical,
+  uint32_t* const count,
+  enum trfs_run_type* const type
+) {
+  struct super_block* const super_block = inode->i_sb;
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+  struct trfs_extent mapped;
+  uint64_t start;
+  bool shared;
+  unsigned int flags = 0;
+
+  down_write(&info->mapping_lock);
+
+  // Also lowers *count to the end of the extent.
+  int error = trfs_lookup_extent(inode, logical, &mapped, count);
+  if (error || (error = trfs_extent_physical(&mapped, logical, physical))) {
+    goto unlock;
+  }
+
+  *type = mapped.length == 0
+    ? TRFS_RUN_HOLE
+    : trfs_extent_unwritten(&mapped) ? TRFS_RUN_UNWRITTEN : TRFS_RUN_MAPPED;
+
+  if (*type != TRFS_RUN_MAPPED || !(info->flags & TRFS_INODE_SHARED)) {
+    goto unlock;
+  }
+
+  if ((error = trfs_lookup_shared_blocks(super_block, *physical, count, &shared))) {
+    goto unlock;
+  }
+
+  // The other files sharing the blocks have freed them since the write.
+  if (!shared) {
+    uint32_t const removed = trfs_remove_delayed_extents(&info->cow_extents, logical, (uint64_t) logical + *count);
+    if (removed > 0) {
+      trfs_unreserve_blocks(super_block, removed);
+    }
+
+    goto unlock;
+  }
+
+  *count = min(*count, written);
+
+  struct trfs_delayed_extent const* const extent = trfs_find_delayed_extent(&info->cow_extents, logical);
+
+  if (extent != NULL && extent->logical <= logical) {
+    *count = min(*count, extent->logical + extent->length - logical);
+    flags = TRFS_ALLOCATE_RESERVED;
+  }
+  else if (extent != NULL) {
+    *count = min(*count, extent->logical - logical);
+  }
+
+  // Also lowers *count to the length of the new run.
+  error = trfs_allocate_blocks(super_block, trfs_lookup_goal(inode, logical), count, &start, flags);
+  if (error) {
+    goto unlock;
+  }
+
+  if ((error = trfs_remap_extents(inode, logical, (uint64_t) logical + *count, start))) {
+    trfs_free_blocks(super_block, start, *count);
+
+    // The blocks are free again, so the reservation is not expected to fail.
+    if (flags & TRFS_ALLOCATE_RESERVED) {
+      trfs_reserve_blocks(super_block, *count);
+    }
+
+    goto unlock;
+  }
+
+  if (flags & TRFS_ALLOCATE_RESERVED) {
+    trfs_remove_delayed_extents(&info->cow_extents, logical, (uint64_t) logical + *count);
+  }
+
+  *physical = start;
+  *type = TRFS_RUN_UNWRITTEN;
+
+unlock:
+  up_write(&info->mapping_lock);
+  return error;
+}
+
+// ╔═╗┌─┐┌┬┐┌─┐┬─┐┌─┐┌─┐┌─┐┌─┐┌┬┐
+// ║  │ ││││├─┘├┬┘├┤ └─┐└─┐├┤  ││
+// ╚═╝└─┘┴ ┴┴  ┴└─└─┘└─┘└─┘└─┘─┴┘
+
+///
+/// Copies the compressed extent mapping the given logical block to *extent.
+///
+/// @return false when the block is not in a compressed cluster.
+///
+bool trfs_lookup_compressed(
+  struct inode* const inode,
+  uint32_t const logical,
+  struct trfs_extent* const extent
+) {
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+
+  down_read(&info->mapping_lock);
+
+  bool const compressed = (READ_ONCE(info->flags) & TRFS_INODE_COMPRESSED)
+    && !trfs_lookup_extent(inode, logical, extent, NULL)
+    && extent->length > 0
+    && trfs_extent_compression(extent) != TRFS_COMPRESS_NONE;
+
+  up_read(&info->mapping_lock);
+  return compressed;
+}
+
+///
+/// Returns true when a cluster of the file may be compressed (see
+/// TRFS_INODE_COMPRESSED).
+///
+bool trfs_has_compressed_extents(
+  struct inode* const inode
+) {
+  return READ_ONCE(trfs_inode_info(inode)->flags) & TRFS_INODE_COMPRESSED;
+}
+
+///
+/// Returns the physical block where the blocks of the given logical block
+/// would best be allocated (see trfs_lookup_goal()).
+///
+uint64_t trfs_allocation_goal(
+  struct inode* const inode,
+  uint32_t const logical
+) {
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+
+  down_read(&info->mapping_lock);
+  uint64_t const goal = trfs_lookup_goal(inode, logical);
+  up_read(&info->mapping_lock);
+
+  return goal;
+}
+
+///
+/// Finds the first cluster from *logical (rounded up to a cluster) whose
+/// blocks are all delayed, the clusters that can be compressed at writeback.
+///
+/// @return false when there is none.
+///
+bool trfs_next_delayed_cluster(
+  struct inode* const inode,
+  uint32_t* const logical
+) {
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+  uint32_t const cluster_blocks = trfs_cluster_blocks(inode);
+  bool found = false;
+
+  down_read(&info->mapping_lock);
+
+  // Contiguous delayed extents are merged, a cluster is never split across two.
+  struct trfs_delayed_extent* extent = trfs_find_delayed_extent(&info->delayed_extents, *logical);
+
+  while (extent != NULL && !found) {
+    uint64_t const cluster = round_up((uint64_t) max(extent->logical, *logical), cluster_blocks);
+
+    if (cluster + cluster_blocks <= (uint64_t) extent->logical + extent->length) {
+      *logical = (uint32_t) cluster;
+      found = true;
+    }
+
+    struct rb_node* const next = rb_next(&extent->node);
+    extent = next != NULL ? delayed_entry(next) : NULL;
+  }
+
+  up_read(&info->mapping_lock);
+  return found;
+}
+
+///
+/// Maps the delayed cluster starting at the given logical block to its
+/// compressed form, in the given blocks allocated from the reservation of the
+/// cluster. The rest of the reservation is given back.
+///
+/// @return -EFBIG when the inode has no room for another extent.
+///
+/// @pre The whole cluster is delayed.
+///
+int trfs_map_compressed_cluster(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint64_t const physical,
+  uint32_t const blocks,
+  uint32_t const compression
+) {
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+  uint32_t removed = 0;
+
+  down_write(&info->mapping_lock);
+
+  int const error = trfs_insert_extent(
+    inode, logical, physical, blocks, compression << TRFS_EXTENT_COMPRESSION_SHIFT
+  );
+  if (!error) {
+    removed = trfs_remove_delayed_extents(&info->delayed_extents, logical, (uint64_t) logical + trfs_cluster_blocks(inode));
+  }
+
+  up_write(&info->mapping_lock);
+
+  if (removed > blocks) {
+    trfs_unreserve_blocks(inode->i_sb, removed - blocks);
+  }
+
+  return error;
+}
+
+///
+/// Turns the compressed cluster starting at the given logical block back into
+/// delayed blocks (up to the end of the file) and frees its compressed blocks.
+/// The pages of the cluster have to be uptodate, locked, and are to be dirtied
+/// by the caller.
+///
+/// @return -ENOSPC when the blocks of the cluster cannot be reserved.
+///
+int trfs_unmap_compressed_cluster(
+  struct inode* const inode,
+  uint32_t const logical
+) {
+  struct super_block* const super_block = inode->i_sb;
+  struct trfs_inode_info* const info = trfs_inode_info(inode);
+  uint64_t const size = (uint64_t) i_size_read(inode);
+  uint64_t const last = (size + super_block->s_blocksize - 1) >> super_block->s_blocksize_bits;
+  uint64_t const end = min(last, (uint64_t) logical + trfs_cluster_blocks(inode));
+  uint32_t const delayed = end > logical ? (uint32_t) (end - logical) : 0;
+
+  int error = trfs_reserve_blocks(super_block, delayed);
+  if (error) {
+    return error;
+  }
+
+  down_write(&info->mapping_lock);
+
+  struct trfs_extent extent;
+  error = trfs_lookup_extent(inode, logical, &extent, NULL);
+
+  if (
+    error
+    || extent.length == 0
+    || extent.logical != logical
+    || trfs_extent_compression(&extent) == TRFS_COMPRESS_NONE
+  ) {
+    // Already expanded (or the extent tree could not be read).
+    up_write(&info->mapping_lock);
+    trfs_unreserve_blocks(super_block, delayed);
+    return error;
+  }
+
+  if (delayed > 0 && (error = trfs_insert_delayed_extent(&info->delayed_extents, logical, delayed))) {
+    up_write(&info->mapping_lock);
+    trfs_unreserve_blocks(super_block, delayed);
+    return error;
+  }
+
+  // Also frees the compressed blocks.
+  if ((error = trfs_remove_extent(inode, logical))) {
+    trfs_remove_delayed_extents(&info->delayed_extents, logical, (uint64_t) logical + delayed);
+    up_write(&info->mapping_lock);
+    trfs_unreserve_blocks(super_block, delayed);
+    return error;
+  }
+
+  up_write(&info->mapping_lock);
+  return 0;
+}
@@ -0,0 +1,285 @@
+#ifndef TRFS_INODE_H
+#define TRFS_INODE_H
+
+#include <linux/fs.h>
+#include <linux/list.h>
+#include <linux/rbtree.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+#include <linux/workqueue.h>
+
+#include "trfs/super.h"
+
+struct buffer_head;
+struct writeback_control;
+
+///
+/// A run of blocks written to the page cache, reserved but not allocated yet
+/// (delayed allocation, or copy on write of shared blocks).
+///
+struct trfs_delayed_extent {
+  struct rb_node node;
+  uint32_t logical;
+  uint32_t length;
+};
+
+///
+/// In-memory inode, allocated from a dedicated slab cache (see
+/// trfs_inode_cache_init()) so that the VFS inode and the TRFS specific data
+/// come from a single allocation.
+///
+struct trfs_inode_info {
+  /// Protects the extents and the flags.
+  struct rw_semaphore mapping_lock;
+
+  /// TRFS_INODE_* flags (see trfs/super.h).
+  unsigned int flags;
+
+  /// The depth of the extent tree (0 when the root holds the extents).
+  uint32_t extent_depth;
+
+  /// The number of entries of the root of the extent tree.
+  uint32_t extent_count;
+
+  /// The root of the extent tree (see trfs/extent.c), sorted by logical block.
+  /// Integers are big-endian, as in the nodes of the tree.
+  union {
+    struct trfs_extent extents[TRFS_INODE_EXTENTS];
+    struct trfs_extent_index index[TRFS_INODE_INDEX_ENTRIES];
+  } extent_root;
+
+  /// Extents recently found in the nodes of the extent tree, sorted by
+  /// logical block (see trfs/extent.c).
+  struct rb_root cached_extents;
+
+  /// Protects cached_extents, lookups only hold the mapping lock for reading.
+  rwlock_t cache_lock;
+
+  /// Delayed extents sorted by logical block, they never overlap extents.
+  /// Also protected by the mapping lock.
+  struct rb_root delayed_extents;
+
+  /// Mapped runs of shared blocks written to the page cache, whose copies are
+  /// reserved (see trfs_reserve_cow_blocks()). Also protected by the mapping
+  /// lock.
+  struct rb_root cow_extents;
+
+  /// Writeback ioends of unwritten blocks whose bios completed, their blocks
+  /// are marked written by ioend_work (see trfs/data.c).
+  struct list_head ioend_list;
+
+  /// Protects ioend_list, taken from bio completion.
+  spinlock_t ioend_lock;
+
+  struct work_struct ioend_work;
+
+  struct inode vfs_inode;
+};
+
+static inline struct trfs_inode_info* trfs_inode_info(
+  struct inode const* const inode
+) {
+  return container_of(inode, struct trfs_inode_info, vfs_inode);
+}
+
+///
+/// What a run of blocks returned by trfs_map_blocks() is.
+///
+enum trfs_run_type {
+  /// Not mapped, reads as zeroes.
+  TRFS_RUN_HOLE,
+
+  /// Not mapped yet, reserved by a buffered write (see trfs_delay_blocks()).
+  TRFS_RUN_DELAYED,
+
+  /// Mapped to blocks holding data.
+  TRFS_RUN_MAPPED,
+
+  /// Mapped to preallocated blocks that read as zeroes (see
+  /// TRFS_EXTENT_UNWRITTEN).
+  TRFS_RUN_UNWRITTEN,
+};
+
+///
+/// Returns true when the content of the inode is stored in its record (see
+/// TRFS_INODE_INLINE).
+///
+static inline bool trfs_inode_is_inline(
+  struct inode const* const inode
+) {
+  return READ_ONCE(trfs_inode_info(inode)->flags) & TRFS_INODE_INLINE;
+}
+
+///
+/// Returns true when some blocks of the inode may be shared with other files
+/// (see TRFS_INODE_SHARED).
+///
+static inline bool trfs_inode_is_shared(
+  struct inode const* const inode
+) {
+  return READ_ONCE(trfs_inode_info(inode)->flags) & TRFS_INODE_SHARED;
+}
+
+///
+/// Returns the number of logical blocks of a compressed cluster (see
+/// TRFS_COMPRESS_CLUSTER_SIZE).
+///
+static inline uint32_t trfs_cluster_blocks(
+  struct inode const* const inode
+) {
+  return TRFS_COMPRESS_CLUSTER_SIZE >> inode->i_blkbits;
+}
+
+int trfs_inode_cache_init(void);
+void trfs_inode_cache_exit(void);
+
+struct inode* trfs_alloc_inode(struct super_block* const super_block);
+void trfs_free_inode(struct inode* const inode);
+void trfs_evict_inode(struct inode* const inode);
+
+int trfs_write_inode(
+  struct inode* const inode,
+  struct writeback_control* const wbc
+);
+
+int trfs_count_free_inodes(struct super_block* const super_block);
+
+struct trfs_inode* trfs_get_inode_record(
+  struct super_block* const super_block,
+  unsigned long const ino,
+  struct buffer_head** const buffer_head
+);
+
+struct inode* trfs_iget(
+  struct super_block* const super_block,
+  unsigned long const ino
+);
+
+struct inode* trfs_new_inode(
+  struct inode* const directory,
+  umode_t const mode
+);
+
+void trfs_clear_inline_flag(struct inode* const inode);
+
+int trfs_map_block(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint64_t* const physical
+);
+
+int trfs_map_blocks(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint64_t* const physical,
+  uint32_t* const count,
+  enum trfs_run_type* const type
+);
+
+int trfs_delay_blocks(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint32_t const count
+);
+
+void trfs_undelay_blocks(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint64_t const end
+);
+
+int trfs_allocate_delayed_blocks(
+  struct inode* const inode,
+  uint32_t const logical
+);
+
+int trfs_map_new_blocks(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint64_t* const physical,
+  uint32_t* const count,
+  bool const unwritten
+);
+
+int trfs_map_new_block(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint64_t* const physical
+);
+
+void trfs_truncate_blocks(struct inode* const inode);
+
+int trfs_preallocate_blocks(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint64_t const end
+);
+
+int trfs_convert_unwritten_blocks(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint64_t const end
+);
+
+int trfs_punch_blocks(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint64_t const end
+);
+
+int trfs_clone_blocks(
+  struct inode* const source,
+  uint32_t const logical,
+  struct inode* const target,
+  uint32_t const target_logical,
+  uint32_t const count
+);
+
+int trfs_reserve_cow_blocks(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint32_t const count
+);
+
+int trfs_unshare_blocks(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint32_t const written,
+  uint64_t* const physical,
+  uint32_t* const count,
+  enum trfs_run_type* const type
+);
+
+bool trfs_lookup_compressed(
+  struct inode* const inode,
+  uint32_t const logical,
+  struct trfs_extent* const extent
+);
+
+bool trfs_has_compressed_extents(struct inode* const inode);
+
+uint64_t trfs_allocation_goal(
+  struct inode* const inode,
+  uint32_t const logical
+);
+
+bool trfs_next_delayed_cluster(
+  struct inode* const inode,
+  uint32_t* const logical
+);
+
+int trfs_map_compressed_cluster(
+  struct inode* const inode,
+  uint32_t const logical,
+  uint64_t const physical,
+  uint32_t const blocks,
+  uint32_t const compression
+);
+
+int trfs_unmap_compressed_cluster(
+  struct inode* const inode,
+  uint32_t const logical
+);
+
+#endif // TRFS_INODE_H
@@ -56,9 +56,15 @@
 #define TRFS_NOTICE(fmt, ...) \
   TRFS_PRINTK(KERN_NOTICE, fmt, ##__VA_ARGS__)
 
-// Print an info-level message.
+// Print an info-level message, only built with TRFS_DEBUG (no_printk() still
+// checks the format and arguments).
+#ifdef TRFS_DEBUG
 #define TRFS_INFO(fmt, ...) \
   TRFS_PRINTK(KERN_INFO, fmt, ##__VA_ARGS__)
+#else
+#define TRFS_INFO(fmt, ...) \
+  no_printk(KERN_INFO fmt, ##__VA_ARGS__)
+#endif
 
 // Continues a previous log message (without '\n') in the same line.
 #define TRFS_CONT(fmt, ...) \
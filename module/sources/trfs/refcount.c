@@ -0,0 +1,294 @@
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/minmax.h>
+#include <linux/mutex.h>
+
+#include "trfs/alloc.h"
+#include "trfs/printk.h"
+#include "trfs/refcount.h"
+#include "trfs/super.h"
+
+// Shared Blocks:
+// With TRFS_FEATURE_INCOMPAT_REFLINK, a block may be mapped by several extents
+// (of one or several files, see FICLONE). Each group has a refcount table
+// right after its free-block bitmap, with one big-endian 16-bit count per
+// block: the number of extents mapping the block besides the first one. A
+// table written by mkfs is zeroed, nothing is shared.
+//
+// An extent unmapping a shared block only decrements its count, the block is
+// freed by the last one (see trfs_release_shared_blocks()). The table is only
+// looked up for the inodes flagged TRFS_INODE_SHARED, the other ones free their
+// blocks right away.
+//
+// As the bitmaps, the tables are updated in the buffer cache and written back
+// with it. Updates are serialized by the refcount lock of the group.
+
+///
+/// Returns the group of [start, start + count), NULL when the range is not in
+/// a single group (extents never cross groups, their metadata separates them).
+///
+static struct trfs_group* trfs_refcount_group(
+  struct super_block* const super_block,
+  uint64_t const start,
+  uint32_t const count
+) {
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
+
+  if (count == 0 || start + count < start || start + count > trfs_super_blocks(&info->super)) {
+    TRFS_ERROR("Invalid shared block range [%llu, +%u).\n", start, count);
+    return NULL;
+  }
+
+  uint32_t const group = trfs_block_group(info, start);
+  if (trfs_block_group(info, start + count - 1) != group) {
+    TRFS_ERROR("Block range [%llu, +%u) crosses a group boundary.\n", start, count);
+    return NULL;
+  }
+
+  return &info->groups[group];
+}
+
+///
+/// Returns the number of counts of a block of a refcount table.
+///
+static inline uint32_t trfs_refcounts_per_block(
+  struct super_block const* const super_block
+) {
+  return (uint32_t) (super_block->s_blocksize / TRFS_REFCOUNT_SIZE);
+}
+
+///
+/// Reads the block of the refcount table holding the count of the given block,
+/// *index is set to the position of the count in it.
+///
+static struct buffer_head* trfs_read_refcounts(
+  struct super_block* const super_block,
+  uint64_t const block,
+  uint32_t* const index
+) {
+  struct trfs_mount_info const* const info = trfs_mount_info(super_block);
+  uint32_t const group = trfs_block_group(info, block);
+  uint32_t const relative = (uint32_t) (block - trfs_group_first_block(&info->super, group));
+  uint64_t const table_block = trfs_group_refcount_block(&info->super, group)
+    + relative / trfs_refcounts_per_block(super_block);
+
+  *index = relative % trfs_refcounts_per_block(super_block);
+
+  struct buffer_head* const buffer_head = sb_bread(super_block, table_block);
+  if (!buffer_head) {
+    TRFS_ERROR("Could not read refcount block [%llu].\n", table_block);
+  }
+
+  return buffer_head;
+}
+
+///
+/// Drops a reference to the blocks of [start, start + count): the counts of
+/// the shared blocks are decremented, the other blocks are freed.
+///
+/// @pre Refcount lock of the group is held.
+///
+static void trfs_put_blocks(
+  struct super_block* const super_block,
+  uint64_t const start,
+  uint32_t const count
+) {
+  uint64_t const end = start + count;
+  uint64_t block = start;
+
+  // The first block of the run of unshared blocks to free.
+  uint64_t unshared = start;
+
+  while (block < end) {
+    uint32_t index;
+
+    // The blocks whose count cannot be read are leaked (and reported).
+    struct buffer_head* const buffer_head = trfs_read_refcounts(super_block, block, &index);
+    if (!buffer_head) {
+      break;
+    }
+
+    __be16* const counts = (void*) buffer_head->b_data;
+    uint32_t const length = (uint32_t) min_t(uint64_t, end - block, trfs_refcounts_per_block(super_block) - index);
+    bool dirty = false;
+
+    for (uint32_t offset = 0; offset < length; ++offset, ++block) {
+      uint16_t const refcount = be16_to_cpu(counts[index + offset]);
+
+      if (refcount == 0) {
+        continue;
+      }
+
+      counts[index + offset] = cpu_to_be16((uint16_t) (refcount - 1));
+      dirty = true;
+
+      if (block > unshared) {
+        trfs_free_blocks(super_block, unshared, (uint32_t) (block - unshared));
+      }
+
+      unshared = block + 1;
+    }
+
+    if (dirty) {
+      mark_buffer_dirty(buffer_head);
+    }
+
+    brelse(buffer_head);
+  }
+
+  if (block > unshared) {
+    trfs_free_blocks(super_block, unshared, (uint32_t) (block - unshared));
+  }
+}
+
+///
+/// Tells whether the blocks starting at the given one are shared, *count is
+/// lowered to the number of blocks that are all shared, or all not shared.
+///
+/// @return -EIO when the refcount table cannot be read.
+///
+/// @pre *count > 0
+///
+int trfs_lookup_shared_blocks(
+  struct super_block* const super_block,
+  uint64_t const start,
+  uint32_t* const count,
+  bool* const shared
+) {
+  struct trfs_group* const group = trfs_refcount_group(super_block, start, *count);
+  uint32_t done = 0;
+  int error = 0;
+
+  if (group == NULL) {
+    return -EIO;
+  }
+
+  mutex_lock(&group->refcount_lock);
+
+  while (done < *count) {
+    uint32_t index;
+
+    struct buffer_head* const buffer_head = trfs_read_refcounts(super_block, start + done, &index);
+    if (!buffer_head) {
+      error = -EIO;
+      break;
+    }
+
+    __be16 const* const counts = (void*) buffer_head->b_data;
+    uint32_t const length = min(*count - done, trfs_refcounts_per_block(super_block) - index);
+    uint32_t same = 0;
+
+    if (done == 0) {
+      *shared = counts[index] != 0;
+    }
+
+    while (same < length && (counts[index + same] != 0) == *shared) {
+      ++same;
+    }
+
+    brelse(buffer_head);
+    done += same;
+
+    if (same < length) {
+      break;
+    }
+  }
+
+  mutex_unlock(&group->refcount_lock);
+
+  if (!error) {
+    *count = done;
+  }
+
+  return error;
+}
+
+///
+/// Adds a reference to the blocks of [start, start + count), mapped by one more
+/// extent. Either all the blocks get one or none does.
+///
+/// @return -EMLINK when a block has TRFS_REFCOUNT_MAX references already, -EIO
+///   when the refcount table cannot be read.
+///
+int trfs_share_blocks(
+  struct super_block* const super_block,
+  uint64_t const start,
+  uint32_t const count
+) {
+  struct trfs_group* const group = trfs_refcount_group(super_block, start, count);
+  uint32_t done = 0;
+  int error = 0;
+
+  if (group == NULL) {
+    return -EIO;
+  }
+
+  mutex_lock(&group->refcount_lock);
+
+  while (done < count) {
+    uint32_t index;
+
+    struct buffer_head* const buffer_head = trfs_read_refcounts(super_block, start + done, &index);
+    if (!buffer_head) {
+      error = -EIO;
+      break;
+    }
+
+    __be16* const counts = (void*) buffer_head->b_data;
+    uint32_t const length = min(count - done, trfs_refcounts_per_block(super_block) - index);
+    uint32_t shared = 0;
+
+    for (; shared < length; ++shared) {
+      uint16_t const refcount = be16_to_cpu(counts[index + shared]);
+
+      if (refcount == TRFS_REFCOUNT_MAX) {
+        break;
+      }
+
+      counts[index + shared] = cpu_to_be16((uint16_t) (refcount + 1));
+    }
+
+    if (shared > 0) {
+      mark_buffer_dirty(buffer_head);
+    }
+
+    brelse(buffer_head);
+    done += shared;
+
+    if (shared < length) {
+      error = -EMLINK;
+      break;
+    }
+  }
+
+  // The blocks referenced so far are still mapped by their extent, they are
+  // not freed.
+  if (error && done > 0) {
+    trfs_put_blocks(super_block, start, done);
+  }
+
+  mutex_unlock(&group->refcount_lock);
+  return error;
+}
+
+///
+/// Releases the blocks of [start, start + count), unmapped by an extent: the
+/// blocks still mapped by other extents lose a reference, the other ones are
+/// freed (see trfs_free_blocks()).
+///
+void trfs_release_shared_blocks(
+  struct super_block* const super_block,
+  uint64_t const start,
+  uint32_t const count
+) {
+  struct trfs_group* const group = trfs_refcount_group(super_block, start, count);
+
+  // Leaked (and reported).
+  if (group == NULL) {
+    return;
+  }
+
+  mutex_lock(&group->refcount_lock);
+  trfs_put_blocks(super_block, start, count);
+  mutex_unlock(&group->refcount_lock);
+}
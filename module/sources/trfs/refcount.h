@@ -0,0 +1,27 @@
+#ifndef TRFS_REFCOUNT_H
+#define TRFS_REFCOUNT_H
+
+#include <linux/types.h>
+
+struct super_block;
+
+int trfs_lookup_shared_blocks(
+  struct super_block* const super_block,
+  uint64_t const start,
+  uint32_t* const count,
+  bool* const shared
+);
+
+int trfs_share_blocks(
+  struct super_block* const super_block,
+  uint64_t const start,
+  uint32_t const count
+);
+
+void trfs_release_shared_blocks(
+  struct super_block* const super_block,
+  uint64_t const start,
+  uint32_t const count
+);
+
+#endif // TRFS_REFCOUNT_H
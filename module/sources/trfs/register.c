@@ -44,31 +44,12 @@
 
 #define TRFS_NAME "trfs"
 
-static struct dentry* trfs_mount(
-  struct file_system_type* const file_system_type,
-  int const flags,
-  char const* const device_name,
-  void* const data // ASCII key-value options?
-) {
-  // See mount_bdev() and mount_nodev().
-  struct dentry* const root_entry = mount_bdev(
-    file_system_type, flags, device_name, data, trfs_fill_super_block
-  );
-
-  // root_entry is either a valid pointer or an error code.
-  if (unlikely(IS_ERR(root_entry))) {
-    TRFS_ERROR("Error while mounting %s on %s\n", TRFS_NAME, device_name);
-    return root_entry;
-  }
-
-  TRFS_INFO("%s is succesfully mounted on %s\n", TRFS_NAME, device_name);
-  return root_entry;
-}
-
 struct file_system_type trfs_type = {
   .owner = THIS_MODULE, // NULL for built-in module?
   .name = TRFS_NAME,
-  .mount = trfs_mount,
+  // Mount options are parsed by the fs_context API (see trfs/super.c).
+  .init_fs_context = trfs_init_fs_context,
+  .parameters = trfs_fs_parameters,
   .kill_sb = trfs_kill_super_block,
   .fs_flags = FS_REQUIRES_DEV,
 };
@@ -0,0 +1,104 @@
+#include <linux/cpumask.h>
+#include <linux/jump_label.h>
+#include <linux/percpu.h>
+
+#include "trfs/printk.h"
+#include "trfs/stats.h"
+#include "trfs/super.h"
+
+// Statistics:
+// Each mount counts its operations, the time they take (log2 histograms) and
+// a few events, in per-CPU structures: accounting is a few CPU-local
+// increments, the cost is on the readers (see misc/procfs.c). Timing is off
+// by default: the operations are only counted until it is enabled (see
+// trfs_start_timing()).
+
+DEFINE_STATIC_KEY_FALSE(trfs_timing);
+
+///
+/// Allocates the statistics of a mount, before anything is accounted.
+///
+int trfs_register_stats(
+  struct super_block* const super_block
+) {
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
+
+  // Zeroed.
+  info->stats = alloc_percpu(struct trfs_cpu_stats);
+  if (info->stats == NULL) {
+    TRFS_ERROR("Could not allocate the statistics.\n");
+    return -ENOMEM;
+  }
+
+  return 0;
+}
+
+///
+/// Frees the statistics of a mount, once nothing is accounted anymore. Also
+/// called when trfs_register_stats() failed or was not called.
+///
+void trfs_unregister_stats(
+  struct super_block* const super_block
+) {
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
+
+  free_percpu(info->stats);
+  info->stats = NULL;
+}
+
+u64 trfs_sum_operations(
+  struct trfs_mount_info const* const info,
+  enum trfs_operation const operation
+) {
+  u64 sum = 0;
+  int cpu;
+
+  for_each_possible_cpu(cpu) {
+    sum += per_cpu_ptr(info->stats, cpu)->operations[operation];
+  }
+
+  return sum;
+}
+
+u64 trfs_sum_nanoseconds(
+  struct trfs_mount_info const* const info,
+  enum trfs_operation const operation
+) {
+  u64 sum = 0;
+  int cpu;
+
+  for_each_possible_cpu(cpu) {
+    sum += per_cpu_ptr(info->stats, cpu)->nanoseconds[operation];
+  }
+
+  return sum;
+}
+
+u64 trfs_sum_latency(
+  struct trfs_mount_info const* const info,
+  enum trfs_operation const operation,
+  unsigned int const bucket
+) {
+  u64 sum = 0;
+  int cpu;
+
+  for_each_possible_cpu(cpu) {
+    sum += per_cpu_ptr(info->stats, cpu)->latency[operation][bucket];
+  }
+
+  return sum;
+}
+
+u64 trfs_sum_counter(
+  struct trfs_mount_info const* const info,
+  enum trfs_counter const counter
+) {
+  u64 sum = 0;
+  int cpu;
+
+  for_each_possible_cpu(cpu) {
+    sum += per_cpu_ptr(info->stats, cpu)->counters[counter];
+  }
+
+  return sum;
+}
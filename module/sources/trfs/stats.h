@@ -0,0 +1,124 @@
+#ifndef TRFS_STATS_H
+#define TRFS_STATS_H
+
+#include <linux/jump_label.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/minmax.h>
+#include <linux/percpu.h>
+#include <linux/types.h>
+
+#include "trfs/super.h"
+
+///
+/// Operations whose count and latency are accounted (see trfs_account()).
+///
+enum trfs_operation {
+  TRFS_OPERATION_LOOKUP,
+  TRFS_OPERATION_READDIR,
+  TRFS_OPERATION_READ_FOLIO,
+  TRFS_OPERATION_READAHEAD,
+  TRFS_OPERATION_WRITEPAGES,
+  TRFS_OPERATION_DIRECT_READ,
+  TRFS_OPERATION_DIRECT_WRITE,
+  TRFS_OPERATION_ALLOCATE,
+  TRFS_OPERATION_FSYNC,
+  TRFS_OPERATION_SYNC_FS,
+  TRFS_OPERATIONS,
+};
+
+///
+/// Event counters (see trfs_count()).
+///
+enum trfs_counter {
+  TRFS_COUNTER_PAGES_READ,
+  TRFS_COUNTER_PAGES_WRITTEN,
+  TRFS_COUNTER_BLOCKS_ALLOCATED,
+  TRFS_COUNTER_BLOCKS_FREED,
+  TRFS_COUNTER_EXTENT_CACHE_HITS,
+  TRFS_COUNTER_EXTENT_CACHE_MISSES,
+  TRFS_COUNTER_NEGATIVE_LOOKUPS,
+  TRFS_COUNTERS,
+};
+
+/// Latency bucket i counts the durations in [2^i, 2^(i + 1)) nanoseconds, the
+/// first one also counts 0 and the last one everything above (about 2s).
+#define TRFS_LATENCY_BUCKETS 32u
+
+///
+/// The statistics of a mount gathered by one CPU, so that accounting does not
+/// share cache lines between CPUs. Readers sum the CPUs (see trfs_sum_*()),
+/// without locks: a sum may miss the operations being accounted.
+///
+struct trfs_cpu_stats {
+  u64 operations[TRFS_OPERATIONS];
+
+  /// Total time spent in each operation.
+  u64 nanoseconds[TRFS_OPERATIONS];
+
+  u64 latency[TRFS_OPERATIONS][TRFS_LATENCY_BUCKETS];
+  u64 counters[TRFS_COUNTERS];
+};
+
+/// Operations are only timed when enabled (see /sys/fs/trfs/timing), reading
+/// the clock twice per operation is not free.
+DECLARE_STATIC_KEY_FALSE(trfs_timing);
+
+int trfs_register_stats(struct super_block* const super_block);
+void trfs_unregister_stats(struct super_block* const super_block);
+
+u64 trfs_sum_operations(struct trfs_mount_info const* const info, enum trfs_operation const operation);
+u64 trfs_sum_nanoseconds(struct trfs_mount_info const* const info, enum trfs_operation const operation);
+u64 trfs_sum_counter(struct trfs_mount_info const* const info, enum trfs_counter const counter);
+
+u64 trfs_sum_latency(
+  struct trfs_mount_info const* const info,
+  enum trfs_operation const operation,
+  unsigned int const bucket
+);
+
+///
+/// Returns the start time of an operation (ktime_get_ns()), 0 when timing is
+/// disabled.
+///
+static inline u64 trfs_start_timing(void) {
+  return static_branch_unlikely(&trfs_timing) ? ktime_get_ns() : 0;
+}
+
+///
+/// Accounts an operation started at the given time (see trfs_start_timing()),
+/// an operation that was not timed (0) is only counted.
+///
+static inline void trfs_account(
+  struct super_block* const super_block,
+  enum trfs_operation const operation,
+  u64 const started
+) {
+  struct trfs_cpu_stats __percpu* const stats = trfs_mount_info(super_block)->stats;
+
+  this_cpu_inc(stats->operations[operation]);
+  if (started == 0) {
+    return;
+  }
+
+  u64 const duration = ktime_get_ns() - started;
+  unsigned int const bucket = duration
+    ? min_t(unsigned int, ilog2(duration), TRFS_LATENCY_BUCKETS - 1)
+    : 0;
+
+  this_cpu_add(stats->nanoseconds[operation], duration);
+  this_cpu_inc(stats->latency[operation][bucket]);
+}
+
+///
+/// Adds to a counter.
+///
+static inline void trfs_count(
+  struct super_block* const super_block,
+  enum trfs_counter const counter,
+  u64 const value
+) {
+  this_cpu_add(trfs_mount_info(super_block)->stats->counters[counter], value);
+}
+
+#endif // TRFS_STATS_H
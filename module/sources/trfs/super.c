@@ -1,60 +1,268 @@
+#include <linux/backing-dev.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/log2.h>
-
+#include <linux/mm.h>
+#include <linux/seq_file.h>
+#include <linux/statfs.h>
+#include <linux/workqueue.h>
+
+#include "misc/procfs.h"
+#include "misc/sysfs.h"
+#include "trfs/compress.h"
+#include "trfs/extent.h"
 #include "trfs/file.h"
+#include "trfs/inode.h"
 #include "trfs/printk.h"
+#include "trfs/stats.h"
 #include "trfs/super.h"
+#include "trace/events/trfs.h"
 
 // The Superblock Object:
 // A superblock object represents a mounted filesystem.
 // https://www.kernel.org/doc/Documentation/filesystems/vfs.txt
 
-// static const struct super_operations trfs_super_operations = {
-//   .statfs = simple_statfs, // Provided by the kernel
-//   .drop_inode = generic_delete_inode, // Provided by the kernel
-// };
-
-// What about:
-// super_block.s_dirt:
-//   Set when superblock is changed, and cleared whenever it is written back to disk.
-// super_block.s_dirty:
-//   A list of all dirty inodes. Recall that if inode is dirty (inode->i_state & I_DIRTY)
-//   then it is on superblock-specific dirty list linked via inode->i_list.
-int trfs_save_super_block(
+// ╔═╗┌─┐┌┬┐┌┬┐┬┌┬┐
+// ║  │ ││││││││ │
+// ╚═╝└─┘┴ ┴┴ ┴┴ ┴
+
+///
+/// Copies the in-memory superblock (and its counters) to the pinned
+/// superblock buffer, converting integers to big-endian, and marks the buffer
+/// dirty. Nothing is written here: the buffer is flushed by sync_fs(), by the
+/// commit work, or by the regular block device writeback.
+///
+void trfs_save_super_block(
   struct super_block* const super_block
 ) {
-  // After sb_bread, the buffer_head and the data block contents are pinned in
-  // memory. The page cache won't remove them. Nevertheless, could buffer_head
-  // exists but block data not in memory (cache miss)?
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
+  struct buffer_head* const buffer_head = info->super_block_head;
+  struct trfs_super_block_info* const disk_info = (void*) buffer_head->b_data;
+
+  // Only the counters change once mounted. The buffer may be under writeback,
+  // do not let it see a torn superblock.
+  lock_buffer(buffer_head);
+
+  // The per-CPU counters are folded here only.
+  uint64_t const free_blocks = (uint64_t) percpu_counter_sum_positive(&info->free_blocks);
+  disk_info->free_blocks = cpu_to_be32((uint32_t) free_blocks);
+  if (info->super.feature_incompat & TRFS_FEATURE_INCOMPAT_64BIT) {
+    disk_info->free_blocks_hi = cpu_to_be32((uint32_t) (free_blocks >> 32));
+  }
 
-  // Disk blocks are represented by buffer_heads. Actual data is in buffer_head->b_data.
-  struct buffer_head* const buffer_head = sb_bread(
-    super_block, TRFS_SUPER_BLOCK_AT_BLOCK
-  );
+  disk_info->free_inodes = cpu_to_be32((uint32_t) percpu_counter_sum_positive(&info->free_inodes));
 
-  if (!buffer_head) {
-    TRFS_ERROR("Could not read superblock at block [%u].\n", TRFS_SUPER_BLOCK_AT_BLOCK);
-    return -EIO;
+  unlock_buffer(buffer_head);
+  mark_buffer_dirty(buffer_head);
+}
+
+///
+/// Sets an incompatible feature flag on a mounted file system (the first time
+/// it is used), the superblock is written back with the next commit.
+///
+void trfs_set_feature_incompat(
+  struct super_block* const super_block,
+  uint32_t const feature
+) {
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
+  struct buffer_head* const buffer_head = info->super_block_head;
+  struct trfs_super_block_info* const disk_info = (void*) buffer_head->b_data;
+
+  if (READ_ONCE(info->super.feature_incompat) & feature) {
+    return;
   }
 
-  // *((struct oneblockfs_super *)bh->b_data) = *super_block->s_fs_info;
+  // The buffer lock also serializes concurrent setters.
+  lock_buffer(buffer_head);
+  WRITE_ONCE(info->super.feature_incompat, info->super.feature_incompat | feature);
+  disk_info->feature_incompat = cpu_to_be32(info->super.feature_incompat);
+  unlock_buffer(buffer_head);
 
-  // Mark the buffer_head dirty so that kernel will eventually sync it to disk.
   mark_buffer_dirty(buffer_head);
+  trfs_dirty_super_block(super_block);
+}
+
+///
+/// Called when the superblock counters change, schedules the commit work
+/// unless it is already pending.
+///
+void trfs_dirty_super_block(
+  struct super_block* const super_block
+) {
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
+
+  if (!delayed_work_pending(&info->commit_work)) {
+    schedule_delayed_work(&info->commit_work, READ_ONCE(info->commit_interval) * HZ);
+  }
+}
+
+static void trfs_commit_super_block(
+  struct work_struct* const work
+) {
+  struct trfs_mount_info* const info = container_of(
+    to_delayed_work(work), struct trfs_mount_info, commit_work
+  );
+
+  // Nothing is written to a read-only file system, the superblock was written
+  // when it went read-only (see trfs_reconfigure()).
+  if (sb_rdonly(info->vfs_super)) {
+    return;
+  }
+
+  trfs_save_super_block(info->vfs_super);
+
+  // Asynchronous, the buffer is written along with the rest of the block
+  // device by the next sync_fs(wait) if it is still in flight.
+  write_dirty_buffer(info->super_block_head, 0);
+}
+
+///
+/// Writes the superblock back, and waits for it when `wait` is set. Called
+/// twice by sync_filesystem(): first without waiting, then waiting.
+///
+static int trfs_sync_fs(
+  struct super_block* const super_block,
+  int const wait
+) {
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
+
+  if (sb_rdonly(super_block)) {
+    return 0;
+  }
+
+  u64 const started = trfs_start_timing();
+  int error = 0;
+
+  trfs_save_super_block(super_block);
+
+  if (wait) {
+    cancel_delayed_work(&info->commit_work);
+
+    if ((error = sync_dirty_buffer(info->super_block_head))) {
+      TRFS_ERROR("Could not write the superblock.\n");
+    }
+  }
+
+  trace_trfs_sync_fs(super_block, wait, error, started);
+  trfs_account(super_block, TRFS_OPERATION_SYNC_FS, started);
+  return error;
+}
+
+///
+/// Called on unmount, once all the inodes are evicted (and their blocks
+/// released): the superblock is written a last time and unpinned.
+///
+static void trfs_put_super(
+  struct super_block* const super_block
+) {
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
+
+  cancel_delayed_work_sync(&info->commit_work);
+
+  if (!sb_rdonly(super_block)) {
+    trfs_save_super_block(super_block);
+    sync_dirty_buffer(info->super_block_head);
+  }
+
+  brelse(info->super_block_head);
+  info->super_block_head = NULL;
+}
+
+///
+/// Reports the file system usage from the per-CPU counters, without folding
+/// them (the values are approximate by up to percpu_counter_batch per CPU).
+/// Blocks reserved by delayed allocations are not free anymore.
+///
+static int trfs_statfs(
+  struct dentry* const dentry,
+  struct kstatfs* const buffer
+) {
+  struct super_block* const super_block = dentry->d_sb;
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
+
+  s64 const free = percpu_counter_read_positive(&info->free_blocks);
+  s64 const dirty = percpu_counter_read_positive(&info->dirty_blocks);
+
+  buffer->f_type = TRFS_SUPER_MAGIC;
+  buffer->f_bsize = super_block->s_blocksize;
+  buffer->f_blocks = trfs_super_blocks(&info->super);
+  buffer->f_bfree = free > dirty ? (u64) (free - dirty) : 0;
+  buffer->f_bavail = buffer->f_bfree;
+  buffer->f_files = info->super.inodes - 1; // Inode 0 is never used.
+  buffer->f_ffree = (u64) percpu_counter_read_positive(&info->free_inodes);
+  buffer->f_namelen = TRFS_NAME_LENGTH;
+  buffer->f_fsid = u64_to_fsid(huge_encode_dev(super_block->s_bdev->bd_dev));
+
+  return 0;
+}
+
+///
+/// Shows the mount options that differ from the defaults, in /proc/mounts.
+///
+static int trfs_show_options(
+  struct seq_file* const file,
+  struct dentry* const root
+) {
+  struct super_block const* const super_block = root->d_sb;
+  struct trfs_mount_info const* const info = trfs_mount_info(super_block);
+
+  if (info->commit_interval != TRFS_DEFAULT_COMMIT_INTERVAL) {
+    seq_printf(file, ",commit=%u", info->commit_interval);
+  }
+
+  if (info->readahead != TRFS_READAHEAD_DEVICE) {
+    seq_printf(file, ",readahead=%u", info->readahead);
+  }
 
-  // Actually flush dirty buffer to disk.
-  sync_dirty_buffer(buffer_head);
+  if (info->alloc_policy == TRFS_ALLOC_PACKED) {
+    seq_puts(file, ",alloc=packed");
+  }
 
-  // Decrement a buffer_head's reference count.
-  // Kernel will decide to either keep buffer_head around, or free the
-  // buffer_head and flush its data (only if marked as dirty before).
-  brelse(buffer_head);
+  if (info->compression != TRFS_COMPRESS_NONE) {
+    seq_printf(file, ",compress=%s", trfs_compression_name(info->compression));
+  }
+
+  if (super_block->s_flags & SB_NOATIME) {
+    seq_puts(file, ",noatime");
+  }
 
   return 0;
 }
 
+///
+/// Shows the counters of the mount, in /proc/self/mountstats.
+///
+static int trfs_show_stats(
+  struct seq_file* const file,
+  struct dentry* const root
+) {
+  struct trfs_mount_info* const info = trfs_mount_info(root->d_sb);
+
+  seq_printf(
+    file, "extent_cache_hits=%llu extent_cache_misses=%llu extent_cache_size=%lu",
+    trfs_sum_counter(info, TRFS_COUNTER_EXTENT_CACHE_HITS),
+    trfs_sum_counter(info, TRFS_COUNTER_EXTENT_CACHE_MISSES),
+    READ_ONCE(info->extent_cache_count)
+  );
+
+  return 0;
+}
+
+// Inodes are kept in the inode cache once unused (the default drop_inode()),
+// generic_delete_inode() would evict them on their last iput().
+static const struct super_operations trfs_super_operations = {
+  .alloc_inode = trfs_alloc_inode,
+  .free_inode = trfs_free_inode,
+  .write_inode = trfs_write_inode,
+  .evict_inode = trfs_evict_inode,
+  .sync_fs = trfs_sync_fs,
+  .put_super = trfs_put_super,
+  .statfs = trfs_statfs,
+  .show_options = trfs_show_options,
+  .show_stats = trfs_show_stats,
+};
+
 int trfs_set_block_size(
   struct super_block* const super_block,
   int size
@@ -76,6 +284,83 @@ int trfs_set_block_size(
   return 0;
 }
 
+///
+/// Copies the on-disk superblock, converting integers to the CPU byte order
+/// (they have been encoded to big-endian for readability).
+///
+static void trfs_decode_super_block(
+  struct trfs_super_block_info* const info,
+  struct trfs_super_block_info const* const disk_info
+) {
+  memcpy(info->magic_number, disk_info->magic_number, TRFS_MAGIC_NUMBER_LENGTH);
+  info->block_size = be32_to_cpu(disk_info->block_size);
+  info->blocks = be32_to_cpu(disk_info->blocks);
+  info->group_blocks = be32_to_cpu(disk_info->group_blocks);
+  info->groups = be32_to_cpu(disk_info->groups);
+  info->group_inodes = be32_to_cpu(disk_info->group_inodes);
+  info->bitmap_blocks = be32_to_cpu(disk_info->bitmap_blocks);
+  info->inode_bitmap_blocks = be32_to_cpu(disk_info->inode_bitmap_blocks);
+  info->inode_table_blocks = be32_to_cpu(disk_info->inode_table_blocks);
+  info->inodes = be32_to_cpu(disk_info->inodes);
+  info->free_blocks = be32_to_cpu(disk_info->free_blocks);
+  info->free_inodes = be32_to_cpu(disk_info->free_inodes);
+  info->feature_incompat = be32_to_cpu(disk_info->feature_incompat);
+  info->hash_key[0] = be64_to_cpu(disk_info->hash_key[0]);
+  info->hash_key[1] = be64_to_cpu(disk_info->hash_key[1]);
+
+  // Older images do not have the high words, they may hold anything.
+  if (info->feature_incompat & TRFS_FEATURE_INCOMPAT_64BIT) {
+    info->blocks_hi = be32_to_cpu(disk_info->blocks_hi);
+    info->free_blocks_hi = be32_to_cpu(disk_info->free_blocks_hi);
+  }
+  else {
+    info->blocks_hi = 0;
+    info->free_blocks_hi = 0;
+  }
+
+  info->cluster_bits = info->feature_incompat & TRFS_FEATURE_INCOMPAT_BIGALLOC
+    ? be32_to_cpu(disk_info->cluster_bits)
+    : 0;
+
+  info->refcount_blocks = info->feature_incompat & TRFS_FEATURE_INCOMPAT_REFLINK
+    ? be32_to_cpu(disk_info->refcount_blocks)
+    : 0;
+}
+
+///
+/// Checks the group geometry of a decoded superblock, the group helpers of
+/// super.h rely on it.
+///
+static bool trfs_check_groups(
+  struct trfs_super_block_info const* const info
+) {
+  uint64_t const inodes_per_block = info->block_size / TRFS_INODE_SIZE;
+
+  if (info->group_blocks == 0 || info->group_inodes == 0
+    || info->cluster_bits > TRFS_MAX_CLUSTER_BITS
+    || info->group_blocks % trfs_super_cluster_blocks(info) != 0
+    || info->groups != DIV_ROUND_UP_ULL(trfs_super_blocks(info), info->group_blocks)
+    || info->inodes != (uint64_t) info->groups * info->group_inodes
+  ) {
+    return false;
+  }
+
+  // Shared blocks are counted one by one, not by cluster.
+  if ((info->feature_incompat & TRFS_FEATURE_INCOMPAT_REFLINK) && (info->cluster_bits > 0
+    || (uint64_t) info->refcount_blocks * (info->block_size / TRFS_REFCOUNT_SIZE) < info->group_blocks
+  )) {
+    return false;
+  }
+
+  // Metadata of the last (possibly smaller) group must fit in it.
+  uint32_t const last = info->groups - 1;
+  uint64_t const metadata = trfs_group_data_block(info, last) - trfs_group_first_block(info, last);
+
+  return (uint64_t) info->inode_table_blocks * inodes_per_block >= info->group_inodes
+    && (uint64_t) info->inode_bitmap_blocks * 8u * info->block_size >= info->group_inodes
+    && DIV_ROUND_UP_ULL(metadata, trfs_super_cluster_blocks(info)) < trfs_group_size(info, last) >> info->cluster_bits;
+}
+
 ///
 /// Finds the superblock and configures the device block size accordingly.
 ///
@@ -133,22 +418,59 @@ static int trfs_find_super_block(
     // kzalloc() allocates memory and set it with zeros.
     // GFP stands for "Get Free Page", see documentation below.
     // https://www.kernel.org/doc/html/next/core-api/memory-allocation.html
-    struct trfs_super_block_info* alloc_info = kzalloc(sizeof(struct trfs_super_block_info), GFP_KERNEL);
-    if (alloc_info == NULL) {
+    struct trfs_mount_info* mount_info = kzalloc(sizeof(struct trfs_mount_info), GFP_KERNEL);
+    if (mount_info == NULL) {
       TRFS_ERROR("Could not allocate superblock info.\n");
       retcode = -ENOMEM;
       goto cleanup;
     }
 
     // Retrieve superblock info.
-    memcpy(alloc_info->magic_number, disk_info->magic_number, TRFS_MAGIC_NUMBER_LENGTH);
-    // Integers have been encoded to big-endian for readability.
-    alloc_info->block_size = be32_to_cpu(disk_info->block_size);
-    alloc_info->blocks = be32_to_cpu(disk_info->blocks);
-    super_block->s_fs_info = alloc_info;
+    struct trfs_super_block_info* const alloc_info = &mount_info->super;
+    trfs_decode_super_block(alloc_info, disk_info);
+    mount_info->hash_key.key[0] = alloc_info->hash_key[0];
+    mount_info->hash_key.key[1] = alloc_info->hash_key[1];
+    mount_info->vfs_super = super_block;
+    mount_info->commit_interval = TRFS_DEFAULT_COMMIT_INTERVAL;
+    mount_info->readahead = TRFS_READAHEAD_DEVICE;
+    INIT_DELAYED_WORK(&mount_info->commit_work, trfs_commit_super_block);
+    super_block->s_fs_info = mount_info;
 
     TRFS_INFO("Block size: %u\n", alloc_info->block_size);
-    TRFS_INFO("Number of blocks: %u\n", alloc_info->blocks);
+    TRFS_INFO("Number of blocks: %llu\n", trfs_super_blocks(alloc_info));
+    TRFS_INFO("Number of groups: %u\n", alloc_info->groups);
+    TRFS_INFO("Cluster size: %u blocks\n", trfs_super_cluster_blocks(alloc_info));
+
+    if (alloc_info->feature_incompat & ~TRFS_FEATURE_INCOMPAT_SUPPORTED) {
+      TRFS_ERROR(
+        "Unsupported incompatible features (%#x).\n",
+        alloc_info->feature_incompat & ~TRFS_FEATURE_INCOMPAT_SUPPORTED
+      );
+      retcode = -EINVAL;
+      goto cleanup;
+    }
+
+    mount_info->inode_extents = alloc_info->feature_incompat & TRFS_FEATURE_INCOMPAT_64BIT
+      ? TRFS_INODE_EXTENTS64
+      : TRFS_INODE_EXTENTS;
+
+    if (!trfs_check_groups(alloc_info)) {
+      TRFS_ERROR("Invalid allocation groups (%u of %u blocks).\n", alloc_info->groups, alloc_info->group_blocks);
+      retcode = -EINVAL;
+      goto cleanup;
+    }
+
+    mount_info->groups = kvcalloc(alloc_info->groups, sizeof(struct trfs_group), GFP_KERNEL);
+    if (mount_info->groups == NULL) {
+      TRFS_ERROR("Could not allocate the allocation groups.\n");
+      retcode = -ENOMEM;
+      goto cleanup;
+    }
+
+    for (uint32_t group = 0; group < alloc_info->groups; ++group) {
+      mutex_init(&mount_info->groups[group].inode_lock);
+      mutex_init(&mount_info->groups[group].refcount_lock);
+    }
 
     // "No-op" if the block size is the same.
     if (!sb_set_blocksize(super_block, alloc_info->block_size)) {
@@ -156,6 +478,12 @@ static int trfs_find_super_block(
       retcode = -EINVAL;
       goto cleanup;
     }
+
+    if (trfs_super_blocks(alloc_info) > sb_bdev_nr_blocks(super_block)) {
+      TRFS_ERROR("The device is smaller than the file system (%llu blocks).\n", sb_bdev_nr_blocks(super_block));
+      retcode = -EINVAL;
+      goto cleanup;
+    }
   }
   else {
     retcode = -1;
@@ -169,16 +497,188 @@ cleanup:
 
   if (retcode) {
     // Explicitly set as NULL for trfs_kill_super_block().
+    if (super_block->s_fs_info != NULL) {
+      kvfree(trfs_mount_info(super_block)->groups);
+    }
+    kfree(super_block->s_fs_info);
     super_block->s_fs_info = NULL;
   }
 
   return retcode;
 }
 
-int trfs_fill_super_block(
+// ╔═╗┌─┐┌┬┐┬┌─┐┌┐┌┌─┐
+// ║ ║├─┘ │ ││ ││││└─┐
+// ╚═╝┴   ┴ ┴└─┘┘└┘└─┘
+
+// Mount Options:
+// The fs_context API parses the options (the mount(2) data string, or each
+// fsconfig(2) call) into a trfs_fs_context, which is applied to the mount info
+// when mounting and when remounting. On remount, the options left out keep
+// their current value.
+// ro, rw, sync, lazytime... are superblock flags handled by the VFS itself.
+// https://docs.kernel.org/filesystems/mount_api.html
+
+enum {
+  TRFS_OPTION_COMMIT,
+  TRFS_OPTION_READAHEAD,
+  TRFS_OPTION_ALLOC,
+  TRFS_OPTION_COMPRESS,
+  TRFS_OPTION_ATIME,
+};
+
+static const struct constant_table trfs_alloc_policies[] = {
+  { "spread", TRFS_ALLOC_SPREAD },
+  { "packed", TRFS_ALLOC_PACKED },
+  {}
+};
+
+static const struct constant_table trfs_compressions[] = {
+  { "none", TRFS_COMPRESS_NONE },
+  { "lz4", TRFS_COMPRESS_LZ4 },
+  { "zstd", TRFS_COMPRESS_ZSTD },
+  {}
+};
+
+const struct fs_parameter_spec trfs_fs_parameters[] = {
+  fsparam_u32("commit", TRFS_OPTION_COMMIT),
+  fsparam_u32("readahead", TRFS_OPTION_READAHEAD),
+  fsparam_enum("alloc", TRFS_OPTION_ALLOC, trfs_alloc_policies),
+  fsparam_enum("compress", TRFS_OPTION_COMPRESS, trfs_compressions),
+  fsparam_flag_no("atime", TRFS_OPTION_ATIME),
+  {}
+};
+
+///
+/// The parsed mount options (fs_context::fs_private).
+///
+struct trfs_fs_context {
+  /// The options that were given (1 << TRFS_OPTION_*).
+  unsigned int given;
+
+  /// See trfs_mount_info.
+  unsigned int commit_interval;
+  unsigned int readahead;
+  unsigned int alloc_policy;
+  unsigned int compression;
+};
+
+static int trfs_parse_parameter(
+  struct fs_context* const fc,
+  struct fs_parameter* const parameter
+) {
+  struct trfs_fs_context* const context = fc->fs_private;
+  struct fs_parse_result result;
+
+  int const option = fs_parse(fc, trfs_fs_parameters, parameter, &result);
+  if (option < 0) {
+    return option;
+  }
+
+  switch (option) {
+    case TRFS_OPTION_COMMIT:
+      if (result.uint_32 > TRFS_MAX_COMMIT_INTERVAL) {
+        return invalfc(fc, "Commit interval too long (%u s)", result.uint_32);
+      }
+
+      // Zero selects the default, as with ext4.
+      context->commit_interval = result.uint_32 ?: TRFS_DEFAULT_COMMIT_INTERVAL;
+      break;
+
+    case TRFS_OPTION_READAHEAD:
+      if (result.uint_32 == TRFS_READAHEAD_DEVICE) {
+        return invalfc(fc, "Readahead too large (%u KiB)", result.uint_32);
+      }
+
+      context->readahead = result.uint_32;
+      break;
+
+    case TRFS_OPTION_ALLOC:
+      context->alloc_policy = result.uint_32;
+      break;
+
+    case TRFS_OPTION_COMPRESS:
+      // A cluster is made of whole pages.
+      if (result.uint_32 != TRFS_COMPRESS_NONE && PAGE_SIZE > TRFS_COMPRESS_CLUSTER_SIZE) {
+        return invalfc(fc, "Compression needs pages of at most %u bytes", TRFS_COMPRESS_CLUSTER_SIZE);
+      }
+
+      context->compression = result.uint_32;
+      break;
+
+    case TRFS_OPTION_ATIME:
+      // noatime for the whole file system (SB_NOATIME), mount(8) turns it
+      // into a flag of the mount point (MNT_NOATIME) instead.
+      if (result.negated) {
+        fc->sb_flags |= SB_NOATIME;
+      }
+      else {
+        fc->sb_flags &= ~SB_NOATIME;
+      }
+
+      fc->sb_flags_mask |= SB_NOATIME;
+      break;
+  }
+
+  context->given |= 1u << option;
+  return 0;
+}
+
+///
+/// Applies the options to the mount info: all of them when mounting (the
+/// options left out have their default value), the given ones on remount.
+///
+static void trfs_apply_options(
+  struct super_block* const super_block,
+  struct trfs_fs_context const* const context,
+  bool const mounting
+) {
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
+  unsigned int const given = mounting ? ~0u : context->given;
+
+  // A pending commit keeps its delay.
+  if (given & (1u << TRFS_OPTION_COMMIT)) {
+    WRITE_ONCE(info->commit_interval, context->commit_interval);
+  }
+
+  if (given & (1u << TRFS_OPTION_READAHEAD)) {
+    trfs_set_readahead(super_block, context->readahead);
+  }
+
+  if (given & (1u << TRFS_OPTION_ALLOC)) {
+    WRITE_ONCE(info->alloc_policy, context->alloc_policy);
+  }
+
+  // Clusters being compressed finish with the previous algorithm.
+  if (given & (1u << TRFS_OPTION_COMPRESS)) {
+    WRITE_ONCE(info->compression, context->compression);
+  }
+}
+
+///
+/// Sets the readahead of the files (in KiB), TRFS_READAHEAD_DEVICE gives them
+/// the readahead of the device.
+///
+void trfs_set_readahead(
   struct super_block* const super_block,
-  void* const data, // Key-value ASCII options?
-  int const silent
+  unsigned int const readahead
+) {
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
+
+  // The BDI of the mount is private (see trfs_fill_super_block()), the files
+  // inherit its readahead when they are opened.
+  WRITE_ONCE(info->readahead, readahead);
+  WRITE_ONCE(
+    super_block->s_bdi->ra_pages,
+    readahead == TRFS_READAHEAD_DEVICE
+      ? READ_ONCE(super_block->s_bdev->bd_disk->bdi->ra_pages)
+      : readahead >> (PAGE_SHIFT - 10)
+  );
+}
+
+static int trfs_fill_super_block(
+  struct super_block* const super_block,
+  struct fs_context* const fc
 ) {
   int error;
 
@@ -191,61 +691,92 @@ int trfs_fill_super_block(
     return error;
   }
 
-  // sb->s_magic = AUFS_MAGIC_NUMBER;
-  // sb->s_op = &aufs_super_ops;
+  struct trfs_mount_info* const info = trfs_mount_info(super_block);
 
-  struct inode* const root_inode = new_inode(super_block);
-  if (!root_inode) {
-    TRFS_ERROR("Could not create the root inode.");
-    return -ENOMEM;
+  // Accounting starts with the first inode read.
+  if ((error = trfs_register_stats(super_block))) {
+    return error;
   }
 
-  // TODO: What is the size of data block? Do mount_bdev set it correctly?
+  // The files get a BDI of their own, so that the readahead of the mount does
+  // not change the one of the disk (shared with its other partitions and
+  // users). set_bdev_super() handed the superblock the BDI of the disk, which
+  // super_setup_bdi() expects to be unset.
+  struct backing_dev_info* const device_bdi = super_block->s_bdi;
+
+  super_block->s_bdi = &noop_backing_dev_info;
+  if ((error = super_setup_bdi(super_block))) {
+    super_block->s_bdi = device_bdi;
+    return error;
+  }
+
+  super_block->s_bdi->ra_pages = device_bdi->ra_pages;
+  super_block->s_bdi->io_pages = device_bdi->io_pages;
+  bdi_put(device_bdi);
+
+  trfs_apply_options(super_block, fc->fs_private, true);
+
+  // Pinned until trfs_put_super(), the superblock is updated in memory and
+  // written back lazily.
+  info->super_block_head = sb_bread(super_block, TRFS_SUPER_BLOCK_AT_BLOCK);
+  if (!info->super_block_head) {
+    TRFS_ERROR("Could not read superblock at block [%u].\n", TRFS_SUPER_BLOCK_AT_BLOCK);
+    return -EIO;
+  }
 
-  // ╦┌┬┐┌┬┐┌─┐┌─┐
-  // ║ │││││├─┤├─┘
-  // ╩╶┴┘┴ ┴┴ ┴┴
+  if ((error = trfs_load_free_space(super_block))) {
+    TRFS_ERROR("Unable to load the free-block bitmap.\n");
+    return error;
+  }
 
-  // https://www.kernel.org/doc/Documentation/filesystems/idmappings.rst
+  if ((error = trfs_count_free_inodes(super_block))) {
+    TRFS_ERROR("Unable to load the inode bitmap.\n");
+    return error;
+  }
 
-  // From inode_init_owner(): [source/fs/inode.c]
-  // Init uid,gid,mode for new inode according to posix standards.
-  // If the inode has been created through an idmapped mount the idmap of
-  // the vfsmount must be passed through @idmap. This function will then take
-  // care to map the inode according to @idmap before checking permissions
-  // and initializing i_uid and i_gid. On non-idmapped mounts or if permission
-  // checking is to be performed on the raw inode simply pass @nop_mnt_idmap.
+  if ((error = trfs_register_extent_cache(super_block))) {
+    TRFS_ERROR("Unable to set up the extent cache.\n");
+    return error;
+  }
 
-  // From [source/include/linux/mnt_idmapping.h]:
-  // struct mnt_idmap nop_mnt_idmap; // Identity mapping.
-  // struct user_namespace init_user_ns; // ??
+  // Needed to write back dirty pages, which may be done to reclaim memory.
+  info->unwritten_workqueue = alloc_workqueue(
+    "trfs-unwritten/%s", WQ_MEM_RECLAIM | WQ_FREEZABLE, 0, super_block->s_id
+  );
 
-  // From "struct super_block::s_user_ns": [source/include/linux/fs.h]
-  // Owning user namespace and default context in which to interpret filesystem
-  // uids, gids, quotas, device nodes, xattrs and security labels.
+  if (!info->unwritten_workqueue) {
+    TRFS_ERROR("Unable to create the unwritten extent workqueue.\n");
+    return -ENOMEM;
+  }
 
-  // S_IFDIR | S_IRWXU | S_IRWXG | S_IRWXO
-  inode_init_owner(super_block->s_user_ns, root_inode, NULL, S_IFDIR | 0755);
+  super_block->s_magic = TRFS_SUPER_MAGIC;
+  super_block->s_op = &trfs_super_operations;
+  super_block->s_maxbytes = MAX_LFS_FILESIZE;
+  super_block->s_time_gran = 1; // Timestamps are stored with nanoseconds.
 
   // ╦┌┐┌┌─┐┌┬┐┌─┐
   // ║││││ │ ││├┤
   // ╩┘└┘└─┘╶┴┘└─┘
 
-  root_inode->i_ino = 1;
-  // inode->i_ino = get_next_ino();
-  // root_inode->i_uid = root_inode->i_gid = 0;
-  root_inode->i_atime = root_inode->i_mtime = root_inode->i_ctime = current_time(root_inode);
+  struct inode* const root_inode = trfs_iget(super_block, TRFS_ROOT_INODE);
+  if (IS_ERR(root_inode)) {
+    TRFS_ERROR("Could not read the root inode.");
+    return PTR_ERR(root_inode);
+  }
 
-  root_inode->i_op = &trfs_inode_operations;
-  root_inode->i_fop = &trfs_directory_operations;
+  if (!S_ISDIR(root_inode->i_mode)) {
+    TRFS_ERROR("The root inode is not a directory.");
+    iput(root_inode);
+    return -EIO;
+  }
 
   // ╔╦╗┌─┐┌┐┌┌┬┐┬─┐┬ ┬
   //  ║║├┤ │││ │ ├┬┘└┬┘
   // ═╩╝└─┘┘└┘ ┴ ┴└─ ┴
 
-  // TODO: Do we have to initialize something about the dcache?
-  // (dcache = dentry cache = directory entry cache)
-  // d_add(dentry, inode)?
+  // The dentries of the mount, negative ones included, need no operations of
+  // their own (see trfs/dentry.c, dcache = dentry cache = directory entry
+  // cache).
 
   // From d_alloc_root(): [source/fs/dcache.c] (linux < 3.3.0)
   // Allocate a root ("/") dentry for the inode given. The inode is
@@ -262,15 +793,95 @@ int trfs_fill_super_block(
     return -ENOMEM;
   }
 
+  trfs_procfs_register(super_block);
+  trfs_sysfs_register(super_block);
+  return 0;
+}
+
+// ╔═╗┌─┐┌┐┌┌┬┐┌─┐─┐ ┬┌┬┐
+// ║  │ ││││ │ ├┤ ┌┴┬┘ │
+// ╚═╝└─┘┘└┘ ┴ └─┘┴ └─ ┴
+
+static int trfs_get_tree(
+  struct fs_context* const fc
+) {
+  int const error = get_tree_bdev(fc, trfs_fill_super_block);
+
+  if (error) {
+    TRFS_ERROR("Error while mounting %s (error: [%d])\n", fc->source, error);
+    return error;
+  }
+
+  TRFS_INFO("%s is succesfully mounted\n", fc->source);
+  return 0;
+}
+
+///
+/// Remount: applies the given options. Dirty data and the superblock are
+/// written first, the file system may be going read-only.
+///
+static int trfs_reconfigure(
+  struct fs_context* const fc
+) {
+  struct super_block* const super_block = fc->root->d_sb;
+
+  int const error = sync_filesystem(super_block);
+  if (error) {
+    return error;
+  }
+
+  // The superblock has just been written, a commit still pending would write
+  // it to a read-only file system.
+  if ((fc->sb_flags_mask & SB_RDONLY) && (fc->sb_flags & SB_RDONLY) && !sb_rdonly(super_block)) {
+    cancel_delayed_work_sync(&trfs_mount_info(super_block)->commit_work);
+  }
+
+  trfs_apply_options(super_block, fc->fs_private, false);
+  return 0;
+}
+
+static void trfs_free_fs_context(
+  struct fs_context* const fc
+) {
+  kfree(fc->fs_private);
+}
+
+static const struct fs_context_operations trfs_context_operations = {
+  .parse_param = trfs_parse_parameter,
+  .get_tree = trfs_get_tree,
+  .reconfigure = trfs_reconfigure,
+  .free = trfs_free_fs_context,
+};
+
+///
+/// Called by the VFS for a new mount and for a remount, before the options
+/// are parsed.
+///
+int trfs_init_fs_context(
+  struct fs_context* const fc
+) {
+  struct trfs_fs_context* const context = kzalloc(sizeof(struct trfs_fs_context), GFP_KERNEL);
+  if (context == NULL) {
+    return -ENOMEM;
+  }
+
+  context->commit_interval = TRFS_DEFAULT_COMMIT_INTERVAL;
+  context->readahead = TRFS_READAHEAD_DEVICE;
+  context->alloc_policy = TRFS_ALLOC_SPREAD;
+  context->compression = TRFS_COMPRESS_NONE;
+
+  fc->fs_private = context;
+  fc->ops = &trfs_context_operations;
   return 0;
 }
 
 void trfs_kill_super_block(
   struct super_block* const super_block
 ) {
+  // Neither the statistics nor the tunables are used anymore.
   if (super_block->s_fs_info != NULL) {
-    TRFS_INFO("Superblock info are released.\n");
-    kfree(super_block->s_fs_info);
+    trfs_sysfs_unregister(super_block);
+    trfs_procfs_unregister(super_block);
   }
 
   // kill_block_super() is an helper function provided by the VFS which
@@ -278,6 +889,29 @@ void trfs_kill_super_block(
   // internal resources.
   kill_block_super(super_block);
 
+  // Released last, evicted inodes may still need it.
+  if (super_block->s_fs_info != NULL) {
+    struct trfs_mount_info* const info = trfs_mount_info(super_block);
+
+    // Already done by trfs_put_super() unless trfs_fill_super_block() failed.
+    cancel_delayed_work_sync(&info->commit_work);
+    brelse(info->super_block_head);
+
+    TRFS_INFO("Superblock info are released.\n");
+    trfs_release_free_space(super_block);
+    trfs_unregister_extent_cache(super_block);
+    trfs_unregister_stats(super_block);
+    percpu_counter_destroy(&info->free_inodes);
+
+    if (info->unwritten_workqueue != NULL) {
+      destroy_workqueue(info->unwritten_workqueue);
+    }
+
+    kvfree(info->groups);
+    kfree(super_block->s_fs_info);
+    super_block->s_fs_info = NULL;
+  }
+
   // So far this function is only here for logging.
   TRFS_INFO("Superblock is destroyed.\n");
   TRFS_INFO("Unmount succesful.\n");
@@ -7,6 +7,9 @@
 #define TRFS_MAGIC_NUMBER "TRFS/1.0"
 #define TRFS_MAGIC_NUMBER_LENGTH 8u
 
+/// The file system type reported by statfs(2) ("TRFS").
+#define TRFS_SUPER_MAGIC 0x54524653u
+
 struct trfs_super_block_info {
   /// The filesystem’s magic number.
   uint8_t magic_number[TRFS_MAGIC_NUMBER_LENGTH];
@@ -14,16 +17,711 @@ struct trfs_super_block_info {
   /// The filesystem's block size (!= disk's block size).
   uint32_t block_size;
 
-  /// The number of blocks.
+  /// The number of blocks (low 32 bits, see blocks_hi).
   uint32_t blocks;
+
+  /// The number of blocks per allocation group (the last group may be
+  /// smaller), see trfs_group_bitmap_block() for the layout of a group.
+  uint32_t group_blocks;
+
+  /// The number of allocation groups.
+  uint32_t groups;
+
+  /// The number of inodes per group, inode n belongs to group
+  /// n / group_inodes.
+  uint32_t group_inodes;
+
+  /// The number of blocks occupied by the free-block bitmap of a group (one bit
+  /// per cluster of the group, see cluster_bits, set when the cluster is in
+  /// use, least significant bit first).
+  uint32_t bitmap_blocks;
+
+  /// The number of blocks occupied by the inode bitmap of a group (same
+  /// encoding as the free-block bitmap, one bit per inode of the group).
+  uint32_t inode_bitmap_blocks;
+
+  /// The number of blocks occupied by the inode table of a group
+  /// (TRFS_INODE_SIZE bytes per inode).
+  uint32_t inode_table_blocks;
+
+  /// The number of inodes (groups x group_inodes, inode 0 is never used).
+  uint32_t inodes;
+
+  /// The number of free blocks, as of the last superblock write (the free-block
+  /// bitmap is authoritative). Low 32 bits, see free_blocks_hi.
+  uint32_t free_blocks;
+
+  /// The number of free inodes, as of the last superblock write (the inode
+  /// bitmap is authoritative).
+  uint32_t free_inodes;
+
+  /// TRFS_FEATURE_INCOMPAT_* flags, a file system using a feature unknown to
+  /// the driver must not be mounted.
+  uint32_t feature_incompat;
+
+  /// The key of the directory name hash (SipHash-2-4), randomly chosen by
+  /// mkfs so that crafted names cannot degrade directory indexes.
+  uint64_t hash_key[2];
+
+  /// The high 32 bits of blocks and free_blocks (TRFS_FEATURE_INCOMPAT_64BIT
+  /// only, meaningless otherwise).
+  uint32_t blocks_hi;
+  uint32_t free_blocks_hi;
+
+  /// Blocks are allocated by clusters of 2^cluster_bits blocks
+  /// (TRFS_FEATURE_INCOMPAT_BIGALLOC only, meaningless otherwise).
+  uint32_t cluster_bits;
+
+  /// The number of blocks occupied by the refcount table of a group
+  /// (TRFS_FEATURE_INCOMPAT_REFLINK only, meaningless otherwise): one
+  /// big-endian TRFS_REFCOUNT_SIZE bytes count per block of the group, the
+  /// number of extents mapping the block besides the first one.
+  uint32_t refcount_blocks;
 };
 
+/// Block numbers are 64-bit: the block count spans blocks and blocks_hi, and
+/// inodes hold TRFS_INODE_EXTENTS64 extents with 64-bit starts (struct
+/// trfs_extent) instead of TRFS_INODE_EXTENTS 32-bit ones (struct
+/// trfs_extent32). Needed beyond 2^32 blocks (16 TiB with 4 KiB blocks).
+#define TRFS_FEATURE_INCOMPAT_64BIT 0x1u
+
+/// Space is allocated by clusters of 2^cluster_bits blocks (at most
+/// 2^TRFS_MAX_CLUSTER_BITS), the free-block bitmaps have one bit per cluster
+/// and group_blocks is a multiple of the cluster size. Files still map single
+/// blocks, the unmapped end of the last cluster of an extent belongs to the
+/// file and is used when it grows.
+#define TRFS_FEATURE_INCOMPAT_BIGALLOC 0x2u
+
+/// Some inodes map their blocks with an extent tree (TRFS_INODE_EXTENT_TREE).
+/// Set by the driver when the first tree grows.
+#define TRFS_FEATURE_INCOMPAT_EXTENT_TREE 0x4u
+
+/// Some extents are unwritten (TRFS_EXTENT_UNWRITTEN). Set by the driver when
+/// the first blocks are preallocated.
+#define TRFS_FEATURE_INCOMPAT_UNWRITTEN 0x8u
+
+/// Blocks may be mapped by several extents (FICLONE, see ioctl_ficlone(2)),
+/// their references are counted in a table following the free-block bitmap of
+/// each group (see refcount_blocks). Set by mkfs, never along with
+/// TRFS_FEATURE_INCOMPAT_BIGALLOC.
+#define TRFS_FEATURE_INCOMPAT_REFLINK 0x10u
+
+/// The features this version understands.
+#define TRFS_FEATURE_INCOMPAT_SUPPORTED ( \
+  TRFS_FEATURE_INCOMPAT_64BIT | TRFS_FEATURE_INCOMPAT_BIGALLOC | TRFS_FEATURE_INCOMPAT_EXTENT_TREE \
+    | TRFS_FEATURE_INCOMPAT_UNWRITTEN | TRFS_FEATURE_INCOMPAT_REFLINK \
+)
+
+/// The largest cluster (in blocks, as a power of 2).
+#define TRFS_MAX_CLUSTER_BITS 16u
+
+/// The size of an entry of a refcount table (see refcount_blocks).
+#define TRFS_REFCOUNT_SIZE 2u
+
+/// The largest count of a refcount table entry.
+#define TRFS_REFCOUNT_MAX 0xFFFFu
+
+///
+/// Returns the number of blocks (superblock in CPU byte order, with blocks_hi
+/// zeroed unless TRFS_FEATURE_INCOMPAT_64BIT is set).
+///
+static inline uint64_t trfs_super_blocks(
+  struct trfs_super_block_info const* const super
+) {
+  return (uint64_t) super->blocks_hi << 32 | super->blocks;
+}
+
+///
+/// Returns the number of blocks of an allocation cluster (superblock in CPU
+/// byte order, with cluster_bits zeroed unless TRFS_FEATURE_INCOMPAT_BIGALLOC
+/// is set).
+///
+static inline uint32_t trfs_super_cluster_blocks(
+  struct trfs_super_block_info const* const super
+) {
+  return 1u << super->cluster_bits;
+}
+
+// ╔═╗┬─┐┌─┐┬ ┬┌─┐┌─┐
+// ║ ┬├┬┘│ ││ │├─┘└─┐
+// ╚═╝┴└─└─┘└─┘┴  └─┘
+
+// Allocation Groups:
+// The device is split into groups of group_blocks blocks, each group has its
+// own free-block bitmap, refcount table (TRFS_FEATURE_INCOMPAT_REFLINK only),
+// inode bitmap and inode table followed by its data blocks. The first group
+// also holds the boot block and the superblock:
+// | boot | superblock | bitmap | refcounts | inode bitmap | inode table | data... (group 0)
+// | bitmap | refcounts | inode bitmap | inode table | data...                     (group n)
+// The helpers below take a superblock in CPU byte order.
+
+///
+/// Returns the first block of the given group.
+///
+static inline uint64_t trfs_group_first_block(
+  struct trfs_super_block_info const* const super,
+  uint32_t const group
+) {
+  return (uint64_t) group * super->group_blocks;
+}
+
+///
+/// Returns the number of blocks of the given group.
+///
+static inline uint32_t trfs_group_size(
+  struct trfs_super_block_info const* const super,
+  uint32_t const group
+) {
+  uint64_t const left = trfs_super_blocks(super) - trfs_group_first_block(super, group);
+  return left < super->group_blocks ? (uint32_t) left : super->group_blocks;
+}
+
+///
+/// Returns the first block of the free-block bitmap of the given group.
+///
+static inline uint64_t trfs_group_bitmap_block(
+  struct trfs_super_block_info const* const super,
+  uint32_t const group
+) {
+  return trfs_group_first_block(super, group) + (group == 0 ? TRFS_SUPER_BLOCK_AT_BLOCK + 1u : 0u);
+}
+
+///
+/// Returns the first block of the refcount table of the given group (with
+/// refcount_blocks zeroed unless TRFS_FEATURE_INCOMPAT_REFLINK is set).
+///
+static inline uint64_t trfs_group_refcount_block(
+  struct trfs_super_block_info const* const super,
+  uint32_t const group
+) {
+  return trfs_group_bitmap_block(super, group) + super->bitmap_blocks;
+}
+
+static inline uint64_t trfs_group_inode_bitmap_block(
+  struct trfs_super_block_info const* const super,
+  uint32_t const group
+) {
+  return trfs_group_refcount_block(super, group) + super->refcount_blocks;
+}
+
+static inline uint64_t trfs_group_inode_table_block(
+  struct trfs_super_block_info const* const super,
+  uint32_t const group
+) {
+  return trfs_group_inode_bitmap_block(super, group) + super->inode_bitmap_blocks;
+}
+
+///
+/// Returns the first data block of the given group.
+///
+static inline uint64_t trfs_group_data_block(
+  struct trfs_super_block_info const* const super,
+  uint32_t const group
+) {
+  return trfs_group_inode_table_block(super, group) + super->inode_table_blocks;
+}
+
+// ╦┌┐┌┌─┐┌┬┐┌─┐
+// ║││││ │ ││├┤
+// ╩┘└┘└─┘╶┴┘└─┘
+
+/// The root directory inode number.
+#define TRFS_ROOT_INODE 1u
+
+/// The size of an on-disk inode.
+#define TRFS_INODE_SIZE 256u
+
+/// The number of extents an inode can hold.
+#define TRFS_INODE_EXTENTS 16u
+
+/// The number of extents an inode can hold with TRFS_FEATURE_INCOMPAT_64BIT.
+#define TRFS_INODE_EXTENTS64 12u
+
+/// The number of bytes an inode can hold in place of its extents.
+#define TRFS_INODE_INLINE_SIZE 192u
+
+/// The content of the file (or the entries of the directory, as a single
+/// directory leaf) is stored in the inode itself, in place of the extents.
+/// Set on new files and directories, cleared (for good) when they outgrow
+/// TRFS_INODE_INLINE_SIZE bytes.
+#define TRFS_INODE_INLINE 0x1u
+
+/// The extents are in a tree whose root is in the inode (extent_root), see
+/// struct trfs_extent_node.
+#define TRFS_INODE_EXTENT_TREE 0x2u
+
+/// Some clusters of the file may be compressed. Set with the first compressed
+/// extent, cleared when the file has no extent left.
+#define TRFS_INODE_COMPRESSED 0x4u
+
+/// Some blocks of the file may be shared with other files (see
+/// TRFS_FEATURE_INCOMPAT_REFLINK), they are copied on write. Set when blocks
+/// are cloned to or from the file, cleared when it has no extent left.
+#define TRFS_INODE_SHARED 0x8u
+
+///
+/// A run of contiguous blocks of a file (on-disk with
+/// TRFS_FEATURE_INCOMPAT_64BIT, and in memory in any case).
+///
+struct trfs_extent {
+  /// The first logical block (in the file).
+  uint32_t logical;
+
+  /// The number of blocks (TRFS_EXTENT_LENGTH_MASK), the compression
+  /// algorithm of the extent (TRFS_COMPRESS_* << TRFS_EXTENT_COMPRESSION_SHIFT)
+  /// and TRFS_EXTENT_UNWRITTEN.
+  uint32_t length;
+
+  /// The first physical block (on the device).
+  uint64_t start;
+};
+
+///
+/// A run of contiguous blocks of a file, on-disk without
+/// TRFS_FEATURE_INCOMPAT_64BIT (same fields as struct trfs_extent).
+///
+struct trfs_extent32 {
+  uint32_t logical;
+  uint32_t start;
+  uint32_t length;
+};
+
+// Compressed Extents:
+// A compressed extent maps a whole cluster of TRFS_COMPRESS_CLUSTER_SIZE bytes
+// of the file (aligned on the cluster size) to the blocks holding its
+// compressed form: a trfs_compressed_header followed by the compressed data.
+// Its length is the number of physical blocks, tagged with the algorithm.
+
+#define TRFS_COMPRESS_NONE 0u
+#define TRFS_COMPRESS_LZ4 1u
+#define TRFS_COMPRESS_ZSTD 2u
+
+/// The size of the clusters of data compressed together.
+#define TRFS_COMPRESS_CLUSTER_SIZE 32768u
+
+#define TRFS_EXTENT_COMPRESSION_SHIFT 30u
+
+/// The blocks of the extent are allocated (fallocate(2)) but were never
+/// written, they read as zeroes. Never set on a compressed extent.
+#define TRFS_EXTENT_UNWRITTEN (1u << 29)
+
+#define TRFS_EXTENT_LENGTH_MASK (TRFS_EXTENT_UNWRITTEN - 1u)
+
+// Extent Trees:
+// Without TRFS_INODE_EXTENT_TREE, the extents of a file are in its inode.
+// With it, they are in the leaves of a B+tree whose root (trfs_extent_root) is
+// in the inode: each index entry holds the lowest logical block of its child
+// node (the first entry of a node covers everything before it too), a node is
+// a block starting with a trfs_extent_node followed by its entries, sorted by
+// logical block. Leaves (depth 0) hold struct trfs_extent entries, whatever
+// TRFS_FEATURE_INCOMPAT_64BIT.
+
+/// The maximum depth of an extent tree (the root is at this depth at most).
+#define TRFS_EXTENT_MAX_DEPTH 4u
+
+/// The number of index entries of the root of an extent tree.
+#define TRFS_INODE_INDEX_ENTRIES 11u
+
+#define TRFS_EXTENT_NODE_MAGIC 0x5452584Eu // "TRXN"
+
+struct trfs_extent_index {
+  /// The lowest logical block of the child node.
+  uint32_t logical;
+
+  /// Zero.
+  uint32_t reserved;
+
+  /// The block of the child node.
+  uint64_t block;
+};
+
+struct trfs_extent_root {
+  /// The depth of the tree (at least 1, the root is an index).
+  uint32_t depth;
+
+  /// Zero.
+  uint32_t reserved;
+
+  struct trfs_extent_index entries[TRFS_INODE_INDEX_ENTRIES];
+};
+
+struct trfs_extent_node {
+  uint32_t magic;
+
+  /// The depth of the node (0 for leaves).
+  uint16_t depth;
+
+  /// The number of entries.
+  uint16_t count;
+
+  /// The inode owning the node.
+  uint32_t inode;
+
+  /// Zero.
+  uint32_t reserved;
+};
+
+_Static_assert(sizeof(struct trfs_extent_index) == sizeof(struct trfs_extent), "Invalid index entry size");
+
+struct trfs_compressed_header {
+  /// The number of bytes of compressed data following the header.
+  uint32_t size;
+
+  /// Zero.
+  uint32_t reserved;
+};
+
+///
+/// Returns the number of physical blocks of an extent (in CPU byte order).
+///
+static inline uint32_t trfs_extent_blocks(
+  struct trfs_extent const* const extent
+) {
+  return extent->length & TRFS_EXTENT_LENGTH_MASK;
+}
+
+///
+/// Returns the compression algorithm of an extent (in CPU byte order).
+///
+static inline uint32_t trfs_extent_compression(
+  struct trfs_extent const* const extent
+) {
+  return extent->length >> TRFS_EXTENT_COMPRESSION_SHIFT;
+}
+
+///
+/// Returns true when the blocks of an extent (in CPU byte order) are unwritten.
+///
+static inline bool trfs_extent_unwritten(
+  struct trfs_extent const* const extent
+) {
+  return extent->length & TRFS_EXTENT_UNWRITTEN;
+}
+
+struct trfs_inode {
+  /// File type and permissions (see stat(2)), zero when the inode is free.
+  uint16_t mode;
+
+  /// The number of hard links.
+  uint16_t links;
+
+  uint32_t uid;
+  uint32_t gid;
+
+  /// The number of allocated blocks.
+  uint32_t blocks;
+
+  /// The file size in bytes.
+  uint64_t size;
+
+  /// Timestamps (seconds since the epoch and nanoseconds).
+  int64_t atime;
+  int64_t mtime;
+  int64_t ctime;
+  uint32_t atime_nsec;
+  uint32_t mtime_nsec;
+  uint32_t ctime_nsec;
+
+  /// TRFS_INODE_* flags.
+  uint16_t flags;
+
+  /// The number of extents in use, sorted by logical block (zero for inline
+  /// inodes), or the number of entries of extent_root with
+  /// TRFS_INODE_EXTENT_TREE.
+  uint16_t extent_count;
+
+  union {
+    struct trfs_extent32 extents32[TRFS_INODE_EXTENTS];
+    struct trfs_extent extents[TRFS_INODE_EXTENTS64];
+    struct trfs_extent_root extent_root;
+
+    /// The first i_size bytes of the file when TRFS_INODE_INLINE is set, the
+    /// rest is zeroed.
+    uint8_t inline_data[TRFS_INODE_INLINE_SIZE];
+  };
+};
+
+_Static_assert(sizeof(struct trfs_inode) == TRFS_INODE_SIZE, "Invalid inode size");
+_Static_assert(
+  sizeof(((struct trfs_inode*) 0)->extents32) == TRFS_INODE_INLINE_SIZE,
+  "Invalid inline data size"
+);
+_Static_assert(
+  sizeof(((struct trfs_inode*) 0)->extents) == TRFS_INODE_INLINE_SIZE,
+  "Invalid inline data size"
+);
+_Static_assert(
+  sizeof(((struct trfs_inode*) 0)->extent_root) <= TRFS_INODE_INLINE_SIZE,
+  "Invalid extent root size"
+);
+
+// ╔╦╗┬┬─┐┌─┐┌─┐┌┬┐┌─┐┬─┐┬ ┬
+//  ║║│├┬┘├┤ │   │ │ │├┬┘└┬┘
+// ═╩╝┴┴└─└─┘└─┘ ┴ └─┘┴└─ ┴
+
+// Directories are hash-indexed: logical block 0 is the root of a (at most)
+// two-level index sorted by name hash whose leaves are the blocks holding the
+// actual entries. Finding a name therefore reads the index block(s) and a
+// single leaf, whatever the number of entries. An empty directory has no
+// block at all.
+
+/// The maximum length of a file name.
+#define TRFS_NAME_LENGTH 255u
+
+/// The maximum depth of the root index (0: its entries point to leaves, 1:
+/// its entries point to index nodes whose entries point to leaves).
+#define TRFS_DIRECTORY_MAX_DEPTH 1u
+
+#define TRFS_DIRECTORY_INDEX_MAGIC 0x54524449u // "TRDI"
+#define TRFS_DIRECTORY_LEAF_MAGIC 0x5452444Cu // "TRDL"
+
+struct trfs_directory_index_entry {
+  /// The lowest name hash of the child block.
+  uint32_t hash;
+
+  /// The logical block of the child (in the directory).
+  uint32_t block;
+};
+
+struct trfs_directory_index {
+  uint32_t magic;
+
+  /// The depth of the block (0 for nodes).
+  uint32_t depth;
+
+  /// The number of entries, sorted by hash. The first entry has hash 0.
+  uint32_t count;
+
+  uint32_t reserved;
+  struct trfs_directory_index_entry entries[];
+};
+
+struct trfs_directory_leaf {
+  uint32_t magic;
+
+  /// The number of entries.
+  uint32_t count;
+
+  /// The number of bytes in use (header included).
+  uint32_t used;
+
+  uint32_t reserved;
+};
+
+///
+/// A directory entry, entries are packed after their leaf header and padded to
+/// TRFS_DIRECTORY_ENTRY_ALIGN bytes.
+///
+struct trfs_directory_entry {
+  uint32_t inode;
+
+  /// The name hash (see trfs_super_block_info::hash_key).
+  uint32_t hash;
+
+  uint8_t name_length;
+
+  /// The file type (DT_* constants of readdir(3)).
+  uint8_t type;
+
+  char name[];
+};
+
+#define TRFS_DIRECTORY_ENTRY_ALIGN 4u
+
+/// The size of a directory entry whose name is `length` bytes long.
+#define TRFS_DIRECTORY_ENTRY_SIZE(length) \
+  ((sizeof(struct trfs_directory_entry) + (length) + TRFS_DIRECTORY_ENTRY_ALIGN - 1u) \
+    & ~(TRFS_DIRECTORY_ENTRY_ALIGN - 1u))
+
 #ifdef __KERNEL__
 
-  int trfs_fill_super_block(
+  #include <linux/fs.h>
+  #include <linux/fs_context.h>
+  #include <linux/fs_parser.h>
+  #include <linux/math64.h>
+  #include <linux/mutex.h>
+  #include <linux/percpu_counter.h>
+  #include <linux/shrinker.h>
+  #include <linux/siphash.h>
+  #include <linux/workqueue.h>
+
+  #include "trfs/alloc.h"
+
+  struct buffer_head;
+  struct kobject;
+  struct proc_dir_entry;
+  struct trfs_cpu_stats;
+
+  ///
+  /// In-memory information about an allocation group. Each group has its own
+  /// locks, so that threads working in different groups do not contend.
+  ///
+  struct trfs_group {
+    /// Index of the free extents of the group, built from its bitmap.
+    struct trfs_free_space free_space;
+
+    /// Serializes inode number allocations in the group.
+    struct mutex inode_lock;
+
+    /// Where to start looking for a free inode number (group relative).
+    uint32_t inode_hint;
+
+    /// The number of free inodes of the group (protected by inode_lock).
+    uint32_t free_inodes;
+
+    /// Serializes the updates of the refcount table of the group.
+    struct mutex refcount_lock;
+  } ____cacheline_aligned_in_smp;
+
+  ///
+  /// In-memory information about a mounted filesystem (super_block->s_fs_info).
+  ///
+  struct trfs_mount_info {
+    /// Superblock as read from disk (integers are in CPU byte order).
+    struct trfs_super_block_info super;
+
+    /// The allocation groups (super.groups).
+    struct trfs_group* groups;
+
+    /// Directory name hash key (see trfs_super_block_info::hash_key).
+    siphash_key_t hash_key;
+
+    /// The number of extents an inode can hold (TRFS_INODE_EXTENTS, or
+    /// TRFS_INODE_EXTENTS64 with TRFS_FEATURE_INCOMPAT_64BIT).
+    uint32_t inode_extents;
+
+    /// The algorithm compressing written data (TRFS_COMPRESS_*, compress=
+    /// mount option).
+    unsigned int compression;
+
+    /// Where new inodes go (TRFS_ALLOC_*, alloc= mount option).
+    unsigned int alloc_policy;
+
+    /// Readahead of the files in KiB (readahead= mount option), or
+    /// TRFS_READAHEAD_DEVICE to keep the readahead of the device.
+    unsigned int readahead;
+
+    /// The number of free blocks (per-CPU, read by statfs()).
+    struct percpu_counter free_blocks;
+
+    /// Free blocks promised to delayed allocations (dirty pages), not
+    /// allocated yet.
+    struct percpu_counter dirty_blocks;
+
+    /// The number of free inodes.
+    struct percpu_counter free_inodes;
+
+    /// Extents cached by the inodes (see trfs/extent.c), least recently
+    /// cached first.
+    struct list_head extent_cache_lru;
+
+    /// Protects extent_cache_lru and extent_cache_count.
+    spinlock_t extent_cache_lock;
+
+    /// The number of cached extents.
+    unsigned long extent_cache_count;
+
+    /// Scales the number of cached extents the shrinker sees, in percent
+    /// (see /sys/fs/trfs/<device>/extent_cache_pressure).
+    unsigned int extent_cache_pressure;
+
+    /// Trims the extent cache under memory pressure.
+    struct shrinker extent_cache_shrinker;
+
+    /// Marks unwritten blocks written once their data is on disk (see
+    /// trfs_complete_ioends()).
+    struct workqueue_struct* unwritten_workqueue;
+
+    /// The VFS superblock (for the commit work).
+    struct super_block* vfs_super;
+
+    /// The superblock buffer, pinned for the lifetime of the mount.
+    struct buffer_head* super_block_head;
+
+    /// Writes the superblock back at most commit_interval seconds after it
+    /// has been dirtied (see trfs_dirty_super_block()).
+    struct delayed_work commit_work;
+
+    /// Seconds between a superblock change and its write back.
+    unsigned int commit_interval;
+
+    /// Operation counts and latencies (see trfs/stats.h).
+    struct trfs_cpu_stats __percpu* stats;
+
+    /// /proc/fs/trfs/<device> (see misc/procfs.c).
+    struct proc_dir_entry* proc_entry;
+
+    /// /sys/fs/trfs/<device> (see misc/sysfs.c).
+    struct kobject* kobject;
+  };
+
+  static inline struct trfs_mount_info* trfs_mount_info(
+    struct super_block const* const super_block
+  ) {
+    return super_block->s_fs_info;
+  }
+
+  ///
+  /// Returns the group holding the given block.
+  ///
+  static inline uint32_t trfs_block_group(
+    struct trfs_mount_info const* const info,
+    uint64_t const block
+  ) {
+    return (uint32_t) div_u64(block, info->super.group_blocks);
+  }
+
+  ///
+  /// Returns the group holding the given inode.
+  ///
+  static inline uint32_t trfs_inode_group(
+    struct trfs_mount_info const* const info,
+    unsigned long const ino
+  ) {
+    return (uint32_t) (ino / info->super.group_inodes);
+  }
+
+  /// Default commit interval (seconds).
+  #define TRFS_DEFAULT_COMMIT_INTERVAL 5u
+
+  /// The longest commit interval (seconds), it has to fit in jiffies.
+  #define TRFS_MAX_COMMIT_INTERVAL ((unsigned int) (INT_MAX / HZ))
+
+  /// The cached extents are reclaimed as the inode and dentry caches.
+  #define TRFS_DEFAULT_EXTENT_CACHE_PRESSURE 100u
+
+  /// New directories are spread over the groups (default).
+  #define TRFS_ALLOC_SPREAD 0u
+
+  /// New directories go to the group of their parent, the file system stays
+  /// packed at the start of the device (small or rotational devices).
+  #define TRFS_ALLOC_PACKED 1u
+
+  /// The files use the readahead of the device (no readahead= mount option).
+  #define TRFS_READAHEAD_DEVICE UINT_MAX
+
+  extern const struct fs_parameter_spec trfs_fs_parameters[];
+
+  void trfs_save_super_block(
+    struct super_block* const super_block
+  );
+
+  void trfs_dirty_super_block(
+    struct super_block* const super_block
+  );
+
+  void trfs_set_readahead(
     struct super_block* const super_block,
-    void* const data, // Key-value ASCII options?
-    int const silent
+    unsigned int const readahead
+  );
+
+  void trfs_set_feature_incompat(
+    struct super_block* const super_block,
+    uint32_t const feature
+  );
+
+  int trfs_init_fs_context(
+    struct fs_context* const context
   );
 
   void trfs_kill_super_block(
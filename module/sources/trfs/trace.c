@@ -0,0 +1,4 @@
+// Defines the tracepoints declared by trace/events/trfs.h, the other
+// translation units only include it.
+#define CREATE_TRACE_POINTS
+#include "trace/events/trfs.h"
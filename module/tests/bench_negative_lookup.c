@@ -0,0 +1,86 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// Negative Lookups:
+// stat(2)s a name missing from a directory over and over, as build systems and
+// $PATH searches do. The first miss reads the directory, the next ones should
+// be answered by the negative dentry left in the dcache (see
+// sources/trfs/dentry.c and negative_lookups in /proc/fs/trfs/<device>/stats).
+//
+// Usage: bench_negative_lookup <directory> [iterations]
+
+#define BENCH_DEFAULT_ITERATIONS 1000000ul
+
+static double bench_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+///
+/// stat(2)s the missing path once.
+///
+/// @return 0 when the path is missing, -1 otherwise (reported).
+///
+static int bench_stat_missing(char const* const path) {
+  struct stat status;
+
+  if (stat(path, &status) == 0) {
+    fprintf(stderr, "%s exists, pick a missing name.\n", path);
+    return -1;
+  }
+
+  if (errno != ENOENT) {
+    fprintf(stderr, "stat(%s): %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+int main(int const argc, char const* const argv[]) {
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "Usage: %s <directory> [iterations]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  unsigned long const iterations = argc == 3
+    ? strtoul(argv[2], NULL, 10)
+    : BENCH_DEFAULT_ITERATIONS;
+
+  if (iterations == 0) {
+    fprintf(stderr, "The number of iterations must be positive.\n");
+    return EXIT_FAILURE;
+  }
+
+  char path[4096];
+  if (snprintf(path, sizeof(path), "%s/.trfs-bench-missing-%ld", argv[1], (long) time(NULL)) >= (int) sizeof(path)) {
+    fprintf(stderr, "The directory path is too long.\n");
+    return EXIT_FAILURE;
+  }
+
+  // The first miss goes to the file system.
+  double const first = bench_seconds();
+  if (bench_stat_missing(path)) {
+    return EXIT_FAILURE;
+  }
+
+  double const started = bench_seconds();
+  for (unsigned long i = 0; i < iterations; ++i) {
+    if (bench_stat_missing(path)) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  double const elapsed = bench_seconds() - started;
+
+  printf("first miss: %.0f ns\n", (started - first) * 1e9);
+  printf("%lu misses in %.3f s: %.0f ops/s, %.0f ns/op\n",
+    iterations, elapsed, (double) iterations / elapsed, elapsed * 1e9 / (double) iterations);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,173 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// sendfile(2) vs read(2) + write(2):
+// Copies a file to another one (or to /dev/null) both ways and reports the
+// throughput of each. sendfile(2) splices the page cache of the source into
+// the destination (see trfs_file_operations.splice_read), read(2) + write(2)
+// copy every byte through a user buffer.
+//
+// Usage: bench_sendfile <source> <destination> [rounds]
+//
+// Drop the page cache (echo 3 > /proc/sys/vm/drop_caches) before a run to
+// measure cold reads, the first round of each method is cold otherwise.
+
+#define BENCH_BUFFER_SIZE (128u * 1024u)
+#define BENCH_DEFAULT_ROUNDS 5ul
+
+static double bench_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+///
+/// Copies size bytes with sendfile(2).
+///
+/// @return 0 on success, -1 otherwise (reported).
+///
+static int bench_copy_sendfile(int const source, int const destination, off_t const size) {
+  off_t offset = 0;
+
+  while (offset < size) {
+    ssize_t const sent = sendfile(destination, source, &offset, (size_t) (size - offset));
+    if (sent < 0) {
+      fprintf(stderr, "sendfile: %s\n", strerror(errno));
+      return -1;
+    }
+
+    if (sent == 0) {
+      break;
+    }
+  }
+
+  return 0;
+}
+
+///
+/// Copies size bytes with read(2) and write(2) through a user buffer.
+///
+/// @return 0 on success, -1 otherwise (reported).
+///
+static int bench_copy_read_write(int const source, int const destination, off_t const size) {
+  static char buffer[BENCH_BUFFER_SIZE];
+  off_t offset = 0;
+
+  while (offset < size) {
+    ssize_t const count = pread(source, buffer, sizeof(buffer), offset);
+    if (count < 0) {
+      fprintf(stderr, "read: %s\n", strerror(errno));
+      return -1;
+    }
+
+    if (count == 0) {
+      break;
+    }
+
+    for (ssize_t written = 0; written < count;) {
+      ssize_t const result = write(destination, buffer + written, (size_t) (count - written));
+      if (result < 0) {
+        fprintf(stderr, "write: %s\n", strerror(errno));
+        return -1;
+      }
+
+      written += result;
+    }
+
+    offset += count;
+  }
+
+  return 0;
+}
+
+///
+/// Runs one method for the given number of rounds, the destination is
+/// truncated before each round.
+///
+/// @return 0 on success, -1 otherwise (reported).
+///
+static int bench_run(
+  char const* const name,
+  int (*const copy)(int, int, off_t),
+  int const source,
+  int const destination,
+  off_t const size,
+  unsigned long const rounds
+) {
+  double best = 0;
+
+  for (unsigned long round = 0; round < rounds; ++round) {
+    if ((ftruncate(destination, 0) && errno != EINVAL) || lseek(destination, 0, SEEK_SET) < 0) {
+      fprintf(stderr, "Could not rewind the destination: %s\n", strerror(errno));
+      return -1;
+    }
+
+    double const started = bench_seconds();
+    if (copy(source, destination, size)) {
+      return -1;
+    }
+
+    double const elapsed = bench_seconds() - started;
+    double const throughput = (double) size / elapsed / (1024.0 * 1024.0);
+
+    printf("%-10s round %lu: %.3f s, %.1f MiB/s\n", name, round, elapsed, throughput);
+    if (throughput > best) {
+      best = throughput;
+    }
+  }
+
+  printf("%-10s best: %.1f MiB/s\n", name, best);
+  return 0;
+}
+
+int main(int const argc, char const* const argv[]) {
+  if (argc < 3 || argc > 4) {
+    fprintf(stderr, "Usage: %s <source> <destination> [rounds]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  unsigned long const rounds = argc == 4
+    ? strtoul(argv[3], NULL, 10)
+    : BENCH_DEFAULT_ROUNDS;
+
+  if (rounds == 0) {
+    fprintf(stderr, "The number of rounds must be positive.\n");
+    return EXIT_FAILURE;
+  }
+
+  int const source = open(argv[1], O_RDONLY);
+  if (source < 0) {
+    fprintf(stderr, "open(%s): %s\n", argv[1], strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  int const destination = open(argv[2], O_WRONLY | O_CREAT, 0644);
+  if (destination < 0) {
+    fprintf(stderr, "open(%s): %s\n", argv[2], strerror(errno));
+    close(source);
+    return EXIT_FAILURE;
+  }
+
+  struct stat status;
+  int result = EXIT_FAILURE;
+
+  if (fstat(source, &status)) {
+    fprintf(stderr, "fstat(%s): %s\n", argv[1], strerror(errno));
+  }
+  else if (!bench_run("sendfile", bench_copy_sendfile, source, destination, status.st_size, rounds)
+    && !bench_run("read+write", bench_copy_read_write, source, destination, status.st_size, rounds)
+  ) {
+    result = EXIT_SUCCESS;
+  }
+
+  close(destination);
+  close(source);
+  return result;
+}